@@ -1,7 +1,9 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
 #include <unistd.h>
+#include <cerrno>
 #include <cstring>
 #include <string>
 #include <vector>
@@ -15,83 +17,546 @@
 #include <sstream>
 #include <iomanip>
 #include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <unordered_map>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <climits>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include "common_options.h"
+#include "shm_ring.h"
+#ifdef WITH_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
 
-// Device information structure
-struct DeviceInfo {
+// Hot per-tick loops: an AVX2 clone is picked at load time where available,
+// and the dynamic cost model lets them vectorize at -O2 as well
+#define VECTORIZED_SCAN __attribute__((target_clones("avx2", "default"), optimize("vect-cost-model=dynamic")))
+
+// Device status codes; codes past STATUS_OFFLINE are interned on demand
+// for free-form statuses pushed by the web server
+enum DeviceStatusCode : unsigned char {
+    STATUS_OK,
+    STATUS_OPERATIONAL,
+    STATUS_ACTIVE,
+    STATUS_DEGRADED,
+    STATUS_FAULT,
+    STATUS_OFFLINE
+};
+
+// Compact UDP telemetry, must match the web server's decoder. A datagram
+// carries records for one shard; integers in network byte order:
+//   header: "LWT1", shard (u8), record count (u8), reserved (u16), sequence (u32)
+//   record: name length (u8), status length (u8), name, status
+// A record with an empty name carries the shard's system status.
+const char TELEMETRY_MAGIC[4] = {'L', 'W', 'T', '1'};
+const size_t TELEMETRY_HEADER_SIZE = 12;
+const size_t TELEMETRY_MAX_DATAGRAM = 1472;  // Fits one Ethernet frame
+const int TELEMETRY_BATCH = 64;              // Datagrams per sendmmsg()
+
+// Thread classes that --cpu-affinity CLASS=CPUS can pin: the simulation
+// (the main thread and the per-tick slice threads it starts) and the
+// notification listener
+enum ThreadClass {
+    THREAD_SIMULATION,
+    THREAD_LISTENER,
+    THREAD_CLASS_COUNT
+};
+const char* const THREAD_CLASS_NAMES[THREAD_CLASS_COUNT] = {"simulation", "listener"};
+
+static_assert(THREAD_CLASS_COUNT <= MAX_THREAD_CLASSES, "too many thread classes");
+ThreadPinning thread_pinning = {THREAD_CLASS_NAMES, THREAD_CLASS_COUNT, {}, {}};
+
+// One entry of a --device-catalog file
+struct DeviceSpec {
     std::string name;
     std::string status;
-    int fault_probability;  // Percentage chance of fault (0-100)
+    int fault_probability;      // Percent chance of a fault per tick
+};
+
+// Device catalog: one "name, status, fault percent" line per device, e.g.
+// "Storage Unit, operational, 12"; blank lines and "#" comments are skipped
+bool read_device_catalog(const std::string& path, std::vector<DeviceSpec>* catalog) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) {
+        perror(path.c_str());
+        return false;
+    }
+    char line[1024];
+    int line_number = 0;
+    bool valid = true;
+    while (valid && fgets(line, sizeof(line), file)) {
+        line_number++;
+        std::string text = line;
+        text.resize(std::min(text.find('#'), text.find_first_of("\r\n")));
+        if (text.find_first_not_of(" \t") == std::string::npos) {
+            continue;
+        }
+        std::vector<std::string> fields;
+        std::stringstream stream(text);
+        std::string field;
+        while (std::getline(stream, field, ',')) {
+            size_t start = field.find_first_not_of(" \t");
+            size_t end = field.find_last_not_of(" \t");
+            fields.push_back(start == std::string::npos ? "" : field.substr(start, end - start + 1));
+        }
+        char* number_end = nullptr;
+        long probability = fields.size() == 3 ? strtol(fields[2].c_str(), &number_end, 10) : -1;
+        if (fields.size() != 3 || fields[0].empty() || fields[1].empty() || *number_end || probability < 0 ||
+            probability > 100) {
+            printf("%s:%d: expected \"name, status, fault percent\"\n", path.c_str(), line_number);
+            valid = false;
+            break;
+        }
+        catalog->push_back({fields[0], fields[1], (int)probability});
+    }
+    fclose(file);
+    return valid && !catalog->empty();
+}
+
+// Device table in structure-of-arrays layout so one tick streams through
+// a few dense columns instead of strings
+struct DeviceTable {
+    std::vector<std::string> names;
+    std::vector<unsigned char> status;           // Current status code
+    std::vector<unsigned char> recovery_status;  // Status when not faulted, decided once per device type
+    std::vector<unsigned int> fault_threshold;   // Fault probability scaled to 2^32
+    std::unordered_map<std::string, size_t> index;  // Name -> row
+};
+
+// Philox4x32-10 counter-based RNG: the draw for (tick, device) depends only
+// on the key and counter, so threads need no shared generator state and
+// results do not depend on how a tick is split across cores
+struct Philox4x32 {
+    unsigned int key0;
+    unsigned int key1;
+
+    void generate(unsigned int counter0, unsigned int counter1, unsigned int out[4]) const {
+        unsigned int c0 = counter0, c1 = counter1, c2 = 0, c3 = 0;
+        unsigned int k0 = key0, k1 = key1;
+        for (int round = 0; round < 10; round++) {
+            unsigned long long p0 = 0xD2511F53ull * c0;
+            unsigned long long p1 = 0xCD9E8D57ull * c2;
+            unsigned int n0 = (unsigned int)(p1 >> 32) ^ c1 ^ k0;
+            unsigned int n2 = (unsigned int)(p0 >> 32) ^ c3 ^ k1;
+            c1 = (unsigned int)p1;
+            c3 = (unsigned int)p0;
+            c0 = n0;
+            c2 = n2;
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
+        out[0] = c0;
+        out[1] = c1;
+        out[2] = c2;
+        out[3] = c3;
+    }
+};
+
+// Outcome of simulating one slice of the device table
+struct TickSliceResult {
+    int fault_count;
+    int transition_count;
+};
+
+// Decide the next status of every device in a block: fault if the draw
+// falls under the device's threshold, otherwise its recovery status
+VECTORIZED_SCAN
+void apply_fault_draws(const unsigned int* __restrict draws, const unsigned int* __restrict thresholds,
+                       const unsigned char* __restrict recovery, unsigned char* __restrict status,
+                       unsigned char* __restrict changed, size_t count, int* fault_count) {
+    int faults = 0;
+    for (size_t i = 0; i < count; i++) {
+        unsigned char fault_mask = (unsigned char)-(unsigned char)(draws[i] < thresholds[i]);
+        unsigned char next = (unsigned char)((recovery[i] & ~fault_mask) | (STATUS_FAULT & fault_mask));
+        changed[i] = next != status[i];
+        faults += fault_mask & 1;
+        status[i] = next;
+    }
+    *fault_count += faults;
+}
+
+// Parsed notification from the web server
+struct NotificationCommand {
+    NotificationCommand* next;  // Queue link
+    bool has_system_status;
+    std::string system_status;
+    std::vector<std::pair<std::string, std::string>> device_updates;  // Name, status
+};
+
+// Lock-free multi-producer, single-consumer queue. Producers push with a
+// CAS onto an intrusive stack; the consumer takes the whole stack with one
+// exchange and reverses it to restore arrival order.
+template <typename T>
+class MpscQueue {
+private:
+    std::atomic<T*> head;
+    
+public:
+    MpscQueue() : head(nullptr) {}
+    
+    void push(T* node) {
+        T* old_head = head.load(std::memory_order_relaxed);
+        do {
+            node->next = old_head;
+        } while (!head.compare_exchange_weak(old_head, node, std::memory_order_release,
+                                             std::memory_order_relaxed));
+    }
+    
+    // Take every queued node, oldest first
+    T* drain() {
+        T* node = head.exchange(nullptr, std::memory_order_acquire);
+        T* ordered = nullptr;
+        while (node) {
+            T* next = node->next;
+            node->next = ordered;
+            ordered = node;
+            node = next;
+        }
+        return ordered;
+    }
+};
+
+// OpenSSL's SSL, SSL_CTX and SSL_SESSION; TLS needs a build with
+// -DWITH_TLS -lssl -lcrypto
+struct ssl_st;
+struct ssl_ctx_st;
+struct ssl_session_st;
+
+// A connection to the web server, over TLS when tls is set
+struct ServerConnection {
+    int fd;
+    ssl_st* tls;
+};
+
+// Client context for a web server started with --tls-cert. The server's
+// certificate is verified only against ca_file; without one any
+// certificate is accepted, as suits self-signed test setups.
+ssl_ctx_st* create_tls_client_context([[maybe_unused]] const std::string& ca_file) {
+#ifdef WITH_TLS
+    SSL_CTX* tls = SSL_CTX_new(TLS_client_method());
+    if (!tls) {
+        return nullptr;
+    }
+    SSL_CTX_set_min_proto_version(tls, TLS1_2_VERSION);
+    SSL_CTX_set_options(tls, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_session_cache_mode(tls, SSL_SESS_CACHE_CLIENT);
+    if (!ca_file.empty()) {
+        if (SSL_CTX_load_verify_locations(tls, ca_file.c_str(), nullptr) != 1) {
+            ERR_print_errors_fp(stdout);
+            SSL_CTX_free(tls);
+            return nullptr;
+        }
+        SSL_CTX_set_verify(tls, SSL_VERIFY_PEER, nullptr);
+    }
+    return tls;
+#else
+    printf("TLS needs a build with -DWITH_TLS -lssl -lcrypto\n");
+    return nullptr;
+#endif
+}
+
+// Connect, and with a TLS context shake hands offering *session for
+// resumption; fd is -1 on failure. *resumed tells whether it was resumed.
+ServerConnection server_connect(const std::string& host, int port,
+                                [[maybe_unused]] ssl_ctx_st* tls_context = nullptr,
+                                [[maybe_unused]] ssl_session_st* session = nullptr, bool* resumed = nullptr) {
+    ServerConnection connection = {socket(AF_INET, SOCK_STREAM, 0), nullptr};
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+    if (connection.fd < 0 || connect(connection.fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        if (connection.fd >= 0) close(connection.fd);
+        connection.fd = -1;
+        return connection;
+    }
+    if (resumed) *resumed = false;
+#ifdef WITH_TLS
+    if (tls_context) {
+        connection.tls = SSL_new(tls_context);
+        SSL_set_fd(connection.tls, connection.fd);
+        if (session) {
+            SSL_set_session(connection.tls, session);
+        }
+        if (SSL_connect(connection.tls) != 1) {
+            ERR_print_errors_fp(stdout);
+            SSL_free(connection.tls);
+            close(connection.fd);
+            connection = {-1, nullptr};
+            return connection;
+        }
+        if (resumed) *resumed = SSL_session_reused(connection.tls);
+    }
+#endif
+    return connection;
+}
+
+ssize_t server_recv(ServerConnection connection, void* buffer, size_t length) {
+#ifdef WITH_TLS
+    if (connection.tls) {
+        size_t received;
+        if (SSL_read_ex(connection.tls, buffer, length, &received) == 1) {
+            return (ssize_t)received;
+        }
+        return SSL_get_error(connection.tls, 0) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+    }
+#endif
+    return recv(connection.fd, buffer, length, 0);
+}
+
+bool server_send_all(ServerConnection connection, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t n;
+#ifdef WITH_TLS
+        if (connection.tls) {
+            size_t written;
+            n = SSL_write_ex(connection.tls, data, length, &written) == 1 ? (ssize_t)written : -1;
+        } else
+#endif
+        n = send(connection.fd, data, length, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+// Close; *session, when given, takes the connection's TLS session for the
+// next connect to resume. TLS 1.3 sends its ticket after the handshake, so
+// this is only useful once a response has been read.
+void server_close(ServerConnection connection, [[maybe_unused]] ssl_session_st** session = nullptr) {
+#ifdef WITH_TLS
+    if (connection.tls) {
+        SSL_SESSION* latest = SSL_get1_session(connection.tls);
+        if (session && latest && SSL_SESSION_is_resumable(latest)) {
+            SSL_SESSION_free(*session);
+            *session = latest;
+        } else {
+            SSL_SESSION_free(latest);
+        }
+        SSL_shutdown(connection.tls);
+        SSL_free(connection.tls);
+        ERR_clear_error();
+    }
+#endif
+    close(connection.fd);
+}
+
+// One push handed from the sampling loop to the sender thread
+struct PendingPush {
+    std::string body;
+    std::vector<unsigned> rows;          // Devices carried; empty for a full push
+    bool full;
+    bool has_changes;                    // Carries changes, not just a heartbeat
+    std::chrono::steady_clock::time_point changed_at;  // Sample time of the oldest change it carries
+    // Filled in once sent
+    int http_status;                     // 0 if there was no response
+    int retry_after_ms;
+    double latency_ms;
+    std::chrono::steady_clock::time_point acked_at;
 };
 
 // System monitor class
 class SystemMonitor {
 private:
-    std::vector<DeviceInfo> devices;
-    std::mt19937 random_generator;
-    std::uniform_int_distribution<int> random_dist;
+    DeviceTable devices;
+    std::vector<std::string> status_names;  // Status code -> text
+    Philox4x32 random_generator;
+    unsigned int tick_counter;
+    int worker_threads;
+    int update_interval_ms;
     std::string web_server_host;
     int web_server_port;
+    std::string notification_address;    // Listener bind address
     int notification_port;
+    int shard_id;                        // Device shard this monitor reports
+    unsigned long long push_epoch;       // Identifies this run to the web server
+    unsigned long long push_sequence;    // Last sequence number pushed in this epoch
+    bool quiet;                          // Suppress per-tick logging
+    int udp_port;                        // Push over UDP telemetry when non-zero
+    int udp_fd;                          // Connected UDP socket, opened on first push
+    unsigned int udp_sequence;           // Next datagram sequence number
+    std::vector<char> datagrams;         // Encoded datagrams of the current push
+    std::vector<size_t> datagram_lengths;
+    bool use_shm;                        // Prefer the shared-memory channel over TCP
+    bool wait_for_ack;                   // Block each shm push until it has been applied
+    std::atomic<ShmChannel*> shm_channel; // Attached channel, null when using TCP
+    bool shm_reader_started;
+    double last_push_ms;                 // Transport time of the latest push
     bool external_status_override;
     std::string external_system_status;
+    MpscQueue<NotificationCommand> pending_notifications;  // Listener -> simulation loop
+    bool adaptive_push;                  // run() pushes when worth it instead of every tick
+    int heartbeat_ms;                    // Adaptive: full push at least this often
+    int coalesce_ms;                     // Adaptive: longest a minor change waits to be pushed
+    int push_window;                     // Adaptive: pushes queued or in flight at most
+    std::mutex push_mutex;
+    std::condition_variable push_ready;  // The sender waits here for push_queue
+    std::deque<PendingPush*> push_queue;  // Built by the sampling loop, not yet sent
+    std::vector<PendingPush*> push_done;  // Sent; results not yet taken by the sampling loop
+    int pushes_in_flight;                 // Queued or being sent, under push_mutex
+    ssl_ctx_st* tls_context;              // Push over TLS when set
+    ssl_session_st* tls_session;          // Resumed by the next push; only the pushing thread uses it
+
+    // Devices are simulated in blocks of this many rows; slices handed to
+    // threads are block-aligned so no two threads share a cache line
+    static const size_t SIMULATION_BLOCK = 1024;
+    // Above this many devices individual transitions are not logged
+    static const size_t VERBOSE_DEVICE_LIMIT = 64;
     
 public:
-    SystemMonitor(const std::string& host = "127.0.0.1", int port = 12345) 
-        : random_generator(std::time(nullptr)), random_dist(1, 100),
-          web_server_host(host), web_server_port(port), notification_port(54321),
-          external_status_override(false) {
+    // catalog, when given, replaces the built-in devices
+    SystemMonitor(const std::string& host = "127.0.0.1", int port = 12345, int simulated_devices = 0,
+                  int interval_ms = 5000, int threads = 0, int shard = 0,
+                  const std::vector<DeviceSpec>* catalog = nullptr)
+        : tick_counter(0), worker_threads(threads), update_interval_ms(interval_ms),
+          web_server_host(host), web_server_port(port), notification_address("0.0.0.0"),
+          notification_port(54321 + shard),
+          shard_id(shard), push_sequence(0), quiet(false), udp_port(0), udp_fd(-1), udp_sequence(0),
+          use_shm(false), wait_for_ack(false), shm_channel(nullptr), shm_reader_started(false), last_push_ms(0),
+          external_status_override(false), adaptive_push(false), heartbeat_ms(5000), coalesce_ms(1000),
+          push_window(2), pushes_in_flight(0), tls_context(nullptr), tls_session(nullptr) {
         printf("SystemMonitor constructor: Starting initialization\n");
         fflush(stdout);
-        initialize_devices();
+        std::random_device seed_source;
+        random_generator.key0 = seed_source() ^ (unsigned int)std::time(nullptr);
+        random_generator.key1 = seed_source();
+        // A new epoch per run lets the web server accept our sequence
+        // numbers restarting from 1 without treating them as stale
+        push_epoch = (unsigned long long)std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        if (worker_threads <= 0) {
+            worker_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        status_names = {"ok", "operational", "active", "degraded", "fault", "offline"};
+        initialize_devices(simulated_devices, catalog);
         printf("SystemMonitor constructor: Initialization complete\n");
         fflush(stdout);
     }
     
-    void initialize_devices() {
+    // Map a status string to its code, interning new free-form statuses
+    unsigned char status_code(const std::string& status) {
+        for (size_t i = 0; i < status_names.size(); i++) {
+            if (status_names[i] == status) {
+                return (unsigned char)i;
+            }
+        }
+        if (status_names.size() >= 255) {
+            return STATUS_DEGRADED;
+        }
+        status_names.push_back(status);
+        return (unsigned char)(status_names.size() - 1);
+    }
+    
+    // Register a device; the recovery status is derived from the name once
+    // here rather than by substring searches on every tick
+    void add_device(const std::string& name, const std::string& status, int fault_probability) {
+        unsigned char recovery = STATUS_OK;
+        if (name.find("Controller") != std::string::npos ||
+            name.find("Unit") != std::string::npos) {
+            recovery = STATUS_OPERATIONAL;
+        } else if (name.find("Link") != std::string::npos) {
+            recovery = STATUS_ACTIVE;
+        }
+        unsigned long long threshold = (unsigned long long)fault_probability * 0x100000000ull / 100;
+        
+        devices.index[name] = devices.names.size();
+        devices.names.push_back(name);
+        devices.status.push_back(status_code(status));
+        devices.recovery_status.push_back(recovery);
+        devices.fault_threshold.push_back((unsigned int)std::min(threshold, 0xFFFFFFFFull));
+    }
+    
+    void initialize_devices(int simulated_devices, const std::vector<DeviceSpec>* catalog) {
         printf("initialize_devices: Starting\n");
         fflush(stdout);
         
         // Clear any existing devices
-        devices.clear();
+        devices = DeviceTable();
         printf("initialize_devices: Cleared devices\n");
         fflush(stdout);
         
         // Reserve space for better performance
-        devices.reserve(6);
+        size_t built_in = catalog ? catalog->size() : shard_id == 0 ? 6 : 0;
+        size_t total = built_in + (size_t)std::max(0, simulated_devices);
+        devices.names.reserve(total);
+        devices.status.reserve(total);
+        devices.recovery_status.reserve(total);
+        devices.fault_threshold.reserve(total);
+        devices.index.reserve(total);
         printf("initialize_devices: Reserved space\n");
         fflush(stdout);
         
         try {
-            // Initialize device list with different fault probabilities
-            DeviceInfo dev1 = {"Device1", "ok", 5};
-            devices.push_back(dev1);
-            printf("initialize_devices: Added Device1\n");
-            fflush(stdout);
-            
-            DeviceInfo dev2 = {"Device2", "ok", 15};
-            devices.push_back(dev2);
-            printf("initialize_devices: Added Device2\n");
-            fflush(stdout);
-            
-            DeviceInfo dev3 = {"Device3", "ok", 3};
-            devices.push_back(dev3);
-            printf("initialize_devices: Added Device3\n");
-            fflush(stdout);
-            
-            DeviceInfo dev4 = {"Network Controller", "operational", 8};
-            devices.push_back(dev4);
-            printf("initialize_devices: Added Network Controller\n");
-            fflush(stdout);
-            
-            DeviceInfo dev5 = {"Storage Unit", "operational", 12};
-            devices.push_back(dev5);
-            printf("initialize_devices: Added Storage Unit\n");
-            fflush(stdout);
+            if (catalog) {
+                for (const DeviceSpec& device : *catalog) {
+                    add_device(device.name, device.status, device.fault_probability);
+                }
+                printf("initialize_devices: Added %d catalog devices\n", (int)catalog->size());
+                fflush(stdout);
+            } else if (shard_id == 0) {
+                // The built-in devices belong to shard 0 only, each with
+                // its own fault probability
+                add_device("Device1", "ok", 5);
+                printf("initialize_devices: Added Device1\n");
+                fflush(stdout);
+                
+                add_device("Device2", "ok", 15);
+                printf("initialize_devices: Added Device2\n");
+                fflush(stdout);
+                
+                add_device("Device3", "ok", 3);
+                printf("initialize_devices: Added Device3\n");
+                fflush(stdout);
+                
+                add_device("Network Controller", "operational", 8);
+                printf("initialize_devices: Added Network Controller\n");
+                fflush(stdout);
+                
+                add_device("Storage Unit", "operational", 12);
+                printf("initialize_devices: Added Storage Unit\n");
+                fflush(stdout);
+                
+                add_device("Comm Link", "active", 7);
+                printf("initialize_devices: Added Comm Link\n");
+                fflush(stdout);
+            }
             
-            DeviceInfo dev6 = {"Comm Link", "active", 7};
-            devices.push_back(dev6);
-            printf("initialize_devices: Added Comm Link\n");
-            fflush(stdout);
+            // Synthetic load: cycle through the device types with
+            // fault probabilities between 1% and 15%
+            static const char* const type_names[] = {"Device", "Controller", "Unit", "Link"};
+            static const char* const type_statuses[] = {"ok", "operational", "operational", "active"};
+            std::mt19937 setup_generator(random_generator.key0);
+            std::uniform_int_distribution<int> probability_dist(1, 15);
+            for (int i = 0; i < simulated_devices; i++) {
+                char name[64];
+                if (shard_id == 0) {
+                    snprintf(name, sizeof(name), "Sim %s %07d", type_names[i % 4], i);
+                } else {
+                    // Keep names unique across monitors
+                    snprintf(name, sizeof(name), "Sim %s %02d-%07d", type_names[i % 4], shard_id, i);
+                }
+                add_device(name, type_statuses[i % 4], probability_dist(setup_generator));
+            }
+            if (simulated_devices > 0) {
+                printf("initialize_devices: Added %d simulated devices\n", simulated_devices);
+                fflush(stdout);
+            }
             
         } catch (...) {
             printf("initialize_devices: Exception caught during device creation\n");
@@ -99,15 +564,16 @@ public:
             return;
         }
         
-        printf("Initialized %d devices\n", (int)devices.size());
+        printf("Initialized %d devices\n", (int)devices.names.size());
         fflush(stdout);
     }
     
     void start_notification_listener() {
-        printf("Starting notification listener on port %d\n", notification_port);
+        printf("Starting notification listener on %s:%d\n", notification_address.c_str(), notification_port);
         
         std::thread listener_thread([this]() {
-            int server_sock = socket(AF_INET, SOCK_STREAM, 0);
+            pin_current_thread(THREAD_LISTENER);
+            int server_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
             if (server_sock < 0) {
                 printf("Failed to create notification listener socket\n");
                 return;
@@ -117,9 +583,9 @@ public:
             int opt = 1;
             setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
             
-            sockaddr_in server_addr = {0};
+            sockaddr_in server_addr = {};
             server_addr.sin_family = AF_INET;
-            server_addr.sin_addr.s_addr = INADDR_ANY;
+            inet_pton(AF_INET, notification_address.c_str(), &server_addr.sin_addr);
             server_addr.sin_port = htons(notification_port);
             
             if (bind(server_sock, (sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
@@ -128,121 +594,380 @@ public:
                 return;
             }
             
-            if (listen(server_sock, 5) < 0) {
+            if (listen(server_sock, 128) < 0) {
                 printf("Failed to listen on notification socket\n");
                 close(server_sock);
                 return;
             }
             
+            int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            if (epoll_fd < 0) {
+                printf("Failed to create notification epoll instance\n");
+                close(server_sock);
+                return;
+            }
+            epoll_event listen_event = {};
+            listen_event.events = EPOLLIN;
+            listen_event.data.fd = server_sock;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_sock, &listen_event);
+            
             printf("Notification listener ready on port %d\n", notification_port);
             
+            // Partially received messages per connection
+            std::unordered_map<int, std::string> pending_input;
+            epoll_event events[64];
+            
             while (true) {
-                sockaddr_in client_addr;
-                socklen_t client_len = sizeof(client_addr);
-                int client_sock = accept(server_sock, (sockaddr*)&client_addr, &client_len);
-                
-                if (client_sock < 0) {
-                    continue;
+                int ready = epoll_wait(epoll_fd, events, 64, -1);
+                if (ready < 0) {
+                    if (errno == EINTR) continue;
+                    perror("notification epoll_wait");
+                    break;
                 }
                 
-                // Handle notification in a separate thread
-                std::thread([this, client_sock]() {
-                    handle_notification(client_sock);
-                    close(client_sock);
-                }).detach();
+                for (int i = 0; i < ready; i++) {
+                    int fd = events[i].data.fd;
+                    if (fd == server_sock) {
+                        // Accept everything queued
+                        while (true) {
+                            int client_sock = accept4(server_sock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                            if (client_sock < 0) {
+                                break;
+                            }
+                            epoll_event client_event = {};
+                            client_event.events = EPOLLIN | EPOLLRDHUP;
+                            client_event.data.fd = client_sock;
+                            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sock, &client_event);
+                            pending_input[client_sock];
+                        }
+                        continue;
+                    }
+                    
+                    if (!read_notification_input(fd, pending_input[fd])) {
+                        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+                        pending_input.erase(fd);
+                        close(fd);
+                    }
+                }
             }
+            close(epoll_fd);
+            close(server_sock);
         });
         
         listener_thread.detach();
     }
     
-    void handle_notification(int client_sock) {
-        char buffer[4096];
-        ssize_t bytes_received = recv(client_sock, buffer, sizeof(buffer)-1, 0);
-        
-        if (bytes_received <= 0) {
-            return;
+    // Drain a readable notification socket, queueing every complete
+    // message. Returns false once the connection should be closed.
+    bool read_notification_input(int client_sock, std::string& input) {
+        const size_t max_message_size = 64 * 1024 * 1024;
+        bool peer_closed = false;
+        char buffer[16384];
+        while (true) {
+            ssize_t bytes_received = recv(client_sock, buffer, sizeof(buffer), 0);
+            if (bytes_received > 0) {
+                input.append(buffer, bytes_received);
+                continue;
+            }
+            if (bytes_received == 0) {
+                peer_closed = true;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                peer_closed = true;
+            }
+            break;
         }
         
-        buffer[bytes_received] = '\0';
-        std::string notification(buffer);
+        // A message ends with an "END" line; several may arrive back to back
+        while (true) {
+            size_t end_pos = input.compare(0, 4, "END\n") == 0 ? 0 : input.find("\nEND\n");
+            if (end_pos == std::string::npos) {
+                break;
+            }
+            size_t message_end = end_pos == 0 ? 4 : end_pos + 5;
+            queue_notification(input.substr(0, message_end));
+            input.erase(0, message_end);
+        }
         
+        // Senders that close without the END line still get their message applied
+        if (peer_closed && !input.empty()) {
+            queue_notification(input);
+            input.clear();
+        }
+        if (input.size() > max_message_size) {
+            printf("Dropping oversized notification (%d bytes)\n", (int)input.size());
+            return false;
+        }
+        return !peer_closed;
+    }
+    
+    // Parse one complete notification and hand it to the simulation loop
+    void queue_notification(const std::string& notification) {
         printf("Received notification from webserver:\n%s\n", notification.c_str());
         
+        NotificationCommand* command = new NotificationCommand();
+        command->has_system_status = false;
+        
         // Parse the notification
         std::istringstream stream(notification);
         std::string line;
         
         while (std::getline(stream, line)) {
             if (line.find("SYSTEM_STATUS_UPDATE:") == 0) {
-                printf("Debug: parsing line: '%s'\n", line.c_str());
-                printf("Debug: line length: %d\n", (int)line.length());
-                printf("Debug: 'SYSTEM_STATUS_UPDATE:' length: %d\n", (int)strlen("SYSTEM_STATUS_UPDATE:"));
-                external_system_status = line.substr(21); // Remove "SYSTEM_STATUS_UPDATE:" (21 chars)
-                printf("Debug: extracted status: '%s'\n", external_system_status.c_str());
-                external_status_override = true;
-                printf("Backend received system status override: '%s'\n", external_system_status.c_str());
+                command->system_status = line.substr(21); // Remove "SYSTEM_STATUS_UPDATE:" (21 chars)
+                command->has_system_status = true;
             } else if (line.find("DEVICE:") == 0) {
                 // Parse device update
                 size_t eq_pos = line.find('=');
                 if (eq_pos != std::string::npos) {
                     std::string device_name = line.substr(7, eq_pos - 7); // Remove "DEVICE:"
                     std::string device_status = line.substr(eq_pos + 1);
-                    
-                    // Update the device status in our list
-                    for (auto& device : devices) {
-                        if (device.name == device_name) {
-                            device.status = device_status;
-                            printf("Backend updated device '%s' to '%s'\n", device_name.c_str(), device_status.c_str());
-                            break;
-                        }
-                    }
+                    command->device_updates.emplace_back(device_name, device_status);
                 }
             } else if (line == "END") {
                 break;
             }
         }
+        
+        pending_notifications.push(command);
+    }
+    
+    // Apply queued notifications in arrival order; called by the simulation
+    // loop at the tick boundary, so no state is touched concurrently
+    void apply_pending_notifications() {
+        NotificationCommand* command = pending_notifications.drain();
+        while (command) {
+            if (command->has_system_status) {
+                external_system_status = command->system_status;
+                external_status_override = true;
+                printf("Backend received system status override: '%s'\n", external_system_status.c_str());
+            }
+            for (const auto& update : command->device_updates) {
+                // Update the device status in our table
+                auto it = devices.index.find(update.first);
+                if (it != devices.index.end()) {
+                    devices.status[it->second] = status_code(update.second);
+                    if (devices.names.size() <= VERBOSE_DEVICE_LIMIT) {
+                        printf("Backend updated device '%s' to '%s'\n", update.first.c_str(), update.second.c_str());
+                    }
+                }
+            }
+            NotificationCommand* next = command->next;
+            delete command;
+            command = next;
+        }
+    }
+    
+    // Simulate one block-aligned slice [begin, end) of the device table
+    TickSliceResult simulate_slice(size_t begin, size_t end, unsigned int tick, const char* timestamp) {
+        TickSliceResult result = {0, 0};
+        unsigned int draws[SIMULATION_BLOCK];
+        unsigned char changed[SIMULATION_BLOCK];
+        
+        for (size_t block = begin; block < end; block += SIMULATION_BLOCK) {
+            size_t count = std::min(SIMULATION_BLOCK, end - block);
+            for (size_t i = 0; i < count; i += 4) {
+                random_generator.generate(tick, (unsigned int)((block + i) / 4), &draws[i]);
+            }
+            apply_fault_draws(draws, &devices.fault_threshold[block], &devices.recovery_status[block],
+                              &devices.status[block], changed, count, &result.fault_count);
+            for (size_t i = 0; i < count; i++) {
+                result.transition_count += changed[i];
+            }
+            
+            // Per-device log lines only for small fleets
+            if (devices.names.size() <= VERBOSE_DEVICE_LIMIT) {
+                for (size_t i = 0; i < count; i++) {
+                    if (!changed[i]) continue;
+                    unsigned char status = devices.status[block + i];
+                    if (status == STATUS_FAULT) {
+                        printf("[%s] Device '%s' changed to FAULT\n", timestamp, devices.names[block + i].c_str());
+                    } else {
+                        printf("[%s] Device '%s' recovered to %s\n", timestamp, devices.names[block + i].c_str(),
+                               status_names[status].c_str());
+                    }
+                }
+            }
+        }
+        return result;
+    }
+    
+    ~SystemMonitor() {
+        if (udp_fd >= 0) {
+            close(udp_fd);
+        }
+#ifdef WITH_TLS
+        SSL_SESSION_free(tls_session);
+#endif
+    }
+    
+    void set_quiet(bool enabled) {
+        quiet = enabled;
+    }
+    
+    // Where to listen for the web server's notifications; the port
+    // defaults to 54321 + shard, which is what the web server expects
+    // unless it was started with a different --monitor-port
+    void set_notification_listener(const std::string& address, int port) {
+        notification_address = address;
+        if (port > 0) {
+            notification_port = port;
+        }
+    }
+    
+    // Push device state as UDP telemetry instead of HTTP
+    void set_udp_port(int port) {
+        udp_port = port;
     }
     
-    void update_device_statuses() {
+    // Push over the shard's shared-memory channel when the web server
+    // offers one, falling back to TCP otherwise
+    void set_use_shm(bool enabled, bool ack) {
+        use_shm = enabled;
+        wait_for_ack = ack;
+    }
+    
+    // Push over TLS, to a web server whose backend port has it
+    void set_tls(ssl_ctx_st* context) {
+        tls_context = context;
+    }
+    
+    // Let run() decide when to push (see run_adaptive) instead of pushing
+    // the full state every tick
+    void set_adaptive_push(bool enabled, int heartbeat, int coalesce, int window) {
+        adaptive_push = enabled;
+        heartbeat_ms = heartbeat;
+        coalesce_ms = coalesce;
+        push_window = window;
+    }
+    
+    double last_push_latency_ms() const {
+        return last_push_ms;
+    }
+    
+    // Map the shard's channel if the web server created one and is still
+    // running. A mapping whose server went away is dropped but never
+    // unmapped, so the notification reader can't touch freed memory.
+    ShmChannel* attach_shm_channel() {
+        ShmChannel* channel = shm_channel.load();
+        if (channel && shm_peer_alive(channel->server_pid)) {
+            return channel;
+        }
+        shm_channel.store(nullptr);
+        
+        char name[32];
+        snprintf(name, sizeof(name), "/lws_ring.shard%02d", shard_id);
+        int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat st;
+        void* mapping = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ShmChannel)) {
+            mapping = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            return nullptr;
+        }
+        channel = static_cast<ShmChannel*>(mapping);
+        if (memcmp(channel->magic, SHM_CHANNEL_MAGIC, sizeof(channel->magic)) != 0 ||
+            !shm_peer_alive(channel->server_pid) ||
+            channel->down.data_offset + channel->down.capacity > (unsigned long long)st.st_size) {
+            munmap(mapping, st.st_size);
+            return nullptr;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        channel->client_pid.store(getpid());
+        shm_channel.store(channel);
+        printf("Attached to shared-memory channel %s\n", name);
+        
+        if (!shm_reader_started) {
+            // Notifications from the down ring join the same queue as the
+            // TCP listener's
+            shm_reader_started = true;
+            std::thread reader([this]() {
+                std::string message;
+                while (true) {
+                    ShmChannel* current = shm_channel.load();
+                    if (!current) {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                        continue;
+                    }
+                    if (shm_ring_read(current, &current->down, &message, 1000)) {
+                        queue_notification(message);
+                        shm_ring_ack(&current->down);
+                    }
+                }
+            });
+            reader.detach();
+        }
+        return channel;
+    }
+    
+    size_t device_count() const {
+        return devices.names.size();
+    }
+    
+    // Runs one tick and pushes the result; returns whether the web server
+    // accepted the push
+    bool update_device_statuses() {
+        std::string overall_status = run_tick();
+        
+        // Send update to web server
+        if (udp_port > 0) {
+            return send_status_update_udp(overall_status);
+        }
+        return send_status_update(overall_status);
+    }
+    
+    // Simulate one tick; returns the overall system status it leaves
+    std::string run_tick() {
         // Get current timestamp
         auto now = std::chrono::system_clock::now();
         auto time_t = std::chrono::system_clock::to_time_t(now);
         char timestamp[100];
         strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&time_t));
         
-
-        int fault_count = 0;
+        // Fold in web-side changes received since the previous tick
+        apply_pending_notifications();
         
-        for (auto& device : devices) {
-            // Using C rand() instead of C++ random (for comparison):
-            // int roll = (rand() % 100) + 1;  // Less uniform, thread-unsafe
-            int roll = random_dist(random_generator);
-            
-            if (roll <= device.fault_probability) {
-                // Device goes to fault state
-                if (device.status != "fault") {
-                    device.status = "fault";
-                    printf("[%s] Device '%s' changed to FAULT\n", timestamp, device.name.c_str());
-                }
-                fault_count++;
-            } else {
-                // Device recovers to normal state
-                std::string new_status;
-                if (device.name.find("Controller") != std::string::npos ||
-                    device.name.find("Unit") != std::string::npos) {
-                    new_status = "operational";
-                } else if (device.name.find("Link") != std::string::npos) {
-                    new_status = "active";
-                } else {
-                    new_status = "ok";
-                }
-                
-                if (device.status != new_status) {
-                    device.status = new_status;
-                    printf("[%s] Device '%s' recovered to %s\n", timestamp, device.name.c_str(), new_status.c_str());
-                }
-            }
+        // Split the table into block-aligned slices, one per worker thread
+        auto tick_start = std::chrono::steady_clock::now();
+        unsigned int tick = tick_counter++;
+        size_t device_count = devices.names.size();
+        size_t blocks = (device_count + SIMULATION_BLOCK - 1) / SIMULATION_BLOCK;
+        size_t slice_count = std::min(blocks, (size_t)worker_threads);
+        size_t blocks_per_slice = slice_count ? (blocks + slice_count - 1) / slice_count : 0;
+        
+        std::vector<TickSliceResult> results(slice_count);
+        std::vector<std::thread> workers;
+        for (size_t s = 1; s < slice_count; s++) {
+            size_t begin = s * blocks_per_slice * SIMULATION_BLOCK;
+            size_t end = std::min(device_count, begin + blocks_per_slice * SIMULATION_BLOCK);
+            if (begin >= end) break;
+            workers.emplace_back([this, &results, s, begin, end, tick, &timestamp]() {
+                results[s] = simulate_slice(begin, end, tick, timestamp);
+            });
+        }
+        if (slice_count > 0) {
+            results[0] = simulate_slice(0, std::min(device_count, blocks_per_slice * SIMULATION_BLOCK), tick, timestamp);
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        
+        int fault_count = 0;
+        int transition_count = 0;
+        for (const auto& result : results) {
+            fault_count += result.fault_count;
+            transition_count += result.transition_count;
+        }
+        double tick_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tick_start).count();
+        if (device_count > VERBOSE_DEVICE_LIMIT && !quiet) {
+            printf("[%s] Simulated %d devices in %.2f ms on %d threads: %d faults, %d transitions\n",
+                   timestamp, (int)device_count, tick_ms, (int)slice_count, fault_count, transition_count);
         }
         
         // Update overall system status
@@ -265,43 +990,80 @@ public:
             } else {
                 overall_status = "Operational";
             }
-            printf("[%s] Generated system status: '%s'\n", timestamp, overall_status.c_str());
+            if (!quiet) {
+                printf("[%s] Generated system status: '%s'\n", timestamp, overall_status.c_str());
+            }
         }
-        
-        // Send update to web server
-        send_status_update(overall_status);
+        return overall_status;
     }
     
-    void send_status_update(const std::string& system_status) {
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock < 0) {
-            perror("socket creation failed");
-            return;
-        }
-        
-        sockaddr_in server_addr = {0};
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(web_server_port);
-        inet_pton(AF_INET, web_server_host.c_str(), &server_addr.sin_addr);
-        
-        if (connect(sock, (sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-            printf("Connection to web server failed (server may not be running)\n");
-            close(sock);
-            return;
+    bool send_status_update(const std::string& system_status) {
+        auto push_start = std::chrono::steady_clock::now();
+        std::string body = build_push_body(system_status, nullptr);
+        bool accepted = false;
+        if (!(use_shm && send_over_shm(body, &accepted))) {
+            accepted = send_over_tcp(body) == 200;
         }
-        
-        // Create POST request body with device statuses
+        last_push_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - push_start).count();
+        return accepted;
+    }
+    
+    // POST body of the next push: shard header fields, then the statuses of
+    // the given rows, or of every device when rows is null
+    std::string build_push_body(const std::string& system_status, const std::vector<unsigned>* rows) {
         std::ostringstream post_body;
         std::string encoded_status = url_encode(system_status);
-        printf("Encoding system status: '%s' -> '%s'\n", system_status.c_str(), encoded_status.c_str());
-        post_body << "system_status=" << encoded_status;
+        if (!quiet) {
+            printf("Encoding system status: '%s' -> '%s'\n", system_status.c_str(), encoded_status.c_str());
+        }
+        post_body << "shard=" << shard_id << "&epoch=" << push_epoch << "&seq=" << ++push_sequence;
+        post_body << "&system_status=" << encoded_status;
         
-        for (const auto& device : devices) {
-            post_body << "&" << url_encode(device.name) << "=" << url_encode(device.status);
+        size_t count = rows ? rows->size() : devices.names.size();
+        for (size_t r = 0; r < count; r++) {
+            size_t i = rows ? (*rows)[r] : r;
+            post_body << "&" << url_encode(devices.names[i]) << "=" << url_encode(status_names[devices.status[i]]);
         }
         
         std::string body = post_body.str();
-        printf("POST body: %s\n", body.c_str());
+        if (devices.names.size() <= VERBOSE_DEVICE_LIMIT && !quiet) {
+            printf("POST body: %s\n", body.c_str());
+        }
+        return body;
+    }
+    
+    // Hand a push body to the shared-memory channel. False if the channel
+    // is unavailable or full, in which case the caller uses TCP.
+    bool send_over_shm(const std::string& body, bool* accepted) {
+        ShmChannel* channel = attach_shm_channel();
+        if (!channel || !shm_ring_write(channel, &channel->up, body, 100)) {
+            if (channel && !quiet) {
+                printf("Shared-memory channel unavailable, falling back to TCP\n");
+            }
+            return false;
+        }
+        *accepted = true;
+        if (wait_for_ack) {
+            unsigned long long target = channel->up.messages.load(std::memory_order_relaxed);
+            *accepted = shm_wait(&channel->up.space_signal, &channel->up.producer_sleeping, 1000, [&]() {
+                return channel->up.acked.load(std::memory_order_acquire) >= target;
+            });
+        }
+        if (!quiet) {
+            printf("Status update sent over shared memory (%d bytes)\n", (int)body.size());
+        }
+        return true;
+    }
+    
+    // Returns the response's HTTP status, 0 if there was none; *retry_after_ms
+    // gets a Retry-After header's delay, 0 without one
+    int send_over_tcp(const std::string& body, int* retry_after_ms = nullptr) {
+        if (retry_after_ms) *retry_after_ms = 0;
+        ServerConnection connection = server_connect(web_server_host, web_server_port, tls_context, tls_session);
+        if (connection.fd < 0) {
+            printf("Connection to web server failed (server may not be running)\n");
+            return 0;
+        }
         
         // Create HTTP POST request
         std::ostringstream request;
@@ -315,15 +1077,136 @@ public:
         
         std::string http_request = request.str();
         
-        // Send the request
-        ssize_t sent = send(sock, http_request.c_str(), http_request.length(), 0);
-        if (sent < 0) {
+        // Send the request; large fleets need more than one send()
+        if (!server_send_all(connection, http_request.c_str(), http_request.length())) {
             perror("send failed");
-        } else {
-            printf("Status update sent to web server (%d bytes)\n", (int)sent);
+            server_close(connection);
+            return 0;
+        }
+        if (!quiet) {
+            printf("Status update sent to web server (%d bytes)\n", (int)http_request.length());
         }
         
-        close(sock);
+        // Wait for the response headers so a rejected push (stale sequence,
+        // bad shard, overload) is reported instead of silently dropped
+        char response[1024];
+        ssize_t received = 0;
+        while ((size_t)received < sizeof(response) - 1) {
+            ssize_t n = server_recv(connection, response + received, sizeof(response) - 1 - received);
+            if (n <= 0) break;
+            received += n;
+            response[received] = '\0';
+            if (strstr(response, "\r\n\r\n")) break;
+        }
+        response[received] = '\0';
+        server_close(connection, &tls_session);
+        
+        int status = 0;
+        sscanf(response, "HTTP/%*d.%*d %d", &status);
+        const char* retry_after = strstr(response, "\r\nRetry-After:");
+        if (retry_after && retry_after_ms) {
+            *retry_after_ms = std::atoi(retry_after + 14) * 1000;
+        }
+        if (status != 200) {
+            char* line_end = strpbrk(response, "\r\n");
+            if (line_end) *line_end = '\0';
+            printf("Status update rejected by web server: '%s'\n", response);
+        }
+        return status;
+    }
+    
+    // Append one telemetry record, starting a new datagram when full
+    void append_telemetry_record(const char* name, size_t name_length, const std::string& status) {
+        size_t record_size = 2 + name_length + status.size();
+        size_t current = datagram_lengths.size() - 1;
+        char* datagram = &datagrams[current * TELEMETRY_MAX_DATAGRAM];
+        if (datagram_lengths[current] != 0 &&
+            (datagram_lengths[current] + record_size > TELEMETRY_MAX_DATAGRAM || (unsigned char)datagram[5] == 255)) {
+            current++;
+            datagram_lengths.push_back(0);
+            datagrams.resize(datagram_lengths.size() * TELEMETRY_MAX_DATAGRAM);
+            datagram = &datagrams[current * TELEMETRY_MAX_DATAGRAM];
+        }
+        if (datagram_lengths[current] == 0) {
+            unsigned int sequence = htonl(udp_sequence++);
+            memcpy(datagram, TELEMETRY_MAGIC, 4);
+            datagram[4] = (char)shard_id;
+            datagram[5] = 0;
+            datagram[6] = datagram[7] = 0;
+            memcpy(datagram + 8, &sequence, sizeof(sequence));
+            datagram_lengths[current] = TELEMETRY_HEADER_SIZE;
+        }
+        char* record = datagram + datagram_lengths[current];
+        record[0] = (char)name_length;
+        record[1] = (char)status.size();
+        memcpy(record + 2, name, name_length);
+        memcpy(record + 2 + name_length, status.data(), status.size());
+        datagram_lengths[current] += record_size;
+        datagram[5]++;
+    }
+    
+    // Send the device state (every device, or only the given rows) as UDP
+    // telemetry datagrams, handed to the kernel TELEMETRY_BATCH at a time
+    // with sendmmsg()
+    bool send_status_update_udp(const std::string& system_status, const std::vector<unsigned>* rows = nullptr) {
+        if (udp_fd < 0) {
+            udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+            sockaddr_in server_addr = {};
+            server_addr.sin_family = AF_INET;
+            server_addr.sin_port = htons(udp_port);
+            inet_pton(AF_INET, web_server_host.c_str(), &server_addr.sin_addr);
+            if (udp_fd < 0 || connect(udp_fd, (sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+                perror("UDP telemetry socket");
+                if (udp_fd >= 0) close(udp_fd);
+                udp_fd = -1;
+                return false;
+            }
+            int buffer_size = 4 * 1024 * 1024;
+            setsockopt(udp_fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+        }
+        
+        datagram_lengths.assign(1, 0);
+        datagrams.resize(TELEMETRY_MAX_DATAGRAM);
+        append_telemetry_record("", 0, system_status.substr(0, 255));
+        size_t count = rows ? rows->size() : devices.names.size();
+        for (size_t r = 0; r < count; r++) {
+            size_t i = rows ? (*rows)[r] : r;
+            const std::string& name = devices.names[i];
+            const std::string& status = status_names[devices.status[i]];
+            if (name.size() > 255 || status.size() > 255) continue;  // Not encodable
+            append_telemetry_record(name.data(), name.size(), status);
+        }
+        
+        size_t total = datagram_lengths.size();
+        size_t sent = 0;
+        while (sent < total) {
+            mmsghdr messages[TELEMETRY_BATCH];
+            iovec vectors[TELEMETRY_BATCH];
+            int count = (int)std::min(total - sent, (size_t)TELEMETRY_BATCH);
+            memset(messages, 0, sizeof(messages));
+            for (int i = 0; i < count; i++) {
+                vectors[i].iov_base = &datagrams[(sent + i) * TELEMETRY_MAX_DATAGRAM];
+                vectors[i].iov_len = datagram_lengths[sent + i];
+                messages[i].msg_hdr.msg_iov = &vectors[i];
+                messages[i].msg_hdr.msg_iovlen = 1;
+            }
+            int n = sendmmsg(udp_fd, messages, count, 0);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                // ECONNREFUSED just means nobody listened to an earlier datagram
+                if (errno != ECONNREFUSED) perror("sendmmsg");
+                return false;
+            }
+            sent += n;
+        }
+        if (!quiet) {
+            printf("Status update sent as %d UDP datagrams\n", (int)total);
+        }
+        return true;
+    }
+    
+    size_t datagrams_sent() const {
+        return udp_sequence;
     }
     
     std::string url_encode(const std::string& str) {
@@ -345,41 +1228,1221 @@ public:
     
     void run() {
         printf("System Monitor started\n");
-        printf("Monitoring %d devices, updating every 5 seconds\n", (int)devices.size());
+        printf("Monitoring %d devices, updating every %d ms on up to %d threads\n",
+               (int)devices.names.size(), update_interval_ms, worker_threads);
         printf("Web server: %s:%d\n", web_server_host.c_str(), web_server_port);
         
         // Start the notification listener
         start_notification_listener();
         
+        if (adaptive_push) {
+            run_adaptive();
+            return;
+        }
+        
+        // Fixed cadence: the simulation and push time count against the interval
+        auto next_tick = std::chrono::steady_clock::now();
         while (true) {
             update_device_statuses();
-            std::this_thread::sleep_for(std::chrono::seconds(5));
+            next_tick += std::chrono::milliseconds(update_interval_ms);
+            std::this_thread::sleep_until(next_tick);
+        }
+    }
+    
+    // Adaptive cadence. Devices are still sampled every update_interval_ms,
+    // but a push goes out only when it is worth one: a significant change
+    // (a device entering or leaving fault, a new system status) right
+    // away, other changes after at most coalesce_ms so they travel
+    // together, and a full push every heartbeat_ms that repairs anything
+    // lost. Pushes carry only the devices that differ from what was last
+    // pushed. A sender thread delivers them in order; with push_window of
+    // them queued or in flight, changes keep accumulating for the next one.
+    // 429/503 (honouring Retry-After), pushes that got no answer and ack
+    // latency well above its usual level widen the minimum gap between
+    // pushes, up to heartbeat_ms; healthy acks shrink it back to zero.
+    void run_adaptive() {
+        typedef std::chrono::steady_clock Clock;
+        const unsigned char UNSENT = 0xFF;
+        const double MIN_BACKOFF_MS = 100;
+        std::vector<unsigned char> sent_status(devices.names.size(), UNSENT);  // Last pushed, per device
+        std::string sent_system_status;
+        std::vector<unsigned> rows;
+        bool unsent_changes = false;
+        Clock::time_point changed_at;
+        Clock::time_point next_heartbeat = Clock::now();
+        Clock::time_point next_push_allowed = Clock::now();
+        double gap_ms = 0;
+        double latency_average = 0, latency_floor = 0;
+        
+        // Per-report counters
+        int pushes = 0, full_pushes = 0, held_back = 0, failed = 0, overloaded = 0;
+        std::vector<double> freshness;
+        Clock::time_point next_report = Clock::now() + std::chrono::seconds(10);
+        
+        if (udp_port <= 0) {
+            std::thread sender([this]() { run_push_sender(); });
+            sender.detach();
+        }
+        
+        auto next_tick = Clock::now();
+        while (true) {
+            std::string system_status = run_tick();
+            Clock::time_point now = Clock::now();
+            
+            // Fold in the pushes the sender finished
+            std::vector<PendingPush*> done;
+            int in_flight;
+            {
+                std::lock_guard<std::mutex> lock(push_mutex);
+                done.swap(push_done);
+                in_flight = pushes_in_flight;
+            }
+            for (PendingPush* push : done) {
+                if (push->http_status == 200) {
+                    if (push->has_changes) {
+                        freshness.push_back(
+                            std::chrono::duration<double, std::milli>(push->acked_at - push->changed_at).count());
+                    }
+                    // The floor follows the best latency seen, rising only slowly
+                    latency_floor = latency_floor == 0 || push->latency_ms < latency_floor
+                                        ? push->latency_ms
+                                        : latency_floor + (push->latency_ms - latency_floor) * 0.01;
+                    latency_average = latency_average == 0 ? push->latency_ms
+                                                           : 0.8 * latency_average + 0.2 * push->latency_ms;
+                    if (latency_average > 2 * latency_floor + 20) {
+                        gap_ms = std::min((double)heartbeat_ms, std::max(20.0, gap_ms * 1.5));
+                    } else {
+                        gap_ms = gap_ms < 1 ? 0 : gap_ms / 2;
+                    }
+                } else {
+                    // Not applied: its devices go out again with the next push
+                    if (push->full) {
+                        std::fill(sent_status.begin(), sent_status.end(), UNSENT);
+                    }
+                    for (unsigned row : push->rows) {
+                        sent_status[row] = UNSENT;
+                    }
+                    sent_system_status.clear();
+                    failed++;
+                    if (push->http_status == 0 || push->http_status == 429 || push->http_status == 503) {
+                        overloaded++;
+                        gap_ms = std::min((double)heartbeat_ms,
+                                          std::max({gap_ms * 2, MIN_BACKOFF_MS, (double)push->retry_after_ms}));
+                    }
+                }
+                delete push;
+            }
+            
+            // What differs from what was last pushed
+            rows.clear();
+            bool significant = system_status != sent_system_status;
+            for (size_t i = 0; i < devices.status.size(); i++) {
+                unsigned char status = devices.status[i];
+                if (status != sent_status[i]) {
+                    rows.push_back((unsigned)i);
+                    significant |= sent_status[i] == UNSENT || (status == STATUS_FAULT) != (sent_status[i] == STATUS_FAULT);
+                }
+            }
+            if (significant || !rows.empty()) {
+                if (!unsent_changes) {
+                    changed_at = now;
+                }
+                unsent_changes = true;
+            }
+            
+            bool heartbeat = now >= next_heartbeat;
+            bool wanted = heartbeat || significant ||
+                          (unsent_changes && now - changed_at >= std::chrono::milliseconds(coalesce_ms));
+            if (wanted && in_flight < push_window && now >= next_push_allowed) {
+                PendingPush* push = new PendingPush();
+                push->full = heartbeat;
+                push->has_changes = unsent_changes;
+                push->changed_at = changed_at;
+                push->body = udp_port > 0 ? "" : build_push_body(system_status, heartbeat ? nullptr : &rows);
+                if (!heartbeat) {
+                    push->rows.swap(rows);
+                    for (unsigned row : push->rows) {
+                        sent_status[row] = devices.status[row];
+                    }
+                } else {
+                    sent_status = devices.status;
+                    next_heartbeat = now + std::chrono::milliseconds(heartbeat_ms);
+                }
+                sent_system_status = system_status;
+                unsent_changes = false;
+                next_push_allowed = now + std::chrono::microseconds((long long)(gap_ms * 1000));
+                pushes++;
+                full_pushes += heartbeat;
+                
+                if (udp_port > 0) {
+                    // Datagrams are never acknowledged; only a failed send counts
+                    bool sent = send_status_update_udp(system_status, heartbeat ? nullptr : &push->rows);
+                    push->acked_at = Clock::now();
+                    push->latency_ms = std::chrono::duration<double, std::milli>(push->acked_at - now).count();
+                    push->http_status = sent ? 200 : 0;
+                    push->retry_after_ms = 0;
+                    std::lock_guard<std::mutex> lock(push_mutex);
+                    push_done.push_back(push);
+                } else {
+                    std::lock_guard<std::mutex> lock(push_mutex);
+                    push_queue.push_back(push);
+                    pushes_in_flight++;
+                    push_ready.notify_one();
+                }
+            } else if (wanted) {
+                held_back++;
+            }
+            
+            if (now >= next_report) {
+                if (!quiet) {
+                    std::sort(freshness.begin(), freshness.end());
+                    printf("[PUSH] last 10 s: %d pushes (%d full), %d held back, %d failed (%d overload); "
+                           "freshness p50 %.1f ms, p99 %.1f ms; ack %.1f ms (floor %.1f); gap %.0f ms; "
+                           "window %d/%d\n",
+                           pushes, full_pushes, held_back, failed, overloaded,
+                           freshness.empty() ? 0.0 : freshness[freshness.size() / 2],
+                           freshness.empty() ? 0.0 : freshness[freshness.size() * 99 / 100], latency_average,
+                           latency_floor, gap_ms, in_flight, push_window);
+                }
+                pushes = full_pushes = held_back = failed = overloaded = 0;
+                freshness.clear();
+                next_report = now + std::chrono::seconds(10);
+            }
+            
+            next_tick += std::chrono::milliseconds(update_interval_ms);
+            std::this_thread::sleep_until(next_tick);
+        }
+    }
+    
+    // Adaptive pushes go out from here, in order, so the sampling loop
+    // never waits on the web server
+    void run_push_sender() {
+        pin_current_thread(THREAD_SIMULATION);
+        while (true) {
+            PendingPush* push;
+            {
+                std::unique_lock<std::mutex> lock(push_mutex);
+                push_ready.wait(lock, [this]() { return !push_queue.empty(); });
+                push = push_queue.front();
+                push_queue.pop_front();
+            }
+            auto start = std::chrono::steady_clock::now();
+            bool accepted = false;
+            push->retry_after_ms = 0;
+            if (use_shm && send_over_shm(push->body, &accepted)) {
+                push->http_status = accepted ? 200 : 0;
+            } else {
+                push->http_status = send_over_tcp(push->body, &push->retry_after_ms);
+            }
+            push->acked_at = std::chrono::steady_clock::now();
+            push->latency_ms = std::chrono::duration<double, std::milli>(push->acked_at - start).count();
+            std::lock_guard<std::mutex> lock(push_mutex);
+            push_done.push_back(push);
+            pushes_in_flight--;
         }
     }
     
     void print_current_status() {
+        const size_t max_listed = 20;
         printf("\n=== Current Device Status ===\n");
-        for (const auto& device : devices) {
-            printf("%-20s: %s\n", device.name.c_str(), device.status.c_str());
+        for (size_t i = 0; i < devices.names.size() && i < max_listed; i++) {
+            printf("%-20s: %s\n", devices.names[i].c_str(), status_names[devices.status[i]].c_str());
+        }
+        if (devices.names.size() > max_listed) {
+            printf("... and %d more devices\n", (int)(devices.names.size() - max_listed));
         }
         printf("=============================\n\n");
     }
 };
 
+// Ingest benchmark: several monitors, one per shard, push back to back
+// against one web server and the aggregate ingest rate is reported. With
+// a UDP port the pushes go out as telemetry datagrams; compare the sender's
+// rate with the "udp" counters of /shard_status to see what was dropped.
+int run_ingest_benchmark(const std::string& host, int port, int monitor_count, int devices_per_monitor, int seconds,
+                         int udp_port) {
+    printf("Ingest benchmark: %d monitors x %d devices against %s:%d for %d s\n",
+           monitor_count, devices_per_monitor, host.c_str(), udp_port > 0 ? udp_port : port, seconds);
+    std::vector<SystemMonitor*> monitors;
+    for (int i = 0; i < monitor_count; i++) {
+        monitors.push_back(new SystemMonitor(host, port, devices_per_monitor, 0, 1, i));
+        monitors.back()->set_quiet(true);
+        monitors.back()->set_udp_port(udp_port);
+    }
+    
+    std::atomic<bool> stop(false);
+    std::vector<unsigned long long> accepted(monitor_count, 0), rejected(monitor_count, 0);
+    std::vector<std::thread> pushers;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < monitor_count; i++) {
+        pushers.emplace_back([&, i]() {
+            while (!stop.load(std::memory_order_relaxed)) {
+                if (monitors[i]->update_device_statuses()) {
+                    accepted[i]++;
+                } else {
+                    rejected[i]++;
+                }
+            }
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    stop.store(true);
+    for (auto& pusher : pushers) {
+        pusher.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    unsigned long long total_pushes = 0, total_rejected = 0, total_devices = 0, total_datagrams = 0;
+    for (int i = 0; i < monitor_count; i++) {
+        total_pushes += accepted[i];
+        total_rejected += rejected[i];
+        total_devices += accepted[i] * monitors[i]->device_count();
+        total_datagrams += monitors[i]->datagrams_sent();
+        delete monitors[i];
+    }
+    printf("Ingest benchmark: %llu pushes accepted, %llu failed in %.2f s\n", total_pushes, total_rejected, elapsed);
+    printf("Ingest benchmark: %.0f pushes/s, %.0f device updates/s\n",
+           total_pushes / elapsed, total_devices / elapsed);
+    if (udp_port > 0) {
+        printf("Ingest benchmark: %llu datagrams, %.0f datagrams/s sent\n", total_datagrams, total_datagrams / elapsed);
+    }
+    return total_rejected == 0 ? 0 : 1;
+}
+
+// Transport latency: the same monitor pushes back to back over TCP, then
+// over the shared-memory channel, each push waiting until the web server
+// has applied it (HTTP response / ring ack)
+int run_latency_benchmark(const std::string& host, int port, int shard, int pushes, int devices) {
+    SystemMonitor monitor(host, port, devices, 0, 1, shard);
+    monitor.set_quiet(true);
+    for (int transport = 0; transport < 2; transport++) {
+        monitor.set_use_shm(transport == 1, true);
+        if (transport == 1 && !monitor.attach_shm_channel()) {
+            printf("Latency benchmark: no shared-memory channel for shard %d (start web_server with --shm-shards)\n",
+                   shard);
+            return 1;
+        }
+        std::vector<double> latencies;
+        int failed = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < pushes; i++) {
+            if (!monitor.update_device_statuses()) {
+                failed++;
+            }
+            latencies.push_back(monitor.last_push_latency_ms());
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::sort(latencies.begin(), latencies.end());
+        double total = 0;
+        for (double latency : latencies) total += latency;
+        printf("Latency benchmark: %-4s %d pushes x %d devices: mean %.3f ms, p50 %.3f ms, p99 %.3f ms, "
+               "%.0f pushes/s, %d failed\n",
+               transport == 0 ? "tcp" : "shm", pushes, (int)monitor.device_count(), total / latencies.size(),
+               latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100], pushes / elapsed, failed);
+    }
+    return 0;
+}
+
+// Fetch the web server's /io_stats counters over a fresh connection (TLS
+// with tls_context); the whole JSON body is returned too for the less
+// common fields
+bool fetch_io_stats(const std::string& host, int port, std::string& engine, unsigned long long& requests,
+                    unsigned long long& syscalls, std::string* json = nullptr, ssl_ctx_st* tls_context = nullptr) {
+    ServerConnection connection = server_connect(host, port, tls_context);
+    if (connection.fd < 0) {
+        return false;
+    }
+    const char request[] = "GET /io_stats HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n";
+    server_send_all(connection, request, sizeof(request) - 1);
+    std::string response;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = server_recv(connection, buffer, sizeof(buffer))) > 0) {
+        response.append(buffer, n);
+    }
+    server_close(connection);
+    char engine_name[32];
+    size_t body = response.find("{");
+    if (body == std::string::npos ||
+        sscanf(response.c_str() + body, "{\"engine\":\"%31[^\"]\",\"requests\":%llu,\"syscalls\":%llu",
+               engine_name, &requests, &syscalls) != 3) {
+        return false;
+    }
+    engine = engine_name;
+    if (json) {
+        *json = response.substr(body);
+    }
+    return true;
+}
+
+// Keep-alive HTTP benchmark: every connection sends a request, waits for
+// the whole response and sends the next one. Connections are opened
+// non-blocking and start cycling requests at once, so none sits idle while
+// the rest connect; the measurement window starts when all are up.
+// Reports throughput, latency and the server's socket syscalls per request
+// from /io_stats, so the web server's thread and io_uring engines can be
+// compared. The first heavy_count connections request heavy_path instead,
+// and their latency is reported apart: with expensive renders running, the
+// cheap requests' p99 shows whether they are kept off the I/O path.
+int run_http_benchmark(const std::string& host, int port, int connection_count, int seconds, const std::string& path,
+                       int heavy_count = 0, const std::string& heavy_path = "") {
+    printf("HTTP benchmark: %d keep-alive connections to %s:%d%s for %d s\n", connection_count - heavy_count,
+           host.c_str(), port, path.c_str(), seconds);
+    if (heavy_count > 0) {
+        printf("HTTP benchmark: plus %d connections requesting %s\n", heavy_count, heavy_path.c_str());
+    }
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+
+    const int max_pending_connects = 256;
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: bench\r\n\r\n";
+    std::string heavy_request = "GET " + heavy_path + " HTTP/1.1\r\nHost: bench\r\n\r\n";
+    int epoll_fd = epoll_create1(0);
+    std::vector<int> fds;
+    std::vector<std::string> inputs(connection_count);
+    std::vector<std::chrono::steady_clock::time_point> sent_at(connection_count);
+    std::vector<double> latencies, heavy_latencies;
+    unsigned long long shed[2] = {0, 0};   // 503 responses per class
+    int pending_connects = 0, established = 0, open_connections = 0;
+    unsigned long long completed = 0, errors = 0;
+    bool measuring = false;
+    std::string engine;
+    unsigned long long requests_before = 0, syscalls_before = 0, requests_after = 0, syscalls_after = 0;
+    bool have_stats = false;
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start;
+    auto connect_deadline = start + std::chrono::seconds(60);
+
+    std::vector<epoll_event> events(1024);
+    char buffer[65536];
+    while (true) {
+        // Keep a bounded number of connects in flight until all are open
+        while ((int)fds.size() < connection_count && pending_connects < max_pending_connects) {
+            int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if (fd < 0) {
+                perror("HTTP benchmark: socket");
+                connection_count = fds.size();
+                break;
+            }
+            connect(fd, (sockaddr*)&addr, sizeof(addr));
+            epoll_event event = {};
+            event.events = EPOLLOUT;
+            event.data.u32 = fds.size();
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+            fds.push_back(fd);
+            pending_connects++;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (!measuring && (established == connection_count || now > connect_deadline)) {
+            printf("HTTP benchmark: %d connections established\n", established);
+            have_stats = fetch_io_stats(host, port, engine, requests_before, syscalls_before);
+            measuring = true;
+            completed = 0;
+            latencies.clear();
+            heavy_latencies.clear();
+            shed[0] = shed[1] = 0;
+            start = std::chrono::steady_clock::now();
+            deadline = start + std::chrono::seconds(seconds);
+        }
+        if ((measuring && now >= deadline) || (fds.size() == (size_t)connection_count && open_connections == 0 &&
+                                                pending_connects == 0)) {
+            break;
+        }
+
+        int ready = epoll_wait(epoll_fd, events.data(), events.size(), 100);
+        now = std::chrono::steady_clock::now();
+        for (int e = 0; e < ready; e++) {
+            size_t i = events[e].data.u32;
+            if (events[e].events & EPOLLOUT) {
+                pending_connects--;
+                int error = 0;
+                socklen_t error_length = sizeof(error);
+                getsockopt(fds[i], SOL_SOCKET, SO_ERROR, &error, &error_length);
+                if (error != 0) {
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fds[i], nullptr);
+                    errors++;
+                    continue;
+                }
+                epoll_event event = {};
+                event.events = EPOLLIN;
+                event.data.u32 = i;
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fds[i], &event);
+                established++;
+                open_connections++;
+                sent_at[i] = now;
+                const std::string& first = (int)i < heavy_count ? heavy_request : request;
+                send(fds[i], first.data(), first.size(), MSG_NOSIGNAL);
+                continue;
+            }
+            ssize_t n;
+            while ((n = recv(fds[i], buffer, sizeof(buffer), 0)) > 0) {
+                inputs[i].append(buffer, n);
+            }
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fds[i], nullptr);
+                open_connections--;
+                errors++;
+                continue;
+            }
+            // One request outstanding per connection, so at most one response
+            size_t header_end = inputs[i].find("\r\n\r\n");
+            if (header_end == std::string::npos) continue;
+            size_t length_pos = inputs[i].find("Content-Length: ");
+            size_t content_length = length_pos < header_end ? strtoull(inputs[i].c_str() + length_pos + 16, nullptr, 10) : 0;
+            if (inputs[i].size() < header_end + 4 + content_length) continue;
+            bool overloaded = inputs[i].compare(0, 12, "HTTP/1.1 503") == 0;
+            inputs[i].erase(0, header_end + 4 + content_length);
+            if (measuring && sent_at[i] >= start) {
+                completed++;
+                if (overloaded) shed[(int)i < heavy_count]++;
+                ((int)i < heavy_count ? heavy_latencies : latencies)
+                    .push_back(std::chrono::duration<double, std::milli>(now - sent_at[i]).count());
+            }
+            sent_at[i] = now;
+            const std::string& next = (int)i < heavy_count ? heavy_request : request;
+            send(fds[i], next.data(), next.size(), MSG_NOSIGNAL);
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    have_stats = have_stats && fetch_io_stats(host, port, engine, requests_after, syscalls_after);
+    for (int fd : fds) {
+        close(fd);
+    }
+    close(epoll_fd);
+
+    printf("HTTP benchmark: %llu responses in %.2f s, %.0f requests/s, %llu connection errors\n",
+           completed, elapsed, completed / elapsed, errors);
+    std::vector<double>* series[] = {&latencies, &heavy_latencies};
+    const std::string* series_paths[] = {&path, &heavy_path};
+    for (int s = 0; s < 2; s++) {
+        std::vector<double>& values = *series[s];
+        if (values.empty()) continue;
+        std::sort(values.begin(), values.end());
+        std::string label = heavy_count > 0 ? *series_paths[s] + " " : "";
+        printf("HTTP benchmark: %slatency p50 %.3f ms, p99 %.3f ms, max %.3f ms (%d responses, %llu shed with 503)\n",
+               label.c_str(), values[values.size() / 2], values[values.size() * 99 / 100], values.back(),
+               (int)values.size(), shed[s]);
+    }
+    if (have_stats && requests_after > requests_before) {
+        printf("HTTP benchmark: server engine %s, %.2f socket syscalls per request\n", engine.c_str(),
+               (double)(syscalls_after - syscalls_before) / (requests_after - requests_before));
+    }
+    return errors == 0 ? 0 : 1;
+}
+
+// Numeric field of a flat JSON object, 0 if missing
+unsigned long long json_number(const std::string& json, const char* key) {
+    size_t pos = json.find("\"" + std::string(key) + "\":");
+    return pos == std::string::npos ? 0 : strtoull(json.c_str() + pos + strlen(key) + 3, nullptr, 10);
+}
+
+// Reconnect storm: open every connection at once, as a fleet of dashboards
+// and monitors does after a network blip, and send one request on each.
+// Reports how long connects took to complete and how long until the first
+// response byte: once the server's accept queue overflows, dropped SYNs
+// and handshakes show up as retransmit delays of a second or more. The
+// server's accept batching comes from /io_stats (web port only).
+int run_connect_storm(const std::string& host, int port, int connection_count, const std::string& path) {
+    printf("Connect storm: %d simultaneous connections to %s:%d%s\n", connection_count, host.c_str(), port,
+           path.c_str());
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+    std::string engine, stats_before, stats_after;
+    unsigned long long requests = 0, syscalls = 0;
+    bool have_stats = fetch_io_stats(host, port, engine, requests, syscalls, &stats_before);
+
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: storm\r\nConnection: close\r\n\r\n";
+    int epoll_fd = epoll_create1(0);
+    std::vector<int> fds;
+    std::vector<std::chrono::steady_clock::time_point> started;
+    std::vector<double> connect_latencies, response_latencies;
+    int errors = 0, open_connections = 0;
+    auto storm_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < connection_count; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) {
+            perror("Connect storm: socket");
+            break;
+        }
+        started.push_back(std::chrono::steady_clock::now());
+        if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+            close(fd);
+            fds.push_back(-1);
+            errors++;
+            continue;
+        }
+        epoll_event event = {};
+        event.events = EPOLLOUT;
+        event.data.u32 = fds.size();
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        fds.push_back(fd);
+        open_connections++;
+    }
+
+    std::vector<epoll_event> events(1024);
+    char buffer[4096];
+    auto deadline = storm_start + std::chrono::seconds(60);
+    while (open_connections > 0 && std::chrono::steady_clock::now() < deadline) {
+        int ready = epoll_wait(epoll_fd, events.data(), events.size(), 100);
+        auto now = std::chrono::steady_clock::now();
+        for (int e = 0; e < ready; e++) {
+            size_t i = events[e].data.u32;
+            double elapsed_ms = std::chrono::duration<double, std::milli>(now - started[i]).count();
+            bool failed = false;
+            if (events[e].events & EPOLLOUT) {
+                int error = 0;
+                socklen_t error_length = sizeof(error);
+                getsockopt(fds[i], SOL_SOCKET, SO_ERROR, &error, &error_length);
+                if (error == 0) {
+                    connect_latencies.push_back(elapsed_ms);
+                    send(fds[i], request.data(), request.size(), MSG_NOSIGNAL);
+                    epoll_event event = {};
+                    event.events = EPOLLIN;
+                    event.data.u32 = i;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fds[i], &event);
+                    continue;
+                }
+                failed = true;
+            } else if (recv(fds[i], buffer, sizeof(buffer), 0) > 0) {
+                response_latencies.push_back(elapsed_ms);
+            } else {
+                failed = true;
+            }
+            errors += failed ? 1 : 0;
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fds[i], nullptr);
+            close(fds[i]);
+            fds[i] = -1;
+            open_connections--;
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - storm_start).count();
+    for (int fd : fds) {
+        if (fd >= 0) close(fd);
+    }
+    close(epoll_fd);
+    errors += open_connections;    // Still waiting at the deadline
+
+    printf("Connect storm: %d of %d answered in %.2f s, %d failed or timed out\n", (int)response_latencies.size(),
+           connection_count, elapsed, errors);
+    std::vector<double>* series[] = {&connect_latencies, &response_latencies};
+    const char* names[] = {"connect", "first byte"};
+    for (int s = 0; s < 2; s++) {
+        std::vector<double>& latencies = *series[s];
+        if (latencies.empty()) continue;
+        std::sort(latencies.begin(), latencies.end());
+        printf("Connect storm: %-10s p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n", names[s],
+               latencies[latencies.size() / 2], latencies[latencies.size() * 9 / 10],
+               latencies[latencies.size() * 99 / 100], latencies.back());
+    }
+    if (have_stats && fetch_io_stats(host, port, engine, requests, syscalls, &stats_after)) {
+        unsigned long long accepts = json_number(stats_after, "accepts") - json_number(stats_before, "accepts");
+        unsigned long long wakeups =
+            json_number(stats_after, "accept_wakeups") - json_number(stats_before, "accept_wakeups");
+        if (wakeups > 0) {
+            printf("Connect storm: server engine %s accepted %llu in %llu wakeups (%.1f per wakeup)\n",
+                   engine.c_str(), accepts, wakeups, (double)accepts / wakeups);
+        }
+    }
+    return errors == 0 ? 0 : 1;
+}
+
+// Rate limiting benchmark: polite clients, each from its own loopback
+// address (127.0.1.N), send one request every interval_ms while an abusive
+// client on 127.0.0.2 keeps abusive_connections requests in flight back to
+// back from its own thread, reconnecting whenever the server closes on it.
+// Run it against a server with and without --rate-limit: limited, the
+// abuser gets cheap 429s and the polite p99 stays near a run with no
+// abuser at all (abusive_connections 0).
+struct AbuseClients {
+    int first;                     // Index of the first connection, for the source address
+    int count;
+    bool polite;
+    int interval_ms;               // Polite clients only
+    std::vector<double> latencies = {};
+    unsigned long long responses = 0;
+    unsigned long long limited = 0;     // 429s
+    unsigned long long reconnects = 0;  // The server closed the connection
+};
+
+void run_abuse_clients(const sockaddr_in& addr, const std::string& request, AbuseClients* clients,
+                       std::chrono::steady_clock::time_point deadline) {
+    int count = clients->count;
+    int epoll_fd = epoll_create1(0);
+    std::vector<int> fds(count, -1);
+    std::vector<std::string> inputs(count);
+    std::vector<std::chrono::steady_clock::time_point> sent_at(count), next_send(count);
+    std::vector<bool> in_flight(count, false);
+    auto open_connection = [&](int i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in source = {};
+        source.sin_family = AF_INET;
+        source.sin_addr.s_addr = htonl(clients->polite ? 0x7f000101 + (clients->first + i) % 254 : 0x7f000002);
+        if (bind(fd, (sockaddr*)&source, sizeof(source)) < 0 && i == 0) {
+            perror("Abuse benchmark: bind to a loopback source address (clients will share one address)");
+        }
+        if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror("Abuse benchmark: connect");
+            close(fd);
+            return;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u32 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        fds[i] = fd;
+        inputs[i].clear();
+        in_flight[i] = false;
+    };
+    // Polite clients spread their first requests over one interval
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        open_connection(i);
+        next_send[i] = start + std::chrono::microseconds(1000LL * clients->interval_ms * i / count);
+    }
+
+    std::vector<epoll_event> events(1024);
+    char buffer[65536];
+    while (true) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) break;
+        for (int i = 0; i < count; i++) {
+            if (fds[i] < 0 || in_flight[i] || (clients->polite && now < next_send[i])) continue;
+            sent_at[i] = now;
+            in_flight[i] = true;
+            send(fds[i], request.data(), request.size(), MSG_NOSIGNAL);
+        }
+        int ready = epoll_wait(epoll_fd, events.data(), events.size(), 1);
+        now = std::chrono::steady_clock::now();
+        for (int e = 0; e < ready; e++) {
+            int i = events[e].data.u32;
+            ssize_t n;
+            while ((n = recv(fds[i], buffer, sizeof(buffer), 0)) > 0) {
+                inputs[i].append(buffer, n);
+            }
+            // Count a response that arrived before a close too
+            size_t header_end = inputs[i].find("\r\n\r\n");
+            if (header_end != std::string::npos) {
+                size_t length_pos = inputs[i].find("Content-Length: ");
+                size_t content_length =
+                    length_pos < header_end ? strtoull(inputs[i].c_str() + length_pos + 16, nullptr, 10) : 0;
+                if (inputs[i].size() >= header_end + 4 + content_length) {
+                    if (inputs[i].compare(0, 12, "HTTP/1.1 429") == 0) clients->limited++;
+                    inputs[i].erase(0, header_end + 4 + content_length);
+                    in_flight[i] = false;
+                    clients->responses++;
+                    if (clients->polite) {
+                        clients->latencies.push_back(
+                            std::chrono::duration<double, std::milli>(now - sent_at[i]).count());
+                        next_send[i] = sent_at[i] + std::chrono::milliseconds(clients->interval_ms);
+                    }
+                }
+            }
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fds[i], nullptr);
+                close(fds[i]);
+                fds[i] = -1;
+                clients->reconnects++;
+                open_connection(i);
+            }
+        }
+    }
+    for (int fd : fds) {
+        if (fd >= 0) close(fd);
+    }
+    close(epoll_fd);
+}
+
+int run_abuse_benchmark(const std::string& host, int port, int polite_clients, int abusive_connections,
+                        int interval_ms, int seconds, const std::string& path) {
+    printf("Abuse benchmark: %d polite clients every %d ms, %d abusive connections, %s:%d%s for %d s\n",
+           polite_clients, interval_ms, abusive_connections, host.c_str(), port, path.c_str(), seconds);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: bench\r\n\r\n";
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    AbuseClients polite{0, polite_clients, true, interval_ms};
+    AbuseClients abusive{0, abusive_connections, false, 0};
+    std::thread abuser;
+    if (abusive_connections > 0) {
+        abuser = std::thread(run_abuse_clients, std::cref(addr), std::cref(request), &abusive, deadline);
+    }
+    run_abuse_clients(addr, request, &polite, deadline);
+    if (abuser.joinable()) {
+        abuser.join();
+    }
+
+    printf("Abuse benchmark: abusive client %.0f responses/s, %llu of %llu answered 429, %llu reconnects\n",
+           abusive.responses / (double)seconds, abusive.limited, abusive.responses, abusive.reconnects);
+    if (!polite.latencies.empty()) {
+        std::vector<double>& latencies = polite.latencies;
+        std::sort(latencies.begin(), latencies.end());
+        printf("Abuse benchmark: polite clients p50 %.3f ms, p99 %.3f ms, max %.3f ms (%llu responses, %llu "
+               "answered 429, %llu reconnects)\n",
+               latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100], latencies.back(),
+               polite.responses, polite.limited, polite.reconnects);
+    }
+    return polite.limited == 0 && polite.reconnects == 0 ? 0 : 1;
+}
+
+// Idle connection footprint: open connection_count keep-alive connections,
+// make one request on each (a dashboard that loaded and now sits idle) and
+// report the web server's resident memory and threads per idle connection
+// from /io_stats, once at the start of the hold and once at its end. The
+// server's --client-timeout must outlast the run or it closes them first.
+// On loopback the connections are spread over source addresses 127.0.0.x,
+// since one address has only ~28k ephemeral ports.
+int run_idle_benchmark(const std::string& host, int port, int connection_count, int hold_seconds) {
+    rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && (rlim_t)connection_count + 16 > files.rlim_cur) {
+        printf("Idle benchmark: descriptor limit %llu, opening %llu connections instead of %d\n",
+               (unsigned long long)files.rlim_cur, (unsigned long long)files.rlim_cur - 16, connection_count);
+        connection_count = (int)files.rlim_cur - 16;
+    }
+    printf("Idle benchmark: %d idle keep-alive connections to %s:%d, held %d s\n", connection_count, host.c_str(),
+           port, hold_seconds);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+    bool loopback = (ntohl(addr.sin_addr.s_addr) >> 24) == 127;
+    const int connections_per_source = 10000;
+
+    std::string engine, stats_before;
+    unsigned long long requests = 0, syscalls = 0;
+    if (!fetch_io_stats(host, port, engine, requests, syscalls, &stats_before)) {
+        printf("Idle benchmark: no /io_stats from %s:%d\n", host.c_str(), port);
+        return 1;
+    }
+
+    const int max_pending = 256;
+    const char request[] = "GET /check_status HTTP/1.1\r\nHost: idle\r\n\r\n";
+    int epoll_fd = epoll_create1(0);
+    std::vector<int> fds;
+    std::vector<std::string> inputs(connection_count);
+    int pending = 0, idle = 0, errors = 0;
+    std::vector<epoll_event> events(1024);
+    char buffer[4096];
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(120);
+    while ((idle + errors < connection_count) && std::chrono::steady_clock::now() < deadline) {
+        // Bounded connects in flight; each answered connection leaves the epoll set
+        while ((int)fds.size() < connection_count && pending < max_pending) {
+            int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if (fd < 0) {
+                perror("Idle benchmark: socket");
+                connection_count = fds.size();
+                break;
+            }
+            if (loopback) {
+                sockaddr_in source = {};
+                source.sin_family = AF_INET;
+                source.sin_addr.s_addr = htonl(0x7f000001 + (unsigned)fds.size() / connections_per_source);
+                bind(fd, (sockaddr*)&source, sizeof(source));
+            }
+            connect(fd, (sockaddr*)&addr, sizeof(addr));
+            epoll_event event = {};
+            event.events = EPOLLOUT;
+            event.data.u32 = fds.size();
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+            fds.push_back(fd);
+            pending++;
+        }
+        int ready = epoll_wait(epoll_fd, events.data(), events.size(), 100);
+        for (int e = 0; e < ready; e++) {
+            size_t i = events[e].data.u32;
+            if (events[e].events & EPOLLOUT) {
+                int error = 0;
+                socklen_t error_length = sizeof(error);
+                getsockopt(fds[i], SOL_SOCKET, SO_ERROR, &error, &error_length);
+                if (error == 0 && send(fds[i], request, sizeof(request) - 1, MSG_NOSIGNAL) > 0) {
+                    epoll_event event = {};
+                    event.events = EPOLLIN;
+                    event.data.u32 = i;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fds[i], &event);
+                    continue;
+                }
+                pending--;
+                errors++;
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fds[i], nullptr);
+                continue;
+            }
+            ssize_t n;
+            while ((n = recv(fds[i], buffer, sizeof(buffer), 0)) > 0) {
+                inputs[i].append(buffer, n);
+            }
+            size_t header_end = inputs[i].find("\r\n\r\n");
+            size_t length_pos = inputs[i].find("Content-Length: ");
+            size_t content_length =
+                length_pos < header_end ? strtoull(inputs[i].c_str() + length_pos + 16, nullptr, 10) : 0;
+            bool answered = header_end != std::string::npos && inputs[i].size() >= header_end + 4 + content_length;
+            if (!answered && !(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))) {
+                continue;
+            }
+            pending--;
+            (answered ? idle : errors)++;
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fds[i], nullptr);
+            std::string().swap(inputs[i]);
+        }
+    }
+    close(epoll_fd);
+    printf("Idle benchmark: %d connections answered and idle, %d failed\n", idle, errors);
+
+    long long rss_before = (long long)json_number(stats_before, "rss_kb");
+    long long threads_before = (long long)json_number(stats_before, "threads");
+    long long virtual_before = (long long)json_number(stats_before, "virtual_kb");
+    int result = 0;
+    for (int sample = 0; sample < 2; sample++) {
+        // First a moment for the server to park them, then the end of the hold
+        std::this_thread::sleep_for(std::chrono::seconds(sample == 0 ? 2 : std::max(0, hold_seconds - 2)));
+        std::string stats;
+        if (!fetch_io_stats(host, port, engine, requests, syscalls, &stats)) {
+            printf("Idle benchmark: /io_stats failed\n");
+            result = 1;
+            break;
+        }
+        long long rss = (long long)json_number(stats, "rss_kb");
+        long long open = (long long)json_number(stats, "web_connections") - 1;   // Less the /io_stats one
+        long long virtual_size = (long long)json_number(stats, "virtual_kb");
+        printf("Idle benchmark: %s engine, %s: %lld open (%llu parked), RSS %lld KB (+%lld KB, %.2f KB per "
+               "connection), virtual +%lld MB, %llu threads (was %lld)\n",
+               engine.c_str(), sample == 0 ? "start of hold" : "end of hold", open,
+               json_number(stats, "parked_connections"), rss, rss - rss_before,
+               idle > 0 ? (double)(rss - rss_before) / idle : 0.0, (virtual_size - virtual_before) / 1024,
+               json_number(stats, "threads"), threads_before);
+        if (open < idle) {
+            printf("Idle benchmark: the server closed %lld idle connections (raise its --client-timeout)\n",
+                   idle - open);
+            result = 1;
+        }
+    }
+    for (int fd : fds) {
+        close(fd);
+    }
+    return errors == 0 ? result : 1;
+}
+
+// One request on its own connection, read to EOF; returns the bytes
+// received, -1 if the connection or handshake failed. *session is offered
+// for resumption and replaced by the connection's.
+long long fetch_once(const std::string& host, int port, ssl_ctx_st* tls_context, ssl_session_st** session,
+                     const std::string& request, bool* resumed) {
+    ServerConnection connection = server_connect(host, port, tls_context, session ? *session : nullptr, resumed);
+    if (connection.fd < 0) {
+        return -1;
+    }
+    timeval timeout = {5, 0};
+    setsockopt(connection.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    long long received = 0;
+    if (server_send_all(connection, request.c_str(), request.size())) {
+        char buffer[65536];
+        ssize_t n;
+        while ((n = server_recv(connection, buffer, sizeof(buffer))) > 0) {
+            received += n;
+        }
+    }
+    server_close(connection, session);
+    return received;
+}
+
+// TLS benchmark, run once against a plaintext port and once against a
+// --tls-cert one to see what TLS costs. Connection setup: handshakes
+// sequential connections each fetch /check_status, first with full
+// handshakes, then resuming the previous connection's session. Bulk: for
+// seconds, connections fetch path (a large response) back to back. The
+// server's TLS counters from /io_stats show whether the kernel took over
+// encryption (kTLS) and how many handshakes were resumed.
+int run_tls_benchmark(const std::string& host, int port, bool use_tls, int handshakes, int seconds,
+                      const std::string& path) {
+    ssl_ctx_st* tls_context = nullptr;
+    if (use_tls && !(tls_context = create_tls_client_context(""))) {
+        return 1;
+    }
+    printf("TLS benchmark: %s:%d over %s\n", host.c_str(), port, use_tls ? "TLS" : "plain TCP");
+    const std::string check = "GET /check_status HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n";
+    ssl_session_st* session = nullptr;
+    int result = 0;
+    for (int phase = 0; phase < (use_tls ? 2 : 1); phase++) {
+        bool resuming = phase == 1;
+        std::vector<double> latencies;
+        int failed = 0, resumed_count = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < handshakes; i++) {
+            auto begin = std::chrono::steady_clock::now();
+            bool resumed = false;
+            if (fetch_once(host, port, tls_context, resuming ? &session : nullptr, check, &resumed) <= 0) {
+                failed++;
+                continue;
+            }
+            resumed_count += resumed;
+            latencies.push_back(
+                std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count());
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (latencies.empty()) {
+            printf("TLS benchmark: no connection succeeded\n");
+            result = 1;
+            break;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        printf("TLS benchmark: %-9s %d connections: %.0f/s, p50 %.3f ms, p99 %.3f ms, %d resumed, %d failed\n",
+               !use_tls ? "plain" : resuming ? "resumed" : "full", handshakes, latencies.size() / elapsed,
+               latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100], resumed_count, failed);
+    }
+
+    // Bulk transfer, one HTTP/1.0 response per connection
+    const std::string bulk = "GET " + path + " HTTP/1.0\r\nHost: bench\r\n\r\n";
+    long long bytes = 0;
+    int responses = 0, failed = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + std::chrono::seconds(seconds);
+    while (result == 0 && std::chrono::steady_clock::now() < end) {
+        long long received = fetch_once(host, port, tls_context, &session, bulk, nullptr);
+        if (received <= 0) {
+            failed++;
+            continue;
+        }
+        bytes += received;
+        responses++;
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (result == 0) {
+        printf("TLS benchmark: bulk %s: %d responses of %.0f KB, %.1f MB/s, %d failed\n", path.c_str(), responses,
+               responses ? bytes / 1024.0 / responses : 0.0, bytes / 1048576.0 / elapsed, failed);
+    }
+
+    std::string engine, stats;
+    unsigned long long requests, syscalls;
+    if (fetch_io_stats(host, port, engine, requests, syscalls, &stats, tls_context) && use_tls) {
+        printf("TLS benchmark: server (%s engine): %llu handshakes, %llu resumed, %llu failed, "
+               "kTLS send on %llu, receive on %llu\n",
+               engine.c_str(), json_number(stats, "tls_handshakes"), json_number(stats, "tls_resumed"),
+               json_number(stats, "tls_failures"), json_number(stats, "ktls_send"),
+               json_number(stats, "ktls_receive"));
+    }
+#ifdef WITH_TLS
+    SSL_SESSION_free(session);
+    SSL_CTX_free(tls_context);
+#endif
+    return result;
+}
+
 int main(int argc, char* argv[]) {
     std::string host = "127.0.0.1";
     int port = 12345;
+    int simulated_devices = 0;   // Synthetic devices on top of the built-in six
+    int interval_ms = 5000;      // Tick interval
+    int threads = 0;             // Simulation threads, 0 = one per core
+    int shard = 0;               // Device shard reported by this monitor
+    int udp_port = 0;            // Push as UDP telemetry to this port, 0 = HTTP
+    bool use_shm = false;        // Prefer the web server's shared-memory channel
+    
+    // backend_monitor --latency [host] [port] [shard] [pushes] [devices]
+    if (argc >= 2 && strcmp(argv[1], "--latency") == 0) {
+        if (argc >= 3) host = argv[2];
+        if (argc >= 4) port = std::atoi(argv[3]);
+        int latency_shard = argc >= 5 ? std::atoi(argv[4]) : 0;
+        int pushes = argc >= 6 ? std::max(1, std::atoi(argv[5])) : 2000;
+        int devices = argc >= 7 ? std::atoi(argv[6]) : 100;
+        return run_latency_benchmark(host, port, latency_shard, pushes, devices);
+    }
+    
+    // backend_monitor --http-bench [host] [web_port] [connections] [seconds] [path]
+    if (argc >= 2 && strcmp(argv[1], "--http-bench") == 0) {
+        int web_port = argc >= 4 ? std::atoi(argv[3]) : 8080;
+        int connection_count = argc >= 5 ? std::max(1, std::atoi(argv[4])) : 10000;
+        int seconds = argc >= 6 ? std::max(1, std::atoi(argv[5])) : 10;
+        std::string path = argc >= 7 ? argv[6] : "/check_status";
+        if (argc >= 3) host = argv[2];
+        return run_http_benchmark(host, web_port, connection_count, seconds, path);
+    }
+    
+    // backend_monitor --mixed-bench [host] [web_port] [cheap_connections] [heavy_connections] [seconds] [heavy_path]
+    if (argc >= 2 && strcmp(argv[1], "--mixed-bench") == 0) {
+        int web_port = argc >= 4 ? std::atoi(argv[3]) : 8080;
+        int cheap_count = argc >= 5 ? std::max(1, std::atoi(argv[4])) : 100;
+        int heavy_count = argc >= 6 ? std::max(0, std::atoi(argv[5])) : 32;
+        int seconds = argc >= 7 ? std::max(1, std::atoi(argv[6])) : 10;
+        std::string heavy_path = argc >= 8 ? argv[7] : "/";
+        if (argc >= 3) host = argv[2];
+        return run_http_benchmark(host, web_port, cheap_count + heavy_count, seconds, "/check_status", heavy_count,
+                                  heavy_path);
+    }
+    
+    // backend_monitor --abuse-bench [host] [web_port] [polite_clients] [abusive_connections] [interval_ms] [seconds] [path]
+    if (argc >= 2 && strcmp(argv[1], "--abuse-bench") == 0) {
+        int web_port = argc >= 4 ? std::atoi(argv[3]) : 8080;
+        int polite_clients = argc >= 5 ? std::max(1, std::atoi(argv[4])) : 50;
+        int abusive_connections = argc >= 6 ? std::max(0, std::atoi(argv[5])) : 16;
+        int interval_ms = argc >= 7 ? std::max(1, std::atoi(argv[6])) : 100;
+        int seconds = argc >= 8 ? std::max(1, std::atoi(argv[7])) : 10;
+        std::string path = argc >= 9 ? argv[8] : "/device_status_json?limit=50";
+        if (argc >= 3) host = argv[2];
+        return run_abuse_benchmark(host, web_port, polite_clients, abusive_connections, interval_ms, seconds, path);
+    }
+    
+    // backend_monitor --idle-bench [host] [web_port] [connections] [hold_seconds]
+    if (argc >= 2 && strcmp(argv[1], "--idle-bench") == 0) {
+        int web_port = argc >= 4 ? std::atoi(argv[3]) : 8080;
+        int connection_count = argc >= 5 ? std::max(1, std::atoi(argv[4])) : 50000;
+        int hold_seconds = argc >= 6 ? std::max(2, std::atoi(argv[5])) : 10;
+        if (argc >= 3) host = argv[2];
+        return run_idle_benchmark(host, web_port, connection_count, hold_seconds);
+    }
+    
+    // backend_monitor --tls-bench [host] [web_port] [tls] [handshakes] [seconds] [path]
+    if (argc >= 2 && strcmp(argv[1], "--tls-bench") == 0) {
+        int web_port = argc >= 4 ? std::atoi(argv[3]) : 8080;
+        bool use_tls = argc >= 5 ? std::atoi(argv[4]) != 0 : true;
+        int handshakes = argc >= 6 ? std::max(1, std::atoi(argv[5])) : 2000;
+        int seconds = argc >= 7 ? std::max(1, std::atoi(argv[6])) : 10;
+        std::string path = argc >= 8 ? argv[7] : "/device_status_json";
+        if (argc >= 3) host = argv[2];
+        return run_tls_benchmark(host, web_port, use_tls, handshakes, seconds, path);
+    }
+    
+    // backend_monitor --connect-storm [host] [port] [connections] [path]
+    if (argc >= 2 && strcmp(argv[1], "--connect-storm") == 0) {
+        int storm_port = argc >= 4 ? std::atoi(argv[3]) : 8080;
+        int connection_count = argc >= 5 ? std::max(1, std::atoi(argv[4])) : 5000;
+        std::string path = argc >= 6 ? argv[5] : "/check_status";
+        if (argc >= 3) host = argv[2];
+        return run_connect_storm(host, storm_port, connection_count, path);
+    }
+    
+    // backend_monitor --bench [host] [port] [monitors] [devices_per_monitor] [seconds] [udp_port]
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0) {
+        int monitor_count = 16;
+        int devices_per_monitor = 1000;
+        int seconds = 10;
+        if (argc >= 3) host = argv[2];
+        if (argc >= 4) port = std::atoi(argv[3]);
+        if (argc >= 5) monitor_count = std::max(1, std::min(64, std::atoi(argv[4])));
+        if (argc >= 6) devices_per_monitor = std::atoi(argv[5]);
+        if (argc >= 7) seconds = std::max(1, std::atoi(argv[6]));
+        int udp_port = argc >= 8 ? std::atoi(argv[7]) : 0;
+        return run_ingest_benchmark(host, port, monitor_count, devices_per_monitor, seconds, udp_port);
+    }
     
     printf("Starting System Monitor Backend\n");
     fflush(stdout);
     
-    // Parse command line arguments
-    if (argc >= 2) {
+    // Parse command line arguments: positional (host port devices interval
+    // threads shard udp_port shm), or named options and --config files
+    std::string notify_address = "0.0.0.0";  // Notification listener
+    int notify_port = 0;                      // 0 = 54321 + shard
+    std::string catalog_path;                 // Replaces the built-in devices
+    bool adaptive_push = true;                // Push when worth it rather than every tick
+    int heartbeat_ms = 5000;                  // Adaptive: full push at least this often
+    int coalesce_ms = 1000;                   // Adaptive: longest a minor change waits
+    int push_window = 2;                      // Adaptive: pushes queued or in flight at most
+    bool use_tls = false;                     // The web server's backend port speaks TLS
+    std::string tls_ca;                       // Verify its certificate against this
+    if (argc >= 2 && strncmp(argv[1], "--", 2) != 0) {
         host = argv[1];
+        if (argc >= 3) port = std::atoi(argv[2]);
+        if (argc >= 4) simulated_devices = std::atoi(argv[3]);
+        if (argc >= 5) interval_ms = std::atoi(argv[4]);
+        if (argc >= 6) threads = std::atoi(argv[5]);
+        if (argc >= 7) shard = std::atoi(argv[6]);
+        if (argc >= 8) udp_port = std::atoi(argv[7]);
+        if (argc >= 9) use_shm = std::atoi(argv[8]) != 0;
+    } else {
+        // Config files first, so the command line overrides them
+        std::vector<std::string> options;
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "--config") == 0 && i + 1 < argc && !read_config_file(argv[++i], &options)) {
+                return 1;
+            }
+        }
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+                i++;
+            } else {
+                options.push_back(argv[i]);
+            }
+        }
+        for (size_t i = 0; i < options.size(); i++) {
+            const std::string& option = options[i];
+            bool has_value = i + 1 < options.size();
+            if (option == "--host" && has_value) {
+                host = options[++i];
+            } else if (option == "--port" && has_value) {
+                port = std::atoi(options[++i].c_str());
+            } else if (option == "--simulated-devices" && has_value) {
+                simulated_devices = std::max(0, std::atoi(options[++i].c_str()));
+            } else if (option == "--device-catalog" && has_value) {
+                catalog_path = options[++i];
+            } else if (option == "--interval" && has_value) {
+                interval_ms = std::max(1, std::atoi(options[++i].c_str()));
+            } else if (option == "--threads" && has_value) {
+                threads = std::max(0, std::atoi(options[++i].c_str()));
+            } else if (option == "--shard" && has_value) {
+                shard = std::max(0, std::min(63, std::atoi(options[++i].c_str())));
+            } else if (option == "--udp-port" && has_value) {
+                udp_port = std::atoi(options[++i].c_str());
+            } else if (option == "--shm" && has_value) {
+                use_shm = std::atoi(options[++i].c_str()) != 0;
+            } else if (option == "--notify-address" && has_value) {
+                notify_address = options[++i];
+            } else if (option == "--notify-port" && has_value) {
+                notify_port = std::atoi(options[++i].c_str());
+            } else if (option == "--push-mode" && has_value && (options[i + 1] == "fixed" || options[i + 1] == "adaptive")) {
+                adaptive_push = options[++i] == "adaptive";
+            } else if (option == "--heartbeat" && has_value) {
+                heartbeat_ms = std::max(1, std::atoi(options[++i].c_str()));
+            } else if (option == "--coalesce" && has_value) {
+                coalesce_ms = std::max(0, std::atoi(options[++i].c_str()));
+            } else if (option == "--push-window" && has_value) {
+                push_window = std::max(1, std::atoi(options[++i].c_str()));
+            } else if (option == "--tls" && has_value) {
+                use_tls = std::atoi(options[++i].c_str()) != 0;
+            } else if (option == "--tls-ca" && has_value) {
+                tls_ca = options[++i];
+            } else if (option == "--cpu-affinity" && has_value) {
+                // CLASS=CPUS, once per thread class
+                const std::string& setting = options[++i];
+                if (!set_thread_affinity(setting.c_str())) {
+                    printf("Bad --cpu-affinity %s: expected simulation=CPUS or listener=CPUS\n", setting.c_str());
+                    return 1;
+                }
+            } else {
+                printf("Unknown option %s\n", option.c_str());
+                printf("Usage: %s [HOST [PORT [DEVICES [INTERVAL_MS [THREADS [SHARD [UDP_PORT [SHM]]]]]]]]\n"
+                       "   or: %s [--config FILE] [--host ADDR] [--port N] [--simulated-devices N]\n"
+                       "          [--device-catalog FILE] [--interval MS] [--threads N] [--shard N] [--udp-port N]\n"
+                       "          [--shm 0|1] [--notify-address ADDR] [--notify-port N] [--cpu-affinity CLASS=CPUS]...\n"
+                       "          [--push-mode fixed|adaptive] [--heartbeat MS] [--coalesce MS] [--push-window N]\n"
+                       "          [--tls 0|1] [--tls-ca FILE]\n"
+                       "Config files take the same options, one per line without the dashes; the command line\n"
+                       "overrides them.\n",
+                       argv[0], argv[0]);
+                return 1;
+            }
+        }
     }
-    if (argc >= 3) {
-        port = std::atoi(argv[2]);
+    std::vector<DeviceSpec> catalog;
+    if (!catalog_path.empty() && !read_device_catalog(catalog_path, &catalog)) {
+        printf("Could not load the device catalog %s\n", catalog_path.c_str());
+        return 1;
     }
+    in_addr notify_in;
+    if (inet_pton(AF_INET, notify_address.c_str(), &notify_in) != 1) {
+        printf("--notify-address must be an IPv4 address\n");
+        return 1;
+    }
+    finish_thread_pinning();
+    pin_current_thread(THREAD_SIMULATION);
     
     printf("Target web server: %s:%d\n", host.c_str(), port);
     fflush(stdout);
@@ -387,7 +2450,20 @@ int main(int argc, char* argv[]) {
     printf("Creating SystemMonitor object...\n");
     fflush(stdout);
     
-    SystemMonitor monitor(host, port);
+    SystemMonitor monitor(host, port, simulated_devices, interval_ms, threads, shard,
+                          catalog.empty() ? nullptr : &catalog);
+    monitor.set_udp_port(udp_port);
+    monitor.set_use_shm(use_shm, false);
+    monitor.set_notification_listener(notify_address, notify_port);
+    monitor.set_adaptive_push(adaptive_push, heartbeat_ms, coalesce_ms, push_window);
+    if (use_tls) {
+        ssl_ctx_st* tls_context = create_tls_client_context(tls_ca);
+        if (!tls_context) {
+            printf("Could not set up TLS\n");
+            return 1;
+        }
+        monitor.set_tls(tls_context);
+    }
     
     printf("SystemMonitor object created successfully\n");
     fflush(stdout);
@@ -0,0 +1,139 @@
+// Option handling shared by web_server and backend_monitor: --config files
+// and --cpu-affinity CLASS=CPUS thread pinning. Each program names its own
+// thread classes and defines the thread_pinning table that uses them.
+#ifndef COMMON_OPTIONS_H
+#define COMMON_OPTIONS_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+const int MAX_THREAD_CLASSES = 16;
+
+struct ThreadAffinity {
+    bool pinned;
+    cpu_set_t cpus;
+};
+
+// Filled in by main before any thread starts, read-only afterwards. Threads
+// inherit their creator's CPUs, so once any class is pinned the others are
+// put back on the CPUs the process started with.
+struct ThreadPinning {
+    const char* const* class_names;
+    int class_count;
+    ThreadAffinity classes[MAX_THREAD_CLASSES];
+    ThreadAffinity unpinned;
+};
+extern ThreadPinning thread_pinning;
+
+// Parse a CPU list such as "0-3,6" into cpus; false if it is malformed
+inline bool parse_cpu_list(const char* list, cpu_set_t* cpus) {
+    CPU_ZERO(cpus);
+    const char* p = list;
+    while (*p) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p) return false;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) return false;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) return false;
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        p = end;
+        if (*p == ',') p++;
+        else if (*p) return false;
+    }
+    return CPU_COUNT(cpus) > 0;
+}
+
+// One --cpu-affinity CLASS=CPUS; false if the class is unknown or the list
+// malformed
+inline bool set_thread_affinity(const char* setting) {
+    const char* equals = strchr(setting, '=');
+    if (!equals) {
+        return false;
+    }
+    std::string name(setting, equals - setting);
+    for (int i = 0; i < thread_pinning.class_count; i++) {
+        if (name == thread_pinning.class_names[i]) {
+            thread_pinning.classes[i].pinned = parse_cpu_list(equals + 1, &thread_pinning.classes[i].cpus);
+            return thread_pinning.classes[i].pinned;
+        }
+    }
+    return false;
+}
+
+// Once every option is read: remember the starting CPUs if anything is pinned
+inline void finish_thread_pinning() {
+    for (int i = 0; i < thread_pinning.class_count; i++) {
+        if (thread_pinning.classes[i].pinned) {
+            thread_pinning.unpinned.pinned =
+                sched_getaffinity(0, sizeof(thread_pinning.unpinned.cpus), &thread_pinning.unpinned.cpus) == 0;
+        }
+    }
+}
+
+// Pin the calling thread to its class's CPUs, if any class is pinned
+inline void pin_current_thread(int thread_class) {
+    const ThreadAffinity& affinity = thread_pinning.classes[thread_class].pinned
+                                         ? thread_pinning.classes[thread_class] : thread_pinning.unpinned;
+    if (affinity.pinned) {
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(affinity.cpus), &affinity.cpus);
+        if (error) {
+            printf("Failed to pin %s thread: %s\n", thread_pinning.class_names[thread_class], strerror(error));
+        }
+    }
+}
+
+// --config FILE: one option per line, named as on the command line without
+// the dashes ("port 8080" or "port = 8080"); blank lines and "#" comments
+// are skipped. Appended to args as "--option" "value".
+inline bool read_config_file(const char* path, std::vector<std::string>* args) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return false;
+    }
+    const char* blanks = " \t";
+    char line[4096];
+    int line_number = 0;
+    bool valid = true;
+    while (valid && fgets(line, sizeof(line), file)) {
+        line_number++;
+        std::string text = line;
+        text.resize(std::min(text.find('#'), text.find_first_of("\r\n")));
+        size_t start = text.find_first_not_of(blanks);
+        if (start == std::string::npos) {
+            continue;
+        }
+        text = text.substr(start, text.find_last_not_of(blanks) - start + 1);
+        size_t split = text.find_first_of(" \t=");
+        std::string key = text.substr(0, split);
+        size_t value_start = split == std::string::npos ? split : text.find_first_not_of(blanks, split);
+        if (value_start != std::string::npos && text[value_start] == '=') {
+            value_start = text.find_first_not_of(blanks, value_start + 1);
+        }
+        std::string value = value_start == std::string::npos ? "" : text.substr(value_start);
+        if (value.empty() || key == "config") {
+            printf("%s:%d: %s\n", path, line_number,
+                   key == "config" ? "config files cannot include others" : "option without a value");
+            valid = false;
+        }
+        args->push_back("--" + key);
+        args->push_back(value);
+    }
+    fclose(file);
+    return valid;
+}
+
+#endif
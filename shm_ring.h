@@ -0,0 +1,170 @@
+// Shared-memory transport between the web server and a co-located monitor
+// (web_server --shm-shards). Each shard gets a POSIX shm segment
+// "/lws_ring.shardNN" holding two single-producer/single-consumer byte
+// rings: up carries the monitor's url-encoded push body (as POSTed to
+// /update_system), down carries the web server's notification text (as sent
+// to the notification port). A message is a u32 length and the payload;
+// sleepers wait on futex words inside the segment. Both programs include
+// this file, so the layout cannot drift apart.
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <string>
+
+const char SHM_CHANNEL_MAGIC[8] = {'L', 'W', 'S', 'R', 'I', 'N', 'G', '1'};
+
+struct ShmRing {
+    alignas(64) std::atomic<unsigned long long> head;      // Bytes written, producer only
+    std::atomic<unsigned long long> messages;               // Messages written, producer only
+    alignas(64) std::atomic<unsigned long long> tail;      // Bytes consumed, consumer only
+    std::atomic<unsigned long long> acked;                  // Messages fully processed, consumer only
+    alignas(64) std::atomic<unsigned int> data_signal;     // Futex word, bumped on every write
+    std::atomic<unsigned int> consumer_sleeping;
+    std::atomic<unsigned int> space_signal;                 // Futex word, bumped on every read and ack
+    std::atomic<unsigned int> producer_sleeping;            // Producers waiting for space
+    unsigned long long capacity;                            // Power of two
+    unsigned long long data_offset;                         // From the start of the segment
+};
+
+struct ShmChannel {
+    char magic[8];
+    std::atomic<int> server_pid;
+    std::atomic<int> client_pid;
+    ShmRing up;
+    ShmRing down;
+};
+
+inline long futex_call(std::atomic<unsigned int>* word, int op, unsigned int value, const struct timespec* timeout) {
+    return syscall(SYS_futex, (unsigned int*)word, op, value, timeout, nullptr, 0);
+}
+
+// Bump a futex word and wake the other side if it is asleep on it
+inline void shm_signal(std::atomic<unsigned int>* signal, std::atomic<unsigned int>* sleeping) {
+    signal->fetch_add(1);
+    if (sleeping->load()) {
+        futex_call(signal, FUTEX_WAKE, INT_MAX, nullptr);
+    }
+}
+
+// Wait up to timeout_ms for ready() to hold. The sleeping count is raised
+// and the futex word sampled before the last check, so a signal between
+// that check and the wait makes the wait return at once. Wakeups meant for
+// another condition on the same word just go round the loop again.
+template <typename Ready>
+bool shm_wait(std::atomic<unsigned int>* signal, std::atomic<unsigned int>* sleeping, int timeout_ms, Ready ready) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (!ready()) {
+        long long remaining_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (remaining_ns <= 0) {
+            return false;
+        }
+        sleeping->fetch_add(1);
+        unsigned int seen = signal->load();
+        if (!ready()) {
+            struct timespec timeout = {(time_t)(remaining_ns / 1000000000), (long)(remaining_ns % 1000000000)};
+            futex_call(signal, FUTEX_WAIT, seen, &timeout);
+        }
+        sleeping->fetch_sub(1);
+    }
+    return true;
+}
+
+// Copy into / out of a ring's data area across the wrap point
+inline void shm_copy_in(char* data, unsigned long long capacity, unsigned long long position, const void* source,
+                        size_t length) {
+    size_t offset = position & (capacity - 1);
+    size_t first = std::min(length, (size_t)(capacity - offset));
+    memcpy(data + offset, source, first);
+    memcpy(data, (const char*)source + first, length - first);
+}
+
+inline void shm_copy_out(const char* data, unsigned long long capacity, unsigned long long position, void* target,
+                         size_t length) {
+    size_t offset = position & (capacity - 1);
+    size_t first = std::min(length, (size_t)(capacity - offset));
+    memcpy(target, data + offset, first);
+    memcpy((char*)target + first, data, length - first);
+}
+
+// Producer: wait up to timeout_ms until a message of `size` bytes fits.
+// Needs no lock, so several producers sharing a ring can wait at once and
+// take turns writing under their own lock afterwards.
+inline bool shm_ring_wait_space(ShmRing* ring, size_t size, int timeout_ms) {
+    unsigned long long needed = sizeof(unsigned int) + size;
+    return needed <= ring->capacity && shm_wait(&ring->space_signal, &ring->producer_sleeping, timeout_ms, [&]() {
+        return ring->capacity - (ring->head.load(std::memory_order_acquire) -
+                                 ring->tail.load(std::memory_order_acquire)) >= needed;
+    });
+}
+
+// Producer: append one message if it fits now
+inline bool shm_ring_try_write(ShmChannel* channel, ShmRing* ring, const std::string& message) {
+    unsigned long long needed = sizeof(unsigned int) + message.size();
+    unsigned long long head = ring->head.load(std::memory_order_relaxed);
+    if (ring->capacity - (head - ring->tail.load(std::memory_order_acquire)) < needed) {
+        return false;
+    }
+    char* data = (char*)channel + ring->data_offset;
+    unsigned int length = message.size();
+    shm_copy_in(data, ring->capacity, head, &length, sizeof(length));
+    shm_copy_in(data, ring->capacity, head + sizeof(length), message.data(), message.size());
+    ring->head.store(head + needed, std::memory_order_release);
+    ring->messages.store(ring->messages.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    shm_signal(&ring->data_signal, &ring->consumer_sleeping);
+    return true;
+}
+
+// Sole producer: append one message, waiting up to timeout_ms for space.
+// False if it does not fit, so the caller can fall back to TCP.
+inline bool shm_ring_write(ShmChannel* channel, ShmRing* ring, const std::string& message, int timeout_ms) {
+    return shm_ring_wait_space(ring, message.size(), timeout_ms) && shm_ring_try_write(channel, ring, message);
+}
+
+// Consumer: take the next message if one arrives within timeout_ms
+inline bool shm_ring_read(ShmChannel* channel, ShmRing* ring, std::string* message, int timeout_ms) {
+    unsigned long long tail = ring->tail.load(std::memory_order_relaxed);
+    if (!shm_wait(&ring->data_signal, &ring->consumer_sleeping, timeout_ms, [&]() {
+            return ring->head.load(std::memory_order_acquire) != tail;
+        })) {
+        return false;
+    }
+    const char* data = (const char*)channel + ring->data_offset;
+    unsigned int length;
+    shm_copy_out(data, ring->capacity, tail, &length, sizeof(length));
+    if (length > ring->capacity - sizeof(length)) {
+        // Corrupt length: drop everything written so far
+        ring->tail.store(ring->head.load(std::memory_order_acquire), std::memory_order_release);
+        return false;
+    }
+    message->resize(length);
+    shm_copy_out(data, ring->capacity, tail + sizeof(length), &(*message)[0], length);
+    ring->tail.store(tail + sizeof(length) + length, std::memory_order_release);
+    shm_signal(&ring->space_signal, &ring->producer_sleeping);
+    return true;
+}
+
+// Consumer: mark the oldest read message as processed
+inline void shm_ring_ack(ShmRing* ring) {
+    ring->acked.store(ring->acked.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    shm_signal(&ring->space_signal, &ring->producer_sleeping);
+}
+
+// Whether the process that registered a pid is still running
+inline bool shm_peer_alive(const std::atomic<int>& pid) {
+    int value = pid.load();
+    return value > 0 && (kill(value, 0) == 0 || errno == EPERM);
+}
+
+#endif
@@ -1,11 +1,14 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <cstring>
 #include <string>
 #include <map>
+#include <deque>
+#include <memory>
 #include <sstream>
 #include <iostream>
 #include <cstdlib>
@@ -15,9 +18,39 @@
 #include <cctype>
 #include <sys/resource.h>
 #include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <charconv>
 #include <chrono>
 #include <ctime>
 #include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <sys/utsname.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <functional>
+#include <coroutine>
+#include "common_options.h"
+#include "shm_ring.h"
+#ifdef WITH_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+// Hot columnar scans: an AVX2 clone is picked at load time where available,
+// and the dynamic cost model lets them vectorize at -O2 as well
+#define VECTORIZED_SCAN __attribute__((target_clones("avx2", "default"), optimize("vect-cost-model=dynamic")))
 
 // Server type enumeration, for logging
 enum ServerType {
@@ -25,6 +58,24 @@ enum ServerType {
     WEB_SERVER
 };
 
+// Thread classes that --cpu-affinity CLASS=CPUS can pin, e.g. to keep the
+// acceptors and the ring off the cores a noisy neighbour shares
+enum ThreadClass {
+    THREAD_ACCEPTOR,               // Thread-path acceptors, including main
+    THREAD_CONNECTION,             // Per-connection threads (HTTP/1, HTTP/2)
+    THREAD_WORKER,                 // CPU pool workers
+    THREAD_LOOP,                   // Coroutine loop
+    THREAD_URING,                  // io_uring engine
+    THREAD_INGEST,                 // UDP telemetry and shm channels
+    THREAD_BACKGROUND,             // Clock, persistence, replication
+    THREAD_CLASS_COUNT
+};
+const char* const THREAD_CLASS_NAMES[THREAD_CLASS_COUNT] = {"acceptor", "connection", "worker", "loop",
+                                                            "uring",    "ingest",     "background"};
+
+static_assert(THREAD_CLASS_COUNT <= MAX_THREAD_CLASSES, "too many thread classes");
+ThreadPinning thread_pinning = {THREAD_CLASS_NAMES, THREAD_CLASS_COUNT, {}, {}};
+
 // URL decoding for form data
 std::string url_decode(const std::string &src) {
     std::string result;
@@ -59,33 +110,558 @@ std::string to_lower(const std::string& str) {
     return result;
 }
 
+// Look up a decoded parameter in a query string ("a=1&b=2")
+std::string get_query_param(const std::string& query, const std::string& key) {
+    std::istringstream query_stream(query);
+    std::string pair;
+    while (std::getline(query_stream, pair, '&')) {
+        size_t eq_pos = pair.find('=');
+        if (eq_pos != std::string::npos && url_decode(pair.substr(0, eq_pos)) == key) {
+            return url_decode(pair.substr(eq_pos + 1));
+        }
+    }
+    return "";
+}
+
+// Escape a string for embedding in a JSON string literal
+std::string json_escape(const std::string& str) {
+    std::string result;
+    result.reserve(str.size());
+    for (unsigned char c : str) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            result += escaped;
+        } else {
+            result += c;
+        }
+    }
+    return result;
+}
+
+// Escape a string for embedding in HTML text or a quoted attribute
+std::string html_escape(const std::string& str) {
+    std::string result;
+    result.reserve(str.size());
+    for (char c : str) {
+        switch (c) {
+        case '&': result += "&amp;"; break;
+        case '<': result += "&lt;"; break;
+        case '>': result += "&gt;"; break;
+        case '"': result += "&quot;"; break;
+        case '\'': result += "&#39;"; break;
+        default: result += c;
+        }
+    }
+    return result;
+}
+
 // HTTP request structure
 struct HttpRequest {
     std::string method;
     std::string path;
+    std::string query;              // Raw query string after '?', if any
     std::string version;
     std::string connection_header;
     std::string content_length_header;
+    std::string upgrade_header;     // Lowercased; "h2c" asks to switch to HTTP/2
+    std::string http2_settings_header;
+    int http2_settings_count;       // An h2c upgrade needs exactly one HTTP2-Settings
     std::string body;
     bool keep_alive;
     ServerType server_type;  // Which server received this request
+    int error_status;        // 400 or 413 when the request cannot be framed, else 0
 };
 
+// Largest request body accepted; a full push of a large fleet is a few MB
+const size_t MAX_REQUEST_BODY = 64 * 1024 * 1024;
+
+// Parse a Content-Length value: 0 if valid, 400 if it is not a number,
+// 413 if the body would be over MAX_REQUEST_BODY
+int parse_content_length(const std::string& value, size_t* length) {
+    // Digits only: strtoull alone would take a sign or leading blanks
+    if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos) {
+        return 400;
+    }
+    errno = 0;
+    unsigned long long parsed = strtoull(value.c_str(), nullptr, 10);
+    if (errno == ERANGE || parsed > MAX_REQUEST_BODY) {
+        return 413;
+    }
+    *length = (size_t)parsed;
+    return 0;
+}
+
 // Device status structure
 struct DeviceStatus {
     std::string name;
     std::string status;
 };
 
+// Compact status codes used by the per-device history rings
+enum DeviceStatusCode : unsigned char {
+    STATUS_OK,
+    STATUS_OPERATIONAL,
+    STATUS_ACTIVE,
+    STATUS_DEGRADED,
+    STATUS_FAULT,
+    STATUS_OFFLINE,
+    STATUS_OTHER,      // Free-form status text not in the list above
+    STATUS_CODE_COUNT
+};
+
+// Per-device ring of status transitions in columnar layout. Each entry
+// covers [start_times[i], end_times[i]) so aggregate scans need no ordering
+// and vectorize; the newest entry stays open until the next transition.
+const unsigned DEVICE_HISTORY_CAPACITY = 64;  // Must be a power of two
+const unsigned HISTORY_OPEN_END = 0xFFFFFFFFu;
+
+struct DeviceHistory {
+    unsigned long long recorded;                        // Transitions ever recorded
+    unsigned int start_times[DEVICE_HISTORY_CAPACITY];  // Epoch seconds
+    unsigned int end_times[DEVICE_HISTORY_CAPACITY];    // Epoch seconds or HISTORY_OPEN_END
+    unsigned char codes[DEVICE_HISTORY_CAPACITY];       // DeviceStatusCode
+};
+
+// Coarse wall clock shared by all handlers. A single thread refreshes the
+// formatted strings once per second and publishes them through a seqlock,
+// so request paths never call localtime()/strftime() themselves.
+struct CachedClock {
+    std::atomic<unsigned> sequence;  // Odd while the writer is updating
+    time_t epoch_seconds;
+    char local_timestamp[20];        // "YYYY-MM-DD HH:MM:SS"
+    char http_date[32];              // RFC 7231 IMF-fixdate
+};
+
+// Consistent copy of the cached clock taken by a reader
+struct ClockReading {
+    time_t epoch_seconds;
+    char local_timestamp[20];
+    char http_date[32];
+};
+
+// On-disk layout of the persisted state. The snapshot is a fixed-layout
+// file read back through mmap; the write-ahead log holds fixed-size,
+// checksummed records so a torn tail from a crash is detected and dropped.
+const char SNAPSHOT_MAGIC[8] = {'L', 'W', 'S', 'S', 'N', 'A', 'P', '1'};
+const size_t PERSISTED_NAME_SIZE = 64;
+const size_t PERSISTED_STATUS_SIZE = 128;
+
+struct SnapshotHeader {
+    char magic[8];
+    unsigned int device_count;
+    unsigned int checksum;               // FNV-1a over the device records
+    unsigned long long wal_sequence;     // Last WAL record folded into this snapshot
+    char system_status[PERSISTED_STATUS_SIZE];
+};
+
+struct PersistedDevice {
+    char name[PERSISTED_NAME_SIZE];      // NUL-padded
+    char status[PERSISTED_STATUS_SIZE];  // NUL-padded
+};
+
+enum WalRecordType : unsigned int {
+    WAL_DEVICE_STATUS = 1,
+    WAL_SYSTEM_STATUS = 2
+};
+
+struct WalRecord {
+    unsigned long long sequence;
+    unsigned int type;                   // WalRecordType
+    unsigned int checksum;               // FNV-1a over the record with this field zeroed
+    char key[PERSISTED_NAME_SIZE];       // Device name (unused for system status)
+    char value[PERSISTED_STATUS_SIZE];
+};
+
+// Write-ahead log and snapshot bookkeeping. Records are staged in
+// 'pending' under the lock that guards the store's owner and written
+// with one write() per request.
+struct PersistentStore {
+    std::string snapshot_path;
+    std::string wal_path;
+    int wal_fd;
+    unsigned long long next_sequence;
+    unsigned long long records_since_snapshot;
+    std::string pending;                 // Encoded records not yet written
+};
+
+// Replication: every state change gets a version and is kept in a bounded
+// log. Replicas stream the log from the primary and fall back to a full
+// snapshot when the versions they need have been overwritten.
+const size_t CHANGE_LOG_CAPACITY = 65536;  // Must be a power of two
+const int REPLICATION_HEARTBEAT_SECONDS = 1;
+
+enum ChangeType : unsigned char {
+    CHANGE_DEVICE_STATUS = 1,
+    CHANGE_SYSTEM_STATUS = 2
+};
+
+struct ChangeRecord {
+    unsigned long long version;
+    ChangeType type;
+    int shard_id;
+    std::string key;
+    std::string value;
+};
+
+struct ChangeLog {
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;              // Broadcast on every append
+    unsigned long long history_id;       // Versions are only comparable within one history
+    unsigned long long version;          // Latest version assigned
+    unsigned long long oldest;           // Oldest version still held, version + 1 if none
+    std::vector<ChangeRecord> records;   // Ring indexed by version
+};
+
+// Devices are partitioned into shards, one per backend monitor. Each shard
+// has its own lock, push sequencing and persisted files, so monitors
+// pushing at the same time never contend on device state.
+const int MAX_SHARDS = 64;
+const int NOTIFICATION_BASE_PORT = 54321;   // Default for --monitor-port
+
+struct DeviceShard {
+    pthread_mutex_t mutex;
+    int shard_id;
+    std::vector<DeviceStatus> device_statuses;   // Device status list
+    std::vector<DeviceHistory> device_histories; // Parallel to device_statuses
+    std::unordered_map<std::string, size_t> device_index; // Name -> position
+    int fault_devices;                   // Devices currently in fault
+    // Query indexes, kept in step by apply_device_status_locked
+    std::vector<unsigned long long> status_bitmaps[STATUS_CODE_COUNT]; // Bit per position
+    size_t status_counts[STATUS_CODE_COUNT];
+    std::vector<unsigned> name_order;    // Positions by name; new devices are appended unsorted
+    size_t sorted_names;                 // Length of the sorted prefix of name_order
+    unsigned long long sequence_epoch;   // Sender run the sequence numbers belong to
+    unsigned long long last_sequence;    // Highest push sequence applied
+    unsigned long long pushes_applied;
+    unsigned long long pushes_rejected;  // Stale or duplicate pushes
+    bool telemetry_started;              // A UDP datagram has been seen
+    unsigned int telemetry_next_sequence; // Expected next UDP datagram sequence
+    PersistentStore* store;              // Opened on first write, null if persistence is off
+    ChangeLog* change_log;               // Null while restoring and on replicas
+};
+
+// What a shard's monitor last reported, used to merge the system status
+struct ShardSummary {
+    bool reporting;
+    std::string reported_status;
+    int device_count;
+    int fault_devices;
+};
+
+// Compact UDP telemetry (optional, --udp-port). A datagram carries records
+// for one shard; losing one is tolerated since monitors resend the full
+// state every tick. Layout, integers in network byte order:
+//   header: "LWT1", shard (u8), record count (u8), reserved (u16), sequence (u32)
+//   record: name length (u8), status length (u8), name, status
+// A record with an empty name carries the shard's system status.
+const char TELEMETRY_MAGIC[4] = {'L', 'W', 'T', '1'};
+const size_t TELEMETRY_HEADER_SIZE = 12;
+const size_t TELEMETRY_MAX_DATAGRAM = 1472;  // Fits one Ethernet frame
+const int TELEMETRY_BATCH = 64;              // Datagrams drained per recvmmsg()
+
+// Written by the UDP ingest thread only, read by /shard_status
+struct TelemetryStats {
+    std::atomic<unsigned long long> batches;
+    std::atomic<unsigned long long> datagrams;
+    std::atomic<unsigned long long> records;
+    std::atomic<unsigned long long> malformed;
+    std::atomic<unsigned long long> lost;      // Sequence gaps
+};
+
+// Shared-memory transport for a co-located monitor (optional, --shm-shards),
+// see shm_ring.h. The web server creates the segments with these sizes.
+const unsigned long long SHM_UP_CAPACITY = 16 * 1024 * 1024;  // Power of two
+const unsigned long long SHM_DOWN_CAPACITY = 1024 * 1024;     // Power of two
+const int SHM_NOTIFY_WAIT_MS = 100;    // Longest wait for room before a notification goes by TCP
+
+// The web server's end of a shard's channel. Any handler thread may send
+// a notification, so the down ring's producer side is serialized.
+struct ShmAttachment {
+    ShmChannel* channel;
+    int shard_id;
+    pthread_mutex_t producer_mutex;
+};
+
+// Requests served and socket syscalls issued by the I/O engine, for
+// /io_stats (thread path: select/accept/clone/recv/send/close; io_uring:
+// io_uring_enter)
+struct IoStats {
+    std::atomic<unsigned long long> requests;
+    std::atomic<unsigned long long> syscalls;
+    std::atomic<unsigned long long> accepts;         // Connections accepted (thread path)
+    std::atomic<unsigned long long> accept_wakeups;  // Listener wakeups that accepted a batch
+    std::atomic<int> parked_connections;             // Thread path: idle, waiting on the coroutine loop
+    std::atomic<unsigned long long> tls_handshakes;  // Completed, resumed ones included
+    std::atomic<unsigned long long> tls_resumed;     // Handshakes that resumed a session
+    std::atomic<unsigned long long> tls_failures;    // Handshakes that failed or timed out
+    std::atomic<unsigned long long> ktls_send;       // TLS connections whose sends the kernel encrypts
+    std::atomic<unsigned long long> ktls_receive;    // ... and whose receives it decrypts
+};
+
+// Large responses are generated and sent in slices of about this size;
+// the buffers are kept in a small pool instead of being freed each time
+const size_t STREAM_CHUNK_SIZE = 64 * 1024;
+const size_t STREAM_BUFFER_POOL_SIZE = 64;
+
+struct StreamBufferPool {
+    pthread_mutex_t mutex;
+    std::vector<std::string> buffers;
+};
+
+// CPU worker pool. Page rendering and device queries run here instead of
+// on the connection's I/O thread, so an expensive render never holds up
+// the io_uring engine and CPU-bound work never exceeds one worker per
+// core however many connections ask for it. Each worker owns a deque and
+// runs its tasks in arrival order; a worker with nothing to do steals from
+// the back of another's deque.
+//
+// Work is queued in lanes. Backend pushes are taken before any web work
+// and have reserved workers that never run web tasks, so a dashboard
+// stampede cannot delay device updates. Web work carries a queue-time
+// budget and is shed with a 503 once it would wait, or has waited, longer.
+enum TaskLane { LANE_BACKEND = 0, LANE_WEB = 1, LANE_COUNT = 2 };
+
+struct TaskLaneStats {
+    std::atomic<int> queued;
+    std::atomic<int> peak_queued;
+    std::atomic<unsigned long long> run;
+    std::atomic<unsigned long long> shed;
+    std::atomic<unsigned long long> wait_us;     // Queue time of admitted tasks
+    std::atomic<long long> last_wait_us;         // Queue time of the latest task dequeued
+    std::atomic<long long> service_us;           // Moving average of one task's run time
+};
+
+struct TaskWorker {
+    pthread_mutex_t mutex;
+    std::deque<std::function<void()>> tasks[LANE_COUNT];
+};
+
+struct TaskPool {
+    std::vector<TaskWorker*> workers;  // The first shared_workers take both lanes, the rest backend work only
+    int shared_workers;
+    int web_budget_ms;             // Queue-time budget of web tasks, 0 never sheds
+    pthread_mutex_t idle_mutex;    // Sleeping workers wait on idle_cond or reserved_cond
+    pthread_cond_t idle_cond;
+    pthread_cond_t reserved_cond;
+    std::atomic<int> queued;       // Submitted and not yet taken
+    std::atomic<int> sleeping;     // Shared workers
+    std::atomic<int> reserved_sleeping;
+    std::atomic<unsigned> next_worker;  // Round-robin target for submissions from outside the pool
+    std::atomic<unsigned long long> tasks_run;
+    std::atomic<unsigned long long> steals;
+    TaskLaneStats lanes[LANE_COUNT];
+};
+
+// Coroutine reactor. Handlers that wait on the network are C++20
+// coroutines returning Task<T>; each wait parks the coroutine here instead
+// of blocking its thread, and the loop thread resumes it once epoll reports
+// the socket ready or the wait's deadline passes. A thousand handlers stuck
+// on a slow monitor cost a thousand coroutine frames, not a thousand threads.
+struct LoopWaiter {
+    std::coroutine_handle<> handle;
+    int fd;                        // -1 for a plain timer
+    unsigned events;               // EPOLLIN/EPOLLOUT
+    int timeout_ms;                // Negative waits without a deadline
+    bool ready;                    // Result: fd ready, or a plain timer's deadline reached
+    bool timed;                    // timer is valid
+    std::multimap<long long, LoopWaiter*>::iterator timer;
+};
+
+struct CoroutineLoop {
+    int epoll_fd;
+    int wake_fd;                   // eventfd, bumped when incoming gains a waiter
+    pthread_mutex_t mutex;         // For incoming
+    std::vector<LoopWaiter*> incoming;  // Posted by suspending coroutines on any thread
+    std::multimap<long long, LoopWaiter*> timers;  // By monotonic deadline (ms); loop thread only
+    std::atomic<int> suspended;    // Coroutines parked on the loop
+    std::atomic<unsigned long long> waits;
+    std::atomic<unsigned long long> timeouts;
+};
+
+// Per-client rate limiting on the web port (--rate-limit). Each client
+// IPv4 address has a token bucket refilled at `rate` per second up to
+// `burst` tokens; a request that finds it empty is not parsed, and gets a
+// 429 once the bucket would have a token again. Buckets live in one fixed
+// table split into shards of RATE_SHARD_SLOTS; an address hashes to a shard
+// and a start slot, and probes at most RATE_PROBE_LIMIT neighbours. Lookups, inserts and
+// token updates are CAS loops on the slot's two words, with no locks. A
+// bucket idle long enough to have refilled is the same as a new one, so its
+// slot is simply taken over by the next address that needs one (lazy
+// expiry); if no slot can be had, the request is let through.
+const int RATE_SHARDS = 64;
+const int RATE_SHARD_SLOTS = 1024;            // Power of two
+const int RATE_PROBE_LIMIT = 16;
+const unsigned long long RATE_TOKEN_MASK = 0xffffff;  // Low 24 bits of a bucket's state
+
+struct RateBucket {
+    std::atomic<unsigned> address;             // IPv4, network order; 0 = free
+    std::atomic<unsigned long long> state;     // Refill time in ms << 24 | milli-tokens; 0 = full
+};
+
+struct RateLimiter {
+    double rate;                               // Tokens per second
+    long long burst_milli;                     // Bucket size in milli-tokens
+    long long refill_ms;                       // Time an empty bucket takes to fill
+    long long epoch_ms;                        // Monotonic clock at start
+    RateBucket* buckets;                       // RATE_SHARDS * RATE_SHARD_SLOTS
+    std::atomic<unsigned long long> limited;
+    std::atomic<unsigned long long> reused;    // Idle buckets taken over
+    std::atomic<unsigned long long> table_full;
+};
+
+// Application variables: a fixed schema of typed values. Each value is one
+// 64-bit word (an integer, a double's bits, an enum option index or a
+// pointer to an interned string), so a read on a hot path is a single
+// atomic load. Batches are published under a seqlock whose count is also
+// the table's version; a reader that needs several variables consistent
+// with each other copies them with app_vars_snapshot().
+enum AppVarType : unsigned char { APP_VAR_INT, APP_VAR_FLOAT, APP_VAR_STRING, APP_VAR_ENUM };
+
+struct AppVarSpec {
+    const char* name;
+    AppVarType type;
+    double min;                    // Numbers: inclusive range
+    double max;                    // Strings: longest length
+    const char* options;           // Enums: '|'-separated names in index order
+    const char* initial;
+};
+
+enum AppVar { APP_VAR_MODE, APP_VAR_SPEED, APP_VAR_ALERT_FAULT_RATIO, APP_VAR_BANNER, APP_VAR_COUNT };
+
+const AppVarSpec APP_VAR_SCHEMA[APP_VAR_COUNT] = {
+    {"mode", APP_VAR_ENUM, 0, 0, "normal|maintenance|degraded", "normal"},
+    {"speed", APP_VAR_INT, 0, 100, nullptr, "50"},
+    {"alert_fault_ratio", APP_VAR_FLOAT, 0, 1, nullptr, "0.1"},
+    {"banner", APP_VAR_STRING, 0, 256, nullptr, ""},
+};
+
+// A string value lives in `strings` while the table refers to it. Once
+// replaced it moves to `retired`, which is freed by a later batch that finds
+// no reader inside an AppVarStringGuard.
+struct AppVarStore {
+    std::atomic<unsigned long long> sequence;   // Odd while a batch is applied; version = sequence / 2
+    std::atomic<unsigned long long> values[APP_VAR_COUNT];
+    mutable std::atomic<int> string_readers;    // Readers that may hold a string value
+    pthread_mutex_t write_mutex;                // Serializes batches and interning
+    std::unordered_set<std::string> strings;    // Interned string values in use
+    std::vector<std::unordered_set<std::string>::node_type> retired;
+};
+
+// Held while string values read from the store are in use
+struct AppVarStringGuard {
+    const AppVarStore* store;
+    explicit AppVarStringGuard(const AppVarStore* store) : store(store) {
+        store->string_readers.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);    // Pairs with app_vars_apply's
+    }
+    ~AppVarStringGuard() { store->string_readers.fetch_sub(1, std::memory_order_release); }
+};
+
+// Hot-path reads of a single variable
+long long app_var_int(const AppVarStore* store, AppVar var) {
+    return (long long)store->values[var].load(std::memory_order_acquire);
+}
+
+double app_var_float(const AppVarStore* store, AppVar var) {
+    unsigned long long bits = store->values[var].load(std::memory_order_acquire);
+    double number;
+    memcpy(&number, &bits, sizeof(number));
+    return number;
+}
+
+std::string app_var_string(const AppVarStore* store, AppVar var) {
+    AppVarStringGuard guard(store);
+    return *reinterpret_cast<const std::string*>(store->values[var].load(std::memory_order_acquire));
+}
+
+// A stored value as text, the inverse of app_var_parse; a string value
+// needs an AppVarStringGuard
+std::string app_var_format(int var, unsigned long long value) {
+    const AppVarSpec& spec = APP_VAR_SCHEMA[var];
+    switch (spec.type) {
+    case APP_VAR_INT:
+        return std::to_string((long long)value);
+    case APP_VAR_FLOAT: {
+        double number;
+        memcpy(&number, &value, sizeof(number));
+        char text[32];
+        std::to_chars_result formatted = std::to_chars(text, text + sizeof(text), number);
+        return std::string(text, formatted.ptr);
+    }
+    case APP_VAR_ENUM: {
+        const char* option = spec.options;
+        for (unsigned long long i = 0; i < value && strchr(option, '|'); i++) {
+            option = strchr(option, '|') + 1;
+        }
+        const char* option_end = strchr(option, '|');
+        return option_end ? std::string(option, option_end - option) : std::string(option);
+    }
+    case APP_VAR_STRING:
+        return *reinterpret_cast<const std::string*>(value);
+    }
+    return "";
+}
+
+
+// Hot upgrade (SIGUSR2): state changes are frozen while the state is
+// handed to the new process, then this one drains and exits
+enum UpgradeState {
+    UPGRADE_NONE,
+    UPGRADE_FROZEN,                // No accepts, writes refused
+    UPGRADE_DRAINING               // New process serving; connections close after their response
+};
+
+// OpenSSL's SSL and SSL_CTX; TLS needs a build with -DWITH_TLS -lssl -lcrypto
+struct ssl_st;
+struct ssl_ctx_st;
+
 // Context structure for shared data
 struct ThreadContext {
-    pthread_mutex_t mutex;         // For system_status and app_vars
+    pthread_mutex_t mutex;         // For system_status and shard summaries
     pthread_mutex_t conn_mutex;    // For active_connections tracking
     int active_backend_connections;
     int active_web_connections;
     std::string system_status;
-    std::map<std::string, std::string> app_vars;
-    std::vector<DeviceStatus> device_statuses; // Device status list
+    AppVarStore app_vars;          // Lock-free for readers
+    DeviceShard shards[MAX_SHARDS];            // Each guarded by its own mutex
+    ShardSummary shard_summaries[MAX_SHARDS];  // Under mutex
+    CachedClock clock;             // Refreshed by clock_thread
+    std::string state_prefix;      // Persisted file name prefix, empty if persistence is off
+    PersistentStore* store;        // System status log; null while restoring or if off
+    ChangeLog changes;             // Versioned change stream for replicas
+    ChangeLog* change_log;         // &changes once local changes are versioned, null on replicas
+    bool read_only;                // Replica: state only changes through replication
+    std::string primary_address;   // Replica: host:port of the primary's replication port
+    bool primary_connected;        // Replica: under changes.mutex
+    int replicas_connected;        // Primary: under changes.mutex
+    int replication_fd;            // Primary: replication listener, -1 if not serving replicas
+    int telemetry_fd;              // UDP telemetry socket, -1 if disabled
+    TelemetryStats telemetry;
+    ShmAttachment* shm_channels[MAX_SHARDS];  // Null for shards without a shm channel
+    const char* io_engine;         // "threads" or "uring"
+    IoStats io;
+    std::atomic<int> connection_counter;  // Thread-path connection ids, shared by the acceptors
+    TaskPool* cpu_pool;            // Render and query handlers, null to run them inline
+    CoroutineLoop* coro_loop;      // Resumes handlers suspended on sockets and timers
+    RateLimiter* rate_limiter;     // Web port, null if unlimited
+    StreamBufferPool stream_buffers;
+    int client_timeout_seconds;    // Idle limit on client connections
+    int park_idle_ms;              // Thread path: idle time before a connection gives up its thread, -1 = never
+    pthread_attr_t connection_thread_attr;  // Detached, with the --connection-stack size
+    in_addr monitor_address;       // Where backend monitors listen for notifications
+    int monitor_base_port;         // Shard K's monitor listens on monitor_base_port + K
+    int monitor_timeout_ms;        // Connect and send limit for a notification
+    std::atomic<int> upgrade_state;       // UpgradeState
+    std::atomic<int> writes_in_flight;    // Between begin_write and end_write
+    pthread_mutex_t compaction_mutex;     // Held by the persistence thread while it compacts
+    std::vector<std::pair<char, int>> listeners;  // Every listening socket by kind, handed over on upgrade
+    int upgrade_wake_fd;           // io_uring engine's eventfd, -1 on the thread path
+    ssl_ctx_st* tls;               // Null without --tls-cert
+    bool tls_ports[2];             // Indexed by ServerType: the listener speaks TLS
 };
 
 // Thread arguments (per-client)
@@ -94,16 +670,535 @@ struct ClientThreadArgs {
     int client_fd;         // Client socket
     int connection_id;     // Unique connection ID
     ServerType server_type; // Which server this client connected to
+    unsigned client_address;  // Peer IPv4 address, network order
+    ssl_st* tls;           // Session of a TLS connection coming back from parking, else null
+};
+
+// A thread-path client socket. TLS connections read and write through
+// OpenSSL, which leaves the record layer to the kernel where kTLS could be
+// enabled; those calls then cost what plain socket calls do.
+struct ClientSocket {
+    int fd;
+    ssl_st* tls;                   // Null for plaintext
 };
 
+// recv() on a client socket: -1 with errno EAGAIN on the receive timeout,
+// 0 once the peer is gone
+ssize_t client_recv(ClientSocket socket, void* buffer, size_t length) {
+#ifdef WITH_TLS
+    if (socket.tls) {
+        size_t received;
+        if (SSL_read_ex(socket.tls, buffer, length, &received) == 1) {
+            return (ssize_t)received;
+        }
+        int error = SSL_get_error(socket.tls, 0);
+        ERR_clear_error();
+        if (error == SSL_ERROR_ZERO_RETURN) return 0;
+        if (error == SSL_ERROR_WANT_READ) {
+            errno = EAGAIN;
+        } else if (error != SSL_ERROR_SYSCALL || errno == 0) {
+            errno = EPROTO;
+        }
+        return -1;
+    }
+#endif
+    return recv(socket.fd, buffer, length, 0);
+}
+
+// Send a whole buffer on a client socket; false once the peer is gone
+bool client_send_all(ClientSocket socket, const char* data, size_t length) {
+#ifdef WITH_TLS
+    if (socket.tls) {
+        while (length > 0) {
+            size_t written;
+            if (SSL_write_ex(socket.tls, data, length, &written) != 1) {
+                ERR_clear_error();
+                return false;
+            }
+            data += written;
+            length -= written;
+        }
+        return true;
+    }
+#endif
+    while (length > 0) {
+        ssize_t n = send(socket.fd, data, length, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+bool client_send_all(ClientSocket socket, const std::string& data) {
+    return client_send_all(socket, data.data(), data.size());
+}
+
+// True if TLS already holds decrypted bytes the socket will not signal
+bool client_has_buffered_input([[maybe_unused]] ClientSocket socket) {
+#ifdef WITH_TLS
+    return socket.tls && SSL_pending(socket.tls) > 0;
+#else
+    return false;
+#endif
+}
+
+// Format the current time into the cached clock slot (writer side)
+void refresh_cached_clock(CachedClock* clock) {
+    static const char* const day_names[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+    static const char* const month_names[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                              "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+    // time() may read a coarse clock that lags the tick boundary
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    time_t now = ts.tv_sec;
+    struct tm local_tm;
+    struct tm utc_tm;
+    localtime_r(&now, &local_tm);
+    gmtime_r(&now, &utc_tm);
+
+    // Format outside the critical section, then publish with a plain copy
+    char local_timestamp[sizeof(clock->local_timestamp)];
+    char http_date[sizeof(clock->http_date)];
+    strftime(local_timestamp, sizeof(local_timestamp), "%Y-%m-%d %H:%M:%S", &local_tm);
+    snprintf(http_date, sizeof(http_date), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+             day_names[utc_tm.tm_wday], utc_tm.tm_mday, month_names[utc_tm.tm_mon],
+             utc_tm.tm_year + 1900, utc_tm.tm_hour, utc_tm.tm_min, utc_tm.tm_sec);
+
+    unsigned seq = clock->sequence.load(std::memory_order_relaxed);
+    clock->sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    clock->epoch_seconds = now;
+    memcpy(clock->local_timestamp, local_timestamp, sizeof(local_timestamp));
+    memcpy(clock->http_date, http_date, sizeof(http_date));
+    clock->sequence.store(seq + 2, std::memory_order_release);
+}
+
+// Read the cached clock without locks or syscalls (reader side)
+void read_cached_clock(const CachedClock* clock, ClockReading* reading) {
+    unsigned before;
+    unsigned after;
+    do {
+        before = clock->sequence.load(std::memory_order_acquire);
+        reading->epoch_seconds = clock->epoch_seconds;
+        memcpy(reading->local_timestamp, clock->local_timestamp, sizeof(reading->local_timestamp));
+        memcpy(reading->http_date, clock->http_date, sizeof(reading->http_date));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = clock->sequence.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+}
+
+// Clock tick thread: refresh the cached strings at every second boundary
+void* clock_thread(void* arg) {
+    CachedClock* clock = static_cast<CachedClock*>(arg);
+    pin_current_thread(THREAD_BACKGROUND);
+    while (true) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        struct timespec next_tick = {now.tv_sec + 1, 0};
+        while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &next_tick, nullptr) == EINTR) {
+        }
+        refresh_cached_clock(clock);
+    }
+    return nullptr;
+}
+
+// Insert a Date header after the status line of a generated response
+void add_date_header(ThreadContext* ctx, std::string& response) {
+    size_t status_line_end = response.find("\r\n");
+    if (status_line_end == std::string::npos) {
+        return;
+    }
+    ClockReading now;
+    read_cached_clock(&ctx->clock, &now);
+    std::string date_header = "Date: ";
+    date_header += now.http_date;
+    date_header += "\r\n";
+    response.insert(status_line_end + 2, date_header);
+}
+
+// Tell a keep-alive client that the connection closes after this response
+void add_connection_close_header(std::string& response) {
+    size_t status_line_end = response.find("\r\n");
+    if (status_line_end == std::string::npos || response.find("\r\nConnection: close\r\n") != std::string::npos) {
+        return;
+    }
+    response.insert(status_line_end + 2, "Connection: close\r\n");
+}
+
+// Bracket a state change so an upgrade can wait for it. False (and nothing
+// to end) while the state is frozen for an upgrade.
+bool begin_write(ThreadContext* ctx) {
+    ctx->writes_in_flight.fetch_add(1);
+    if (ctx->upgrade_state.load() != UPGRADE_NONE) {
+        ctx->writes_in_flight.fetch_sub(1);
+        return false;
+    }
+    return true;
+}
+
+void end_write(ThreadContext* ctx) {
+    ctx->writes_in_flight.fetch_sub(1);
+}
+
+// Map a status string onto its compact code
+DeviceStatusCode status_to_code(const std::string& status) {
+    if (status == "ok") return STATUS_OK;
+    if (status == "operational") return STATUS_OPERATIONAL;
+    if (status == "active") return STATUS_ACTIVE;
+    if (status == "degraded") return STATUS_DEGRADED;
+    if (status == "fault") return STATUS_FAULT;
+    if (status == "offline") return STATUS_OFFLINE;
+    return STATUS_OTHER;
+}
+
+// Status string for a compact code
+const char* status_code_name(unsigned char code) {
+    static const char* const names[STATUS_CODE_COUNT] = {
+        "ok", "operational", "active", "degraded", "fault", "offline", "other"
+    };
+    return code < STATUS_CODE_COUNT ? names[code] : "other";
+}
+
+// Append a transition, closing the previous entry at the same instant
+void record_device_transition(DeviceHistory* history, time_t when, DeviceStatusCode code) {
+    const unsigned mask = DEVICE_HISTORY_CAPACITY - 1;
+    unsigned int timestamp = static_cast<unsigned int>(when);
+    if (history->recorded > 0) {
+        history->end_times[(history->recorded - 1) & mask] = timestamp;
+    }
+    unsigned slot = history->recorded & mask;
+    history->start_times[slot] = timestamp;
+    history->end_times[slot] = HISTORY_OPEN_END;
+    history->codes[slot] = code;
+    history->recorded++;
+}
+
+// 32-bit FNV-1a checksum
+unsigned int fnv1a(const void* data, size_t length, unsigned int hash = 2166136261u) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Whether a device fits the persisted records. Longer names or statuses
+// are refused when they arrive, so what is served always matches what a
+// restart restores.
+bool fits_persisted_record(const std::string& name, const std::string& status) {
+    return name.size() < PERSISTED_NAME_SIZE && status.size() < PERSISTED_STATUS_SIZE;
+}
+
+// Copy a string into a fixed NUL-padded field, truncating if needed
+void copy_fixed_field(char* field, size_t field_size, const std::string& value) {
+    memset(field, 0, field_size);
+    memcpy(field, value.data(), std::min(value.size(), field_size - 1));
+}
+
+// Stage a WAL record; caller holds the lock guarding the store
+void wal_append_locked(PersistentStore* store, WalRecordType type, const std::string& key, const std::string& value) {
+    if (!store) {
+        return;
+    }
+    WalRecord record;
+    memset(&record, 0, sizeof(record));
+    record.sequence = store->next_sequence++;
+    record.type = type;
+    copy_fixed_field(record.key, sizeof(record.key), key);
+    copy_fixed_field(record.value, sizeof(record.value), value);
+    record.checksum = fnv1a(&record, sizeof(record));
+    store->pending.append(reinterpret_cast<const char*>(&record), sizeof(record));
+    store->records_since_snapshot++;
+}
+
+// Write staged WAL records with a single write(); caller holds the lock
+// guarding the store. The page cache makes them survive a process crash;
+// the persistence thread fdatasync()s the log once per second for power loss.
+void wal_flush_locked(PersistentStore* store) {
+    if (!store || store->pending.empty()) {
+        return;
+    }
+    const char* data = store->pending.data();
+    size_t remaining = store->pending.size();
+    while (remaining > 0) {
+        ssize_t written = write(store->wal_fd, data, remaining);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            perror("[PERSIST] WAL write");
+            break;
+        }
+        data += written;
+        remaining -= written;
+    }
+    store->pending.clear();
+}
+
+// Append a change with the next version (or the given one on a replica)
+// and wake the replication streams. A null log records nothing.
+void change_log_append(ChangeLog* log, ChangeType type, int shard_id, const std::string& key,
+                       const std::string& value, unsigned long long version = 0) {
+    if (!log) {
+        return;
+    }
+    pthread_mutex_lock(&log->mutex);
+    if (version == 0) {
+        version = log->version + 1;
+    }
+    ChangeRecord& record = log->records[version & (CHANGE_LOG_CAPACITY - 1)];
+    record.version = version;
+    record.type = type;
+    record.shard_id = shard_id;
+    record.key = key;
+    record.value = value;
+    log->version = version;
+    if (log->version - log->oldest >= CHANGE_LOG_CAPACITY) {
+        log->oldest = log->version - CHANGE_LOG_CAPACITY + 1;
+    }
+    pthread_cond_broadcast(&log->changed);
+    pthread_mutex_unlock(&log->mutex);
+}
+
+// Start a new history at the given version (replica after a snapshot)
+void change_log_reset(ChangeLog* log, unsigned long long history_id, unsigned long long version) {
+    pthread_mutex_lock(&log->mutex);
+    log->history_id = history_id;
+    log->version = version;
+    log->oldest = version + 1;
+    pthread_cond_broadcast(&log->changed);
+    pthread_mutex_unlock(&log->mutex);
+}
+
+// Set the overall system status; caller holds ctx->mutex
+void set_system_status_locked(ThreadContext* ctx, const std::string& status) {
+    ctx->system_status = status;
+    wal_append_locked(ctx->store, WAL_SYSTEM_STATUS, "", status);
+    change_log_append(ctx->change_log, CHANGE_SYSTEM_STATUS, 0, "", status);
+}
+
+// File name prefix of a shard's snapshot and WAL
+std::string shard_file_prefix(ThreadContext* ctx, const DeviceShard* shard) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".shard%02d", shard->shard_id);
+    return ctx->state_prefix + suffix;
+}
+
+// Open a fresh WAL for a shard on its first write; caller holds
+// shard->mutex. Without persistence the shard simply has no store.
+void open_shard_store_locked(ThreadContext* ctx, DeviceShard* shard) {
+    if (shard->store || ctx->state_prefix.empty()) {
+        return;
+    }
+    PersistentStore* store = new PersistentStore();
+    store->snapshot_path = shard_file_prefix(ctx, shard) + ".snap";
+    store->wal_path = shard_file_prefix(ctx, shard) + ".wal";
+    store->next_sequence = 1;
+    store->records_since_snapshot = 0;
+    store->wal_fd = open(store->wal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (store->wal_fd < 0) {
+        perror("[PERSIST] open shard WAL");
+        delete store;
+        return;
+    }
+    shard->store = store;
+}
+
+// Move a device between the per-status bitmaps and counts; old_code is
+// STATUS_CODE_COUNT for a newly registered device. Caller holds shard->mutex.
+void index_device_status_locked(DeviceShard* shard, size_t position, int old_code, DeviceStatusCode new_code) {
+    size_t word = position / 64;
+    unsigned long long bit = 1ULL << (position % 64);
+    if (old_code < STATUS_CODE_COUNT) {
+        shard->status_bitmaps[old_code][word] &= ~bit;
+        shard->status_counts[old_code]--;
+    }
+    std::vector<unsigned long long>& bitmap = shard->status_bitmaps[new_code];
+    if (bitmap.size() <= word) {
+        bitmap.resize(word + 1, 0);
+    }
+    bitmap[word] |= bit;
+    shard->status_counts[new_code]++;
+}
+
+// Sort the devices registered since the last query into name_order, so
+// registering stays O(1) and a query after a burst of them pays one merge.
+// Caller holds shard->mutex.
+void sort_name_index_locked(DeviceShard* shard) {
+    if (shard->sorted_names == shard->name_order.size()) {
+        return;
+    }
+    const std::vector<DeviceStatus>& devices = shard->device_statuses;
+    auto by_name = [&devices](unsigned a, unsigned b) { return devices[a].name < devices[b].name; };
+    auto middle = shard->name_order.begin() + shard->sorted_names;
+    std::sort(middle, shard->name_order.end(), by_name);
+    std::inplace_merge(shard->name_order.begin(), middle, shard->name_order.end(), by_name);
+    shard->sorted_names = shard->name_order.size();
+}
+
+// Apply a device status change or registration, recording the transition.
+// Caller must hold shard->mutex. A null log_prefix applies it silently.
+// Returns true if anything changed.
+bool apply_device_status_locked(DeviceShard* shard, const std::string& name, const std::string& status,
+                                const char* log_prefix, const ClockReading& now) {
+    if (!fits_persisted_record(name, status)) {
+        if (log_prefix) {
+            printf("%s [%s] Refused device with over-long name or status: %.40s...\n", log_prefix,
+                   now.local_timestamp, name.c_str());
+        }
+        return false;
+    }
+    DeviceStatusCode code = status_to_code(status);
+    auto it = shard->device_index.find(name);
+    if (it == shard->device_index.end()) {
+        // Add new device if not found
+        size_t position = shard->device_statuses.size();
+        shard->device_index[name] = position;
+        shard->device_statuses.push_back({name, status});
+        shard->name_order.push_back(position);
+        index_device_status_locked(shard, position, STATUS_CODE_COUNT, code);
+        shard->device_histories.emplace_back();
+        DeviceHistory* history = &shard->device_histories.back();
+        history->recorded = 0;
+        record_device_transition(history, now.epoch_seconds, code);
+        shard->fault_devices += (code == STATUS_FAULT);
+        wal_append_locked(shard->store, WAL_DEVICE_STATUS, name, status);
+        change_log_append(shard->change_log, CHANGE_DEVICE_STATUS, shard->shard_id, name, status);
+        if (log_prefix) {
+            printf("%s [%s] New device added: %s = %s\n", log_prefix, now.local_timestamp, name.c_str(), status.c_str());
+        }
+        return true;
+    }
+
+    DeviceStatus& device = shard->device_statuses[it->second];
+    if (device.status == status) {
+        return false;
+    }
+    if (log_prefix) {
+        printf("%s [%s] Device '%s' status changed: %s -> %s\n",
+               log_prefix, now.local_timestamp, name.c_str(), device.status.c_str(), status.c_str());
+    }
+    DeviceStatusCode old_code = status_to_code(device.status);
+    shard->fault_devices += (code == STATUS_FAULT) - (old_code == STATUS_FAULT);
+    index_device_status_locked(shard, it->second, old_code, code);
+    device.status = status;
+    record_device_transition(&shard->device_histories[it->second], now.epoch_seconds, code);
+    wal_append_locked(shard->store, WAL_DEVICE_STATUS, name, status);
+    change_log_append(shard->change_log, CHANGE_DEVICE_STATUS, shard->shard_id, name, status);
+    return true;
+}
+
+// Copy the devices of every shard, shard by shard
+std::vector<DeviceStatus> collect_devices(ThreadContext* ctx) {
+    std::vector<DeviceStatus> devices;
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        DeviceShard* shard = &ctx->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        devices.insert(devices.end(), shard->device_statuses.begin(), shard->device_statuses.end());
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    return devices;
+}
+
+// Find and lock the shard holding a device; returns null if unknown
+DeviceShard* lock_device_shard(ThreadContext* ctx, const std::string& name, size_t* position) {
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        DeviceShard* shard = &ctx->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        auto it = shard->device_index.find(name);
+        if (it != shard->device_index.end()) {
+            *position = it->second;
+            return shard;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    return nullptr;
+}
+
+// Merge the statuses reported by the shard monitors; caller holds ctx->mutex.
+// A single reporting monitor is passed through unchanged, as are statuses
+// all monitors agree on (e.g. an override echoed back by each); otherwise
+// the status is derived from the combined fault count, critical once it
+// reaches alert_fault_ratio of the devices.
+bool merge_shard_statuses_locked(ThreadContext* ctx, std::string* merged) {
+    int reporting = 0;
+    int device_count = 0;
+    int fault_devices = 0;
+    bool all_agree = true;
+    const std::string* first_status = nullptr;
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        const ShardSummary& summary = ctx->shard_summaries[i];
+        if (!summary.reporting) continue;
+        reporting++;
+        device_count += summary.device_count;
+        fault_devices += summary.fault_devices;
+        if (!first_status) {
+            first_status = &summary.reported_status;
+        } else if (summary.reported_status != *first_status) {
+            all_agree = false;
+        }
+    }
+    if (reporting == 0) {
+        return false;
+    }
+    if (all_agree) {
+        *merged = *first_status;
+    } else if (fault_devices == 0) {
+        *merged = "Operational";
+    } else {
+        // Critical once the faulted share of the fleet reaches alert_fault_ratio
+        bool critical = fault_devices >= app_var_float(&ctx->app_vars, APP_VAR_ALERT_FAULT_RATIO) * device_count;
+        *merged = std::string(critical ? "Critical: " : "Warning: ") + std::to_string(fault_devices) +
+                  (fault_devices == 1 ? " device fault" : " device faults");
+    }
+    return true;
+}
+
+// Seconds a device spent in fault within [from, to). Branch-free scan over
+// the columnar ring so the compiler can vectorize it; entry order does not
+// matter because every entry carries its own end time.
+VECTORIZED_SCAN
+unsigned int device_fault_seconds(const DeviceHistory& history, unsigned int from, unsigned int to,
+                                  unsigned int now) {
+    unsigned count = history.recorded < DEVICE_HISTORY_CAPACITY
+                         ? static_cast<unsigned>(history.recorded) : DEVICE_HISTORY_CAPACITY;
+    unsigned int window_end = std::min(to, now);
+    unsigned int total = 0;  // Bounded by the window length
+    for (unsigned i = 0; i < count; i++) {
+        unsigned int begin = std::max(history.start_times[i], from);
+        unsigned int end = std::min(history.end_times[i], window_end);
+        unsigned int span = end > begin ? end - begin : 0;
+        total += (history.codes[i] == STATUS_FAULT) ? span : 0;
+    }
+    return total;
+}
+
+// Transitions of a device starting within [from, to)
+VECTORIZED_SCAN
+unsigned device_transitions_in_window(const DeviceHistory& history, unsigned int from, unsigned int to) {
+    unsigned count = history.recorded < DEVICE_HISTORY_CAPACITY
+                         ? static_cast<unsigned>(history.recorded) : DEVICE_HISTORY_CAPACITY;
+    unsigned transitions = 0;
+    for (unsigned i = 0; i < count; i++) {
+        transitions += (history.start_times[i] >= from && history.start_times[i] < to) ? 1 : 0;
+    }
+    return transitions;
+}
+
 
-// Parse HTTP request from buffer
-HttpRequest parse_http_request(const char* buffer, ssize_t bytes, int client_fd, ServerType server_type) {
+// Parse HTTP request from buffer. With client, the rest of a body the
+// buffer does not hold is read from it; without, the buffer must hold the
+// whole request (the io_uring engine frames requests before parsing).
+HttpRequest parse_http_request(const char* buffer, ssize_t bytes, const ClientSocket* client,
+                               ServerType server_type) {
     HttpRequest request = {};
     request.server_type = server_type;
+    std::string raw(buffer, bytes);    // Bodies may hold NUL bytes
     
     // Parse first line using getline to properly handle line endings
-    std::istringstream req_stream(buffer);
+    std::istringstream req_stream(raw);
     std::string request_line;
     std::getline(req_stream, request_line);
     
@@ -116,6 +1211,13 @@ HttpRequest parse_http_request(const char* buffer, ssize_t bytes, int client_fd,
     std::istringstream line_stream(request_line);
     line_stream >> request.method >> request.path >> request.version;
 
+    // Split off the query string so routes match on the bare path
+    size_t query_pos = request.path.find('?');
+    if (query_pos != std::string::npos) {
+        request.query = request.path.substr(query_pos + 1);
+        request.path.resize(query_pos);
+    }
+
     // Parse headers
     std::string line;
     while (std::getline(req_stream, line)) {
@@ -141,7 +1243,16 @@ HttpRequest parse_http_request(const char* buffer, ssize_t bytes, int client_fd,
             if (header_name == "connection") {
                 request.connection_header = to_lower(header_value);
             } else if (header_name == "content-length") {
+                // Two lengths leave the body's end ambiguous
+                if (!request.content_length_header.empty()) {
+                    request.error_status = 400;
+                }
                 request.content_length_header = header_value;
+            } else if (header_name == "upgrade") {
+                request.upgrade_header = to_lower(header_value);
+            } else if (header_name == "http2-settings") {
+                request.http2_settings_header = header_value;
+                request.http2_settings_count++;
             }
         }
     }
@@ -155,24 +1266,37 @@ HttpRequest parse_http_request(const char* buffer, ssize_t bytes, int client_fd,
         request.keep_alive = (request.connection_header == "keep-alive");
     }
 
+    // The rest of the stream cannot be framed after a bad length
+    size_t content_length = 0;
+    if (!request.error_status && !request.content_length_header.empty()) {
+        request.error_status = parse_content_length(request.content_length_header, &content_length);
+    }
+    if (request.error_status) {
+        request.keep_alive = false;
+        return request;
+    }
+
     // Extract body if present (for POST requests)
     if (request.method == "POST" && !request.content_length_header.empty()) {
-        size_t content_length = std::stoul(request.content_length_header);
-        size_t body_start = std::string(buffer).find("\r\n\r\n");
+        size_t body_start = raw.find("\r\n\r\n");
 
         if (body_start != std::string::npos) {
             body_start += 4;  // Skip past CRLFCRLF
-            request.body = std::string(buffer).substr(body_start);
-
-            // If we didn't get the full body, read the remaining bytes
-            if (request.body.length() < content_length) {
-                size_t remaining = content_length - request.body.length();
-                char body_buffer[remaining + 1];
-                ssize_t body_bytes = recv(client_fd, body_buffer, remaining, 0);
-                if (body_bytes > 0) {
-                    body_buffer[body_bytes] = '\0';
-                    request.body += std::string(body_buffer, body_bytes);
+            request.body = raw.substr(body_start, content_length);
+
+            // If we didn't get the full body, keep reading until we have it;
+            // large shard pushes span many segments
+            size_t received = request.body.length();
+            if (received < content_length && client) {
+                request.body.resize(content_length);
+                while (received < content_length) {
+                    ssize_t body_bytes = client_recv(*client, &request.body[received], content_length - received);
+                    if (body_bytes <= 0) {
+                        break;
+                    }
+                    received += body_bytes;
                 }
+                request.body.resize(received);
             }
         }
     }
@@ -181,15 +1305,31 @@ HttpRequest parse_http_request(const char* buffer, ssize_t bytes, int client_fd,
 }
 
 // Generate response for root path "/"
+// Larger fleets get a free-text device field instead of a drop-down
+const size_t DEVICE_SELECT_MAX_OPTIONS = 500;
+
 std::string handle_root_request(ThreadContext* ctx) {
     printf("[WEB] Serving root page request\n");
     
     pthread_mutex_lock(&ctx->mutex);
     std::string system_status = ctx->system_status;
-    std::vector<DeviceStatus> devices = ctx->device_statuses; // Copy for thread safety
     pthread_mutex_unlock(&ctx->mutex);
+    std::string banner = app_var_string(&ctx->app_vars, APP_VAR_BANNER);
+    long long mode = app_var_int(&ctx->app_vars, APP_VAR_MODE);
+    // Count from the shard sizes; names are copied only when few enough to list
+    size_t device_count = 0;
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        DeviceShard* shard = &ctx->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        device_count += shard->device_statuses.size();
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    std::vector<DeviceStatus> devices;
+    if (device_count <= DEVICE_SELECT_MAX_OPTIONS) {
+        devices = collect_devices(ctx);
+    }
 
-    printf("[WEB] Current device count: %d\n", (int)devices.size());
+    printf("[WEB] Current device count: %d\n", (int)device_count);
     printf("[WEB] System status: %s\n", system_status.c_str());
 
     std::ostringstream html;
@@ -201,11 +1341,14 @@ std::string handle_root_request(ThreadContext* ctx) {
          << "h1 { color: #2c3e50; text-align: center; border-bottom: 2px solid #3498db; padding-bottom: 10px; }"
          << ".status-summary { background: #ecf0f1; padding: 15px; border-radius: 5px; margin: 20px 0; text-align: center; }"
          << ".status-summary h2 { margin: 0; color: #2c3e50; }"
+         << ".banner { background: #fcf3cf; border: 1px solid #f39c12; padding: 10px; border-radius: 5px; text-align: center; }"
          << ".status-value { font-size: 1.2em; font-weight: bold; color: #27ae60; }"
          << "table { width: 100%; border-collapse: collapse; margin-top: 20px; }"
          << "th { background-color: #3498db; color: white; text-align: left; padding: 12px; }"
          << "td { padding: 12px; border-bottom: 1px solid #ddd; }"
-         << "tr:nth-child(even) { background-color: #f2f2f2; }"
+         << "tr.odd { background-color: #f2f2f2; }"
+         << "#device-table td { height: 15px; white-space: nowrap; overflow: hidden; text-overflow: ellipsis; }"
+         << "#device-table td:first-child { width: 60%; }"
          << ".ok { color: #27ae60; font-weight: bold; }"
          << ".fault { color: #e74c3c; font-weight: bold; }"
          << ".operational { color: #2980b9; font-weight: bold; }"
@@ -266,65 +1409,170 @@ std::string handle_root_request(ThreadContext* ctx) {
          << "}\n"
          << "console.log('refreshStatus function defined successfully');\n"
          << "\n"
-         << "console.log('About to define refreshDevices function...');\n"
-         << "function refreshDevices() {\n"
-         << "  console.log('refreshDevices() called - starting device status fetch');\n"
-         << "  console.log('About to fetch /device_status_json...');\n"
-         << "  var deviceFetchPromise = fetch('/device_status_json');\n"
-         << "  console.log('device fetch() called, promise object:', deviceFetchPromise);\n"
-         << "  deviceFetchPromise\n"
-         << "    .then(function(response) {\n"
-         << "      console.log('Device status response received:', response.status, response.statusText);\n"
-         << "      console.log('Response headers:', response.headers);\n"
-         << "      console.log('Response URL:', response.url);\n"
-         << "      if (!response.ok) {\n"
-         << "        console.error('Response not OK, throwing error');\n"
+         << "console.log('About to define device window functions...');\n"
+         << "// Only the rows in view are requested; the spacer keeps the scrollbar sized to the full result\n"
+         << "var ROW_HEIGHT = 40;\n"
+         << "var OVERSCAN_ROWS = 10;\n"
+         << "var deviceRequestId = 0;\n"
+         << "var scrollPending = false;\n"
+         << "// Version of the rendered window; polls ask only for changes after it\n"
+         << "var deviceVersion = null;\n"
+         << "var deviceHistory = null;\n"
+         << "var deviceCount = null;\n"
+         << "var deviceTotal = 0;\n"
+         << "var visibleRows = {};\n"
+         << "function statusClassFor(status) {\n"
+         << "  if (status === 'fault') return 'fault';\n"
+         << "  if (status === 'operational') return 'operational';\n"
+         << "  if (status === 'degraded') return 'degraded';\n"
+         << "  if (status === 'active') return 'active';\n"
+         << "  return 'ok';\n"
+         << "}\n"
+         << "function showDeviceCounts(total, data) {\n"
+         << "  var counts = [];\n"
+         << "  for (var name in data.counts) {\n"
+         << "    if (data.counts[name] > 0) counts.push(name + ': ' + data.counts[name]);\n"
+         << "  }\n"
+         << "  document.getElementById('device-counts').innerText =\n"
+         << "    total + ' of ' + data.device_count + ' devices (' + counts.join(', ') + ')';\n"
+         << "}\n"
+         << "function deviceQueryUrl(offset, limit) {\n"
+         << "  var url = '/device_status_json?offset=' + offset + '&limit=' + limit;\n"
+         << "  url += '&sort=' + encodeURIComponent(document.getElementById('sort-order').value);\n"
+         << "  var status = document.getElementById('filter-status').value;\n"
+         << "  if (status) url += '&status=' + encodeURIComponent(status);\n"
+         << "  var prefix = document.getElementById('filter-prefix').value;\n"
+         << "  if (prefix) url += '&prefix=' + encodeURIComponent(prefix);\n"
+         << "  return url;\n"
+         << "}\n"
+         << "function renderDeviceWindow() {\n"
+         << "  var viewport = document.getElementById('device-viewport');\n"
+         << "  var first = Math.max(0, Math.floor(viewport.scrollTop / ROW_HEIGHT) - OVERSCAN_ROWS);\n"
+         << "  var count = Math.ceil(viewport.clientHeight / ROW_HEIGHT) + 2 * OVERSCAN_ROWS;\n"
+         << "  var requestId = ++deviceRequestId;\n"
+         << "  var url = deviceQueryUrl(first, count);\n"
+         << "  console.log('renderDeviceWindow(): fetching', url);\n"
+         << "  fetch(url)\n"
+         << "    .then(function(response) {\n"
+         << "      console.log('Device window response received:', response.status, response.statusText);\n"
+         << "      if (!response.ok) {\n"
          << "        throw new Error('HTTP ' + response.status);\n"
          << "      }\n"
-         << "      console.log('Response OK, parsing JSON...');\n"
          << "      return response.json();\n"
          << "    })\n"
          << "    .then(function(data) {\n"
-         << "      console.log('Device JSON data received:', JSON.stringify(data));\n"
+         << "      if (requestId !== deviceRequestId) {\n"
+         << "        console.log('Dropping stale device window response', requestId);\n"
+         << "        return;\n"
+         << "      }\n"
          << "      if (!data.devices || !Array.isArray(data.devices)) {\n"
          << "        console.error('Invalid device data format:', data);\n"
          << "        throw new Error('Invalid device data format');\n"
          << "      }\n"
-         << "      var devices = data.devices;\n"
-         << "      console.log('Processing', devices.length, 'devices');\n"
-         << "      var tbody = document.querySelector('#device-table tbody');\n"
-         << "      if (!tbody) {\n"
-         << "        console.error('Could not find tbody element');\n"
-         << "        return;\n"
-         << "      }\n"
-         << "      console.log('Found tbody element, clearing content');\n"
-         << "      tbody.innerHTML = '';\n"
-         << "      for (var i = 0; i < devices.length; i++) {\n"
-         << "        var device = devices[i];\n"
-         << "        console.log('Adding device:', device.name, device.status);\n"
-         << "        var row = tbody.insertRow();\n"
-         << "        var nameCell = row.insertCell(0);\n"
-         << "        var statusCell = row.insertCell(1);\n"
-         << "        nameCell.textContent = device.name;\n"
-         << "        statusCell.textContent = device.status;\n"
-         << "        var statusClass = 'ok';\n"
-         << "        if (device.status === 'fault') statusClass = 'fault';\n"
-         << "        else if (device.status === 'operational') statusClass = 'operational';\n"
-         << "        else if (device.status === 'degraded') statusClass = 'degraded';\n"
-         << "        else if (device.status === 'active') statusClass = 'active';\n"
-         << "        statusCell.className = statusClass;\n"
+         << "      console.log('Rendering', data.devices.length, 'of', data.total, 'devices from offset', data.offset);\n"
+         << "      document.getElementById('device-spacer').style.height = (data.total * ROW_HEIGHT) + 'px';\n"
+         << "      var table = document.getElementById('device-table');\n"
+         << "      table.style.top = (data.offset * ROW_HEIGHT) + 'px';\n"
+         << "      var tbody = table.tBodies[0];\n"
+         << "      visibleRows = {};\n"
+         << "      // Reuse the existing rows rather than rebuilding the table\n"
+         << "      while (tbody.rows.length > data.devices.length) tbody.deleteRow(-1);\n"
+         << "      for (var i = 0; i < data.devices.length; i++) {\n"
+         << "        var device = data.devices[i];\n"
+         << "        var row = i < tbody.rows.length ? tbody.rows[i] : tbody.insertRow();\n"
+         << "        if (row.cells.length === 0) {\n"
+         << "          row.insertCell(0);\n"
+         << "          row.insertCell(1);\n"
+         << "          row.onclick = function() {\n"
+         << "            document.getElementById('device-select').value = this.cells[0].textContent;\n"
+         << "          };\n"
+         << "        }\n"
+         << "        row.className = (data.offset + i) % 2 ? 'odd' : '';\n"
+         << "        row.cells[0].textContent = device.name;\n"
+         << "        row.cells[1].textContent = device.status;\n"
+         << "        row.cells[1].className = statusClassFor(device.status);\n"
+         << "        visibleRows[device.name] = row;\n"
          << "      }\n"
+         << "      showDeviceCounts(data.total, data);\n"
+         << "      deviceVersion = data.version;\n"
+         << "      deviceHistory = data.history;\n"
+         << "      deviceCount = data.device_count;\n"
+         << "      deviceTotal = data.total;\n"
          << "      if (data.timestamp) {\n"
-         << "        console.log('Updating timestamp to:', data.timestamp);\n"
          << "        document.getElementById('last-updated').innerText = data.timestamp;\n"
          << "      }\n"
-         << "      console.log('Table update completed successfully');\n"
+         << "      console.log('Device window update completed successfully');\n"
          << "    })\n"
          << "    .catch(function(error) {\n"
-         << "      console.error('Error fetching device status:', error);\n"
+         << "      console.error('Error fetching device window:', error);\n"
          << "      console.error('Error details:', error.message, error.stack);\n"
          << "      document.getElementById('last-updated').innerText = 'Error: ' + error.message;\n"
          << "    });\n"
+         << "}\n"
+         << "function onDeviceScroll() {\n"
+         << "  if (scrollPending) return;\n"
+         << "  scrollPending = true;\n"
+         << "  requestAnimationFrame(function() {\n"
+         << "    scrollPending = false;\n"
+         << "    renderDeviceWindow();\n"
+         << "  });\n"
+         << "}\n"
+         << "function onDeviceFilterChange() {\n"
+         << "  console.log('Device filter changed, returning to the top of the list');\n"
+         << "  document.getElementById('device-viewport').scrollTop = 0;\n"
+         << "  renderDeviceWindow();\n"
+         << "}\n"
+         << "console.log('Device window functions defined successfully');\n"
+         << "\n"
+         << "// Apply a changes-since response to the rows in view. Anything that can\n"
+         << "// move rows in or out of the window (new devices, a status filter) or a\n"
+         << "// resync marker falls back to querying the window again.\n"
+         << "function applyDeviceChanges(data) {\n"
+         << "  if (data.resync || data.device_count !== deviceCount ||\n"
+         << "      (data.devices.length > 0 && document.getElementById('filter-status').value)) {\n"
+         << "    console.log('Device changes need a window refresh (resync:', data.resync, ')');\n"
+         << "    renderDeviceWindow();\n"
+         << "    return;\n"
+         << "  }\n"
+         << "  console.log('Applying', data.devices.length, 'device changes up to version', data.version);\n"
+         << "  for (var i = 0; i < data.devices.length; i++) {\n"
+         << "    var device = data.devices[i];\n"
+         << "    var row = visibleRows[device.name];\n"
+         << "    if (row) {\n"
+         << "      row.cells[1].textContent = device.status;\n"
+         << "      row.cells[1].className = statusClassFor(device.status);\n"
+         << "    }\n"
+         << "  }\n"
+         << "  if (data.system_status !== undefined) {\n"
+         << "    document.getElementById('status-value').innerText = data.system_status;\n"
+         << "  }\n"
+         << "  showDeviceCounts(deviceTotal, data);\n"
+         << "  document.getElementById('last-updated').innerText = data.timestamp;\n"
+         << "  deviceVersion = data.version;\n"
+         << "}\n"
+         << "\n"
+         << "console.log('About to define refreshDevices function...');\n"
+         << "function refreshDevices() {\n"
+         << "  console.log('refreshDevices() called - refreshing visible device rows');\n"
+         << "  if (deviceVersion === null) {\n"
+         << "    renderDeviceWindow();\n"
+         << "  } else {\n"
+         << "    var requestId = deviceRequestId;\n"
+         << "    fetch('/device_status_json?since=' + deviceVersion + '&history=' + deviceHistory)\n"
+         << "      .then(function(response) {\n"
+         << "        console.log('Device changes response received:', response.status, response.statusText);\n"
+         << "        if (!response.ok) throw new Error('HTTP ' + response.status);\n"
+         << "        return response.json();\n"
+         << "      })\n"
+         << "      .then(function(data) {\n"
+         << "        // A window query started meanwhile carries newer state\n"
+         << "        if (requestId === deviceRequestId) applyDeviceChanges(data);\n"
+         << "      })\n"
+         << "      .catch(function(error) {\n"
+         << "        console.error('Error fetching device changes:', error);\n"
+         << "        document.getElementById('last-updated').innerText = 'Error: ' + error.message;\n"
+         << "      });\n"
+         << "  }\n"
          << "  console.log('About to fetch /check_status for system status...');\n"
          << "  var statusFetchPromise = fetch('/check_status');\n"
          << "  console.log('system status fetch() called, promise object:', statusFetchPromise);\n"
@@ -460,7 +1708,7 @@ std::string handle_root_request(ThreadContext* ctx) {
          << "  })\n"
          << "  .then(function(data) {\n"
          << "    console.log('Device update successful:', data);\n"
-         << "    deviceSelect.selectedIndex = 0;\n"
+         << "    deviceSelect.value = '';\n"
          << "    statusSelect.selectedIndex = 0;\n"
          << "    // Reset the 10-second timer immediately (before showing alert)\n"
          << "    console.log('About to call resetRefreshTimer()...');\n"
@@ -481,8 +1729,15 @@ std::string handle_root_request(ThreadContext* ctx) {
          << "</script>\n"
          << "</head>"
          << "<body><div class='container'>"
-         << "<h1>COMM SYSTEM STATUS</h1>"
-         << "<div class='status-summary'>"
+         << "<h1>COMM SYSTEM STATUS</h1>";
+    if (!banner.empty() || mode != 0) {    // Anything but "normal"
+        html << "<div class='banner'>";
+        if (mode != 0) {
+            html << "<b>Mode: " << app_var_format(APP_VAR_MODE, mode) << "</b> ";
+        }
+        html << html_escape(banner) << "</div>";
+    }
+    html << "<div class='status-summary'>"
          << "<h2>Current System Status</h2>"
          << "<div id='status-value' class='status-value'>" << system_status << "</div>"
          << "<div style='margin-top: 10px; font-size: 0.9em; color: #7f8c8d;'>"
@@ -503,15 +1758,24 @@ std::string handle_root_request(ThreadContext* ctx) {
          << "<div class='update-form'>"
          << "<h3>Update Device Status</h3>"
          << "<div class='form-row'>"
-         << "<select id='device-select' style='padding: 8px; margin-right: 10px; width: 150px;'>"
-         << "<option value=''>Select Device</option>";
-    
-    // Add device options based on current devices
-    for (const auto& device : devices) {
-        html << "<option value='" << device.name << "'>" << device.name << "</option>";
+         << "";
+
+    if (device_count > DEVICE_SELECT_MAX_OPTIONS) {
+        html << "<input type='text' id='device-select' placeholder='Device name (click a row)' "
+             << "style='padding: 8px; margin-right: 10px; width: 150px;'>";
+    } else {
+        html << "<select id='device-select' style='padding: 8px; margin-right: 10px; width: 150px;'>"
+             << "<option value=''>Select Device</option>";
+
+        // Add device options based on current devices
+        for (const auto& device : devices) {
+            html << "<option value='" << device.name << "'>" << device.name << "</option>";
+        }
+
+        html << "</select>";
     }
-    
-    html << "</select>"
+
+    html << ""
          << "<select id='status-select' style='padding: 8px; margin-right: 10px; width: 120px;'>"
          << "<option value=''>Select Status</option>"
          << "<option value='ok'>OK</option>"
@@ -525,12 +1789,34 @@ std::string handle_root_request(ThreadContext* ctx) {
          << "</div>"
          << "</div>"
          << ""
-         << "<table id='device-table'>"
+         << "<div class='form-row' style='margin-top: 20px;'>"
+         << "<select id='filter-status' onchange='onDeviceFilterChange()' style='padding: 8px;'>"
+         << "<option value=''>All Statuses</option>"
+         << "<option value='ok'>OK</option>"
+         << "<option value='operational'>Operational</option>"
+         << "<option value='active'>Active</option>"
+         << "<option value='degraded'>Degraded</option>"
+         << "<option value='fault'>Fault</option>"
+         << "<option value='offline'>Offline</option>"
+         << "</select>"
+         << "<input type='text' id='filter-prefix' oninput='onDeviceFilterChange()' placeholder='Device name prefix' style='padding: 8px;'>"
+         << "<select id='sort-order' onchange='onDeviceFilterChange()' style='padding: 8px;'>"
+         << "<option value='name'>Name A-Z</option>"
+         << "<option value='-name'>Name Z-A</option>"
+         << "</select>"
+         << "<span id='device-counts' style='color: #7f8c8d; font-size: 0.9em;'></span>"
+         << "</div>"
+         << ""
+         << "<table style='margin-bottom: 0;'>"
          << "<thead>"
-         << "<tr><th>Device</th><th>Status</th></tr>"
+         << "<tr><th style='width: 60%;'>Device</th><th>Status</th></tr>"
          << "</thead>"
+         << "</table>"
+         << "<div id='device-viewport' onscroll='onDeviceScroll()' style='height: 480px; overflow-y: auto; position: relative;'>"
+         << "<div id='device-spacer'></div>"
+         << "<table id='device-table' style='position: absolute; top: 0; left: 0; margin-top: 0; table-layout: fixed;'>"
          << "<tbody>"
-         << "</tbody></table></div></body></html>";
+         << "</tbody></table></div></div></body></html>";
 
     std::string html_content = html.str();
     printf("[WEB] Generated HTML content length: %d bytes\n", (int)html_content.length());
@@ -547,10 +1833,9 @@ std::string handle_root_request(ThreadContext* ctx) {
 
 // Generate response for status check "/check_status" (WEB only)
 std::string handle_check_status_request(ThreadContext* ctx) {
-    auto now = std::chrono::system_clock::now();
-    auto time_t = std::chrono::system_clock::to_time_t(now);
-    char timestamp[100];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&time_t));
+    ClockReading now;
+    read_cached_clock(&ctx->clock, &now);
+    const char* timestamp = now.local_timestamp;
     
     pthread_mutex_lock(&ctx->mutex);
     std::string status = ctx->system_status;
@@ -565,177 +1850,1510 @@ std::string handle_check_status_request(ThreadContext* ctx) {
     return response;
 }
 
-// Generate JSON response for device status "/device_status_json" (WEB only)
-std::string handle_device_status_json_request(ThreadContext* ctx) {
-    auto now = std::chrono::system_clock::now();
-    auto time_t = std::chrono::system_clock::to_time_t(now);
-    char timestamp[100];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&time_t));
-    
-    pthread_mutex_lock(&ctx->mutex);
-    std::vector<DeviceStatus> devices = ctx->device_statuses; // Copy for thread safety
-    pthread_mutex_unlock(&ctx->mutex);
+std::string build_bad_request_response(const std::string& message) {
+    return "HTTP/1.1 400 Bad Request\r\nContent-Type: text/plain\r\nContent-Length: " +
+           std::to_string(message.size()) + "\r\n\r\n" + message;
+}
 
-    printf("[WEB] Serving device status JSON: %d devices\n", (int)devices.size());
+// 400 for a name or status longer than the persisted records hold
+std::string build_too_long_response() {
+    return build_bad_request_response("Names are limited to " + std::to_string(PERSISTED_NAME_SIZE - 1) +
+                                      " bytes and statuses to " + std::to_string(PERSISTED_STATUS_SIZE - 1));
+}
 
-    std::ostringstream json;
-    json << "{\"devices\":[";
-    for (size_t i = 0; i < devices.size(); ++i) {
-        if (i > 0) json << ",";
-        json << "{\"name\":\"" << devices[i].name << "\",\"status\":\"" << devices[i].status << "\"}";
+// Parse an epoch-seconds query parameter, falling back to a default.
+// History keeps 32-bit times, so later ones clamp to the open end; false
+// if the value is not a number.
+bool get_time_param(const std::string& query, const std::string& key, unsigned int fallback,
+                    unsigned int* seconds) {
+    std::string value = get_query_param(query, key);
+    if (value.empty()) {
+        *seconds = fallback;
+        return true;
+    }
+    if (value.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
     }
-    json << "],\"timestamp\":\"" << timestamp << "\"}";
+    errno = 0;
+    unsigned long long parsed = strtoull(value.c_str(), nullptr, 10);
+    *seconds = errno == ERANGE || parsed > HISTORY_OPEN_END ? HISTORY_OPEN_END : (unsigned int)parsed;
+    return true;
+}
 
-    std::string json_content = json.str();
-    printf("[WEB] JSON response: %s\n", json_content.c_str());
-    
+// Wrap a JSON body in a non-cacheable 200 response
+std::string build_json_response(const std::string& json_content) {
     std::string response = "HTTP/1.1 200 OK\r\n";
     response += "Content-Type: application/json\r\n";
     response += "Cache-Control: no-cache, no-store, must-revalidate\r\n";
-    response += "Pragma: no-cache\r\n";
-    response += "Expires: 0\r\n";
     response += "Content-Length: " + std::to_string(json_content.length()) + "\r\n\r\n" + json_content;
     return response;
 }
 
-// Handle POST request to update system status from backend (BACKEND only)
-std::string handle_update_system_request(ThreadContext* ctx, const std::string& body) {
-    auto now = std::chrono::system_clock::now();
-    auto time_t = std::chrono::system_clock::to_time_t(now);
-    char timestamp[100];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&time_t));
-    
-    printf("[BACKEND] [%s] Raw POST body received: %s\n", timestamp, body.c_str());
-    
-    pthread_mutex_lock(&ctx->mutex);
-    
-    // Parse the form data
-    std::istringstream body_stream(body);
-    std::string pair;
-    
-    while (std::getline(body_stream, pair, '&')) {
-        size_t eq_pos = pair.find('=');
-        if (eq_pos != std::string::npos) {
-            std::string key = url_decode(pair.substr(0, eq_pos));
-            std::string value = url_decode(pair.substr(eq_pos + 1));
-            
-            printf("[BACKEND] [%s] Decoded key-value: '%s' = '%s'\n", timestamp, key.c_str(), value.c_str());
-            
-            if (key == "system_status") {
-                ctx->system_status = value;
-                printf("[BACKEND] [%s] System status updated: %s\n", timestamp, value.c_str());
-            } else {
-                // Update device status
-                bool found = false;
-                for (auto& device : ctx->device_statuses) {
-                    if (device.name == key) {
-                        if (device.status != value) {
-                            printf("[BACKEND] [%s] Device '%s' status changed: %s -> %s\n", 
-                                   timestamp, key.c_str(), device.status.c_str(), value.c_str());
-                            device.status = value;
-                        }
-                        found = true;
-                        break;
+// Device list query "/device_status_json?status=&prefix=&sort=&offset=&limit="
+// (WEB only), served from the shard indexes. Matches come back in name
+// order (sort=-name reverses it) with the total match count and the
+// per-status counts, so a page can show any window of a large fleet.
+const size_t DEVICE_QUERY_DEFAULT_LIMIT = 100;
+const size_t DEVICE_QUERY_MAX_LIMIT = 5000;
+
+// One shard's remaining slice [next, end) of its name_order
+struct DeviceCursor {
+    DeviceShard* shard;
+    size_t next;
+    size_t end;
+};
+
+// Slots where each cursor's first `rank` entries of the merged name order
+// end, found by binary search instead of walking them; equal names in two
+// shards order by shard
+std::vector<size_t> cut_merged_names(const std::vector<DeviceCursor>& cursors, size_t rank) {
+    auto name_at = [&cursors](size_t c, size_t slot) -> const std::string& {
+        return cursors[c].shard->device_statuses[cursors[c].shard->name_order[slot]].name;
+    };
+    // Entries of cursor t ordered before `name` taken from cursor c
+    auto count_before = [&cursors](size_t t, const std::string& name, size_t c) {
+        const std::vector<DeviceStatus>& devices = cursors[t].shard->device_statuses;
+        auto first = cursors[t].shard->name_order.begin() + cursors[t].next;
+        auto last = cursors[t].shard->name_order.begin() + cursors[t].end;
+        if (t < c) {
+            return (size_t)(std::upper_bound(first, last, name, [&devices](const std::string& key, unsigned p) {
+                                return key < devices[p].name;
+                            }) - first);
+        }
+        return (size_t)(std::lower_bound(first, last, name, [&devices](unsigned p, const std::string& key) {
+                            return devices[p].name < key;
+                        }) - first);
+    };
+    auto rank_of = [&](size_t c, size_t slot) {
+        size_t before = slot - cursors[c].next;
+        for (size_t t = 0; t < cursors.size(); t++) {
+            if (t != c) before += count_before(t, name_at(c, slot), c);
+        }
+        return before;
+    };
+
+    std::vector<size_t> cuts;
+    for (size_t c = 0; c < cursors.size(); c++) {
+        size_t low = cursors[c].next, high = cursors[c].end;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (rank_of(c, middle) < rank) low = middle + 1; else high = middle;
+        }
+        if (low < cursors[c].end && rank_of(c, low) == rank) {
+            // The entry at `rank` lives here; every other cursor cuts at it
+            for (size_t t = 0; t < cursors.size(); t++) {
+                cuts.push_back(t == c ? low : cursors[t].next + count_before(t, name_at(c, low), c));
+            }
+            return cuts;
+        }
+    }
+    for (const DeviceCursor& cursor : cursors) {
+        cuts.push_back(cursor.end);    // Rank past the last entry
+    }
+    return cuts;
+}
+
+std::string handle_device_query_request(ThreadContext* ctx, const std::string& query) {
+    ClockReading now;
+    read_cached_clock(&ctx->clock, &now);
+    std::string status = get_query_param(query, "status");
+    std::string prefix = get_query_param(query, "prefix");
+    std::string sort = get_query_param(query, "sort");
+    std::string limit_param = get_query_param(query, "limit");
+    size_t offset = strtoull(get_query_param(query, "offset").c_str(), nullptr, 10);
+    size_t limit = limit_param.empty() ? DEVICE_QUERY_DEFAULT_LIMIT
+                                       : std::min<size_t>(strtoull(limit_param.c_str(), nullptr, 10),
+                                                          DEVICE_QUERY_MAX_LIMIT);
+    if (!sort.empty() && sort != "name" && sort != "-name") {
+        return "HTTP/1.1 400 Bad Request\r\nContent-Type: text/plain\r\nContent-Length: 26\r\n\r\nsort must be name or -name";
+    }
+    bool descending = sort == "-name";
+    DeviceStatusCode code = status_to_code(status);
+    bool exact_status = !status.empty() && code == STATUS_OTHER;  // Free-form text also compares strings
+
+    // Read before the shards so that every change up to this version is
+    // already in the page; a later "since" poll may repeat a few, harmlessly
+    ChangeLog* log = &ctx->changes;
+    pthread_mutex_lock(&log->mutex);
+    unsigned long long version = log->version;
+    unsigned long long history_id = log->history_id;
+    pthread_mutex_unlock(&log->mutex);
+
+    // Hold every populated shard for one consistent answer; nothing else
+    // holds two shard locks, so taking them in ascending order is safe
+    std::vector<DeviceShard*> shards;
+    size_t counts[STATUS_CODE_COUNT] = {0};
+    size_t device_count = 0;
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        DeviceShard* shard = &ctx->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        if (shard->device_statuses.empty()) {
+            pthread_mutex_unlock(&shard->mutex);
+            continue;
+        }
+        sort_name_index_locked(shard);
+        for (int c = 0; c < STATUS_CODE_COUNT; c++) {
+            counts[c] += shard->status_counts[c];
+        }
+        device_count += shard->device_statuses.size();
+        shards.push_back(shard);
+    }
+
+    auto has_prefix = [&prefix](const std::string& name) {
+        return name.compare(0, prefix.size(), prefix) == 0;
+    };
+    auto matches = [&](DeviceShard* shard, unsigned position) {
+        if (!status.empty()) {
+            const std::vector<unsigned long long>& bitmap = shard->status_bitmaps[code];
+            if (position / 64 >= bitmap.size() || !((bitmap[position / 64] >> (position % 64)) & 1)) {
+                return false;
+            }
+            if (exact_status && shard->device_statuses[position].status != status) {
+                return false;
+            }
+        }
+        return prefix.empty() || has_prefix(shard->device_statuses[position].name);
+    };
+
+    std::vector<const DeviceStatus*> page;
+    size_t total = 0;
+    if (!status.empty() && counts[code] * 8 < device_count) {
+        // Sparse status: pull the matches straight out of the bitmaps and
+        // order just those by name
+        std::vector<const DeviceStatus*> found;
+        for (DeviceShard* shard : shards) {
+            const std::vector<unsigned long long>& bitmap = shard->status_bitmaps[code];
+            for (size_t word = 0; word < bitmap.size(); word++) {
+                for (unsigned long long bits = bitmap[word]; bits; bits &= bits - 1) {
+                    unsigned position = word * 64 + __builtin_ctzll(bits);
+                    const DeviceStatus& device = shard->device_statuses[position];
+                    if ((!exact_status || device.status == status) && (prefix.empty() || has_prefix(device.name))) {
+                        found.push_back(&device);
                     }
                 }
-                if (!found) {
-                    // Add new device if not found
-                    ctx->device_statuses.push_back({key, value});
-                    printf("[BACKEND] [%s] New device added: %s = %s\n", timestamp, key.c_str(), value.c_str());
+            }
+        }
+        total = found.size();
+        if (offset < total) {
+            size_t stop = std::min(total, offset + limit);
+            auto by_name = [descending](const DeviceStatus* a, const DeviceStatus* b) {
+                return descending ? b->name < a->name : a->name < b->name;
+            };
+            std::partial_sort(found.begin(), found.begin() + stop, found.end(), by_name);
+            page.assign(found.begin() + offset, found.begin() + stop);
+        }
+    } else {
+        // Walk the name indexes, merged across shards. A prefix narrows each
+        // shard to one contiguous range of its index.
+        std::vector<DeviceCursor> cursors;
+        for (DeviceShard* shard : shards) {
+            const std::vector<DeviceStatus>& devices = shard->device_statuses;
+            auto begin = shard->name_order.begin();
+            auto end = shard->name_order.end();
+            if (!prefix.empty()) {
+                begin = std::lower_bound(begin, end, prefix,
+                                         [&devices](unsigned p, const std::string& key) { return devices[p].name < key; });
+                end = std::partition_point(begin, end, [&](unsigned p) { return has_prefix(devices[p].name); });
+            }
+            if (begin != end) {
+                cursors.push_back({shard, (size_t)(begin - shard->name_order.begin()),
+                                   (size_t)(end - shard->name_order.begin())});
+            }
+        }
+
+        // The total is known up front unless matches have to be tested
+        bool counting = exact_status || (!status.empty() && !prefix.empty());
+        if (status.empty()) {
+            for (const DeviceCursor& cursor : cursors) total += cursor.end - cursor.next;
+        } else if (!counting) {
+            total = counts[code];
+        }
+
+        if (status.empty() && cursors.size() == 1) {
+            // One shard and no per-device test: index the page directly
+            const DeviceCursor& cursor = cursors[0];
+            for (size_t i = offset; i < total && page.size() < limit; i++) {
+                size_t slot = descending ? cursor.end - 1 - i : cursor.next + i;
+                page.push_back(&cursor.shard->device_statuses[cursor.shard->name_order[slot]]);
+            }
+        } else {
+            auto current_name = [&cursors, descending](size_t c) -> const std::string& {
+                const DeviceCursor& cursor = cursors[c];
+                size_t slot = descending ? cursor.end - 1 : cursor.next;
+                return cursor.shard->device_statuses[cursor.shard->name_order[slot]].name;
+            };
+            // Ordered by (name, cursor) like cut_merged_names, so a name held
+            // by several shards neither repeats nor goes missing across pages
+            auto merged_before = [&](size_t a, size_t b) {
+                int order = current_name(a).compare(current_name(b));
+                return order < 0 || (order == 0 && a < b);
+            };
+            auto heap_order = [&](size_t a, size_t b) {
+                return descending ? merged_before(a, b) : merged_before(b, a);
+            };
+            size_t seen = 0;
+            if (status.empty() && offset > 0) {
+                // Nothing to test per device: jump straight to the page
+                std::vector<size_t> cuts = cut_merged_names(cursors, descending ? total - std::min(offset, total)
+                                                                                 : std::min(offset, total));
+                for (size_t c = 0; c < cursors.size(); c++) {
+                    (descending ? cursors[c].end : cursors[c].next) = cuts[c];
+                }
+                seen = offset;
+            }
+            std::vector<size_t> heap;
+            for (size_t c = 0; c < cursors.size(); c++) {
+                if (cursors[c].next < cursors[c].end) heap.push_back(c);
+            }
+            std::make_heap(heap.begin(), heap.end(), heap_order);
+            while (!heap.empty() && (counting || page.size() < limit)) {
+                std::pop_heap(heap.begin(), heap.end(), heap_order);
+                size_t c = heap.back();
+                DeviceCursor& cursor = cursors[c];
+                unsigned position = cursor.shard->name_order[descending ? --cursor.end : cursor.next++];
+                if (cursor.next < cursor.end) {
+                    std::push_heap(heap.begin(), heap.end(), heap_order);
+                } else {
+                    heap.pop_back();
+                }
+                if (!matches(cursor.shard, position)) {
+                    continue;
                 }
+                if (seen >= offset && page.size() < limit) {
+                    page.push_back(&cursor.shard->device_statuses[position]);
+                }
+                seen++;
+            }
+            if (counting) {
+                total = seen;
             }
         }
     }
-    
-    pthread_mutex_unlock(&ctx->mutex);
-    return "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 2\r\n\r\nOK";
+
+    std::ostringstream json;
+    json << "{\"devices\":[";
+    for (size_t i = 0; i < page.size(); i++) {
+        if (i > 0) json << ",";
+        json << "{\"name\":\"" << json_escape(page[i]->name) << "\",\"status\":\"" << json_escape(page[i]->status)
+             << "\"}";
+    }
+    for (DeviceShard* shard : shards) {
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    json << "],\"total\":" << total << ",\"offset\":" << offset << ",\"limit\":" << limit
+         << ",\"device_count\":" << device_count << ",\"counts\":{";
+    for (int c = 0; c < STATUS_CODE_COUNT; c++) {
+        if (c > 0) json << ",";
+        json << "\"" << status_code_name(c) << "\":" << counts[c];
+    }
+    json << "},\"version\":" << version << ",\"history\":\"" << history_id << "\",\"timestamp\":\""
+         << now.local_timestamp << "\"}";
+    return build_json_response(json.str());
 }
 
-// Handle POST request to update variables from backend (BACKEND only)
-std::string handle_update_var_request(ThreadContext* ctx, const std::string& body) {
-    size_t pos = body.find("name=");
-    size_t pos2 = body.find("&value=");
-    if (pos != std::string::npos && pos2 != std::string::npos) {
-        std::string name = url_decode(body.substr(pos+5, pos2-pos-5));
-        std::string value = url_decode(body.substr(pos2+7));
+// Device changes "/device_status_json?since=<version>&history=<id>" (WEB
+// only), read from the replication change log: the devices changed after
+// the given version (latest status each) and the version to poll from
+// next. "resync":true means the log no longer reaches back that far, or
+// the server restarted, and the caller has to query the list again.
+std::string handle_device_changes_request(ThreadContext* ctx, const std::string& query) {
+    ClockReading now;
+    read_cached_clock(&ctx->clock, &now);
+    unsigned long long since = strtoull(get_query_param(query, "since").c_str(), nullptr, 10);
+    std::string history_param = get_query_param(query, "history");
 
-        pthread_mutex_lock(&ctx->mutex);
-        if (ctx->app_vars.find(name) != ctx->app_vars.end()) {
-            ctx->app_vars[name] = value;
-            ctx->system_status = "Updated: " + name + "=" + value;
+    std::vector<std::pair<std::string, std::string>> changed;   // Name, latest status
+    std::unordered_map<std::string, size_t> changed_index;
+    bool system_changed = false;
+    std::string system_status;
+    ChangeLog* log = &ctx->changes;
+    pthread_mutex_lock(&log->mutex);
+    unsigned long long version = log->version;
+    unsigned long long history_id = log->history_id;
+    bool resync = (!history_param.empty() && strtoull(history_param.c_str(), nullptr, 10) != history_id) ||
+                  since > version || since + 1 < log->oldest;
+    for (unsigned long long v = since + 1; !resync && v <= version; v++) {
+        const ChangeRecord& record = log->records[v & (CHANGE_LOG_CAPACITY - 1)];
+        if (record.type == CHANGE_SYSTEM_STATUS) {
+            system_changed = true;
+            system_status = record.value;
+            continue;
+        }
+        auto it = changed_index.find(record.key);
+        if (it != changed_index.end()) {
+            changed[it->second].second = record.value;
+        } else if (changed.size() < DEVICE_QUERY_MAX_LIMIT) {
+            changed_index[record.key] = changed.size();
+            changed.emplace_back(record.key, record.value);
+        } else {
+            resync = true;    // More than a page's worth: cheaper to query again
         }
-        pthread_mutex_unlock(&ctx->mutex);
     }
-    return "HTTP/1.1 303 See Other\r\nLocation: /\r\n\r\n";
+    pthread_mutex_unlock(&log->mutex);
+
+    size_t counts[STATUS_CODE_COUNT] = {0};
+    size_t device_count = 0;
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        DeviceShard* shard = &ctx->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        for (int c = 0; c < STATUS_CODE_COUNT; c++) {
+            counts[c] += shard->status_counts[c];
+        }
+        device_count += shard->device_statuses.size();
+        pthread_mutex_unlock(&shard->mutex);
+    }
+
+    std::ostringstream json;
+    json << "{\"version\":" << version << ",\"history\":\"" << history_id << "\",\"resync\":"
+         << (resync ? "true" : "false") << ",\"devices\":[";
+    for (size_t i = 0; !resync && i < changed.size(); i++) {
+        if (i > 0) json << ",";
+        json << "{\"name\":\"" << json_escape(changed[i].first) << "\",\"status\":\""
+             << json_escape(changed[i].second) << "\"}";
+    }
+    json << "]";
+    if (system_changed && !resync) {
+        json << ",\"system_status\":\"" << json_escape(system_status) << "\"";
+    }
+    json << ",\"device_count\":" << device_count << ",\"counts\":{";
+    for (int c = 0; c < STATUS_CODE_COUNT; c++) {
+        if (c > 0) json << ",";
+        json << "\"" << status_code_name(c) << "\":" << counts[c];
+    }
+    json << "},\"timestamp\":\"" << now.local_timestamp << "\"}";
+    return build_json_response(json.str());
 }
 
-// Forward system status update to backend monitor
-void notify_backend_monitor(const std::string& system_status, const std::vector<DeviceStatus>& devices) {
-    printf("[WEB] notify_backend_monitor called with system_status: '%s'\n", system_status.c_str());
-    
-    // Try to connect to backend monitor (assuming it listens on port 54321 for notifications)
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        printf("[WEB] Failed to create socket for backend notification: %s\n", strerror(errno));
-        return;
+// Take an empty buffer with room for a slice, pooled if one is free
+std::string acquire_stream_buffer(ThreadContext* ctx) {
+    std::string buffer;
+    pthread_mutex_lock(&ctx->stream_buffers.mutex);
+    if (!ctx->stream_buffers.buffers.empty()) {
+        buffer.swap(ctx->stream_buffers.buffers.back());
+        ctx->stream_buffers.buffers.pop_back();
     }
+    pthread_mutex_unlock(&ctx->stream_buffers.mutex);
+    buffer.clear();
+    buffer.reserve(STREAM_CHUNK_SIZE + 4096);
+    return buffer;
+}
+
+// Hand a buffer's storage back to the pool (oversized ones are freed)
+void release_stream_buffer(ThreadContext* ctx, std::string* buffer) {
+    if (buffer->capacity() >= STREAM_CHUNK_SIZE && buffer->capacity() <= 2 * STREAM_CHUNK_SIZE) {
+        pthread_mutex_lock(&ctx->stream_buffers.mutex);
+        if (ctx->stream_buffers.buffers.size() < STREAM_BUFFER_POOL_SIZE) {
+            ctx->stream_buffers.buffers.emplace_back();
+            ctx->stream_buffers.buffers.back().swap(*buffer);
+        }
+        pthread_mutex_unlock(&ctx->stream_buffers.mutex);
+    }
+    std::string().swap(*buffer);
+}
+
+// Full device list "/device_status_json" (WEB only), generated a slice at a
+// time as the connection drains instead of as one string: each slice is
+// serialized under a single shard's lock straight into a pooled buffer, so
+// a request holds one slice however large the fleet is. Device positions
+// never move, so every device appears exactly once; each status is at
+// least as new as the reported version, which a "since" poll picks up from.
+struct DeviceJsonStream {
+    ThreadContext* ctx;
+    bool chunked;                  // Transfer-Encoding: chunked framing (HTTP/1.1)
+    bool started;                  // Opening of the JSON written
+    bool done;                     // Closing written; nothing more to fill
+    int shard;                     // Next shard to read
+    size_t position;               // Next device within it
+    size_t devices;                // Devices written so far
+    unsigned long long version;
+    unsigned long long history_id;
+    std::string buffer;            // Pending output, sent and cleared by the caller
+};
+
+// Append the next slice (about STREAM_CHUNK_SIZE of JSON) to stream->buffer,
+// framed as one chunk when chunked; the last slice carries the closing
+void device_json_stream_fill(DeviceJsonStream* stream) {
+    size_t frame_start = stream->buffer.size();
+    if (stream->chunked) {
+        stream->buffer.append("00000000\r\n");   // Size patched in below
+    }
+    size_t data_start = stream->buffer.size();
+    if (!stream->started) {
+        stream->buffer += "{\"devices\":[";
+        stream->started = true;
+    }
+    while (stream->shard < MAX_SHARDS && stream->buffer.size() - data_start < STREAM_CHUNK_SIZE) {
+        DeviceShard* shard = &stream->ctx->shards[stream->shard];
+        pthread_mutex_lock(&shard->mutex);
+        const std::vector<DeviceStatus>& devices = shard->device_statuses;
+        while (stream->position < devices.size() && stream->buffer.size() - data_start < STREAM_CHUNK_SIZE) {
+            const DeviceStatus& device = devices[stream->position++];
+            if (stream->devices++ > 0) stream->buffer += ',';
+            stream->buffer += "{\"name\":\"";
+            stream->buffer += json_escape(device.name);
+            stream->buffer += "\",\"status\":\"";
+            stream->buffer += json_escape(device.status);
+            stream->buffer += "\"}";
+        }
+        if (stream->position >= devices.size()) {
+            stream->shard++;
+            stream->position = 0;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    if (stream->shard >= MAX_SHARDS) {
+        ClockReading now;
+        read_cached_clock(&stream->ctx->clock, &now);
+        stream->buffer += "],\"version\":" + std::to_string(stream->version) + ",\"history\":\"" +
+                          std::to_string(stream->history_id) + "\",\"timestamp\":\"" + now.local_timestamp + "\"}";
+        stream->done = true;
+        printf("[WEB] Streamed device status JSON: %d devices\n", (int)stream->devices);
+    }
+    if (stream->chunked) {
+        char size[9];
+        snprintf(size, sizeof(size), "%08zx", stream->buffer.size() - data_start);
+        memcpy(&stream->buffer[frame_start], size, 8);
+        stream->buffer += "\r\n";
+        if (stream->done) {
+            stream->buffer += "0\r\n\r\n";
+        }
+    }
+}
+
+// Start a streamed response if the request is for one, with its status
+// line and headers already in the stream's buffer; null otherwise. The
+// caller fills and sends until done, then releases the buffer. Without
+// chunking (HTTP/1.0, HTTP/2 DATA frames) the body just runs to the end.
+DeviceJsonStream* start_streamed_response(const HttpRequest& request, ThreadContext* ctx, int connection_id,
+                                          bool chunked) {
+    if (request.server_type != WEB_SERVER || request.path != "/device_status_json" || !request.query.empty()) {
+        return nullptr;
+    }
+    ctx->io.requests.fetch_add(1, std::memory_order_relaxed);
+    printf("[WEB] connection %d processing %s %s (streamed)\n", connection_id, request.method.c_str(),
+           request.path.c_str());
+
+    DeviceJsonStream* stream = new DeviceJsonStream();
+    stream->ctx = ctx;
+    stream->chunked = chunked;
+    stream->started = false;
+    stream->done = false;
+    stream->shard = 0;
+    stream->position = 0;
+    stream->devices = 0;
+    pthread_mutex_lock(&ctx->changes.mutex);
+    stream->version = ctx->changes.version;
+    stream->history_id = ctx->changes.history_id;
+    pthread_mutex_unlock(&ctx->changes.mutex);
+    stream->buffer = acquire_stream_buffer(ctx);
+    stream->buffer += "HTTP/1.1 200 OK\r\n";
+    stream->buffer += "Content-Type: application/json\r\n";
+    stream->buffer += "Cache-Control: no-cache, no-store, must-revalidate\r\n";
+    stream->buffer += "Pragma: no-cache\r\n";
+    stream->buffer += "Expires: 0\r\n";
+    if (chunked) {
+        stream->buffer += "Transfer-Encoding: chunked\r\n";
+    } else {
+        stream->buffer += "Connection: close\r\n";
+    }
+    stream->buffer += "\r\n";
+    add_date_header(ctx, stream->buffer);
+    return stream;
+}
+
+// Release a finished (or abandoned) stream and its buffer
+void finish_streamed_response(DeviceJsonStream* stream) {
+    release_stream_buffer(stream->ctx, &stream->buffer);
+    delete stream;
+}
+
+// Status transitions of one device "/device_history?name=&from=&to=" (WEB only)
+std::string handle_device_history_request(ThreadContext* ctx, const std::string& query) {
+    ClockReading now;
+    read_cached_clock(&ctx->clock, &now);
+    std::string name = get_query_param(query, "name");
+    unsigned int from, to;
+    if (!get_time_param(query, "from", 0, &from) || !get_time_param(query, "to", HISTORY_OPEN_END, &to)) {
+        return build_bad_request_response("from and to must be epoch seconds");
+    }
+
+    std::ostringstream json;
+    size_t position;
+    DeviceShard* shard = lock_device_shard(ctx, name, &position);
+    if (!shard) {
+        return "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 16\r\n\r\nDevice not found";
+    }
+    const DeviceHistory& history = shard->device_histories[position];
+
+    // Binary search over the logical (oldest-first) order of the ring for
+    // the last transition starting at or before 'from', i.e. the status in
+    // effect when the window opens
+    const unsigned mask = DEVICE_HISTORY_CAPACITY - 1;
+    unsigned count = history.recorded < DEVICE_HISTORY_CAPACITY
+                         ? static_cast<unsigned>(history.recorded) : DEVICE_HISTORY_CAPACITY;
+    unsigned oldest = static_cast<unsigned>(history.recorded - count) & mask;
+    unsigned low = 0;
+    unsigned high = count;
+    while (low < high) {
+        unsigned mid = low + (high - low) / 2;
+        if (history.start_times[(oldest + mid) & mask] <= from) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    unsigned first = low > 0 ? low - 1 : 0;
+
+    json << "{\"name\":\"" << json_escape(name) << "\",\"from\":" << from << ",\"to\":" << to
+         << ",\"now\":" << now.epoch_seconds << ",\"transitions\":[";
+    bool first_entry = true;
+    for (unsigned i = first; i < count; i++) {
+        unsigned slot = (oldest + i) & mask;
+        if (history.start_times[slot] >= to) {
+            break;
+        }
+        if (!first_entry) json << ",";
+        first_entry = false;
+        json << "{\"time\":" << history.start_times[slot]
+             << ",\"status\":\"" << status_code_name(history.codes[slot]) << "\"}";
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    json << "]}";
+
+    return build_json_response(json.str());
+}
+
+// Fault minutes per device over a window "/device_fault_minutes?from=&to=&limit=" (WEB only)
+std::string handle_device_fault_minutes_request(ThreadContext* ctx, const std::string& query) {
+    ClockReading now;
+    read_cached_clock(&ctx->clock, &now);
+    unsigned int now_seconds = static_cast<unsigned int>(now.epoch_seconds);
+    unsigned int from, to, limit;
+    if (!get_time_param(query, "from", now_seconds - 86400, &from) || !get_time_param(query, "to", now_seconds, &to) ||
+        !get_time_param(query, "limit", 100, &limit)) {
+        return build_bad_request_response("from, to and limit must be numbers");
+    }
+
+    struct FaultSummary {
+        std::string name;
+        unsigned int fault_seconds;
+        unsigned transitions;
+    };
+    std::vector<FaultSummary> faulted;
+
+    // Scan shard by shard; only faulted devices leave the lock
+    size_t device_count = 0;
+    for (int s = 0; s < MAX_SHARDS; s++) {
+        DeviceShard* shard = &ctx->shards[s];
+        pthread_mutex_lock(&shard->mutex);
+        size_t shard_devices = shard->device_histories.size();
+        for (size_t i = 0; i < shard_devices; i++) {
+            const DeviceHistory& history = shard->device_histories[i];
+            unsigned int seconds = device_fault_seconds(history, from, to, now_seconds);
+            if (seconds > 0) {
+                faulted.push_back({shard->device_statuses[i].name, seconds,
+                                   device_transitions_in_window(history, from, to)});
+            }
+        }
+        device_count += shard_devices;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    std::sort(faulted.begin(), faulted.end(), [](const FaultSummary& a, const FaultSummary& b) {
+        return a.fault_seconds > b.fault_seconds;
+    });
+    if (faulted.size() > limit) {
+        faulted.resize(limit);
+    }
+
+    std::ostringstream json;
+    json << "{\"from\":" << from << ",\"to\":" << to << ",\"scanned\":" << device_count << ",\"devices\":[";
+    for (size_t i = 0; i < faulted.size(); i++) {
+        if (i > 0) json << ",";
+        json << "{\"name\":\"" << json_escape(faulted[i].name) << "\",\"fault_minutes\":"
+             << (faulted[i].fault_seconds / 60.0) << ",\"transitions\":" << faulted[i].transitions << "}";
+    }
+    json << "]}";
+
+    return build_json_response(json.str());
+}
+
+// Record what a shard's monitor reported and re-merge the system status
+void update_shard_summary(ThreadContext* ctx, int shard_id, const std::string& reported_status,
+                          int device_count, int fault_devices, const char* timestamp) {
+    pthread_mutex_lock(&ctx->mutex);
+    ShardSummary& summary = ctx->shard_summaries[shard_id];
+    summary.reporting = true;
+    summary.reported_status = reported_status;
+    summary.device_count = device_count;
+    summary.fault_devices = fault_devices;
+    std::string merged;
+    if (merge_shard_statuses_locked(ctx, &merged) && merged != ctx->system_status) {
+        set_system_status_locked(ctx, merged);
+        wal_flush_locked(ctx->store);
+        printf("[BACKEND] [%s] System status updated: %s\n", timestamp, merged.c_str());
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+// Handle POST request to update system status from backend (BACKEND only).
+// Optional "shard", "epoch" and "seq" fields identify the pushing monitor:
+// the push is applied under that shard's lock only, and pushes older than
+// the last applied sequence of the same epoch are rejected.
+std::string handle_update_system_request(ThreadContext* ctx, const std::string& body) {
+    ClockReading now;
+    read_cached_clock(&ctx->clock, &now);
+    const char* timestamp = now.local_timestamp;
     
-    sockaddr_in backend_addr = {0};
-    backend_addr.sin_family = AF_INET;
-    backend_addr.sin_port = htons(54321);  // Backend notification port
-    inet_pton(AF_INET, "127.0.0.1", &backend_addr.sin_addr);
-    
-    printf("[WEB] Attempting to connect to backend monitor at 127.0.0.1:54321\n");
-    
-    // Set a short timeout for connection attempt
-    struct timeval timeout;
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
-    
-    if (connect(sock, (sockaddr*)&backend_addr, sizeof(backend_addr)) < 0) {
-        printf("[WEB] Backend monitor not reachable (may not be running): %s\n", strerror(errno));
-        close(sock);
-        return;
+    // Parse the form data before taking any lock
+    std::vector<std::pair<std::string, std::string>> fields;
+    std::istringstream body_stream(body);
+    std::string pair;
+    while (std::getline(body_stream, pair, '&')) {
+        size_t eq_pos = pair.find('=');
+        if (eq_pos != std::string::npos) {
+            fields.emplace_back(url_decode(pair.substr(0, eq_pos)), url_decode(pair.substr(eq_pos + 1)));
+        }
     }
     
-    printf("[WEB] Successfully connected to backend monitor\n");
-    printf("[WEB] Successfully connected to backend monitor\n");
+    // Per-field logging only for small pushes
+    const size_t verbose_field_limit = 64;
+    bool verbose = fields.size() <= verbose_field_limit;
+    if (verbose) {
+        printf("[BACKEND] [%s] Raw POST body received: %s\n", timestamp, body.c_str());
+    }
     
-    // Send status update notification in simple format
-    std::ostringstream notification;
-    notification << "SYSTEM_STATUS_UPDATE:" << system_status << "\n";
-    for (const auto& device : devices) {
-        notification << "DEVICE:" << device.name << "=" << device.status << "\n";
+    int shard_id = 0;
+    unsigned long long epoch = 0;
+    unsigned long long sequence = 0;
+    bool sequenced = false;
+    bool has_system_status = false;
+    std::string system_status;
+    for (const auto& field : fields) {
+        if (field.first == "shard") {
+            char* end;
+            long value = strtol(field.second.c_str(), &end, 10);
+            shard_id = (end == field.second.c_str() || *end || value < 0 || value >= MAX_SHARDS) ? -1 : (int)value;
+        } else if (field.first == "epoch") {
+            epoch = strtoull(field.second.c_str(), nullptr, 10);
+        } else if (field.first == "seq") {
+            sequence = strtoull(field.second.c_str(), nullptr, 10);
+            sequenced = true;
+        } else if (field.first == "system_status") {
+            system_status = field.second;
+            has_system_status = true;
+        }
+    }
+    if (shard_id < 0 || shard_id >= MAX_SHARDS) {
+        printf("[BACKEND] [%s] Rejecting push for invalid shard %d\n", timestamp, shard_id);
+        return "HTTP/1.1 400 Bad Request\r\nContent-Type: text/plain\r\nContent-Length: 13\r\n\r\nInvalid shard";
+    }
+    // All of the push or none of it
+    for (const auto& field : fields) {
+        bool device = field.first != "shard" && field.first != "epoch" && field.first != "seq" &&
+                      field.first != "system_status";
+        if (!fits_persisted_record(device ? field.first : "", field.second)) {
+            printf("[BACKEND] [%s] Rejecting push with an over-long name or status\n", timestamp);
+            return build_too_long_response();
+        }
     }
-    notification << "END\n";
     
-    std::string msg = notification.str();
-    printf("[WEB] Sending notification message:\n%s", msg.c_str());
+    // Apply the device partition under the shard's own lock
+    DeviceShard* shard = &ctx->shards[shard_id];
+    pthread_mutex_lock(&shard->mutex);
+    if (sequenced) {
+        if (epoch == shard->sequence_epoch && sequence <= shard->last_sequence) {
+            shard->pushes_rejected++;
+            pthread_mutex_unlock(&shard->mutex);
+            printf("[BACKEND] [%s] Shard %d: stale push seq %llu (last applied %llu)\n",
+                   timestamp, shard_id, sequence, shard->last_sequence);
+            return "HTTP/1.1 409 Conflict\r\nContent-Type: text/plain\r\nContent-Length: 14\r\n\r\nStale sequence";
+        }
+        shard->sequence_epoch = epoch;
+        shard->last_sequence = sequence;
+    }
+    open_shard_store_locked(ctx, shard);
+    for (const auto& field : fields) {
+        const std::string& key = field.first;
+        if (key == "shard" || key == "epoch" || key == "seq" || key == "system_status") {
+            continue;
+        }
+        if (verbose) {
+            printf("[BACKEND] [%s] Decoded key-value: '%s' = '%s'\n", timestamp, key.c_str(), field.second.c_str());
+        }
+        // Update device status
+        apply_device_status_locked(shard, key, field.second, verbose ? "[BACKEND]" : nullptr, now);
+    }
+    wal_flush_locked(shard->store);
+    shard->pushes_applied++;
+    int device_count = shard->device_statuses.size();
+    int fault_devices = shard->fault_devices;
+    pthread_mutex_unlock(&shard->mutex);
     
-    ssize_t sent = send(sock, msg.c_str(), msg.length(), 0);
-    if (sent < 0) {
-        printf("[WEB] Failed to send notification: %s\n", strerror(errno));
-    } else {
-        printf("[WEB] Sent status update notification to backend monitor (%d bytes)\n", (int)sent);
+    // Fold the shard summary into the system status (short global section)
+    if (has_system_status) {
+        update_shard_summary(ctx, shard_id, system_status, device_count, fault_devices, timestamp);
     }
     
-    close(sock);
+    return "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 2\r\n\r\nOK";
 }
 
-// Handle POST request to update system status from webpage (WEB only)
-std::string handle_update_system_web_request(ThreadContext* ctx, const std::string& body) {
-    auto now = std::chrono::system_clock::now();
-    auto time_t = std::chrono::system_clock::to_time_t(now);
-    char timestamp[100];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&time_t));
-    
-    printf("[WEB] [%s] Raw POST body received: %s\n", timestamp, body.c_str());
-    
+// Per-shard ingestion state "/shard_status" (WEB only)
+std::string handle_shard_status_request(ThreadContext* ctx) {
+    std::ostringstream json;
+    json << "{\"shards\":[";
+    bool first = true;
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        DeviceShard* shard = &ctx->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        size_t device_count = shard->device_statuses.size();
+        int fault_devices = shard->fault_devices;
+        unsigned long long last_sequence = shard->last_sequence;
+        unsigned long long pushes_applied = shard->pushes_applied;
+        unsigned long long pushes_rejected = shard->pushes_rejected;
+        pthread_mutex_unlock(&shard->mutex);
+        if (device_count == 0 && pushes_applied == 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&ctx->mutex);
+        std::string reported_status = ctx->shard_summaries[i].reported_status;
+        pthread_mutex_unlock(&ctx->mutex);
+
+        if (!first) json << ",";
+        first = false;
+        json << "{\"shard\":" << i << ",\"devices\":" << device_count << ",\"faults\":" << fault_devices
+             << ",\"last_seq\":" << last_sequence << ",\"pushes\":" << pushes_applied
+             << ",\"rejected\":" << pushes_rejected
+             << ",\"reported_status\":\"" << json_escape(reported_status) << "\"}";
+    }
     pthread_mutex_lock(&ctx->mutex);
-    
-    // Simplified multipart form parsing approach
+    std::string system_status = ctx->system_status;
+    pthread_mutex_unlock(&ctx->mutex);
+    json << "],\"system_status\":\"" << json_escape(system_status) << "\"";
+    if (ctx->telemetry_fd >= 0) {
+        json << ",\"udp\":{\"batches\":" << ctx->telemetry.batches.load()
+             << ",\"datagrams\":" << ctx->telemetry.datagrams.load()
+             << ",\"records\":" << ctx->telemetry.records.load()
+             << ",\"malformed\":" << ctx->telemetry.malformed.load()
+             << ",\"lost\":" << ctx->telemetry.lost.load() << "}";
+    }
+    json << "}";
+    return build_json_response(json.str());
+}
+
+// Per-lane queue depth, shedding and queue time of the CPU pool
+std::string task_lane_stats_json(TaskPool* pool) {
+    if (!pool) {
+        return "{}";
+    }
+    static const char* names[LANE_COUNT] = {"backend", "web"};
+    std::ostringstream json;
+    json << "{";
+    for (int l = 0; l < LANE_COUNT; l++) {
+        TaskLaneStats& stats = pool->lanes[l];
+        unsigned long long run = stats.run.load();
+        json << (l ? "," : "") << "\"" << names[l] << "\":{\"queued\":" << stats.queued.load()
+             << ",\"peak_queued\":" << stats.peak_queued.load() << ",\"run\":" << run
+             << ",\"shed\":" << stats.shed.load()
+             << ",\"avg_wait_ms\":" << (run ? stats.wait_us.load() / 1000.0 / run : 0)
+             << ",\"service_ms\":" << stats.service_us.load() / 1000.0 << "}";
+    }
+    json << ",\"reserved_backend_workers\":" << pool->workers.size() - pool->shared_workers
+         << ",\"web_budget_ms\":" << pool->web_budget_ms << "}";
+    return json.str();
+}
+
+// Resident and virtual memory and thread count of this process, from /proc
+void read_process_footprint(long long* rss_kb, long long* virtual_kb, int* threads) {
+    *rss_kb = 0;
+    *virtual_kb = 0;
+    *threads = 0;
+    FILE* status = fopen("/proc/self/status", "r");
+    if (!status) return;
+    char line[256];
+    while (fgets(line, sizeof(line), status)) {
+        sscanf(line, "VmRSS: %lld", rss_kb);
+        sscanf(line, "VmSize: %lld", virtual_kb);
+        sscanf(line, "Threads: %d", threads);
+    }
+    fclose(status);
+}
+
+// I/O engine counters "/io_stats" (WEB only)
+std::string handle_io_stats_request(ThreadContext* ctx) {
+    long long rss_kb, virtual_kb;
+    int threads;
+    read_process_footprint(&rss_kb, &virtual_kb, &threads);
+    pthread_mutex_lock(&ctx->conn_mutex);
+    int web_connections = ctx->active_web_connections;
+    int backend_connections = ctx->active_backend_connections;
+    pthread_mutex_unlock(&ctx->conn_mutex);
+    std::ostringstream json;
+    json << "{\"engine\":\"" << ctx->io_engine << "\""
+         << ",\"requests\":" << ctx->io.requests.load()
+         << ",\"syscalls\":" << ctx->io.syscalls.load()
+         << ",\"accepts\":" << ctx->io.accepts.load()
+         << ",\"accept_wakeups\":" << ctx->io.accept_wakeups.load()
+         << ",\"cpu_workers\":" << (ctx->cpu_pool ? ctx->cpu_pool->workers.size() : 0)
+         << ",\"cpu_tasks\":" << (ctx->cpu_pool ? ctx->cpu_pool->tasks_run.load() : 0)
+         << ",\"cpu_steals\":" << (ctx->cpu_pool ? ctx->cpu_pool->steals.load() : 0)
+         << ",\"cpu_queued\":" << (ctx->cpu_pool ? ctx->cpu_pool->queued.load() : 0)
+         << ",\"lanes\":" << task_lane_stats_json(ctx->cpu_pool)
+         << ",\"rate_limited\":" << (ctx->rate_limiter ? ctx->rate_limiter->limited.load() : 0)
+         << ",\"rate_buckets_reused\":" << (ctx->rate_limiter ? ctx->rate_limiter->reused.load() : 0)
+         << ",\"rate_table_full\":" << (ctx->rate_limiter ? ctx->rate_limiter->table_full.load() : 0)
+         << ",\"coroutines_suspended\":" << ctx->coro_loop->suspended.load()
+         << ",\"coroutine_waits\":" << ctx->coro_loop->waits.load()
+         << ",\"coroutine_timeouts\":" << ctx->coro_loop->timeouts.load()
+         << ",\"web_connections\":" << web_connections
+         << ",\"backend_connections\":" << backend_connections
+         << ",\"parked_connections\":" << ctx->io.parked_connections.load()
+         << ",\"tls_handshakes\":" << ctx->io.tls_handshakes.load()
+         << ",\"tls_resumed\":" << ctx->io.tls_resumed.load()
+         << ",\"tls_failures\":" << ctx->io.tls_failures.load()
+         << ",\"ktls_send\":" << ctx->io.ktls_send.load()
+         << ",\"ktls_receive\":" << ctx->io.ktls_receive.load()
+         << ",\"rss_kb\":" << rss_kb
+         << ",\"virtual_kb\":" << virtual_kb
+         << ",\"threads\":" << threads << "}";
+    return build_json_response(json.str());
+}
+
+// Replication role and progress "/replication_status" (WEB only)
+std::string handle_replication_status_request(ThreadContext* ctx) {
+    std::ostringstream json;
+    pthread_mutex_lock(&ctx->changes.mutex);
+    json << "{\"role\":\"" << (ctx->read_only ? "replica" : "primary") << "\""
+         << ",\"history\":" << ctx->changes.history_id
+         << ",\"version\":" << ctx->changes.version
+         << ",\"oldest\":" << ctx->changes.oldest;
+    if (ctx->read_only) {
+        json << ",\"primary\":\"" << json_escape(ctx->primary_address) << "\""
+             << ",\"connected\":" << (ctx->primary_connected ? "true" : "false");
+    } else {
+        json << ",\"replicas\":" << ctx->replicas_connected;
+    }
+    pthread_mutex_unlock(&ctx->changes.mutex);
+    json << "}";
+    return build_json_response(json.str());
+}
+
+// One validated assignment of a batch
+struct AppVarChange {
+    int var;
+    unsigned long long value;      // Unused for strings until interned
+    std::string text;              // As given
+};
+
+// Schema index of a variable, or -1
+int app_var_index(const std::string& name) {
+    for (int i = 0; i < APP_VAR_COUNT; i++) {
+        if (name == APP_VAR_SCHEMA[i].name) return i;
+    }
+    return -1;
+}
+
+// Check `text` against the variable's schema and encode it; false with
+// *error set if it does not fit
+bool app_var_parse(int var, const std::string& text, AppVarChange* change, std::string* error) {
+    const AppVarSpec& spec = APP_VAR_SCHEMA[var];
+    const char* begin = text.data();
+    const char* end = text.data() + text.size();
+    change->var = var;
+    change->value = 0;
+    change->text = text;
+    switch (spec.type) {
+    case APP_VAR_INT: {
+        long long number;
+        std::from_chars_result parsed = std::from_chars(begin, end, number);
+        if (parsed.ec != std::errc() || parsed.ptr != end || number < spec.min || number > spec.max) {
+            *error = std::string(spec.name) + " takes an integer from " + std::to_string((long long)spec.min) +
+                     " to " + std::to_string((long long)spec.max);
+            return false;
+        }
+        change->value = (unsigned long long)number;
+        return true;
+    }
+    case APP_VAR_FLOAT: {
+        double number;
+        std::from_chars_result parsed = std::from_chars(begin, end, number);
+        if (parsed.ec != std::errc() || parsed.ptr != end || !(number >= spec.min && number <= spec.max)) {
+            char range[64];
+            snprintf(range, sizeof(range), " takes a number from %g to %g", spec.min, spec.max);
+            *error = spec.name + std::string(range);
+            return false;
+        }
+        memcpy(&change->value, &number, sizeof(number));
+        return true;
+    }
+    case APP_VAR_ENUM: {
+        unsigned long long index = 0;
+        for (const char* option = spec.options; *option; index++) {
+            const char* option_end = strchr(option, '|');
+            if (!option_end) option_end = option + strlen(option);
+            if (text.compare(0, std::string::npos, option, option_end - option) == 0) {
+                change->value = index;
+                return true;
+            }
+            option = *option_end ? option_end + 1 : option_end;
+        }
+        *error = std::string(spec.name) + " takes one of " + spec.options;
+        return false;
+    }
+    case APP_VAR_STRING:
+        if (text.size() > spec.max) {
+            *error = std::string(spec.name) + " takes at most " + std::to_string((long long)spec.max) + " bytes";
+            return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Apply a batch as one new version: readers of a snapshot see all of it
+// or none of it. Returns the version.
+unsigned long long app_vars_apply(AppVarStore* store, std::vector<AppVarChange>& changes) {
+    pthread_mutex_lock(&store->write_mutex);
+    for (AppVarChange& change : changes) {
+        if (APP_VAR_SCHEMA[change.var].type != APP_VAR_STRING) continue;
+        change.value = reinterpret_cast<unsigned long long>(&*store->strings.insert(change.text).first);
+    }
+    unsigned long long seq = store->sequence.load(std::memory_order_relaxed);
+    store->sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (const AppVarChange& change : changes) {
+        store->values[change.var].store(change.value, std::memory_order_relaxed);
+    }
+    store->sequence.store(seq + 2, std::memory_order_release);
+
+    // Retire the strings no variable refers to any more. A reader that
+    // could still hold one entered its guard before the stores above, so
+    // once no guard is held everything retired so far can go.
+    std::unordered_set<const std::string*> in_use;
+    for (int i = 0; i < APP_VAR_COUNT; i++) {
+        if (APP_VAR_SCHEMA[i].type == APP_VAR_STRING) {
+            in_use.insert(reinterpret_cast<const std::string*>(store->values[i].load(std::memory_order_relaxed)));
+        }
+    }
+    for (auto it = store->strings.begin(); it != store->strings.end();) {
+        auto next = std::next(it);
+        if (!in_use.count(&*it)) {
+            store->retired.push_back(store->strings.extract(it));
+        }
+        it = next;
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (store->string_readers.load(std::memory_order_acquire) == 0) {
+        store->retired.clear();
+    }
+    pthread_mutex_unlock(&store->write_mutex);
+    return (seq + 2) / 2;
+}
+
+// Consistent copy of every variable; returns its version
+unsigned long long app_vars_snapshot(const AppVarStore* store, unsigned long long values[APP_VAR_COUNT]) {
+    unsigned long long before;
+    unsigned long long after;
+    do {
+        before = store->sequence.load(std::memory_order_acquire);
+        for (int i = 0; i < APP_VAR_COUNT; i++) {
+            values[i] = store->values[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = store->sequence.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return before / 2;
+}
+
+void initialize_app_vars(AppVarStore* store) {
+    pthread_mutex_init(&store->write_mutex, nullptr);
+    store->sequence.store(0);
+    store->string_readers.store(0);
+    std::vector<AppVarChange> changes(APP_VAR_COUNT);
+    std::string error;
+    for (int i = 0; i < APP_VAR_COUNT; i++) {
+        app_var_parse(i, APP_VAR_SCHEMA[i].initial, &changes[i], &error);
+    }
+    app_vars_apply(store, changes);
+    store->sequence.store(0);      // The defaults are version 0
+}
+
+// Validate and apply a batch of name/value pairs, recording it in the
+// system status. Returns an empty string on success, else why nothing
+// was applied.
+std::string update_app_vars(ThreadContext* ctx, const std::vector<std::pair<std::string, std::string>>& fields,
+                            unsigned long long* version) {
+    std::vector<AppVarChange> changes(fields.size());
+    std::string error;
+    std::string summary;
+    std::string names;
+    for (size_t i = 0; i < fields.size(); i++) {
+        int var = app_var_index(fields[i].first);
+        if (var < 0) {
+            return "Unknown variable " + fields[i].first;
+        }
+        if (!app_var_parse(var, fields[i].second, &changes[i], &error)) {
+            return error;
+        }
+        summary += (i ? ", " : "") + fields[i].first + "=" + fields[i].second;
+        names += (i ? ", " : "") + fields[i].first;
+    }
+    if (changes.empty()) {
+        return "No variables given";
+    }
+    *version = app_vars_apply(&ctx->app_vars, changes);
+    // Values too long for the persisted status are left out of it
+    std::string status = "Updated: " + summary;
+    if (status.size() >= PERSISTED_STATUS_SIZE) {
+        status = "Updated: " + names;
+    }
+    if (status.size() >= PERSISTED_STATUS_SIZE) {
+        status = "Updated: " + std::to_string(fields.size()) + " variables";
+    }
+    pthread_mutex_lock(&ctx->mutex);
+    set_system_status_locked(ctx, status);
+    wal_flush_locked(ctx->store);
+    pthread_mutex_unlock(&ctx->mutex);
+    return "";
+}
+
+// Answer to a request parse_http_request could not frame; the connection
+// closes after it
+std::string build_request_error_response(int status) {
+    std::string response = status == 413
+        ? "HTTP/1.1 413 Content Too Large\r\nContent-Type: text/plain\r\nContent-Length: 24\r\n\r\n"
+          "Request body too large\r\n"
+        : build_bad_request_response("Bad Content-Length\r\n");
+    add_connection_close_header(response);
+    return response;
+}
+
+// Refusal of an h2c upgrade without exactly one valid HTTP2-Settings header
+std::string build_bad_upgrade_response() {
+    std::string response = build_bad_request_response("Invalid HTTP2-Settings\r\n");
+    add_connection_close_header(response);
+    return response;
+}
+
+// Handle POST request to update one variable from backend (BACKEND only):
+// "name=N&value=V"
+std::string handle_update_var_request(ThreadContext* ctx, const std::string& body) {
+    std::string name = get_query_param(body, "name");
+    std::vector<std::pair<std::string, std::string>> fields = {{name, get_query_param(body, "value")}};
+    unsigned long long version;
+    std::string error = update_app_vars(ctx, fields, &version);
+    if (!error.empty()) {
+        printf("[BACKEND] Rejected variable update: %s\n", error.c_str());
+        return build_bad_request_response(error);
+    }
+    return "HTTP/1.1 303 See Other\r\nLocation: /\r\n\r\n";
+}
+
+// Handle POST request to update several variables at once (BACKEND only):
+// "name1=value1&name2=value2...". Either every change is applied, as one
+// new version, or none is and the 400 says why.
+std::string handle_update_vars_request(ThreadContext* ctx, const std::string& body) {
+    std::vector<std::pair<std::string, std::string>> fields;
+    std::istringstream body_stream(body);
+    std::string pair;
+    while (std::getline(body_stream, pair, '&')) {
+        size_t eq_pos = pair.find('=');
+        if (eq_pos != std::string::npos) {
+            fields.emplace_back(url_decode(pair.substr(0, eq_pos)), url_decode(pair.substr(eq_pos + 1)));
+        }
+    }
+    unsigned long long version;
+    std::string error = update_app_vars(ctx, fields, &version);
+    if (!error.empty()) {
+        printf("[BACKEND] Rejected variable batch: %s\n", error.c_str());
+        return build_bad_request_response(error);
+    }
+    return build_json_response("{\"version\":" + std::to_string(version) + "}");
+}
+
+// Every variable with its type and the table's version "/vars"
+std::string handle_vars_request(ThreadContext* ctx) {
+    static const char* const type_names[] = {"int", "float", "string", "enum"};
+    unsigned long long values[APP_VAR_COUNT];
+    AppVarStringGuard guard(&ctx->app_vars);
+    unsigned long long version = app_vars_snapshot(&ctx->app_vars, values);
+    std::ostringstream json;
+    json << "{\"version\":" << version << ",\"vars\":{";
+    for (int i = 0; i < APP_VAR_COUNT; i++) {
+        const AppVarSpec& spec = APP_VAR_SCHEMA[i];
+        std::string value = app_var_format(i, values[i]);
+        json << (i ? "," : "") << "\"" << spec.name << "\":{\"type\":\"" << type_names[spec.type] << "\",\"value\":";
+        if (spec.type == APP_VAR_INT || spec.type == APP_VAR_FLOAT) {
+            json << value;
+        } else {
+            json << "\"" << json_escape(value) << "\"";
+        }
+        json << "}";
+    }
+    json << "}}";
+    return build_json_response(json.str());
+}
+
+// Task<T>: a lazily started coroutine whose result is taken with co_await.
+// When it finishes, the awaiting coroutine resumes by symmetric transfer on
+// whichever thread finished it, so code after a co_await may run on the
+// coroutine loop or a pool worker. Never hold a mutex across a co_await.
+template <typename T>
+class Task {
+public:
+    struct promise_type {
+        T value;
+        std::coroutine_handle<> continuation;
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                std::coroutine_handle<> next = handle.promise().continuation;
+                return next ? next : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_value(T result) { value = std::move(result); }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    Task(Task&& other) noexcept : handle_(other.handle_) { other.handle_ = nullptr; }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        if (handle_) handle_.destroy();
+    }
+
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+        handle_.promise().continuation = caller;
+        return handle_;
+    }
+    T await_resume() { return std::move(handle_.promise().value); }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+// Fire-and-forget coroutine: runs as soon as it is called and frees its own
+// frame at the end
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+long long monotonic_ms() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// Awaitable for one readiness wait on the loop. co_await yields false if
+// the deadline passed first or the fd cannot be polled.
+struct LoopWait {
+    CoroutineLoop* loop;
+    LoopWaiter waiter;
+
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> handle) {
+        // The loop thread owns the waiter once it is queued and may resume
+        // the coroutine, freeing this awaiter, before the push returns: only
+        // locals are used after it
+        CoroutineLoop* target = loop;
+        waiter.handle = handle;
+        target->suspended.fetch_add(1, std::memory_order_relaxed);
+        target->waits.fetch_add(1, std::memory_order_relaxed);
+        pthread_mutex_lock(&target->mutex);
+        target->incoming.push_back(&waiter);
+        pthread_mutex_unlock(&target->mutex);
+        eventfd_write(target->wake_fd, 1);
+    }
+    bool await_resume() { return waiter.ready; }
+};
+
+LoopWait wait_fd(CoroutineLoop* loop, int fd, unsigned events, int timeout_ms) {
+    return LoopWait{loop, LoopWaiter{nullptr, fd, events, timeout_ms, false, false, {}}};
+}
+
+LoopWait async_sleep(CoroutineLoop* loop, int milliseconds) {
+    return wait_fd(loop, -1, 0, milliseconds);
+}
+
+void* coroutine_loop_thread(void* arg) {
+    CoroutineLoop* loop = static_cast<CoroutineLoop*>(arg);
+    pin_current_thread(THREAD_LOOP);
+    epoll_event events[64];
+    std::vector<LoopWaiter*> posted;
+    std::vector<std::coroutine_handle<>> runnable;
+    while (true) {
+        int timeout = -1;
+        if (!loop->timers.empty()) {
+            timeout = (int)std::max(0LL, loop->timers.begin()->first - monotonic_ms());
+        }
+        int count = epoll_wait(loop->epoll_fd, events, 64, timeout);
+        for (int i = 0; i < count; i++) {
+            LoopWaiter* waiter = static_cast<LoopWaiter*>(events[i].data.ptr);
+            if (!waiter) {
+                eventfd_t value;
+                eventfd_read(loop->wake_fd, &value);
+                continue;
+            }
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, waiter->fd, nullptr);
+            if (waiter->timed) loop->timers.erase(waiter->timer);
+            waiter->ready = true;
+            runnable.push_back(waiter->handle);
+        }
+
+        pthread_mutex_lock(&loop->mutex);
+        posted.swap(loop->incoming);
+        pthread_mutex_unlock(&loop->mutex);
+        for (LoopWaiter* waiter : posted) {
+            waiter->timed = waiter->timeout_ms >= 0;
+            if (waiter->timed) {
+                waiter->timer = loop->timers.emplace(monotonic_ms() + waiter->timeout_ms, waiter);
+            }
+            if (waiter->fd < 0) continue;
+            epoll_event event = {};
+            event.events = waiter->events | EPOLLONESHOT;
+            event.data.ptr = waiter;
+            if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, waiter->fd, &event) < 0) {
+                if (waiter->timed) loop->timers.erase(waiter->timer);
+                waiter->ready = false;
+                runnable.push_back(waiter->handle);
+            }
+        }
+        posted.clear();
+
+        long long now = monotonic_ms();
+        while (!loop->timers.empty() && loop->timers.begin()->first <= now) {
+            LoopWaiter* waiter = loop->timers.begin()->second;
+            loop->timers.erase(loop->timers.begin());
+            if (waiter->fd >= 0) {
+                epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, waiter->fd, nullptr);
+                loop->timeouts.fetch_add(1, std::memory_order_relaxed);
+            }
+            waiter->ready = waiter->fd < 0;
+            runnable.push_back(waiter->handle);
+        }
+
+        // Resumed coroutines may post new waits; those wait for the next pass
+        for (std::coroutine_handle<> handle : runnable) {
+            loop->suspended.fetch_sub(1, std::memory_order_relaxed);
+            handle.resume();
+        }
+        runnable.clear();
+    }
+    return nullptr;
+}
+
+// Start the loop thread; null if it could not be set up
+CoroutineLoop* create_coroutine_loop() {
+    CoroutineLoop* loop = new CoroutineLoop();
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (loop->epoll_fd < 0 || loop->wake_fd < 0) {
+        perror("coroutine loop epoll/eventfd");
+        return nullptr;
+    }
+    pthread_mutex_init(&loop->mutex, nullptr);
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event);
+    pthread_t loop_tid;
+    if (pthread_create(&loop_tid, nullptr, coroutine_loop_thread, loop)) {
+        perror("pthread_create for coroutine loop");
+        return nullptr;
+    }
+    pthread_detach(loop_tid);
+    return loop;
+}
+
+void task_pool_submit(TaskPool* pool, std::function<void()> task, TaskLane lane);
+
+// co_await ResumeOnPool{pool, lane, budget_ms} continues the coroutine on a
+// pool worker, or right here if there is no pool, and yields false if the
+// work was shed instead: the task waited longer than budget_ms, or the last
+// one dequeued did while others are still queued, so this one would too.
+// A budget of 0 never sheds.
+// Blocking storage calls belong behind it too: regular files are always
+// "ready" to epoll, so the loop cannot wait on them.
+struct ResumeOnPool {
+    TaskPool* pool;
+    TaskLane lane;
+    int budget_ms;
+    std::chrono::steady_clock::time_point queued_at = {};    // Set when the coroutine is queued
+    bool shed = false;
+
+    bool await_ready() { return pool == nullptr; }
+    bool await_suspend(std::coroutine_handle<> handle) {
+        TaskLaneStats& stats = pool->lanes[lane];
+        if (budget_ms > 0 && stats.queued.load() > 0 && stats.last_wait_us.load() > budget_ms * 1000LL) {
+            stats.shed.fetch_add(1, std::memory_order_relaxed);
+            shed = true;
+            return false;
+        }
+        queued_at = std::chrono::steady_clock::now();
+        task_pool_submit(pool, [handle]() { handle.resume(); }, lane);
+        return true;
+    }
+    bool await_resume() {
+        if (shed) return false;
+        if (!pool) return true;
+        TaskLaneStats& stats = pool->lanes[lane];
+        long long waited_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                                  std::chrono::steady_clock::now() - queued_at).count();
+        stats.last_wait_us.store(waited_us, std::memory_order_relaxed);
+        if (budget_ms > 0 && waited_us > budget_ms * 1000LL) {
+            stats.shed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        stats.wait_us.fetch_add(waited_us, std::memory_order_relaxed);
+        return true;
+    }
+};
+
+// Connect a non-blocking socket; 0 or the errno it failed with
+Task<int> async_connect(CoroutineLoop* loop, int fd, sockaddr_in address, int timeout_ms) {
+    if (connect(fd, (sockaddr*)&address, sizeof(address)) == 0) {
+        co_return 0;
+    }
+    if (errno != EINPROGRESS) {
+        co_return errno;
+    }
+    if (!co_await wait_fd(loop, fd, EPOLLOUT, timeout_ms)) {
+        co_return ETIMEDOUT;
+    }
+    int error = 0;
+    socklen_t size = sizeof(error);
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size);
+    co_return error;
+}
+
+// Send all of data on a non-blocking socket, waiting at most timeout_ms
+// each time the send buffer fills; 0 or the errno it failed with
+Task<int> async_send(CoroutineLoop* loop, int fd, const std::string& data, int timeout_ms) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n > 0) {
+            sent += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            co_return errno;
+        }
+        if (!co_await wait_fd(loop, fd, EPOLLOUT, timeout_ms)) {
+            co_return ETIMEDOUT;
+        }
+    }
+    co_return 0;
+}
+
+// Forward system status update to the backend monitor that reports a shard;
+// shard K's monitor listens for notifications on monitor_base_port + K.
+// The TCP connect and send suspend on the coroutine loop; true if delivered.
+Task<bool> notify_backend_monitor(ThreadContext* ctx, int shard_id, const std::string& system_status,
+                                  const std::vector<DeviceStatus>& devices) {
+    printf("[WEB] notify_backend_monitor called with system_status: '%s'\n", system_status.c_str());
+    int port = ctx->monitor_base_port + shard_id;
+    
+    // Build the notification in simple format
+    std::ostringstream notification;
+    notification << "SYSTEM_STATUS_UPDATE:" << system_status << "\n";
+    for (const auto& device : devices) {
+        notification << "DEVICE:" << device.name << "=" << device.status << "\n";
+    }
+    notification << "END\n";
+    std::string msg = notification.str();
+    
+    // A monitor attached to the shard's shm channel takes it from the down ring
+    ShmAttachment* attachment = ctx->shm_channels[shard_id];
+    if (attachment && shm_peer_alive(attachment->channel->client_pid)) {
+        // Wait for space outside the lock, so a full ring holds up only the
+        // senders that need it and never one that could write right away
+        ShmRing* ring = &attachment->channel->down;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SHM_NOTIFY_WAIT_MS);
+        bool written;
+        while (true) {
+            pthread_mutex_lock(&attachment->producer_mutex);
+            written = shm_ring_try_write(attachment->channel, ring, msg);
+            pthread_mutex_unlock(&attachment->producer_mutex);
+            int remaining_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            if (written || remaining_ms <= 0 || !shm_ring_wait_space(ring, msg.size(), remaining_ms)) {
+                break;
+            }
+        }
+        if (written) {
+            printf("[WEB] Sent status update notification over shm channel %d (%d bytes)\n", shard_id, (int)msg.size());
+            co_return true;
+        }
+        printf("[WEB] shm channel %d full, falling back to TCP\n", shard_id);
+    }
+    
+    // Try to connect to backend monitor
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        printf("[WEB] Failed to create socket for backend notification: %s\n", strerror(errno));
+        co_return false;
+    }
+    
+    sockaddr_in backend_addr = {};
+    backend_addr.sin_family = AF_INET;
+    backend_addr.sin_port = htons(port);  // Backend notification port
+    backend_addr.sin_addr = ctx->monitor_address;
+    char address_text[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &backend_addr.sin_addr, address_text, sizeof(address_text));
+    
+    printf("[WEB] Attempting to connect to backend monitor at %s:%d\n", address_text, port);
+    
+    // Short timeout for the connection attempt
+    int error = co_await async_connect(ctx->coro_loop, sock, backend_addr, ctx->monitor_timeout_ms);
+    if (error) {
+        printf("[WEB] Backend monitor not reachable (may not be running): %s\n", strerror(error));
+        close(sock);
+        co_return false;
+    }
+    
+    printf("[WEB] Successfully connected to backend monitor\n");
+    printf("[WEB] Successfully connected to backend monitor\n");
+    
+    // Send status update notification
+    printf("[WEB] Sending notification message:\n%s", msg.c_str());
+    
+    error = co_await async_send(ctx->coro_loop, sock, msg, ctx->monitor_timeout_ms);
+    if (error) {
+        printf("[WEB] Failed to send notification: %s\n", strerror(error));
+    } else {
+        printf("[WEB] Sent status update notification to backend monitor (%d bytes)\n", (int)msg.size());
+    }
+    
+    close(sock);
+    co_return error == 0;
+}
+
+// Handle POST request to update system status from webpage (WEB only)
+Task<std::string> handle_update_system_web_request(ThreadContext* ctx, const std::string& body) {
+    ClockReading now;
+    read_cached_clock(&ctx->clock, &now);
+    const char* timestamp = now.local_timestamp;
+    
+    printf("[WEB] [%s] Raw POST body received: %s\n", timestamp, body.c_str());
+    
+    pthread_mutex_lock(&ctx->mutex);
+    
+    // Simplified multipart form parsing approach
     std::string system_status_value;
     
     // Look for the system_status field directly in the body
@@ -784,39 +3402,48 @@ std::string handle_update_system_web_request(ThreadContext* ctx, const std::stri
         printf("[WEB] [%s] Could not find system_status field in body\n", timestamp);
     }
     
+    if (system_status_value.size() >= PERSISTED_STATUS_SIZE) {
+        pthread_mutex_unlock(&ctx->mutex);
+        printf("[WEB] [%s] System status too long, not updating\n", timestamp);
+        co_return build_too_long_response();
+    }
+
     // Update system status if provided
     if (!system_status_value.empty()) {
-        ctx->system_status = system_status_value;
+        set_system_status_locked(ctx, system_status_value);
+        wal_flush_locked(ctx->store);
         printf("[WEB] [%s] System status updated: %s\n", timestamp, system_status_value.c_str());
-        
-        // Notify backend monitor of the status change
-        std::vector<DeviceStatus> devices_copy = ctx->device_statuses; // Copy for thread safety
         pthread_mutex_unlock(&ctx->mutex);
         
-        // Send notification to backend monitor (outside mutex to avoid blocking)
-        notify_backend_monitor(system_status_value, devices_copy);
+        // Notify every shard's monitor of the status change (outside mutex to avoid blocking)
+        for (int i = 0; i < MAX_SHARDS; i++) {
+            DeviceShard* shard = &ctx->shards[i];
+            pthread_mutex_lock(&shard->mutex);
+            std::vector<DeviceStatus> devices_copy = shard->device_statuses; // Copy for thread safety
+            pthread_mutex_unlock(&shard->mutex);
+            if (i == 0 || !devices_copy.empty()) {
+                co_await notify_backend_monitor(ctx, i, system_status_value, devices_copy);
+            }
+        }
         
         printf("[WEB] [%s] System status update successful - client will reset 10s refresh timer\n", timestamp);
-        return "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 7\r\n\r\nSuccess";
+        co_return "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 7\r\n\r\nSuccess";
     } else {
         printf("[WEB] [%s] No system_status value found, not updating\n", timestamp);
     }
     
     pthread_mutex_unlock(&ctx->mutex);
-    return "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 7\r\n\r\nSuccess";
+    co_return "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 7\r\n\r\nSuccess";
 }
 
 // Handle POST request to update device status from webpage (WEB only)
-std::string handle_update_device_web_request(ThreadContext* ctx, const std::string& body) {
-    auto now = std::chrono::system_clock::now();
-    auto time_t = std::chrono::system_clock::to_time_t(now);
-    char timestamp[100];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&time_t));
+Task<std::string> handle_update_device_web_request(ThreadContext* ctx, const std::string& body) {
+    ClockReading now;
+    read_cached_clock(&ctx->clock, &now);
+    const char* timestamp = now.local_timestamp;
     
     printf("[WEB] [%s] Raw POST body received: %s\n", timestamp, body.c_str());
     
-    pthread_mutex_lock(&ctx->mutex);
-    
     // Simplified multipart form parsing for device updates
     std::string device_name;
     std::string device_status;
@@ -893,351 +3520,4707 @@ std::string handle_update_device_web_request(ThreadContext* ctx, const std::stri
         }
     }
     
+    if (!fits_persisted_record(device_name, device_status)) {
+        printf("[WEB] [%s] Device name or status too long, not updating\n", timestamp);
+        co_return build_too_long_response();
+    }
+
     // Update device status if both name and status provided
     if (!device_name.empty() && !device_status.empty()) {
-        bool found = false;
-        for (auto& device : ctx->device_statuses) {
-            if (device.name == device_name) {
-                if (device.status != device_status) {
-                    printf("[WEB] [%s] Device '%s' status changed: %s -> %s\n", 
-                           timestamp, device_name.c_str(), device.status.c_str(), device_status.c_str());
-                    device.status = device_status;
-                }
-                found = true;
-                break;
-            }
-        }
-        if (!found) {
-            // Add new device if not found
-            ctx->device_statuses.push_back({device_name, device_status});
-            printf("[WEB] [%s] New device added: %s = %s\n", timestamp, device_name.c_str(), device_status.c_str());
+        // Update the device in whichever shard holds it; new devices go to shard 0
+        size_t position;
+        DeviceShard* shard = lock_device_shard(ctx, device_name, &position);
+        if (!shard) {
+            shard = &ctx->shards[0];
+            pthread_mutex_lock(&shard->mutex);
         }
+        open_shard_store_locked(ctx, shard);
+        apply_device_status_locked(shard, device_name, device_status, "[WEB]", now);
+        wal_flush_locked(shard->store);
+        std::vector<DeviceStatus> devices_copy = shard->device_statuses; // Copy for thread safety
+        int shard_id = shard->shard_id;
+        pthread_mutex_unlock(&shard->mutex);
         
-        // Get current system status and device list for notification
+        // Get current system status for notification
+        pthread_mutex_lock(&ctx->mutex);
         std::string current_system_status = ctx->system_status;
-        std::vector<DeviceStatus> devices_copy = ctx->device_statuses; // Copy for thread safety
         pthread_mutex_unlock(&ctx->mutex);
         
-        // Send notification to backend monitor (outside mutex to avoid blocking)
+        // Send notification to the monitor owning the shard (outside mutex to avoid blocking)
         printf("[WEB] [%s] Sending device update notification to backend monitor\n", timestamp);
-        notify_backend_monitor(current_system_status, devices_copy);
+        co_await notify_backend_monitor(ctx, shard_id, current_system_status, devices_copy);
         
         printf("[WEB] [%s] Device status update successful - client will reset 10s refresh timer\n", timestamp);
-        return "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 7\r\n\r\nSuccess";
+        co_return "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 7\r\n\r\nSuccess";
     } else {
         printf("[WEB] [%s] Missing device_name or device_status, not updating\n", timestamp);
-        pthread_mutex_unlock(&ctx->mutex);
-        return "HTTP/1.1 400 Bad Request\r\nContent-Type: text/plain\r\nContent-Length: 23\r\n\r\nMissing required fields";
+        co_return "HTTP/1.1 400 Bad Request\r\nContent-Type: text/plain\r\nContent-Length: 23\r\n\r\nMissing required fields";
     }
 }
 
-// Route HTTP requests based on server type
-std::string route_request(const HttpRequest& request, ThreadContext* ctx, int connection_id) {
-    const char* server_type_str = (request.server_type == BACKEND_SERVER) ? "BACKEND" : "WEB";
-    
-    printf("[%s] connection %d processing %s %s\n", 
-           server_type_str, connection_id, request.method.c_str(), request.path.c_str());
+struct TaskWorkerArgs {
+    TaskPool* pool;
+    int index;
+};
 
-    if (request.server_type == BACKEND_SERVER) {
-        // Backend API endpoints - only allow specific operations
-        if (request.path == "/update_system" && request.method == "POST") {
-            return handle_update_system_request(ctx, request.body);
-        } else if (request.path == "/update_var" && request.method == "POST") {
-            return handle_update_var_request(ctx, request.body);
-        } else {
-            printf("[BACKEND] connection %d: 404 Not Found for %s %s\n", 
-                   connection_id, request.method.c_str(), request.path.c_str());
-            return "HTTP/1.1 404 Not Found\r\n\r\nBackend API endpoint not found";
+const int SHARED_WORKER_NICE = 5;  // Scheduling penalty of workers that run web work
+
+thread_local int current_task_worker = -1;  // Pool worker index of this thread, -1 outside the pool
+
+// Queue a task in a lane; from inside the pool it goes to the submitting
+// worker if that worker takes the lane
+void task_pool_submit(TaskPool* pool, std::function<void()> task, TaskLane lane) {
+    int eligible = lane == LANE_WEB ? pool->shared_workers : (int)pool->workers.size();
+    unsigned index = current_task_worker >= 0 && current_task_worker < eligible
+                         ? current_task_worker : pool->next_worker.fetch_add(1, std::memory_order_relaxed);
+    TaskWorker* worker = pool->workers[index % eligible];
+    pthread_mutex_lock(&worker->mutex);
+    worker->tasks[lane].push_back(std::move(task));
+    pthread_mutex_unlock(&worker->mutex);
+    TaskLaneStats& stats = pool->lanes[lane];
+    int depth = stats.queued.fetch_add(1) + 1;
+    int peak = stats.peak_queued.load(std::memory_order_relaxed);
+    while (depth > peak && !stats.peak_queued.compare_exchange_weak(peak, depth, std::memory_order_relaxed)) {
+    }
+    pool->queued.fetch_add(1);
+    if (lane == LANE_BACKEND && pool->reserved_sleeping.load() > 0) {
+        pthread_mutex_lock(&pool->idle_mutex);
+        pthread_cond_signal(&pool->reserved_cond);
+        pthread_mutex_unlock(&pool->idle_mutex);
+    } else if (pool->sleeping.load() > 0) {
+        pthread_mutex_lock(&pool->idle_mutex);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_mutex);
+    }
+}
+
+// Backend lane before web lane; within a lane own deque first, then
+// steal. False if nothing this worker may run is queued.
+bool task_pool_take(TaskPool* pool, int index, std::function<void()>* task, TaskLane* lane) {
+    size_t count = pool->workers.size();
+    int lanes = index < pool->shared_workers ? LANE_COUNT : LANE_BACKEND + 1;
+    for (int l = 0; l < lanes; l++) {
+        if (pool->lanes[l].queued.load() == 0) continue;
+        for (size_t i = 0; i < count; i++) {
+            TaskWorker* worker = pool->workers[(index + i) % count];
+            std::deque<std::function<void()>>& tasks = worker->tasks[l];
+            pthread_mutex_lock(&worker->mutex);
+            bool found = !tasks.empty();
+            if (found && i == 0) {
+                *task = std::move(tasks.front());
+                tasks.pop_front();
+            } else if (found) {
+                *task = std::move(tasks.back());
+                tasks.pop_back();
+            }
+            pthread_mutex_unlock(&worker->mutex);
+            if (found) {
+                pool->lanes[l].queued.fetch_sub(1);
+                pool->queued.fetch_sub(1);
+                if (i > 0) pool->steals.fetch_add(1, std::memory_order_relaxed);
+                *lane = (TaskLane)l;
+                return true;
+            }
         }
-    } else {
-        // Web interface endpoints
-        if (request.path == "/") {
-            return handle_root_request(ctx);
-        } else if (request.path == "/check_status") {
-            return handle_check_status_request(ctx);
-        } else if (request.path == "/device_status_json") {
-            return handle_device_status_json_request(ctx);
-        } else if (request.path == "/update_system_web" && request.method == "POST") {
-            return handle_update_system_web_request(ctx, request.body);
-        } else if (request.path == "/update_device_web" && request.method == "POST") {
-            return handle_update_device_web_request(ctx, request.body);
+    }
+    return false;
+}
+
+void* task_worker_thread(void* arg) {
+    TaskWorkerArgs* args = static_cast<TaskWorkerArgs*>(arg);
+    TaskPool* pool = args->pool;
+    current_task_worker = args->index;
+    delete args;
+    pin_current_thread(THREAD_WORKER);
+    bool reserved = current_task_worker >= pool->shared_workers;
+    if (!reserved) {
+        // Below backend workers and the I/O threads when the CPUs are busy
+        setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), SHARED_WORKER_NICE);
+    }
+    std::function<void()> task;
+    TaskLane lane;
+    while (true) {
+        if (task_pool_take(pool, current_task_worker, &task, &lane)) {
+            auto started = std::chrono::steady_clock::now();
+            task();
+            task = nullptr;
+            long long service_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                                       std::chrono::steady_clock::now() - started).count();
+            TaskLaneStats& stats = pool->lanes[lane];
+            long long average = stats.service_us.load(std::memory_order_relaxed);
+            stats.service_us.store(average == 0 ? service_us : average + (service_us - average) / 8,
+                                   std::memory_order_relaxed);
+            stats.run.fetch_add(1, std::memory_order_relaxed);
+            pool->tasks_run.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        // Submitters check the sleeping counts after queuing, so one of the
+        // two always sees the other
+        pthread_mutex_lock(&pool->idle_mutex);
+        if (reserved) {
+            pool->reserved_sleeping.fetch_add(1);
+            while (pool->lanes[LANE_BACKEND].queued.load() == 0) {
+                pthread_cond_wait(&pool->reserved_cond, &pool->idle_mutex);
+            }
+            pool->reserved_sleeping.fetch_sub(1);
         } else {
-            printf("[WEB] connection %d: 404 Not Found for %s %s\n", 
-                   connection_id, request.method.c_str(), request.path.c_str());
-            return "HTTP/1.1 404 Not Found\r\n\r\nWeb endpoint not found";
+            pool->sleeping.fetch_add(1);
+            while (pool->queued.load() == 0) {
+                pthread_cond_wait(&pool->idle_cond, &pool->idle_mutex);
+            }
+            pool->sleeping.fetch_sub(1);
         }
+        pthread_mutex_unlock(&pool->idle_mutex);
     }
+    return nullptr;
 }
 
-// Handle client requests
-void* handle_client(void* arg) {
-    ClientThreadArgs* args = static_cast<ClientThreadArgs*>(arg);
-    ThreadContext* ctx = args->ctx;
+// Start a pool of shared_workers plus reserved_workers that only take
+// backend work; null if the workers could not be started
+TaskPool* create_task_pool(int shared_workers, int reserved_workers, int web_budget_ms) {
+    TaskPool* pool = new TaskPool();
+    pool->shared_workers = shared_workers;
+    pool->web_budget_ms = web_budget_ms;
+    pthread_mutex_init(&pool->idle_mutex, nullptr);
+    pthread_cond_init(&pool->idle_cond, nullptr);
+    pthread_cond_init(&pool->reserved_cond, nullptr);
+    int worker_count = shared_workers + reserved_workers;
+    for (int i = 0; i < worker_count; i++) {
+        TaskWorker* worker = new TaskWorker();
+        pthread_mutex_init(&worker->mutex, nullptr);
+        pool->workers.push_back(worker);
+    }
+    for (int i = 0; i < worker_count; i++) {
+        pthread_t worker_tid;
+        if (pthread_create(&worker_tid, nullptr, task_worker_thread, new TaskWorkerArgs{pool, i})) {
+            perror("pthread_create for task worker");
+            return nullptr;
+        }
+        pthread_detach(worker_tid);
+    }
+    return pool;
+}
+
+// Handlers that render or scan enough to belong on the pool; the rest are
+// cheap enough that a hand-off would cost more than it saves
+bool is_cpu_heavy_request(const HttpRequest& request) {
+    return request.server_type == WEB_SERVER &&
+           (request.path == "/" || request.path == "/device_status_json" || request.path == "/device_history" ||
+            request.path == "/device_fault_minutes");
+}
+
+Task<std::string> route_request(const HttpRequest& request, ThreadContext* ctx, int connection_id);
+
+// Settles the race between a handler finishing and its caller giving up
+// on an inline result: whichever arrives second owns the response
+struct RequestCompletion {
+    std::atomic<bool> settled;
+    std::string response;
+    std::function<void(std::string&&)> deliver;
+};
+
+DetachedTask run_request(Task<std::string> task, std::shared_ptr<RequestCompletion> completion) {
+    completion->response = co_await task;
+    if (completion->settled.exchange(true)) {
+        completion->deliver(std::move(completion->response));
+    }
+}
+
+// Start a handler. True with *response filled if it finished without
+// suspending; otherwise false, and deliver is called with the response on
+// the thread that finishes it.
+bool start_request(Task<std::string> task, std::string* response, std::function<void(std::string&&)> deliver) {
+    std::shared_ptr<RequestCompletion> completion = std::make_shared<RequestCompletion>();
+    completion->settled = false;
+    completion->deliver = std::move(deliver);
+    run_request(std::move(task), completion);
+    if (completion->settled.exchange(true)) {
+        response->swap(completion->response);
+        return true;
+    }
+    return false;
+}
+
+// Run a handler on the blocking I/O paths (connection threads, HTTP/2): the
+// thread waits while a suspended handler finishes elsewhere
+std::string run_request_blocking(Task<std::string> task) {
+    struct {
+        pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+        pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+        bool done = false;
+        std::string response;
+    } result;
+    if (start_request(std::move(task), &result.response,
+                      [&result](std::string&& response) {
+                          pthread_mutex_lock(&result.mutex);
+                          result.response.swap(response);
+                          result.done = true;
+                          pthread_cond_signal(&result.done_cond);
+                          pthread_mutex_unlock(&result.mutex);
+                      })) {
+        return result.response;
+    }
+    pthread_mutex_lock(&result.mutex);
+    while (!result.done) {
+        pthread_cond_wait(&result.done_cond, &result.mutex);
+    }
+    pthread_mutex_unlock(&result.mutex);
+    return result.response;
+}
+
+std::string route_request_blocking(const HttpRequest& request, ThreadContext* ctx, int connection_id) {
+    return run_request_blocking(route_request(request, ctx, connection_id));
+}
+
+const char UPGRADE_IN_PROGRESS_RESPONSE[] =
+    "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Type: text/plain\r\n"
+    "Content-Length: 19\r\n\r\nUpgrade in progress";
+
+// Route HTTP requests based on server type. Backend requests and heavy web
+// handlers move to their CPU pool lane first; handlers that wait on the
+// network are coroutines themselves.
+Task<std::string> route_request(const HttpRequest& request, ThreadContext* ctx, int connection_id) {
+    const char* server_type_str = (request.server_type == BACKEND_SERVER) ? "BACKEND" : "WEB";
+    ctx->io.requests.fetch_add(1, std::memory_order_relaxed);
+    
+    printf("[%s] connection %d processing %s %s\n", 
+           server_type_str, connection_id, request.method.c_str(), request.path.c_str());
+    if (ctx->cpu_pool && request.server_type == BACKEND_SERVER) {
+        co_await ResumeOnPool{ctx->cpu_pool, LANE_BACKEND, 0};
+    } else if (ctx->cpu_pool && is_cpu_heavy_request(request)) {
+        if (!co_await ResumeOnPool{ctx->cpu_pool, LANE_WEB, ctx->cpu_pool->web_budget_ms}) {
+            printf("[WEB] connection %d: shed %s, over its %d ms queue budget\n", connection_id,
+                   request.path.c_str(), ctx->cpu_pool->web_budget_ms);
+            co_return "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Type: text/plain\r\n"
+                      "Content-Length: 11\r\n\r\nServer busy";
+        }
+    }
+
+    // State changes are refused while an upgrade hands the state over
+    if (request.server_type == BACKEND_SERVER) {
+        // Backend API endpoints - only allow specific operations
+        if (request.path == "/update_system" && request.method == "POST") {
+            if (!begin_write(ctx)) co_return UPGRADE_IN_PROGRESS_RESPONSE;
+            std::string response = handle_update_system_request(ctx, request.body);
+            end_write(ctx);
+            co_return response;
+        } else if (request.path == "/update_var" && request.method == "POST") {
+            if (!begin_write(ctx)) co_return UPGRADE_IN_PROGRESS_RESPONSE;
+            std::string response = handle_update_var_request(ctx, request.body);
+            end_write(ctx);
+            co_return response;
+        } else if (request.path == "/update_vars" && request.method == "POST") {
+            if (!begin_write(ctx)) co_return UPGRADE_IN_PROGRESS_RESPONSE;
+            std::string response = handle_update_vars_request(ctx, request.body);
+            end_write(ctx);
+            co_return response;
+        } else if (request.path == "/vars" && request.method == "GET") {
+            co_return handle_vars_request(ctx);
+        } else {
+            printf("[BACKEND] connection %d: 404 Not Found for %s %s\n", 
+                   connection_id, request.method.c_str(), request.path.c_str());
+            co_return "HTTP/1.1 404 Not Found\r\n\r\nBackend API endpoint not found";
+        }
+    } else {
+        // Web interface endpoints
+        if (request.path == "/") {
+            co_return handle_root_request(ctx);
+        } else if (request.path == "/check_status") {
+            co_return handle_check_status_request(ctx);
+        } else if (request.path == "/device_status_json" && !get_query_param(request.query, "since").empty()) {
+            co_return handle_device_changes_request(ctx, request.query);
+        } else if (request.path == "/device_status_json" && !request.query.empty()) {
+            co_return handle_device_query_request(ctx, request.query);
+        } else if (request.path == "/device_history") {
+            co_return handle_device_history_request(ctx, request.query);
+        } else if (request.path == "/device_fault_minutes") {
+            co_return handle_device_fault_minutes_request(ctx, request.query);
+        } else if (request.path == "/shard_status") {
+            co_return handle_shard_status_request(ctx);
+        } else if (request.path == "/replication_status") {
+            co_return handle_replication_status_request(ctx);
+        } else if (request.path == "/io_stats") {
+            co_return handle_io_stats_request(ctx);
+        } else if (request.path == "/vars") {
+            co_return handle_vars_request(ctx);
+        } else if (ctx->read_only && request.method == "POST") {
+            co_return "HTTP/1.1 503 Service Unavailable\r\nContent-Type: text/plain\r\nContent-Length: 17\r\n\r\nRead-only replica";
+        } else if (request.path == "/update_system_web" && request.method == "POST") {
+            if (!begin_write(ctx)) co_return UPGRADE_IN_PROGRESS_RESPONSE;
+            std::string response = co_await handle_update_system_web_request(ctx, request.body);
+            end_write(ctx);
+            co_return response;
+        } else if (request.path == "/update_device_web" && request.method == "POST") {
+            if (!begin_write(ctx)) co_return UPGRADE_IN_PROGRESS_RESPONSE;
+            std::string response = co_await handle_update_device_web_request(ctx, request.body);
+            end_write(ctx);
+            co_return response;
+        } else {
+            printf("[WEB] connection %d: 404 Not Found for %s %s\n", 
+                   connection_id, request.method.c_str(), request.path.c_str());
+            co_return "HTTP/1.1 404 Not Found\r\n\r\nWeb endpoint not found";
+        }
+    }
+}
+
+const char RATE_LIMITED_RESPONSE[] =
+    "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Type: text/plain\r\n"
+    "Content-Length: 17\r\n\r\nToo many requests";
+
+RateLimiter* create_rate_limiter(double rate, int burst) {
+    RateLimiter* limiter = new RateLimiter();
+    limiter->rate = rate;
+    limiter->burst_milli = std::min<long long>((long long)burst * 1000, RATE_TOKEN_MASK);
+    limiter->refill_ms = (long long)(limiter->burst_milli / rate) + 1;
+    limiter->epoch_ms = monotonic_ms();
+    limiter->buckets = new RateBucket[RATE_SHARDS * RATE_SHARD_SLOTS]();
+    return limiter;
+}
+
+// Refill the bucket for the time since its last update and take a token
+bool rate_bucket_take(RateLimiter* limiter, RateBucket* bucket, unsigned long long now, int* retry_ms) {
+    unsigned long long state = bucket->state.load();
+    while (true) {
+        unsigned long long updated = state >> 24;
+        long long tokens = (long long)(state & RATE_TOKEN_MASK);
+        if (state == 0) {
+            tokens = limiter->burst_milli;
+            updated = now;
+        } else if (now > updated) {
+            // Time too short to earn a whole milli-token is left to accrue
+            long long earned = (long long)((now - updated) * limiter->rate);
+            if (earned > 0) {
+                tokens = std::min(limiter->burst_milli, tokens + earned);
+                updated = now;
+            }
+        }
+        bool allowed = tokens >= 1000;
+        if (allowed) tokens -= 1000;
+        unsigned long long next = updated << 24 | (unsigned long long)tokens;
+        if (next == 0) next = 1 << 24;     // Keep "empty at time 0" distinct from "full"
+        if (bucket->state.compare_exchange_weak(state, next)) {
+            if (!allowed) {
+                *retry_ms = (int)std::min(1000LL, (long long)((1000 - tokens) / limiter->rate) + 1);
+            }
+            return allowed;
+        }
+    }
+}
+
+// True if the client at `address` may make a request now; otherwise
+// *retry_ms is how long until its bucket holds a token again
+bool rate_limit_allow(RateLimiter* limiter, unsigned address, int* retry_ms) {
+    unsigned long long now = monotonic_ms() - limiter->epoch_ms;
+    unsigned long long hash = address * 0x9E3779B97F4A7C15ull;
+    RateBucket* shard = limiter->buckets + (hash >> 58) * RATE_SHARD_SLOTS;
+    unsigned start = (unsigned)(hash >> 32);
+    RateBucket* idle = nullptr;
+    bool allowed = true;
+    for (int i = 0; i < RATE_PROBE_LIMIT; i++) {
+        RateBucket* bucket = &shard[(start + i) & (RATE_SHARD_SLOTS - 1)];
+        unsigned owner = bucket->address.load();
+        if (owner == 0) {
+            if (bucket->address.compare_exchange_strong(owner, address) || owner == address) {
+                allowed = rate_bucket_take(limiter, bucket, now, retry_ms);
+                break;
+            }
+        }
+        if (owner == address) {
+            allowed = rate_bucket_take(limiter, bucket, now, retry_ms);
+            break;
+        }
+        unsigned long long state = bucket->state.load();
+        if (!idle && (state >> 24) + limiter->refill_ms <= now) {
+            idle = bucket;
+        }
+        if (i == RATE_PROBE_LIMIT - 1) {
+            // Not present: take over a bucket that has refilled, resetting it to full
+            unsigned previous = idle ? idle->address.load() : 0;
+            if (idle && previous != 0 && idle->address.compare_exchange_strong(previous, address)) {
+                idle->state.store(0);
+                limiter->reused.fetch_add(1, std::memory_order_relaxed);
+                allowed = rate_bucket_take(limiter, idle, now, retry_ms);
+            } else {
+                limiter->table_full.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+    if (!allowed) {
+        limiter->limited.fetch_add(1, std::memory_order_relaxed);
+    }
+    return allowed;
+}
+
+// The 429 for a limited request, held back until the client's next token
+// is due. A client looping on 429s is paced at its limit on its own
+// connection, instead of spinning on cheap rejections or reconnects.
+Task<std::string> rate_limited_response(ThreadContext* ctx, int retry_ms) {
+    co_await async_sleep(ctx->coro_loop, retry_ms);
+    co_return RATE_LIMITED_RESPONSE;
+}
+
+// Send a whole buffer; false once the peer is gone
+bool send_all(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+// HTTP/2 cleartext (h2c) on the web port. Prior-knowledge connections are
+// recognized by the client preface; HTTP/1.1 requests carrying
+// "Upgrade: h2c" are switched over and answered on stream 1. Every stream's
+// request goes through route_request like an HTTP/1.1 one, and responses
+// are sent as HEADERS plus DATA frames interleaved across streams as the
+// peer's flow-control windows allow.
+const char HTTP2_PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+const size_t HTTP2_PREFACE_SIZE = 24;
+const long long HTTP2_DEFAULT_WINDOW = 65535;
+const long long HTTP2_MAX_WINDOW = 0x7fffffff;
+const unsigned HTTP2_MAX_FRAME_SIZE = 16384;        // Largest frame we accept
+const unsigned HTTP2_MAX_CONCURRENT_STREAMS = 100;
+const size_t HTTP2_MAX_REQUEST_BODY = 64 * 1024 * 1024;
+const size_t HTTP2_OUTPUT_LIMIT = 256 * 1024;        // Frames queued per flush before sending
+const int HTTP2_DRAIN_CHECK_MS = 100;               // How often a waiting connection looks for a drain
+const int HTTP2_LINGER_MS = 1000;                   // Longest wait for the peer to close after GOAWAY
+const size_t HPACK_TABLE_SIZE = 4096;               // Our decoder's dynamic table limit
+
+enum Http2FrameType : unsigned char {
+    H2_DATA = 0,
+    H2_HEADERS = 1,
+    H2_PRIORITY = 2,
+    H2_RST_STREAM = 3,
+    H2_SETTINGS = 4,
+    H2_PUSH_PROMISE = 5,
+    H2_PING = 6,
+    H2_GOAWAY = 7,
+    H2_WINDOW_UPDATE = 8,
+    H2_CONTINUATION = 9
+};
+
+const unsigned char H2_FLAG_END_STREAM = 0x1;
+const unsigned char H2_FLAG_ACK = 0x1;
+const unsigned char H2_FLAG_END_HEADERS = 0x4;
+const unsigned char H2_FLAG_PADDED = 0x8;
+const unsigned char H2_FLAG_PRIORITY = 0x20;
+
+enum Http2Setting : unsigned short {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 1,
+    H2_SETTINGS_ENABLE_PUSH = 2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE = 4,
+    H2_SETTINGS_MAX_FRAME_SIZE = 5
+};
+
+enum Http2Error : unsigned int {
+    H2_NO_ERROR = 0,
+    H2_PROTOCOL_ERROR = 1,
+    H2_FLOW_CONTROL_ERROR = 3,
+    H2_STREAM_CLOSED = 5,
+    H2_FRAME_SIZE_ERROR = 6,
+    H2_REFUSED_STREAM = 7,
+    H2_COMPRESSION_ERROR = 9
+};
+
+// HPACK static table (RFC 7541 Appendix A), index 1..61
+struct HpackStaticEntry {
+    const char* name;
+    const char* value;
+};
+
+const HpackStaticEntry HPACK_STATIC_TABLE[61] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+    {":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""}, {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+    {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+    {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""},
+    {"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+    {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+    {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+    {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""}
+};
+
+// HPACK Huffman code (RFC 7541 Appendix B), symbols 0..255; EOS is
+// 0x3fffffff (30 bits) and never valid inside a string
+const unsigned int HUFFMAN_CODES[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee
+};
+const unsigned char HUFFMAN_CODE_LENGTHS[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26
+};
+const unsigned int HUFFMAN_EOS = 256;
+
+struct HuffmanNode {
+    short children[2];   // -1 if absent
+    short symbol;        // -1 for inner nodes
+};
+
+// Decoding tree built from the code table on first use
+const std::vector<HuffmanNode>& huffman_tree() {
+    static const std::vector<HuffmanNode> tree = []() {
+        std::vector<HuffmanNode> nodes(1, HuffmanNode{{-1, -1}, -1});
+        for (unsigned symbol = 0; symbol <= HUFFMAN_EOS; symbol++) {
+            unsigned code = symbol == HUFFMAN_EOS ? 0x3fffffff : HUFFMAN_CODES[symbol];
+            int length = symbol == HUFFMAN_EOS ? 30 : HUFFMAN_CODE_LENGTHS[symbol];
+            int node = 0;
+            for (int bit = length - 1; bit >= 0; bit--) {
+                int branch = (code >> bit) & 1;
+                if (nodes[node].children[branch] < 0) {
+                    nodes[node].children[branch] = nodes.size();
+                    nodes.push_back(HuffmanNode{{-1, -1}, -1});
+                }
+                node = nodes[node].children[branch];
+            }
+            nodes[node].symbol = symbol;
+        }
+        return nodes;
+    }();
+    return tree;
+}
+
+// Decode a Huffman-coded string; padding must be under a byte of 1 bits
+bool huffman_decode(const unsigned char* data, size_t length, std::string* out) {
+    const std::vector<HuffmanNode>& tree = huffman_tree();
+    int node = 0;
+    int pending_bits = 0;
+    bool pending_ones = true;
+    for (size_t i = 0; i < length; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            int branch = (data[i] >> bit) & 1;
+            node = tree[node].children[branch];
+            if (node < 0) {
+                return false;
+            }
+            pending_bits++;
+            pending_ones = pending_ones && branch;
+            if (tree[node].symbol >= 0) {
+                if (tree[node].symbol == (short)HUFFMAN_EOS) {
+                    return false;
+                }
+                *out += (char)tree[node].symbol;
+                node = 0;
+                pending_bits = 0;
+                pending_ones = true;
+            }
+        }
+    }
+    return pending_bits < 8 && pending_ones;
+}
+
+// HPACK dynamic table, newest entry first. Each entry costs its name and
+// value length plus 32 bytes against max_size.
+struct HpackDynamicTable {
+    std::deque<std::pair<std::string, std::string>> entries;
+    size_t size;
+    size_t max_size;
+};
+
+void hpack_table_evict(HpackDynamicTable* table, size_t limit) {
+    while (table->size > limit && !table->entries.empty()) {
+        table->size -= 32 + table->entries.back().first.size() + table->entries.back().second.size();
+        table->entries.pop_back();
+    }
+}
+
+void hpack_table_add(HpackDynamicTable* table, const std::string& name, const std::string& value) {
+    size_t entry_size = 32 + name.size() + value.size();
+    if (entry_size > table->max_size) {
+        hpack_table_evict(table, 0);
+        return;
+    }
+    hpack_table_evict(table, table->max_size - entry_size);
+    table->entries.emplace_front(name, value);
+    table->size += entry_size;
+}
+
+// Resolve a header index across the static and dynamic tables
+bool hpack_lookup(const HpackDynamicTable& table, unsigned long long index, std::string* name, std::string* value) {
+    if (index >= 1 && index <= 61) {
+        *name = HPACK_STATIC_TABLE[index - 1].name;
+        *value = HPACK_STATIC_TABLE[index - 1].value;
+        return true;
+    }
+    if (index > 61 && index - 62 < table.entries.size()) {
+        *name = table.entries[index - 62].first;
+        *value = table.entries[index - 62].second;
+        return true;
+    }
+    return false;
+}
+
+bool hpack_decode_integer(const unsigned char** position, const unsigned char* end, int prefix_bits,
+                          unsigned long long* value) {
+    const unsigned char* p = *position;
+    if (p >= end) {
+        return false;
+    }
+    unsigned long long mask = (1u << prefix_bits) - 1;
+    unsigned long long result = *p++ & mask;
+    if (result == mask) {
+        int shift = 0;
+        while (true) {
+            if (p >= end || shift > 28) {
+                return false;
+            }
+            unsigned char byte = *p++;
+            result += (unsigned long long)(byte & 0x7f) << shift;
+            shift += 7;
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+    }
+    *position = p;
+    *value = result;
+    return true;
+}
+
+bool hpack_decode_string(const unsigned char** position, const unsigned char* end, std::string* out) {
+    if (*position >= end) {
+        return false;
+    }
+    bool huffman = (**position & 0x80) != 0;
+    unsigned long long length;
+    if (!hpack_decode_integer(position, end, 7, &length) || length > (unsigned long long)(end - *position)) {
+        return false;
+    }
+    out->clear();
+    if (huffman) {
+        if (!huffman_decode(*position, length, out)) {
+            return false;
+        }
+    } else {
+        out->assign((const char*)*position, length);
+    }
+    *position += length;
+    return true;
+}
+
+// Decode a complete header block into name/value pairs
+bool hpack_decode_block(HpackDynamicTable* table, const std::string& block,
+                        std::vector<std::pair<std::string, std::string>>* headers) {
+    const unsigned char* p = (const unsigned char*)block.data();
+    const unsigned char* end = p + block.size();
+    std::string name, value;
+    while (p < end) {
+        unsigned char first = *p;
+        unsigned long long index;
+        if (first & 0x80) {
+            // Indexed header field
+            if (!hpack_decode_integer(&p, end, 7, &index) || !hpack_lookup(*table, index, &name, &value)) {
+                return false;
+            }
+            headers->emplace_back(name, value);
+        } else if ((first & 0xe0) == 0x20) {
+            // Dynamic table size update, bounded by what we advertised
+            if (!hpack_decode_integer(&p, end, 5, &index) || index > HPACK_TABLE_SIZE) {
+                return false;
+            }
+            table->max_size = index;
+            hpack_table_evict(table, index);
+        } else {
+            // Literal, with incremental indexing (01) or without (0000 / 0001)
+            bool indexed = (first & 0xc0) == 0x40;
+            if (!hpack_decode_integer(&p, end, indexed ? 6 : 4, &index)) {
+                return false;
+            }
+            if (index == 0) {
+                if (!hpack_decode_string(&p, end, &name)) {
+                    return false;
+                }
+            } else if (!hpack_lookup(*table, index, &name, &value)) {
+                return false;
+            }
+            if (!hpack_decode_string(&p, end, &value)) {
+                return false;
+            }
+            headers->emplace_back(name, value);
+            if (indexed) {
+                hpack_table_add(table, name, value);
+            }
+        }
+    }
+    return true;
+}
+
+void hpack_encode_integer(std::string* out, unsigned char flags, int prefix_bits, unsigned long long value) {
+    unsigned long long mask = (1u << prefix_bits) - 1;
+    if (value < mask) {
+        *out += (char)(flags | value);
+        return;
+    }
+    *out += (char)(flags | mask);
+    value -= mask;
+    while (value >= 0x80) {
+        *out += (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    *out += (char)value;
+}
+
+void hpack_encode_string(std::string* out, const std::string& value) {
+    hpack_encode_integer(out, 0x00, 7, value.size());
+    *out += value;
+}
+
+// Encode one response header. Exact matches in either table become a
+// single index byte, so our fixed headers (status, content type, cache
+// headers) cost one or two bytes after the first response; values that
+// change per response are sent without indexing so they don't churn the
+// table.
+void hpack_encode_header(HpackDynamicTable* table, std::string* out, const std::string& name,
+                         const std::string& value, bool indexable) {
+    unsigned long long name_index = 0;
+    for (unsigned i = 0; i < 61; i++) {
+        if (name == HPACK_STATIC_TABLE[i].name) {
+            if (value == HPACK_STATIC_TABLE[i].value) {
+                hpack_encode_integer(out, 0x80, 7, i + 1);
+                return;
+            }
+            if (!name_index) name_index = i + 1;
+        }
+    }
+    for (size_t i = 0; i < table->entries.size(); i++) {
+        if (table->entries[i].first == name) {
+            if (table->entries[i].second == value) {
+                hpack_encode_integer(out, 0x80, 7, 62 + i);
+                return;
+            }
+            if (!name_index) name_index = 62 + i;
+        }
+    }
+    if (indexable) {
+        hpack_encode_integer(out, 0x40, 6, name_index);
+    } else {
+        hpack_encode_integer(out, 0x00, 4, name_index);
+    }
+    if (!name_index) {
+        hpack_encode_string(out, name);
+    }
+    hpack_encode_string(out, value);
+    if (indexable) {
+        hpack_table_add(table, name, value);
+    }
+}
+
+void http2_append_frame(std::string* out, Http2FrameType type, unsigned char flags, unsigned stream_id,
+                        const char* payload, size_t length) {
+    char header[9] = {(char)(length >> 16), (char)(length >> 8), (char)length, (char)type, (char)flags,
+                      (char)((stream_id >> 24) & 0x7f), (char)(stream_id >> 16), (char)(stream_id >> 8),
+                      (char)stream_id};
+    out->append(header, sizeof(header));
+    out->append(payload, length);
+}
+
+unsigned http2_read_u32(const unsigned char* p) {
+    return ((unsigned)p[0] << 24) | ((unsigned)p[1] << 16) | ((unsigned)p[2] << 8) | p[3];
+}
+
+void http2_append_u32(std::string* out, unsigned value) {
+    *out += (char)(value >> 24);
+    *out += (char)(value >> 16);
+    *out += (char)(value >> 8);
+    *out += (char)value;
+}
+
+struct Http2Stream {
+    std::string header_block;        // HEADERS + CONTINUATION fragments
+    std::vector<std::pair<std::string, std::string>> request_headers;
+    std::string body;
+    bool headers_complete;
+    bool end_stream_received;
+    bool responded;                  // Response HEADERS queued
+    long long send_window;
+    std::string pending_data;        // Response body not yet sent
+    size_t pending_offset;
+    std::unique_ptr<DeviceJsonStream> body_stream;  // Rest of a streamed body, generated as DATA drains
+};
+
+struct Http2Connection {
+    ThreadContext* ctx;
+    int fd;
+    int connection_id;
+    std::string output;
+    HpackDynamicTable decoder_table;
+    HpackDynamicTable encoder_table;
+    bool encoder_size_update;        // Peer resized its table; announce it in the next block
+    size_t encoder_size_low;         // Smallest size since the last block, announced first
+    long long send_window;           // Connection-level window for our DATA
+    long long peer_initial_window;
+    unsigned peer_max_frame;
+    std::map<unsigned, Http2Stream> streams;
+    unsigned last_stream_id;
+    unsigned continuation_stream;    // Stream whose header block is still open, 0 if none
+    bool goaway;
+    unsigned long long requests;
+    unsigned client_address;         // Peer IPv4 address for rate limiting
+};
+
+void http2_send_goaway(Http2Connection* conn, Http2Error error) {
+    std::string payload;
+    http2_append_u32(&payload, conn->last_stream_id);
+    http2_append_u32(&payload, error);
+    http2_append_frame(&conn->output, H2_GOAWAY, 0, 0, payload.data(), payload.size());
+    conn->goaway = true;
+}
+
+void http2_reset_stream(Http2Connection* conn, unsigned stream_id, Http2Error error) {
+    std::string payload;
+    http2_append_u32(&payload, error);
+    http2_append_frame(&conn->output, H2_RST_STREAM, 0, stream_id, payload.data(), payload.size());
+    conn->streams.erase(stream_id);
+}
+
+// Apply a SETTINGS payload from the peer
+Http2Error http2_apply_settings(Http2Connection* conn, const unsigned char* payload, size_t length) {
+    if (length % 6 != 0) {
+        return H2_FRAME_SIZE_ERROR;
+    }
+    for (size_t offset = 0; offset < length; offset += 6) {
+        unsigned id = (payload[offset] << 8) | payload[offset + 1];
+        unsigned value = http2_read_u32(payload + offset + 2);
+        if (id == H2_SETTINGS_HEADER_TABLE_SIZE) {
+            // RFC 7541 4.2: every change is announced at the start of the
+            // next header block, the smallest first if it changed twice
+            size_t limit = std::min((size_t)value, HPACK_TABLE_SIZE);
+            if (limit != conn->encoder_table.max_size) {
+                if (!conn->encoder_size_update || limit < conn->encoder_size_low) {
+                    conn->encoder_size_low = limit;
+                }
+                conn->encoder_size_update = true;
+            }
+            conn->encoder_table.max_size = limit;
+            hpack_table_evict(&conn->encoder_table, limit);
+        } else if (id == H2_SETTINGS_INITIAL_WINDOW_SIZE) {
+            if (value > HTTP2_MAX_WINDOW) {
+                return H2_FLOW_CONTROL_ERROR;
+            }
+            // Open streams' windows move by the difference
+            long long delta = (long long)value - conn->peer_initial_window;
+            for (auto& entry : conn->streams) {
+                entry.second.send_window += delta;
+            }
+            conn->peer_initial_window = value;
+        } else if (id == H2_SETTINGS_MAX_FRAME_SIZE) {
+            if (value < 16384 || value > 16777215) {
+                return H2_PROTOCOL_ERROR;
+            }
+            conn->peer_max_frame = value;
+        } else if (id == H2_SETTINGS_ENABLE_PUSH && value > 1) {
+            return H2_PROTOCOL_ERROR;
+        }
+    }
+    return H2_NO_ERROR;
+}
+
+// Split an HTTP/1.1 response produced by the handlers into status,
+// headers and body, dropping connection-specific headers; a content-length
+// is added unless the body is streamed
+void http2_split_response(const std::string& response, std::string* status,
+                          std::vector<std::pair<std::string, std::string>>* headers, std::string* body,
+                          bool add_length = true) {
+    size_t line_end = response.find("\r\n");
+    size_t code_start = response.find(' ');
+    *status = code_start != std::string::npos && code_start < line_end ? response.substr(code_start + 1, 3) : "500";
+    size_t header_end = response.find("\r\n\r\n");
+    size_t position = line_end == std::string::npos ? response.size() : line_end + 2;
+    size_t headers_stop = header_end == std::string::npos ? response.size() : header_end + 2;
+    bool has_length = false;
+    while (position < headers_stop) {
+        size_t next = response.find("\r\n", position);
+        if (next == std::string::npos || next > headers_stop) next = headers_stop;
+        std::string line = response.substr(position, next - position);
+        position = next + 2;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) continue;
+        std::string name = to_lower(trim(line.substr(0, colon)));
+        if (name == "connection" || name == "keep-alive" || name == "transfer-encoding" || name == "upgrade" ||
+            name == "proxy-connection") {
+            continue;
+        }
+        has_length = has_length || name == "content-length";
+        headers->emplace_back(name, trim(line.substr(colon + 1)));
+    }
+    *body = header_end == std::string::npos ? "" : response.substr(header_end + 4);
+    if (!has_length && add_length) {
+        headers->emplace_back("content-length", std::to_string(body->size()));
+    }
+}
+
+// Run a complete request through the regular handlers and queue the
+// response: HEADERS (+ CONTINUATION) now, DATA as windows allow
+void http2_respond(Http2Connection* conn, unsigned stream_id, Http2Stream* stream) {
+    HttpRequest request = {};
+    request.server_type = WEB_SERVER;
+    request.version = "HTTP/2";
+    request.keep_alive = true;
+    // Pseudo-headers come first and once each; connection-specific headers,
+    // upper-case names and a Content-Length the body does not match make
+    // the request malformed (RFC 7540 8.1.2)
+    bool malformed = false;
+    bool regular_seen = false;
+    for (const auto& header : stream->request_headers) {
+        const std::string& name = header.first;
+        if (!name.empty() && name[0] == ':') {
+            std::string* field = name == ":method" ? &request.method : name == ":path" ? &request.path : nullptr;
+            bool known = field || name == ":scheme" || name == ":authority";
+            malformed = malformed || regular_seen || !known || (field && !field->empty());
+            if (field) {
+                *field = header.second;
+            }
+            continue;
+        }
+        regular_seen = true;
+        if (name == "content-length") {
+            malformed = malformed || !request.content_length_header.empty();
+            request.content_length_header = header.second;
+        } else if (name.empty() || name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+                   name == "transfer-encoding" || name == "upgrade" || (name == "te" && header.second != "trailers") ||
+                   std::any_of(name.begin(), name.end(), [](unsigned char c) { return isupper(c); })) {
+            malformed = true;
+        }
+    }
+    size_t content_length = 0;
+    if (!request.content_length_header.empty()) {
+        malformed = malformed || parse_content_length(request.content_length_header, &content_length) != 0 ||
+                    content_length != stream->body.size();
+    }
+    if (malformed || request.method.empty() || request.path.empty()) {
+        printf("[WEB] h2 connection %d stream %u: malformed request\n", conn->connection_id, stream_id);
+        http2_reset_stream(conn, stream_id, H2_PROTOCOL_ERROR);
+        return;
+    }
+    size_t query_pos = request.path.find('?');
+    if (query_pos != std::string::npos) {
+        request.query = request.path.substr(query_pos + 1);
+        request.path.resize(query_pos);
+    }
+    request.body.swap(stream->body);
+    printf("[WEB] h2 connection %d stream %u: %s %s\n", conn->connection_id, stream_id, request.method.c_str(),
+           request.path.c_str());
+
+    std::string response;
+    DeviceJsonStream* body_stream = nullptr;
+    int retry_ms;
+    if (conn->ctx->rate_limiter && !rate_limit_allow(conn->ctx->rate_limiter, conn->client_address, &retry_ms)) {
+        response = run_request_blocking(rate_limited_response(conn->ctx, retry_ms));
+    } else if ((body_stream = start_streamed_response(request, conn->ctx, conn->connection_id, false))) {
+        // Only the head for now; http2_flush_data fills the body
+        response = body_stream->buffer;
+        body_stream->buffer.clear();
+        stream->body_stream.reset(body_stream);
+    } else {
+        response = route_request_blocking(request, conn->ctx, conn->connection_id);
+        add_date_header(conn->ctx, response);
+    }
+    conn->requests++;
+
+    std::string status;
+    std::vector<std::pair<std::string, std::string>> headers;
+    http2_split_response(response, &status, &headers, &stream->pending_data, !body_stream);
+    stream->pending_offset = 0;
+
+    std::string block;
+    if (conn->encoder_size_update) {
+        if (conn->encoder_size_low < conn->encoder_table.max_size) {
+            hpack_encode_integer(&block, 0x20, 5, conn->encoder_size_low);
+        }
+        hpack_encode_integer(&block, 0x20, 5, conn->encoder_table.max_size);
+        conn->encoder_size_update = false;
+    }
+    hpack_encode_header(&conn->encoder_table, &block, ":status", status, true);
+    for (const auto& header : headers) {
+        bool indexable = header.first != "date" && header.first != "content-length";
+        hpack_encode_header(&conn->encoder_table, &block, header.first, header.second, indexable);
+    }
+
+    bool end_stream = stream->pending_data.empty() && !stream->body_stream;
+    size_t offset = 0;
+    bool first = true;
+    do {
+        size_t chunk = std::min(block.size() - offset, (size_t)conn->peer_max_frame);
+        bool last = offset + chunk == block.size();
+        unsigned char flags = (last ? H2_FLAG_END_HEADERS : 0) | (first && end_stream ? H2_FLAG_END_STREAM : 0);
+        http2_append_frame(&conn->output, first ? H2_HEADERS : H2_CONTINUATION, flags, stream_id,
+                           block.data() + offset, chunk);
+        offset += chunk;
+        first = false;
+    } while (offset < block.size());
+
+    stream->responded = true;
+    if (end_stream) {
+        conn->streams.erase(stream_id);
+    }
+}
+
+// Queue DATA for every stream with a pending body, one frame per stream
+// per round so large responses don't starve small ones. Streamed bodies
+// are generated a slice at a time, and queuing stops at HTTP2_OUTPUT_LIMIT;
+// returns true if it stopped there, with more ready to go once sent.
+bool http2_flush_data(Http2Connection* conn) {
+    bool progress = true;
+    while (progress && conn->send_window > 0 && conn->output.size() < HTTP2_OUTPUT_LIMIT) {
+        progress = false;
+        for (auto it = conn->streams.begin(); it != conn->streams.end();) {
+            Http2Stream& stream = it->second;
+            if (stream.responded && stream.body_stream && stream.pending_offset == stream.pending_data.size()) {
+                DeviceJsonStream* body_stream = stream.body_stream.get();
+                device_json_stream_fill(body_stream);
+                stream.pending_data.swap(body_stream->buffer);
+                stream.pending_offset = 0;
+                body_stream->buffer.clear();
+                if (body_stream->done) {
+                    finish_streamed_response(stream.body_stream.release());
+                }
+            }
+            size_t remaining = stream.pending_data.size() - stream.pending_offset;
+            if (!stream.responded || remaining == 0 || stream.send_window <= 0 || conn->send_window <= 0) {
+                ++it;
+                continue;
+            }
+            size_t chunk = std::min({remaining, (size_t)conn->peer_max_frame, (size_t)stream.send_window,
+                                     (size_t)conn->send_window});
+            bool last = chunk == remaining && !stream.body_stream;
+            http2_append_frame(&conn->output, H2_DATA, last ? H2_FLAG_END_STREAM : 0, it->first,
+                               stream.pending_data.data() + stream.pending_offset, chunk);
+            stream.pending_offset += chunk;
+            stream.send_window -= chunk;
+            conn->send_window -= chunk;
+            progress = true;
+            if (last) {
+                release_stream_buffer(conn->ctx, &stream.pending_data);
+                it = conn->streams.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    return conn->output.size() >= HTTP2_OUTPUT_LIMIT;
+}
+
+// Decode a finished header block; the request is answered once the
+// stream's END_STREAM has also been seen
+Http2Error http2_finish_headers(Http2Connection* conn, unsigned stream_id) {
+    conn->continuation_stream = 0;
+    auto it = conn->streams.find(stream_id);
+    Http2Stream& stream = it->second;
+    std::vector<std::pair<std::string, std::string>> headers;
+    if (!hpack_decode_block(&conn->decoder_table, stream.header_block, &headers)) {
+        return H2_COMPRESSION_ERROR;
+    }
+    stream.header_block.clear();
+    if (stream.headers_complete) {
+        // Trailers: decoded to keep the table in sync, otherwise ignored
+    } else {
+        stream.request_headers.swap(headers);
+        stream.headers_complete = true;
+    }
+    if (stream.responded) {
+        // Refused stream kept only to decode its header block
+        conn->streams.erase(it);
+    } else if (stream.end_stream_received) {
+        http2_respond(conn, stream_id, &stream);
+    }
+    return H2_NO_ERROR;
+}
+
+// Strip padding (and the priority block on HEADERS) from a frame payload
+bool http2_frame_content(unsigned char flags, bool has_priority, const unsigned char** payload, size_t* length) {
+    size_t padding = 0;
+    if (flags & H2_FLAG_PADDED) {
+        if (*length < 1) return false;
+        padding = (*payload)[0];
+        (*payload)++;
+        (*length)--;
+    }
+    if (has_priority && (flags & H2_FLAG_PRIORITY)) {
+        if (*length < 5) return false;
+        *payload += 5;
+        *length -= 5;
+    }
+    if (padding > *length) return false;
+    *length -= padding;
+    return true;
+}
+
+Http2Error http2_process_frame(Http2Connection* conn, unsigned char type, unsigned char flags, unsigned stream_id,
+                               const unsigned char* payload, size_t length) {
+    if (conn->continuation_stream && (type != H2_CONTINUATION || stream_id != conn->continuation_stream)) {
+        return H2_PROTOCOL_ERROR;
+    }
+    switch (type) {
+    case H2_SETTINGS: {
+        if (stream_id != 0) return H2_PROTOCOL_ERROR;
+        if (flags & H2_FLAG_ACK) return H2_NO_ERROR;
+        Http2Error error = http2_apply_settings(conn, payload, length);
+        if (error == H2_NO_ERROR) {
+            http2_append_frame(&conn->output, H2_SETTINGS, H2_FLAG_ACK, 0, nullptr, 0);
+        }
+        return error;
+    }
+    case H2_PING:
+        if (stream_id != 0) return H2_PROTOCOL_ERROR;
+        if (length != 8) return H2_FRAME_SIZE_ERROR;
+        if (!(flags & H2_FLAG_ACK)) {
+            http2_append_frame(&conn->output, H2_PING, H2_FLAG_ACK, 0, (const char*)payload, length);
+        }
+        return H2_NO_ERROR;
+    case H2_WINDOW_UPDATE: {
+        if (length != 4) return H2_FRAME_SIZE_ERROR;
+        unsigned increment = http2_read_u32(payload) & 0x7fffffff;
+        if (stream_id == 0) {
+            if (increment == 0) return H2_PROTOCOL_ERROR;
+            conn->send_window += increment;
+            if (conn->send_window > HTTP2_MAX_WINDOW) return H2_FLOW_CONTROL_ERROR;
+        } else {
+            auto it = conn->streams.find(stream_id);
+            if (it != conn->streams.end()) {
+                it->second.send_window += increment;
+                if (increment == 0 || it->second.send_window > HTTP2_MAX_WINDOW) {
+                    http2_reset_stream(conn, stream_id, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+                }
+            }
+        }
+        return H2_NO_ERROR;
+    }
+    case H2_HEADERS: {
+        if (stream_id == 0) return H2_PROTOCOL_ERROR;
+        if (!http2_frame_content(flags, true, &payload, &length)) return H2_PROTOCOL_ERROR;
+        auto it = conn->streams.find(stream_id);
+        if (it == conn->streams.end()) {
+            if (stream_id % 2 == 0 || stream_id <= conn->last_stream_id) return H2_PROTOCOL_ERROR;
+            conn->last_stream_id = stream_id;
+            Http2Stream& stream = conn->streams[stream_id];
+            stream.headers_complete = false;
+            stream.end_stream_received = false;
+            stream.responded = false;
+            stream.send_window = conn->peer_initial_window;
+            stream.pending_offset = 0;
+            if (conn->streams.size() > HTTP2_MAX_CONCURRENT_STREAMS) {
+                // Refuse, but the header block must still be decoded
+                std::string payload_words;
+                http2_append_u32(&payload_words, H2_REFUSED_STREAM);
+                http2_append_frame(&conn->output, H2_RST_STREAM, 0, stream_id, payload_words.data(),
+                                   payload_words.size());
+                stream.responded = true;
+            }
+            it = conn->streams.find(stream_id);
+        } else if (it->second.end_stream_received) {
+            return H2_STREAM_CLOSED;
+        }
+        it->second.header_block.append((const char*)payload, length);
+        if (flags & H2_FLAG_END_STREAM) {
+            it->second.end_stream_received = true;
+        }
+        if (flags & H2_FLAG_END_HEADERS) {
+            return http2_finish_headers(conn, stream_id);
+        }
+        conn->continuation_stream = stream_id;
+        return H2_NO_ERROR;
+    }
+    case H2_CONTINUATION: {
+        if (stream_id != conn->continuation_stream || stream_id == 0) return H2_PROTOCOL_ERROR;
+        Http2Stream& stream = conn->streams[stream_id];
+        stream.header_block.append((const char*)payload, length);
+        if (stream.header_block.size() > HTTP2_MAX_REQUEST_BODY) return H2_PROTOCOL_ERROR;
+        if (flags & H2_FLAG_END_HEADERS) {
+            return http2_finish_headers(conn, stream_id);
+        }
+        return H2_NO_ERROR;
+    }
+    case H2_DATA: {
+        if (stream_id == 0) return H2_PROTOCOL_ERROR;
+        size_t frame_length = length;
+        if (!http2_frame_content(flags, false, &payload, &length)) return H2_PROTOCOL_ERROR;
+        // Hand the consumed window straight back: bodies are small and
+        // processed only once complete
+        if (frame_length > 0) {
+            std::string increment;
+            http2_append_u32(&increment, frame_length);
+            http2_append_frame(&conn->output, H2_WINDOW_UPDATE, 0, 0, increment.data(), increment.size());
+        }
+        auto it = conn->streams.find(stream_id);
+        if (it == conn->streams.end() || it->second.end_stream_received || !it->second.headers_complete) {
+            if (stream_id > conn->last_stream_id) return H2_PROTOCOL_ERROR;
+            http2_reset_stream(conn, stream_id, H2_STREAM_CLOSED);
+            return H2_NO_ERROR;
+        }
+        Http2Stream& stream = it->second;
+        stream.body.append((const char*)payload, length);
+        if (stream.body.size() > HTTP2_MAX_REQUEST_BODY) {
+            http2_reset_stream(conn, stream_id, H2_REFUSED_STREAM);
+            return H2_NO_ERROR;
+        }
+        if (flags & H2_FLAG_END_STREAM) {
+            stream.end_stream_received = true;
+            http2_respond(conn, stream_id, &stream);
+        } else if (frame_length > 0) {
+            std::string increment;
+            http2_append_u32(&increment, frame_length);
+            http2_append_frame(&conn->output, H2_WINDOW_UPDATE, 0, stream_id, increment.data(), increment.size());
+        }
+        return H2_NO_ERROR;
+    }
+    case H2_RST_STREAM:
+        if (stream_id == 0) return H2_PROTOCOL_ERROR;
+        if (length != 4) return H2_FRAME_SIZE_ERROR;
+        conn->streams.erase(stream_id);
+        return H2_NO_ERROR;
+    case H2_GOAWAY:
+        conn->goaway = true;
+        return H2_NO_ERROR;
+    case H2_PUSH_PROMISE:
+        return H2_PROTOCOL_ERROR;  // Clients never push
+    default:
+        return H2_NO_ERROR;        // PRIORITY and unknown frame types are ignored
+    }
+}
+
+// Decode unpadded base64url, as the HTTP2-Settings header carries it;
+// false on any other character or a length no encoding produces
+bool base64url_decode(const std::string& input, std::string* output) {
+    if (input.size() % 4 == 1) {
+        return false;
+    }
+    unsigned buffer = 0;
+    int bits = 0;
+    for (char c : input) {
+        int value;
+        if (c >= 'A' && c <= 'Z') value = c - 'A';
+        else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') value = c - '0' + 52;
+        else if (c == '-') value = 62;
+        else if (c == '_') value = 63;
+        else return false;
+        buffer = (buffer << 6) | value;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            *output += (char)((buffer >> bits) & 0xff);
+        }
+    }
+    return true;
+}
+
+// The SETTINGS payload of an h2c upgrade request: there must be exactly
+// one HTTP2-Settings header and it must decode to whole settings
+// (RFC 7540 3.2.1)
+bool http2_upgrade_settings(const HttpRequest& request, std::string* settings) {
+    return request.http2_settings_count == 1 && base64url_decode(request.http2_settings_header, settings) &&
+           settings->size() % 6 == 0;
+}
+
+// Wait for the peer's next bytes a slice at a time, so a drain for an
+// upgrade is noticed in between; false on the idle timeout or once draining
+bool http2_wait_readable(ThreadContext* ctx, int fd) {
+    pollfd ready = {fd, POLLIN, 0};
+    for (int waited = 0; waited < ctx->client_timeout_seconds * 1000; waited += HTTP2_DRAIN_CHECK_MS) {
+        if (ctx->upgrade_state.load() == UPGRADE_DRAINING) {
+            return false;
+        }
+        if (poll(&ready, 1, HTTP2_DRAIN_CHECK_MS) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Serve an HTTP/2 connection until the peer leaves, goes idle or errs.
+// `input` holds bytes already read (starting with the preface for prior
+// knowledge); `upgraded` is the HTTP/1.1 request of an h2c upgrade, which
+// becomes stream 1.
+void serve_http2(ThreadContext* ctx, ClientSocket client, int connection_id, std::string input,
+                 const HttpRequest* upgraded) {
+    int fd = client.fd;
+    Http2Connection conn;
+    conn.ctx = ctx;
+    conn.fd = fd;
+    conn.connection_id = connection_id;
+    conn.decoder_table.size = 0;
+    conn.decoder_table.max_size = HPACK_TABLE_SIZE;
+    conn.encoder_table.size = 0;
+    conn.encoder_table.max_size = HPACK_TABLE_SIZE;
+    conn.encoder_size_update = false;
+    conn.encoder_size_low = HPACK_TABLE_SIZE;
+    conn.send_window = HTTP2_DEFAULT_WINDOW;
+    conn.peer_initial_window = HTTP2_DEFAULT_WINDOW;
+    conn.peer_max_frame = 16384;
+    conn.last_stream_id = 0;
+    conn.continuation_stream = 0;
+    conn.goaway = false;
+    conn.requests = 0;
+    conn.client_address = 0;
+    if (ctx->rate_limiter) {
+        sockaddr_in peer = {};
+        socklen_t peer_length = sizeof(peer);
+        if (getpeername(fd, (sockaddr*)&peer, &peer_length) == 0) {
+            conn.client_address = peer.sin_addr.s_addr;
+        }
+    }
+    printf("[WEB] Connection %d: HTTP/2 (%s)\n", connection_id, upgraded ? "upgrade" : "prior knowledge");
+
+    // Our SETTINGS go first
+    std::string settings;
+    settings += (char)0;
+    settings += (char)H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    http2_append_u32(&settings, HTTP2_MAX_CONCURRENT_STREAMS);
+    settings += (char)0;
+    settings += (char)H2_SETTINGS_ENABLE_PUSH;
+    http2_append_u32(&settings, 0);
+    http2_append_frame(&conn.output, H2_SETTINGS, 0, 0, settings.data(), settings.size());
+
+    Http2Error error = H2_NO_ERROR;
+    if (upgraded) {
+        std::string peer_settings;
+        http2_upgrade_settings(*upgraded, &peer_settings);    // Checked before the 101
+        error = http2_apply_settings(&conn, (const unsigned char*)peer_settings.data(), peer_settings.size());
+        Http2Stream& stream = conn.streams[1];
+        stream.headers_complete = true;
+        stream.end_stream_received = true;
+        stream.responded = false;
+        stream.send_window = conn.peer_initial_window;
+        stream.pending_offset = 0;
+        stream.request_headers.emplace_back(":method", upgraded->method);
+        stream.request_headers.emplace_back(":path", upgraded->query.empty() ? upgraded->path
+                                                                              : upgraded->path + "?" + upgraded->query);
+        if (!upgraded->content_length_header.empty()) {
+            stream.request_headers.emplace_back("content-length", upgraded->content_length_header);
+        }
+        stream.body = upgraded->body;
+        conn.last_stream_id = 1;
+        if (error == H2_NO_ERROR) {
+            http2_respond(&conn, 1, &stream);
+        }
+    }
+
+    bool preface_seen = false;
+    size_t consumed = 0;
+    while (error == H2_NO_ERROR) {
+        // Parse every complete frame that is buffered
+        if (!preface_seen && input.size() >= HTTP2_PREFACE_SIZE) {
+            if (input.compare(0, HTTP2_PREFACE_SIZE, HTTP2_PREFACE) != 0) {
+                error = H2_PROTOCOL_ERROR;
+                break;
+            }
+            preface_seen = true;
+            consumed = HTTP2_PREFACE_SIZE;
+        }
+        while (preface_seen && error == H2_NO_ERROR && input.size() - consumed >= 9) {
+            const unsigned char* header = (const unsigned char*)input.data() + consumed;
+            size_t length = (header[0] << 16) | (header[1] << 8) | header[2];
+            if (length > HTTP2_MAX_FRAME_SIZE) {
+                error = H2_FRAME_SIZE_ERROR;
+                break;
+            }
+            if (input.size() - consumed < 9 + length) {
+                break;
+            }
+            unsigned stream_id = http2_read_u32(header + 5) & 0x7fffffff;
+            error = http2_process_frame(&conn, header[3], header[4], stream_id, header + 9, length);
+            consumed += 9 + length;
+        }
+        input.erase(0, consumed);
+        consumed = 0;
+        if (error != H2_NO_ERROR) {
+            break;
+        }
+
+        // Draining for an upgrade: no new streams, finish the open ones and
+        // close, as HTTP/1.1 connections close after their response
+        if (!conn.goaway && ctx->upgrade_state.load() == UPGRADE_DRAINING) {
+            printf("[WEB] Connection %d: HTTP/2 closing (upgrading)\n", connection_id);
+            http2_send_goaway(&conn, H2_NO_ERROR);
+        }
+
+        bool more = http2_flush_data(&conn);
+        if (!conn.output.empty()) {
+            if (!client_send_all(client, conn.output)) {
+                break;
+            }
+            conn.output.clear();
+        }
+        if (conn.goaway && conn.streams.empty()) {
+            break;
+        }
+        if (more) {
+            continue;    // Windows still open: keep going before waiting on the peer
+        }
+
+        bool idle = false;
+        if (!conn.goaway && !client_has_buffered_input(client) && !http2_wait_readable(ctx, fd)) {
+            if (ctx->upgrade_state.load() == UPGRADE_DRAINING) {
+                continue;    // Goodbye at the top of the loop
+            }
+            idle = true;
+        }
+        char buffer[16384];
+        ssize_t bytes = idle ? -1 : client_recv(client, buffer, sizeof(buffer));
+        if (bytes <= 0) {
+            if (bytes < 0 && !idle && errno == EINTR) continue;
+            if (idle || (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
+                // Idle like an HTTP/1.1 keep-alive connection: say goodbye
+                printf("[WEB] Connection %d: HTTP/2 idle timeout\n", connection_id);
+                http2_send_goaway(&conn, H2_NO_ERROR);
+                client_send_all(client, conn.output);
+            }
+            break;
+        }
+        input.append(buffer, bytes);
+    }
+
+    if (error != H2_NO_ERROR) {
+        printf("[WEB] Connection %d: HTTP/2 error %u, closing\n", connection_id, error);
+        conn.output.clear();
+        http2_send_goaway(&conn, error);
+        client_send_all(client, conn.output);
+    }
+    // The peer may still be sending (WINDOW_UPDATEs for the last response):
+    // closing with unread bytes resets the connection and can lose the end
+    // of what was sent, so stop writing and read until it closes too
+    if (conn.goaway && !client.tls) {
+        shutdown(fd, SHUT_WR);
+        pollfd ready = {fd, POLLIN, 0};
+        char discard[4096];
+        while (poll(&ready, 1, HTTP2_LINGER_MS) > 0 && recv(fd, discard, sizeof(discard), 0) > 0) {
+        }
+    }
+    printf("[WEB] Connection %d: HTTP/2 closed after %llu requests\n", connection_id, conn.requests);
+}
+
+// TLS termination (--tls-cert/--tls-key). The handshake runs on the
+// connection's thread. Returning clients resume their session, from a
+// ticket or the session cache, without the certificate exchange and key
+// agreement; the ticket keys go along on a hot upgrade so tickets stay
+// valid. With SSL_OP_ENABLE_KTLS, OpenSSL hands the record layer to the
+// kernel after the handshake where the kernel and cipher allow it.
+const char TLS_WEB_ALPN[] = "\x02h2\x08http/1.1";    // ALPN wire format, in order of preference
+const char TLS_BACKEND_ALPN[] = "\x08http/1.1";
+const long TLS_SESSION_CACHE_SIZE = 20000;
+const size_t TLS_TICKET_KEYS_SIZE = 80;             // Key name, HMAC secret and AES key
+
+#ifdef WITH_TLS
+// Pick the protocol from the listener's list (the connection's app data)
+int tls_select_alpn(SSL* tls, const unsigned char** out, unsigned char* out_length, const unsigned char* in,
+                    unsigned in_length, void*) {
+    const char* offered = static_cast<const char*>(SSL_get_app_data(tls));
+    unsigned char* selected;
+    if (SSL_select_next_proto(&selected, out_length, (const unsigned char*)offered, strlen(offered), in,
+                              in_length) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+#endif
+
+// Server context for the certificate chain and key (PEM); null if they
+// cannot be loaded or this build has no TLS
+ssl_ctx_st* create_tls_context(const char* certificate, const char* key) {
+#ifdef WITH_TLS
+    SSL_CTX* tls = SSL_CTX_new(TLS_server_method());
+    if (!tls || SSL_CTX_use_certificate_chain_file(tls, certificate) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(tls) != 1) {
+        ERR_print_errors_fp(stdout);
+        SSL_CTX_free(tls);
+        return nullptr;
+    }
+    static const unsigned char session_context[] = "lightweight_web_server";
+    SSL_CTX_set_min_proto_version(tls, TLS1_2_VERSION);
+    SSL_CTX_set_options(tls, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION);
+    SSL_CTX_set_mode(tls, SSL_MODE_RELEASE_BUFFERS);    // Idle connections keep no record buffers
+    SSL_CTX_set_session_id_context(tls, session_context, sizeof(session_context) - 1);
+    SSL_CTX_set_session_cache_mode(tls, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(tls, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_num_tickets(tls, 1);
+    SSL_CTX_set_alpn_select_cb(tls, tls_select_alpn, nullptr);
+    return tls;
+#else
+    printf("TLS needs a build with -DWITH_TLS -lssl -lcrypto (certificate %s, key %s)\n", certificate, key);
+    return nullptr;
+#endif
+}
+
+// Handshake on a newly accepted connection; null, with the failure
+// counted, if the client left, timed out or spoke something else
+ssl_st* tls_accept(ThreadContext* ctx, [[maybe_unused]] int client_fd, int connection_id,
+                   ServerType server_type) {
+    const char* server_type_str = (server_type == BACKEND_SERVER) ? "BACKEND" : "WEB";
+#ifdef WITH_TLS
+    SSL* tls = SSL_new(ctx->tls);
+    if (tls && SSL_set_fd(tls, client_fd) == 1) {
+        SSL_set_app_data(tls, const_cast<char*>(server_type == WEB_SERVER ? TLS_WEB_ALPN : TLS_BACKEND_ALPN));
+        if (SSL_accept(tls) == 1) {
+            bool resumed = SSL_session_reused(tls);
+            bool ktls_send = BIO_get_ktls_send(SSL_get_wbio(tls));
+            bool ktls_receive = BIO_get_ktls_recv(SSL_get_rbio(tls));
+            ctx->io.tls_handshakes.fetch_add(1, std::memory_order_relaxed);
+            ctx->io.tls_resumed.fetch_add(resumed, std::memory_order_relaxed);
+            ctx->io.ktls_send.fetch_add(ktls_send, std::memory_order_relaxed);
+            ctx->io.ktls_receive.fetch_add(ktls_receive, std::memory_order_relaxed);
+            printf("[%s] Connection %d: %s %s, %s%s%s\n", server_type_str, connection_id, SSL_get_version(tls),
+                   SSL_get_cipher_name(tls), resumed ? "resumed" : "full handshake", ktls_send ? ", kTLS send" : "",
+                   ktls_receive ? ", kTLS receive" : "");
+            return tls;
+        }
+    }
+    char reason[256] = "";
+    ERR_error_string_n(ERR_get_error(), reason, sizeof(reason));
+    ERR_clear_error();
+    SSL_free(tls);
+    printf("[%s] Connection %d: TLS handshake failed %s\n", server_type_str, connection_id, reason);
+#else
+    printf("[%s] Connection %d: TLS handshake failed (no TLS in this build)\n", server_type_str, connection_id);
+#endif
+    ctx->io.tls_failures.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+}
+
+// Send close_notify (without waiting for the peer's) and free the session
+void tls_close([[maybe_unused]] ssl_st* tls) {
+#ifdef WITH_TLS
+    SSL_shutdown(tls);
+    ERR_clear_error();
+    SSL_free(tls);
+#endif
+}
+
+// Session ticket keys as hex, empty without TLS
+std::string tls_ticket_keys([[maybe_unused]] ThreadContext* ctx) {
+    std::string hex;
+#ifdef WITH_TLS
+    unsigned char keys[TLS_TICKET_KEYS_SIZE];
+    if (ctx->tls && SSL_CTX_get_tlsext_ticket_keys(ctx->tls, keys, sizeof(keys)) == 1) {
+        char digits[3];
+        for (unsigned char byte : keys) {
+            snprintf(digits, sizeof(digits), "%02x", byte);
+            hex += digits;
+        }
+    }
+#endif
+    return hex;
+}
+
+// Adopt the ticket keys of the process this one takes over from
+void tls_set_ticket_keys([[maybe_unused]] ThreadContext* ctx, [[maybe_unused]] const std::string& hex) {
+#ifdef WITH_TLS
+    unsigned char keys[TLS_TICKET_KEYS_SIZE];
+    if (!ctx->tls || hex.size() != 2 * sizeof(keys)) return;
+    for (size_t i = 0; i < sizeof(keys); i++) {
+        keys[i] = (unsigned char)strtoul(hex.substr(2 * i, 2).c_str(), nullptr, 16);
+    }
+    SSL_CTX_set_tlsext_ticket_keys(ctx->tls, keys, sizeof(keys));
+#endif
+}
+
+void* handle_client(void* arg);
+
+// Give a connection a handle_client thread (detached, with the bounded
+// --connection-stack); false if none could be created
+bool start_connection_thread(ClientThreadArgs* args) {
+    pthread_t thread;
+    args->ctx->io.syscalls.fetch_add(1, std::memory_order_relaxed);  // clone
+    return pthread_create(&thread, &args->ctx->connection_thread_attr, handle_client, args) == 0;
+}
+
+// Close a thread-path connection and drop it from the active count
+void close_client_connection(ThreadContext* ctx, ClientSocket client, int connection_id, ServerType server_type) {
+    if (client.tls) {
+        tls_close(client.tls);
+    }
+    pthread_mutex_lock(&ctx->conn_mutex);
+    if (server_type == BACKEND_SERVER) {
+        ctx->active_backend_connections--;
+        printf("[BACKEND] close connection %d (remaining backend connections: %d)\n",
+               connection_id, ctx->active_backend_connections);
+    } else {
+        ctx->active_web_connections--;
+        printf("[WEB] close connection %d (remaining web connections: %d)\n",
+               connection_id, ctx->active_web_connections);
+    }
+    pthread_mutex_unlock(&ctx->conn_mutex);
+
+    close(client.fd);
+    ctx->io.syscalls.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Memory-budget mode (--park-idle): a keep-alive connection left idle
+// waits for its next request on the coroutine loop instead of in a thread,
+// so it costs a coroutine frame and an epoll entry rather than a thread and
+// its stack. When it turns readable (a request, or the client leaving) it
+// gets a new handle_client thread; if it stays idle past the client
+// timeout it is closed.
+DetachedTask park_connection(ThreadContext* ctx, ClientSocket client, int connection_id, ServerType server_type,
+                             unsigned client_address) {
+    int timeout_ms = std::max(0, ctx->client_timeout_seconds * 1000 - ctx->park_idle_ms);
+    ctx->io.parked_connections.fetch_add(1, std::memory_order_relaxed);
+    bool readable = co_await wait_fd(ctx->coro_loop, client.fd, EPOLLIN, timeout_ms);
+    ctx->io.parked_connections.fetch_sub(1, std::memory_order_relaxed);
+    if (!readable) {
+        printf("[%s] Connection %d: Receive timeout\n", server_type == BACKEND_SERVER ? "BACKEND" : "WEB",
+               connection_id);
+        close_client_connection(ctx, client, connection_id, server_type);
+        co_return;
+    }
+    ClientThreadArgs* args =
+        new ClientThreadArgs{ctx, client.fd, connection_id, server_type, client_address, client.tls};
+    if (!start_connection_thread(args)) {
+        perror("pthread_create for parked connection");
+        close_client_connection(ctx, client, connection_id, server_type);
+        delete args;
+    }
+}
+
+// Handle client requests
+void* handle_client(void* arg) {
+    ClientThreadArgs* args = static_cast<ClientThreadArgs*>(arg);
+    ThreadContext* ctx = args->ctx;
     int client_fd = args->client_fd;
     int connection_id = args->connection_id;
     ServerType server_type = args->server_type;
+    unsigned client_address = args->client_address;
+    ClientSocket client = {client_fd, args->tls};
+    delete args;
+    pin_current_thread(THREAD_CONNECTION);
+
+    const char* server_type_str = (server_type == BACKEND_SERVER) ? "BACKEND" : "WEB";
+
+    // Set receive timeout (--client-timeout, 5 seconds by default)
+    struct timeval tv;
+    tv.tv_sec = ctx->client_timeout_seconds;
+    tv.tv_usec = 0;
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ctx->io.syscalls.fetch_add(1, std::memory_order_relaxed);
+
+    // A new connection to a TLS listener shakes hands first; the timeout
+    // above bounds a client that stalls in the middle
+    if (!client.tls && ctx->tls_ports[server_type]) {
+        client.tls = tls_accept(ctx, client_fd, connection_id, server_type);
+        if (!client.tls) {
+            close_client_connection(ctx, client, connection_id, server_type);
+            return nullptr;
+        }
+    }
+
+    while (true) {
+        // Idle past --park-idle: hand the socket to the coroutine loop and let this thread go
+        if (ctx->park_idle_ms >= 0 && !client_has_buffered_input(client)) {
+            pollfd ready = {client_fd, POLLIN, 0};
+            int polled = poll(&ready, 1, ctx->park_idle_ms);
+            ctx->io.syscalls.fetch_add(1, std::memory_order_relaxed);
+            if (polled == 0) {
+                park_connection(ctx, client, connection_id, server_type, client_address);
+                return nullptr;
+            }
+        }
+
+        char buffer[4096];
+        ssize_t bytes = client_recv(client, buffer, sizeof(buffer)-1);
+        ctx->io.syscalls.fetch_add(1, std::memory_order_relaxed);
+
+        if (bytes < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                printf("[%s] Connection %d: Receive timeout\n", server_type_str, connection_id);
+            } else {
+                perror("recv failed");
+            }
+            break;
+        } else if (bytes == 0) {
+            printf("[%s] Connection %d: Client disconnected\n", server_type_str, connection_id);
+            break;
+        }
+
+        buffer[bytes] = '\0';
+        printf("[%s] Request recv connection %d: (%d bytes)\n", server_type_str, connection_id, (int)bytes);
+
+        // HTTP/2 with prior knowledge starts with the client preface
+        if (server_type == WEB_SERVER && bytes >= 4 && memcmp(buffer, HTTP2_PREFACE, 4) == 0) {
+            serve_http2(ctx, client, connection_id, std::string(buffer, bytes), nullptr);
+            break;
+        }
+
+        // Parse HTTP request
+        HttpRequest request = parse_http_request(buffer, bytes, &client, server_type);
+        printf("[%s] Connection %d: %s, keep_alive=%s\n", 
+               server_type_str, connection_id, request.version.c_str(), request.keep_alive ? "true" : "false");
+        if (request.error_status) {
+            printf("[%s] Connection %d: Rejected with %d\n", server_type_str, connection_id, request.error_status);
+            client_send_all(client, build_request_error_response(request.error_status));
+            break;
+        }
+
+        // Over the client's rate: the pre-built 429 instead of the response.
+        // The request is parsed first so its body is not read as the next one.
+        int retry_ms;
+        bool limited = server_type == WEB_SERVER && ctx->rate_limiter &&
+                       !rate_limit_allow(ctx->rate_limiter, client_address, &retry_ms);
+
+        // h2c upgrade: switch protocols and answer this request on stream 1
+        if (!limited && server_type == WEB_SERVER && request.upgrade_header == "h2c" &&
+            request.connection_header.find("http2-settings") != std::string::npos) {
+            std::string settings;
+            if (!http2_upgrade_settings(request, &settings)) {
+                printf("[%s] Connection %d: Rejected h2c upgrade\n", server_type_str, connection_id);
+                client_send_all(client, build_bad_upgrade_response());
+                break;
+            }
+            client_send_all(client, "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+            serve_http2(ctx, client, connection_id, "", &request);
+            break;
+        }
+
+        // The full device list goes out a slice at a time as the socket
+        // drains; during an upgrade it is sent unchunked and the connection closed
+        bool upgrading = ctx->upgrade_state.load() != UPGRADE_NONE;
+        DeviceJsonStream* stream = limited ? nullptr
+            : start_streamed_response(request, ctx, connection_id, request.version != "HTTP/1.0" && !upgrading);
+        if (stream) {
+            bool chunked = stream->chunked;
+            bool sent;
+            do {
+                device_json_stream_fill(stream);
+                sent = client_send_all(client, stream->buffer);
+                ctx->io.syscalls.fetch_add(1, std::memory_order_relaxed);
+                stream->buffer.clear();
+            } while (sent && !stream->done);
+            finish_streamed_response(stream);
+            printf("[%s] Sent streamed response for connection %d\n", server_type_str, connection_id);
+            if (!sent || !chunked || !request.keep_alive) {
+                break;
+            }
+            continue;
+        }
+
+        // Route request and generate response
+        std::string response;
+        if (limited) {
+            response = run_request_blocking(rate_limited_response(ctx, retry_ms));
+        } else {
+            response = route_request_blocking(request, ctx, connection_id);
+            add_date_header(ctx, response);
+        }
+        upgrading = ctx->upgrade_state.load() != UPGRADE_NONE;
+        if (upgrading && request.keep_alive) {
+            add_connection_close_header(response);
+        }
+        
+        // Send response
+        client_send_all(client, response);
+        ctx->io.syscalls.fetch_add(1, std::memory_order_relaxed);
+        printf("[%s] Sent response for connection %d\n", server_type_str, connection_id);
+
+        // Break loop if not keep-alive
+        if (!request.keep_alive) {
+            printf("[%s] Closing connection %d (keep-alive: false)\n", server_type_str, connection_id);
+            break;
+        }
+        if (upgrading) {
+            printf("[%s] Closing connection %d (upgrading)\n", server_type_str, connection_id);
+            break;
+        }
+
+        printf("[%s] Keeping connection %d alive\n", server_type_str, connection_id);
+    }
+
+    close_client_connection(ctx, client, connection_id, server_type);
+    return nullptr;
+}
+
+// io_uring engine (optional, --io-engine uring). One thread drives both
+// listeners and every connection from a single ring: multishot accepts,
+// multishot recvs that pick buffers from a registered buffer ring, and
+// responses sent with MSG_WAITALL; a connection that is done gets its
+// send, shutdown and close submitted as one hard-linked chain. Requests go
+// through route_request exactly as on the thread path. HTTP/2 connections
+// are handed to a thread running serve_http2 once their recv is cancelled.
+// Defaults for --uring-entries, --uring-buffers and --uring-buffer-size
+const unsigned URING_ENTRIES = 4096;          // At most 16384: the CQ is 4x and the kernel caps it at 65536
+const unsigned URING_BUFFER_COUNT = 4096;     // Power of two, at most 32768
+const unsigned URING_BUFFER_SIZE = 4096;
+const unsigned short URING_BUFFER_GROUP = 0;
+const size_t URING_MAX_HEADER_SIZE = 64 * 1024;
+
+// Operation in the low byte of user_data, connection id above it
+enum UringOp : unsigned long long {
+    URING_ACCEPT = 1,
+    URING_RECV = 2,
+    URING_SEND = 3,
+    URING_SHUTDOWN = 4,
+    URING_CLOSE = 5,
+    URING_CANCEL = 6,
+    URING_TICK = 7,
+    URING_HANDLER = 8              // Handlers finished off the ring (eventfd read)
+};
+
+struct UringConnection {
+    int fd;
+    int connection_id;
+    ServerType server_type;
+    std::string input;             // Received, not yet parsed
+    std::string output;            // Send in flight
+    std::string queued;            // Responses waiting for the send in flight
+    DeviceJsonStream* stream;      // Streamed response still being generated, or null
+    bool handler_pending;          // A handler suspended off the ring; later requests wait
+    bool handler_close;            // Close once that response is sent
+    bool sending;
+    bool recv_armed;
+    bool closing;                  // Shutdown/close submitted or waiting on the send
+    bool close_after_send;
+    bool http2;                    // Waiting for the recv to end, then handed off
+    bool upgrade;                  // h2c upgrade of upgrade_request
+    std::unique_ptr<HttpRequest> upgrade_request;  // Only while switching to HTTP/2
+    unsigned client_address;       // Peer IPv4 address, only looked up for rate limiting
+    time_t last_active;
+};
+
+struct UringEngine {
+    ThreadContext* ctx;
+    unsigned entries;              // Submission queue size
+    unsigned buffer_count;         // Provided recv buffers, power of two
+    unsigned buffer_size;
+    int ring_fd;
+    void* sq_ring;                 // SQ and CQ rings share one mapping
+    size_t sq_ring_size;
+    io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;        // SQEs filled in, published on submit
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+    io_uring_buf* buffer_ring;     // Provided buffer ring; slot 0's resv is the tail
+    size_t buffer_ring_size;
+    char* buffers;
+    unsigned short buffer_tail;
+    int listen_fds[2];             // Indexed by ServerType, -1 if not listening
+    bool accepting;                // Accepts armed; cancelled while an upgrade takes over
+    std::unordered_map<int, UringConnection*> connections;  // By connection id
+    int connection_counter;
+    int accept_counter;
+    __kernel_timespec tick;
+    int handler_event_fd;          // Bumped when a response is posted to handler_done
+    unsigned long long handler_event_value;
+    pthread_mutex_t handler_mutex;
+    std::vector<std::pair<int, std::string>> handler_done;  // Connection id, response
+};
+
+int uring_enter(UringEngine* engine, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    engine->ctx->io.syscalls.fetch_add(1, std::memory_order_relaxed);
+    return syscall(__NR_io_uring_enter, engine->ring_fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+// Publish queued SQEs and optionally wait for completions
+int uring_submit(UringEngine* engine, unsigned wait_nr) {
+    unsigned to_submit = engine->sq_local_tail - *engine->sq_head;
+    __atomic_store_n(engine->sq_tail, engine->sq_local_tail, __ATOMIC_RELEASE);
+    if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+    int result;
+    do {
+        result = uring_enter(engine, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while (result < 0 && errno == EINTR);
+    return result;
+}
+
+// Make room for `count` SQEs so a linked chain is never split across submits
+void uring_reserve(UringEngine* engine, unsigned count) {
+    while (engine->sq_local_tail + count - __atomic_load_n(engine->sq_head, __ATOMIC_ACQUIRE) > engine->sq_entries) {
+        uring_submit(engine, 0);
+    }
+}
+
+io_uring_sqe* uring_get_sqe(UringEngine* engine) {
+    uring_reserve(engine, 1);
+    io_uring_sqe* sqe = &engine->sqes[engine->sq_local_tail & engine->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    engine->sq_local_tail++;
+    return sqe;
+}
+
+unsigned long long uring_user_data(int connection_id, UringOp op) {
+    return ((unsigned long long)connection_id << 8) | op;
+}
+
+// Hand a provided buffer back to the kernel
+void uring_recycle_buffer(UringEngine* engine, unsigned short buffer_id) {
+    io_uring_buf* buffer = &engine->buffer_ring[engine->buffer_tail & (engine->buffer_count - 1)];
+    buffer->addr = (unsigned long long)(engine->buffers + (size_t)buffer_id * engine->buffer_size);
+    buffer->len = engine->buffer_size;
+    buffer->bid = buffer_id;
+    engine->buffer_tail++;
+    __atomic_store_n(&engine->buffer_ring[0].resv, engine->buffer_tail, __ATOMIC_RELEASE);
+}
+
+void uring_prep_accept(UringEngine* engine, ServerType server_type) {
+    io_uring_sqe* sqe = uring_get_sqe(engine);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = engine->listen_fds[server_type];
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = uring_user_data(server_type, URING_ACCEPT);
+}
+
+void uring_prep_recv(UringEngine* engine, UringConnection* conn) {
+    io_uring_sqe* sqe = uring_get_sqe(engine);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = uring_user_data(conn->connection_id, URING_RECV);
+    conn->recv_armed = true;
+}
+
+// Shutdown wakes the multishot recv (which holds its own file reference)
+// and sends FIN; the close then drops the descriptor
+void uring_prep_close(UringEngine* engine, UringConnection* conn, bool linked_to_send) {
+    io_uring_sqe* sqe;
+    if (linked_to_send) {
+        sqe = &engine->sqes[(engine->sq_local_tail - 1) & engine->sq_mask];
+        sqe->flags |= IOSQE_IO_HARDLINK;
+    }
+    sqe = uring_get_sqe(engine);
+    sqe->opcode = IORING_OP_SHUTDOWN;
+    sqe->fd = conn->fd;
+    sqe->len = SHUT_RDWR;
+    sqe->flags = IOSQE_IO_HARDLINK;
+    sqe->user_data = uring_user_data(conn->connection_id, URING_SHUTDOWN);
+    sqe = uring_get_sqe(engine);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = conn->fd;
+    sqe->user_data = uring_user_data(conn->connection_id, URING_CLOSE);
+    conn->closing = true;
+}
+
+// Send the queued responses; a final response carries the close chain.
+// A streamed response gets its next slice only when the last one is out.
+void uring_start_send(UringEngine* engine, UringConnection* conn) {
+    if (!conn->sending && conn->queued.empty() && conn->stream) {
+        DeviceJsonStream* stream = conn->stream;
+        device_json_stream_fill(stream);
+        conn->queued.swap(stream->buffer);
+        if (stream->done) {
+            finish_streamed_response(stream);
+            conn->stream = nullptr;
+        }
+    }
+    if (conn->sending || conn->queued.empty()) {
+        if (!conn->sending && conn->close_after_send && !conn->closing) {
+            uring_prep_close(engine, conn, false);
+        }
+        return;
+    }
+    conn->output.swap(conn->queued);
+    conn->queued.clear();
+    bool last = conn->close_after_send && !conn->stream;
+    uring_reserve(engine, last ? 3 : 1);
+    io_uring_sqe* sqe = uring_get_sqe(engine);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (unsigned long long)conn->output.data();
+    sqe->len = conn->output.size();
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = uring_user_data(conn->connection_id, URING_SEND);
+    conn->sending = true;
+    if (last) {
+        uring_prep_close(engine, conn, true);
+    }
+}
+
+// Close once nothing is in flight; the close completion frees the connection
+void uring_close_connection(UringEngine* engine, UringConnection* conn) {
+    conn->close_after_send = true;
+    if (!conn->closing && !conn->sending) {
+        uring_prep_close(engine, conn, false);
+    }
+}
+
+struct UringHttp2Args {
+    ThreadContext* ctx;
+    int fd;
+    int connection_id;
+    std::string input;
+    bool upgrade;
+    HttpRequest request;
+};
+
+// HTTP/2 connections leave the ring and run on their own thread
+void* uring_http2_thread(void* arg) {
+    UringHttp2Args* args = static_cast<UringHttp2Args*>(arg);
+    pin_current_thread(THREAD_CONNECTION);
+    struct timeval tv;
+    tv.tv_sec = args->ctx->client_timeout_seconds;
+    tv.tv_usec = 0;
+    setsockopt(args->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (args->upgrade) {
+        send_all(args->fd, "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+        args->input.clear();
+    }
+    serve_http2(args->ctx, ClientSocket{args->fd, nullptr}, args->connection_id, args->input,
+                args->upgrade ? &args->request : nullptr);
+
+    pthread_mutex_lock(&args->ctx->conn_mutex);
+    args->ctx->active_web_connections--;
+    printf("[WEB] close connection %d (remaining web connections: %d)\n",
+           args->connection_id, args->ctx->active_web_connections);
+    pthread_mutex_unlock(&args->ctx->conn_mutex);
+    close(args->fd);
+    delete args;
+    return nullptr;
+}
+
+void uring_hand_off_http2(UringEngine* engine, UringConnection* conn) {
+    UringHttp2Args* args = new UringHttp2Args{engine->ctx, conn->fd, conn->connection_id, conn->input,
+                                              conn->upgrade, conn->upgrade ? *conn->upgrade_request : HttpRequest()};
+    engine->connections.erase(conn->connection_id);
+    delete conn;
+    pthread_t thread;
+    if (pthread_create(&thread, &engine->ctx->connection_thread_attr, uring_http2_thread, args)) {
+        perror("pthread_create for http2");
+        pthread_mutex_lock(&engine->ctx->conn_mutex);
+        engine->ctx->active_web_connections--;
+        pthread_mutex_unlock(&engine->ctx->conn_mutex);
+        close(args->fd);
+        delete args;
+    }
+}
+
+// Switch to HTTP/2: stop the multishot recv, hand off when it has ended
+void uring_begin_http2(UringEngine* engine, UringConnection* conn) {
+    conn->http2 = true;
+    io_uring_sqe* sqe = uring_get_sqe(engine);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uring_user_data(conn->connection_id, URING_RECV);
+    sqe->user_data = uring_user_data(conn->connection_id, URING_CANCEL);
+}
+
+// Hand a response finished off the ring back to the engine thread
+void uring_post_handler_response(UringEngine* engine, int connection_id, std::string&& response) {
+    pthread_mutex_lock(&engine->handler_mutex);
+    engine->handler_done.emplace_back(connection_id, std::move(response));
+    pthread_mutex_unlock(&engine->handler_mutex);
+    eventfd_write(engine->handler_event_fd, 1);
+}
+
+// Answer every complete request buffered on the connection, in order
+void uring_process_input(UringEngine* engine, UringConnection* conn) {
+    const char* server_type_str = (conn->server_type == BACKEND_SERVER) ? "BACKEND" : "WEB";
+    while (!conn->close_after_send && !conn->http2 && !conn->stream && !conn->handler_pending) {
+        if (conn->server_type == WEB_SERVER && conn->input.size() >= 4 &&
+            memcmp(conn->input.data(), HTTP2_PREFACE, 4) == 0) {
+            uring_begin_http2(engine, conn);
+            return;
+        }
+        size_t header_end = conn->input.find("\r\n\r\n");
+        if (header_end == std::string::npos) {
+            if (conn->input.size() > URING_MAX_HEADER_SIZE) {
+                uring_close_connection(engine, conn);
+            }
+            return;
+        }
+        // The body must be framed here: the parser cannot read more without
+        // blocking the ring. A length that is ambiguous, not a number or too
+        // large leaves the rest of the stream unframed, so it is answered
+        // and the connection closed before any body is buffered.
+        size_t content_length = 0;
+        int error_status = 0;
+        std::string headers = to_lower(conn->input.substr(0, header_end));
+        size_t length_pos = headers.find("\r\ncontent-length:");
+        if (length_pos != std::string::npos) {
+            size_t value_start = length_pos + 17;
+            size_t value_end = headers.find("\r\n", value_start);
+            error_status = headers.find("\r\ncontent-length:", value_start) != std::string::npos
+                               ? 400
+                               : parse_content_length(trim(headers.substr(value_start, value_end - value_start)),
+                                                      &content_length);
+        }
+        if (error_status) {
+            printf("[%s] Connection %d: Rejected with %d\n", server_type_str, conn->connection_id, error_status);
+            conn->input.clear();
+            conn->queued += build_request_error_response(error_status);
+            conn->close_after_send = true;
+            return;
+        }
+        if (conn->input.size() < header_end + 4 + content_length) {
+            return;
+        }
+
+        // Over the client's rate: the pre-built 429, before any parsing.
+        // It is held back like a suspended handler, so requests behind it wait.
+        int retry_ms;
+        if (conn->server_type == WEB_SERVER && engine->ctx->rate_limiter &&
+            !rate_limit_allow(engine->ctx->rate_limiter, conn->client_address, &retry_ms)) {
+            conn->input.erase(0, header_end + 4 + content_length);
+            int connection_id = conn->connection_id;
+            std::string response;
+            if (!start_request(rate_limited_response(engine->ctx, retry_ms), &response,
+                               [engine, connection_id](std::string&& response) {
+                                   uring_post_handler_response(engine, connection_id, std::move(response));
+                               })) {
+                conn->handler_pending = true;
+                conn->handler_close = false;
+                return;
+            }
+            if (engine->ctx->upgrade_state.load() != UPGRADE_NONE) {
+                add_connection_close_header(response);
+                conn->queued += response;
+                conn->close_after_send = true;
+                return;
+            }
+            conn->queued += response;
+            continue;
+        }
+
+        std::string raw = conn->input.substr(0, header_end + 4 + content_length);
+        conn->input.erase(0, raw.size());
+        printf("[%s] Request recv connection %d: (%d bytes)\n", server_type_str, conn->connection_id, (int)raw.size());
+        HttpRequest request = parse_http_request(raw.data(), raw.size(), nullptr, conn->server_type);
+
+        if (conn->server_type == WEB_SERVER && request.upgrade_header == "h2c" &&
+            request.connection_header.find("http2-settings") != std::string::npos) {
+            std::string settings;
+            if (!http2_upgrade_settings(request, &settings)) {
+                printf("[%s] Connection %d: Rejected h2c upgrade\n", server_type_str, conn->connection_id);
+                conn->input.clear();
+                conn->queued += build_bad_upgrade_response();
+                conn->close_after_send = true;
+                return;
+            }
+            conn->upgrade = true;
+            conn->upgrade_request.reset(new HttpRequest(request));
+            uring_begin_http2(engine, conn);
+            return;
+        }
+
+        // A streamed response holds back the requests behind it until it is
+        // out; during an upgrade it is sent unchunked and the connection closed
+        bool upgrading = engine->ctx->upgrade_state.load() != UPGRADE_NONE;
+        conn->stream = start_streamed_response(request, engine->ctx, conn->connection_id,
+                                               request.version != "HTTP/1.0" && !upgrading);
+        if (conn->stream) {
+            if (!conn->stream->chunked || !request.keep_alive) {
+                conn->close_after_send = true;
+            }
+            return;
+        }
+
+        // A handler that suspends (CPU pool, network wait) finishes off the
+        // ring; its response comes back through handler_done. The request
+        // lives in the completion until then.
+        int connection_id = conn->connection_id;
+        std::shared_ptr<HttpRequest> pending = std::make_shared<HttpRequest>(std::move(request));
+        std::string response;
+        if (!start_request(route_request(*pending, engine->ctx, connection_id), &response,
+                           [engine, connection_id, pending](std::string&& response) {
+                               add_date_header(engine->ctx, response);
+                               uring_post_handler_response(engine, connection_id, std::move(response));
+                           })) {
+            conn->handler_pending = true;
+            conn->handler_close = !pending->keep_alive;
+            return;
+        }
+        add_date_header(engine->ctx, response);
+        if (pending->keep_alive && engine->ctx->upgrade_state.load() != UPGRADE_NONE) {
+            add_connection_close_header(response);
+            conn->close_after_send = true;
+        }
+        conn->queued += response;
+        if (!pending->keep_alive) {
+            printf("[%s] Closing connection %d (keep-alive: false)\n", server_type_str, conn->connection_id);
+            conn->close_after_send = true;
+        }
+    }
+}
+
+void uring_handle_accept(UringEngine* engine, ServerType server_type, const io_uring_cqe* cqe) {
+    const char* server_type_str = (server_type == BACKEND_SERVER) ? "BACKEND" : "WEB";
+    if (!(cqe->flags & IORING_CQE_F_MORE) && engine->accepting) {
+        uring_prep_accept(engine, server_type);
+    }
+    if (cqe->res == -ECANCELED) {
+        return;
+    }
+    engine->accept_counter++;
+    if (cqe->res < 0) {
+        printf("[%s] accept failed: %s\n", server_type_str, strerror(-cqe->res));
+        return;
+    }
+    engine->connection_counter++;
+    pthread_mutex_lock(&engine->ctx->conn_mutex);
+    int& active = server_type == BACKEND_SERVER ? engine->ctx->active_backend_connections
+                                                : engine->ctx->active_web_connections;
+    int current_connections = ++active;
+    pthread_mutex_unlock(&engine->ctx->conn_mutex);
+    printf("%s accepted connection: accept %d, connection %d (active %s connections: %d)\n", server_type_str,
+           engine->accept_counter, engine->connection_counter, server_type == BACKEND_SERVER ? "backend" : "web",
+           current_connections);
+
+    // TLS connections are served on a thread, as HTTP/2 ones are
+    if (engine->ctx->tls_ports[server_type]) {
+        sockaddr_in peer = {};
+        socklen_t peer_length = sizeof(peer);
+        getpeername(cqe->res, (sockaddr*)&peer, &peer_length);
+        ClientThreadArgs* args = new ClientThreadArgs{engine->ctx, cqe->res, engine->connection_counter, server_type,
+                                                      peer.sin_addr.s_addr, nullptr};
+        if (!start_connection_thread(args)) {
+            perror("pthread_create for TLS connection");
+            close_client_connection(engine->ctx, ClientSocket{cqe->res, nullptr}, engine->connection_counter,
+                                    server_type);
+            delete args;
+        }
+        return;
+    }
+
+    UringConnection* conn = new UringConnection();
+    conn->fd = cqe->res;
+    conn->connection_id = engine->connection_counter;
+    conn->server_type = server_type;
+    conn->sending = false;
+    conn->recv_armed = false;
+    conn->closing = false;
+    conn->close_after_send = false;
+    conn->stream = nullptr;
+    conn->handler_pending = false;
+    conn->handler_close = false;
+    conn->http2 = false;
+    conn->upgrade = false;
+    conn->client_address = 0;
+    if (server_type == WEB_SERVER && engine->ctx->rate_limiter) {
+        sockaddr_in peer = {};
+        socklen_t peer_length = sizeof(peer);
+        if (getpeername(conn->fd, (sockaddr*)&peer, &peer_length) == 0) {
+            conn->client_address = peer.sin_addr.s_addr;
+        }
+    }
+    conn->last_active = time(nullptr);
+    engine->connections[conn->connection_id] = conn;
+    uring_prep_recv(engine, conn);
+}
+
+// Wait for the next handler_done wakeup
+void uring_prep_handler_read(UringEngine* engine) {
+    io_uring_sqe* sqe = uring_get_sqe(engine);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = engine->handler_event_fd;
+    sqe->addr = (unsigned long long)&engine->handler_event_value;
+    sqe->len = sizeof(engine->handler_event_value);
+    sqe->user_data = URING_HANDLER;
+}
+
+// Track the upgrade state: stop accepting while the listeners are handed
+// over (resume if the new process fails), and once it has taken over close
+// connections as soon as they are idle
+void uring_follow_upgrade(UringEngine* engine) {
+    int state = engine->ctx->upgrade_state.load();
+    bool accepting = state == UPGRADE_NONE;
+    if (accepting != engine->accepting) {
+        engine->accepting = accepting;
+        for (int type = BACKEND_SERVER; type <= WEB_SERVER; type++) {
+            if (engine->listen_fds[type] < 0) {
+                continue;
+            }
+            if (accepting) {
+                uring_prep_accept(engine, (ServerType)type);
+            } else {
+                // Connection ids start at 1, so the cancel's own completion matches none
+                io_uring_sqe* sqe = uring_get_sqe(engine);
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = uring_user_data(type, URING_ACCEPT);
+                sqe->user_data = uring_user_data(0, URING_CANCEL);
+            }
+        }
+    }
+    if (state == UPGRADE_DRAINING) {
+        for (auto& entry : engine->connections) {
+            UringConnection* conn = entry.second;
+            if (!conn->closing && !conn->sending && !conn->http2 && !conn->handler_pending && !conn->stream &&
+                conn->input.empty()) {
+                uring_close_connection(engine, conn);
+            }
+        }
+    }
+}
+
+void uring_handle_completion(UringEngine* engine, const io_uring_cqe* cqe) {
+    UringOp op = (UringOp)(cqe->user_data & 0xff);
+    int id = (int)(cqe->user_data >> 8);
+    if (op == URING_ACCEPT) {
+        uring_handle_accept(engine, (ServerType)id, cqe);
+        return;
+    }
+    if (op == URING_TICK) {
+        uring_follow_upgrade(engine);
+        // Same idle limit as SO_RCVTIMEO on the thread path
+        time_t now = time(nullptr);
+        for (auto& entry : engine->connections) {
+            UringConnection* conn = entry.second;
+            if (!conn->closing && !conn->sending && !conn->http2 && !conn->handler_pending &&
+                now - conn->last_active >= engine->ctx->client_timeout_seconds) {
+                printf("[%s] Connection %d: Receive timeout\n",
+                       conn->server_type == BACKEND_SERVER ? "BACKEND" : "WEB", conn->connection_id);
+                uring_close_connection(engine, conn);
+            }
+        }
+        io_uring_sqe* sqe = uring_get_sqe(engine);
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (unsigned long long)&engine->tick;
+        sqe->len = 1;
+        sqe->user_data = URING_TICK;
+        return;
+    }
+    if (op == URING_HANDLER) {
+        uring_prep_handler_read(engine);
+        uring_follow_upgrade(engine);
+        std::vector<std::pair<int, std::string>> done;
+        pthread_mutex_lock(&engine->handler_mutex);
+        done.swap(engine->handler_done);
+        pthread_mutex_unlock(&engine->handler_mutex);
+        for (auto& result : done) {
+            auto found = engine->connections.find(result.first);
+            if (found == engine->connections.end() || found->second->closing) {
+                continue;    // Closed while its handler ran
+            }
+            UringConnection* conn = found->second;
+            conn->handler_pending = false;
+            if (!conn->handler_close && engine->ctx->upgrade_state.load() != UPGRADE_NONE) {
+                add_connection_close_header(result.second);
+                conn->close_after_send = true;
+            }
+            conn->queued += result.second;
+            if (conn->handler_close) {
+                conn->close_after_send = true;
+            }
+            conn->last_active = time(nullptr);
+            uring_process_input(engine, conn);    // Pipelined requests held back behind it
+            uring_start_send(engine, conn);
+        }
+        return;
+    }
+
+    // Buffers are recycled even if the connection is already gone
+    std::string data;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0) {
+            data.assign(engine->buffers + (size_t)buffer_id * engine->buffer_size, cqe->res);
+        }
+        uring_recycle_buffer(engine, buffer_id);
+    }
+    auto it = engine->connections.find(id);
+    if (it == engine->connections.end()) {
+        return;
+    }
+    UringConnection* conn = it->second;
+
+    if (op == URING_RECV) {
+        bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+        if (!more) {
+            conn->recv_armed = false;
+        }
+        if (cqe->res > 0 && !conn->close_after_send) {    // Nothing more is answered once closing
+            conn->input += data;
+            conn->last_active = time(nullptr);
+            uring_process_input(engine, conn);
+            uring_start_send(engine, conn);
+        }
+        if (!more && conn->http2) {
+            if (!conn->sending) {
+                uring_hand_off_http2(engine, conn);
+            }
+        } else if (!more && cqe->res == -ENOBUFS && !conn->closing) {
+            uring_prep_recv(engine, conn);    // Buffers were exhausted for a moment
+        } else if (!more && !conn->closing) {
+            if (cqe->res == 0) {
+                printf("[%s] Connection %d: Client disconnected\n",
+                       conn->server_type == BACKEND_SERVER ? "BACKEND" : "WEB", conn->connection_id);
+            } else if (cqe->res < 0) {
+                printf("[%s] Connection %d: recv failed: %s\n",
+                       conn->server_type == BACKEND_SERVER ? "BACKEND" : "WEB", conn->connection_id,
+                       strerror(-cqe->res));
+            } else {
+                uring_prep_recv(engine, conn);
+                return;
+            }
+            uring_close_connection(engine, conn);
+        }
+    } else if (op == URING_SEND) {
+        conn->sending = false;
+        if (cqe->res < 0 || (size_t)cqe->res < conn->output.size()) {
+            if (!conn->closing) {
+                uring_close_connection(engine, conn);
+            }
+            return;
+        }
+        printf("[%s] Sent response for connection %d\n", conn->server_type == BACKEND_SERVER ? "BACKEND" : "WEB",
+               conn->connection_id);
+        conn->output.clear();
+        if (!conn->stream && conn->output.capacity() >= STREAM_CHUNK_SIZE) {
+            release_stream_buffer(engine->ctx, &conn->output);
+        }
+        if (!conn->closing && !conn->stream && !conn->input.empty()) {
+            uring_process_input(engine, conn);    // Requests held back by a streamed response
+        }
+        if (!conn->closing) {
+            uring_start_send(engine, conn);
+        }
+        if (conn->http2 && !conn->sending && !conn->recv_armed) {
+            uring_hand_off_http2(engine, conn);
+        } else if (!conn->sending && !conn->stream && !conn->handler_pending && conn->input.empty()) {
+            // Everything answered: an idle keep-alive connection holds no buffers
+            std::string().swap(conn->input);
+            std::string().swap(conn->output);
+            std::string().swap(conn->queued);
+        }
+    } else if (op == URING_CLOSE) {
+        pthread_mutex_lock(&engine->ctx->conn_mutex);
+        if (conn->server_type == BACKEND_SERVER) {
+            engine->ctx->active_backend_connections--;
+            printf("[BACKEND] close connection %d (remaining backend connections: %d)\n",
+                   conn->connection_id, engine->ctx->active_backend_connections);
+        } else {
+            engine->ctx->active_web_connections--;
+            printf("[WEB] close connection %d (remaining web connections: %d)\n",
+                   conn->connection_id, engine->ctx->active_web_connections);
+        }
+        pthread_mutex_unlock(&engine->ctx->conn_mutex);
+        if (conn->stream) {
+            finish_streamed_response(conn->stream);    // Client went away mid-stream
+        }
+        engine->connections.erase(it);
+        delete conn;
+    }
+}
+
+// Undo a partial uring_setup: unmap whatever got mapped and close the ring
+void uring_release(UringEngine* engine) {
+    if (engine->buffers != MAP_FAILED) {
+        munmap(engine->buffers, (size_t)engine->buffer_count * engine->buffer_size);
+    }
+    if (engine->buffer_ring != MAP_FAILED) {
+        munmap(engine->buffer_ring, engine->buffer_ring_size);
+    }
+    if (engine->sqes != MAP_FAILED) {
+        munmap(engine->sqes, engine->sqes_size);
+    }
+    if (engine->sq_ring != MAP_FAILED) {
+        munmap(engine->sq_ring, engine->sq_ring_size);
+    }
+    close(engine->ring_fd);
+    engine->ring_fd = -1;
+}
+
+// Set up the ring and the provided buffers; false if this kernel can't
+// run the engine (io_uring missing or disabled, or older than 6.0, which
+// added multishot recv), so the caller falls back to the thread path
+bool uring_setup(UringEngine* engine) {
+    struct utsname name;
+    int major = 0, minor = 0;
+    if (uname(&name) != 0 || sscanf(name.release, "%d.%d", &major, &minor) != 2 || major < 6) {
+        printf("[URING] kernel %s lacks multishot recv\n", name.release);
+        return false;
+    }
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = engine->entries * 4;
+    engine->ring_fd = syscall(__NR_io_uring_setup, engine->entries, &params);
+    if (engine->ring_fd < 0) {
+        perror("[URING] io_uring_setup");
+        return false;
+    }
+    engine->sq_ring = MAP_FAILED;
+    engine->sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    engine->buffer_ring = static_cast<io_uring_buf*>(MAP_FAILED);
+    engine->buffers = static_cast<char*>(MAP_FAILED);
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        printf("[URING] kernel lacks IORING_FEAT_SINGLE_MMAP\n");
+        uring_release(engine);
+        return false;
+    }
+
+    engine->sq_ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                    params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    engine->sq_ring = mmap(nullptr, engine->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           engine->ring_fd, IORING_OFF_SQ_RING);
+    engine->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    engine->sqes = static_cast<io_uring_sqe*>(mmap(nullptr, engine->sqes_size, PROT_READ | PROT_WRITE,
+                                                   MAP_SHARED | MAP_POPULATE, engine->ring_fd, IORING_OFF_SQES));
+    if (engine->sq_ring == MAP_FAILED || engine->sqes == MAP_FAILED) {
+        perror("[URING] mmap ring");
+        uring_release(engine);
+        return false;
+    }
+    char* sq = static_cast<char*>(engine->sq_ring);
+    engine->sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    engine->sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    engine->sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    engine->sq_entries = params.sq_entries;
+    engine->sq_local_tail = *engine->sq_tail;
+    unsigned* sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+    engine->cq_head = reinterpret_cast<unsigned*>(sq + params.cq_off.head);
+    engine->cq_tail = reinterpret_cast<unsigned*>(sq + params.cq_off.tail);
+    engine->cq_mask = *reinterpret_cast<unsigned*>(sq + params.cq_off.ring_mask);
+    engine->cqes = reinterpret_cast<io_uring_cqe*>(sq + params.cq_off.cqes);
+
+    // Provided buffer ring: the kernel picks a buffer per recv completion
+    // Indexed as plain io_uring_buf slots: under C++ the flexible array in
+    // io_uring_buf_ring does not start at offset 0
+    engine->buffer_ring_size = engine->buffer_count * sizeof(io_uring_buf);
+    engine->buffer_ring = static_cast<io_uring_buf*>(mmap(nullptr, engine->buffer_ring_size, PROT_READ | PROT_WRITE,
+                                                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    engine->buffers = static_cast<char*>(mmap(nullptr, (size_t)engine->buffer_count * engine->buffer_size,
+                                              PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (engine->buffer_ring == MAP_FAILED || engine->buffers == MAP_FAILED) {
+        perror("[URING] mmap buffers");
+        uring_release(engine);
+        return false;
+    }
+    io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (unsigned long long)engine->buffer_ring;
+    registration.ring_entries = engine->buffer_count;
+    registration.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, engine->ring_fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+        perror("[URING] register buffer ring");
+        uring_release(engine);
+        return false;
+    }
+    engine->buffer_tail = 0;
+    for (unsigned i = 0; i < engine->buffer_count; i++) {
+        uring_recycle_buffer(engine, i);
+    }
+    return true;
+}
+
+// Serve both listeners from the ring; only returns if the ring fails
+void run_uring_engine(UringEngine* engine) {
+    pin_current_thread(THREAD_URING);
+    engine->accepting = true;
+    for (int type = BACKEND_SERVER; type <= WEB_SERVER; type++) {
+        if (engine->listen_fds[type] >= 0) {
+            uring_prep_accept(engine, (ServerType)type);
+        }
+    }
+    engine->tick.tv_sec = 1;
+    engine->tick.tv_nsec = 0;
+    io_uring_sqe* sqe = uring_get_sqe(engine);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long long)&engine->tick;
+    sqe->len = 1;
+    sqe->user_data = URING_TICK;
+    pthread_mutex_init(&engine->handler_mutex, nullptr);
+    engine->handler_event_fd = eventfd(0, EFD_CLOEXEC);
+    if (engine->handler_event_fd < 0) {
+        perror("[URING] eventfd");
+        return;
+    }
+    engine->ctx->upgrade_wake_fd = engine->handler_event_fd;
+    uring_prep_handler_read(engine);
+
+    while (true) {
+        if (uring_submit(engine, 1) < 0 && errno != ETIME && errno != EBUSY) {
+            perror("[URING] io_uring_enter");
+            return;
+        }
+        unsigned head = *engine->cq_head;
+        unsigned tail = __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            io_uring_cqe cqe = engine->cqes[head & engine->cq_mask];
+            head++;
+            // Release the slot before handling so handlers can submit freely
+            __atomic_store_n(engine->cq_head, head, __ATOMIC_RELEASE);
+            uring_handle_completion(engine, &cqe);
+        }
+    }
+}
+
+// Web and backend listener tuning. A reconnect storm (every dashboard and
+// monitor at once after a network blip) needs a deep accept queue and
+// acceptors that drain it in batches; with --acceptors N each acceptor
+// thread gets its own SO_REUSEPORT sockets so the kernel spreads the
+// connections without a shared wakeup.
+struct ListenerOptions {
+    int backlog;                   // listen() backlog; the kernel caps it at net.core.somaxconn
+    int acceptors;                 // Thread-path accept threads
+    int defer_accept;              // TCP_DEFER_ACCEPT seconds (wake only once data arrives), 0 = off
+    int fastopen;                  // TCP_FASTOPEN queue length, 0 = off
+    int receive_buffer;            // SO_RCVBUF of accepted sockets, 0 = kernel default
+    int send_buffer;               // SO_SNDBUF of accepted sockets, 0 = kernel default
+};
+
+// Listening socket on address (network order, any by default); without
+// options it is blocking with a short backlog, as the replication
+// listener wants
+int create_server_socket(int port, const ListenerOptions* options = nullptr, in_addr_t address = INADDR_ANY) {
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (options ? SOCK_NONBLOCK : 0), 0);
+    if (server_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // Set SO_REUSEADDR
+    int opt = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (options && options->acceptors > 1) {
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+    }
+    if (options && options->defer_accept > 0) {
+        setsockopt(server_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &options->defer_accept, sizeof(options->defer_accept));
+    }
+    if (options && options->fastopen > 0 &&
+        setsockopt(server_fd, IPPROTO_TCP, TCP_FASTOPEN, &options->fastopen, sizeof(options->fastopen))) {
+        perror("TCP_FASTOPEN");
+    }
+    // Accepted sockets inherit these; set before listen() so the window
+    // scale offered in the handshake matches
+    if (options && options->receive_buffer > 0) {
+        setsockopt(server_fd, SOL_SOCKET, SO_RCVBUF, &options->receive_buffer, sizeof(options->receive_buffer));
+    }
+    if (options && options->send_buffer > 0) {
+        setsockopt(server_fd, SOL_SOCKET, SO_SNDBUF, &options->send_buffer, sizeof(options->send_buffer));
+    }
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = address;
+
+    if (bind(server_fd, (sockaddr*)&addr, sizeof(addr))) {
+        perror("bind");
+        close(server_fd);
+        return -1;
+    }
+
+    if (listen(server_fd, options ? options->backlog : 10)) {
+        perror("listen");
+        close(server_fd);
+        return -1;
+    }
+
+    return server_fd;
+}
+
+// Accept everything queued on a non-blocking listener, one handle_client
+// thread per connection. Accepted sockets stay blocking: handle_client
+// relies on blocking recv with SO_RCVTIMEO.
+void accept_connections(ThreadContext* ctx, int listen_fd, ServerType server_type) {
+    const char* server_type_str = (server_type == BACKEND_SERVER) ? "BACKEND" : "WEB";
+    int batch = 0;
+    while (true) {
+        sockaddr_in client_addr = {};
+        socklen_t client_addr_length = sizeof(client_addr);
+        int client_fd = accept4(listen_fd, (sockaddr*)&client_addr, &client_addr_length, SOCK_CLOEXEC);
+        ctx->io.syscalls.fetch_add(1, std::memory_order_relaxed);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror(server_type == BACKEND_SERVER ? "backend accept" : "web accept");
+                if (errno == EMFILE || errno == ENFILE) {
+                    usleep(10000);    // Out of descriptors: the queue stays readable, don't spin
+                }
+            }
+            break;
+        }
+        batch++;
+        unsigned long long accept_count = ctx->io.accepts.fetch_add(1, std::memory_order_relaxed) + 1;
+        int connection_id = ctx->connection_counter.fetch_add(1, std::memory_order_relaxed) + 1;
+
+        // Update connection count
+        pthread_mutex_lock(&ctx->conn_mutex);
+        int& active = server_type == BACKEND_SERVER ? ctx->active_backend_connections : ctx->active_web_connections;
+        int current_connections = ++active;
+        pthread_mutex_unlock(&ctx->conn_mutex);
+
+        printf("%s accepted connection: accept %llu, connection %d (active %s connections: %d)\n", server_type_str,
+               accept_count, connection_id, server_type == BACKEND_SERVER ? "backend" : "web", current_connections);
+
+        // Create thread arguments for the client
+        ClientThreadArgs* args = new ClientThreadArgs();
+        args->ctx = ctx;
+        args->client_fd = client_fd;
+        args->connection_id = connection_id;
+        args->server_type = server_type;
+        args->client_address = client_addr.sin_addr.s_addr;
+        args->tls = nullptr;
+
+        // Create thread to handle the client
+        if (!start_connection_thread(args)) {
+            perror(server_type == BACKEND_SERVER ? "pthread_create for backend" : "pthread_create for web");
+
+            // Roll back connection count on error
+            pthread_mutex_lock(&ctx->conn_mutex);
+            active--;
+            pthread_mutex_unlock(&ctx->conn_mutex);
+
+            close(client_fd);
+            delete args;
+        }
+    }
+    if (batch > 0) {
+        ctx->io.accept_wakeups.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+struct AcceptorArgs {
+    ThreadContext* ctx;
+    int listen_fds[2];             // Indexed by ServerType, -1 if not listening
+};
+
+// Thread-path accept loop: wait on this acceptor's listeners, then drain
+// whichever are ready. Once an upgrade starts the listeners belong to the
+// new process, so nothing more is accepted unless it fails.
+void* acceptor_thread(void* arg) {
+    AcceptorArgs* args = static_cast<AcceptorArgs*>(arg);
+    pin_current_thread(THREAD_ACCEPTOR);
+    while (true) {
+        if (args->ctx->upgrade_state.load() != UPGRADE_NONE) {
+            usleep(10000);
+            continue;
+        }
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        int max_fd = -1;
+        for (int fd : args->listen_fds) {
+            if (fd >= 0) {
+                FD_SET(fd, &read_fds);
+                max_fd = std::max(max_fd, fd);
+            }
+        }
+
+        // Wait for activity on either server socket
+        int activity = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
+        args->ctx->io.syscalls.fetch_add(1, std::memory_order_relaxed);
+        if (activity < 0) {
+            if (errno == EINTR) continue;
+            perror("select");
+            break;
+        }
+        if (args->ctx->upgrade_state.load() != UPGRADE_NONE) {
+            continue;
+        }
+        if (args->listen_fds[BACKEND_SERVER] >= 0 && FD_ISSET(args->listen_fds[BACKEND_SERVER], &read_fds)) {
+            accept_connections(args->ctx, args->listen_fds[BACKEND_SERVER], BACKEND_SERVER);
+        }
+        if (FD_ISSET(args->listen_fds[WEB_SERVER], &read_fds)) {
+            accept_connections(args->ctx, args->listen_fds[WEB_SERVER], WEB_SERVER);
+        }
+    }
+    return nullptr;
+}
+
+// Write a compacted snapshot through a temporary mmap'd file, then rename
+// it over the previous one so a crash never leaves a half-written snapshot
+bool write_snapshot_file(const std::string& path, const std::string& system_status,
+                         const std::vector<DeviceStatus>& devices, unsigned long long wal_sequence) {
+    std::string temp_path = path + ".tmp";
+    int fd = open(temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("[PERSIST] open snapshot");
+        return false;
+    }
+    size_t file_size = sizeof(SnapshotHeader) + devices.size() * sizeof(PersistedDevice);
+    if (ftruncate(fd, file_size) < 0) {
+        perror("[PERSIST] ftruncate snapshot");
+        close(fd);
+        return false;
+    }
+    void* mapping = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        perror("[PERSIST] mmap snapshot");
+        close(fd);
+        return false;
+    }
+
+    SnapshotHeader* header = static_cast<SnapshotHeader*>(mapping);
+    PersistedDevice* records = reinterpret_cast<PersistedDevice*>(header + 1);
+    for (size_t i = 0; i < devices.size(); i++) {
+        copy_fixed_field(records[i].name, sizeof(records[i].name), devices[i].name);
+        copy_fixed_field(records[i].status, sizeof(records[i].status), devices[i].status);
+    }
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->device_count = devices.size();
+    header->checksum = fnv1a(records, devices.size() * sizeof(PersistedDevice));
+    header->wal_sequence = wal_sequence;
+    copy_fixed_field(header->system_status, sizeof(header->system_status), system_status);
+
+    bool ok = msync(mapping, file_size, MS_SYNC) == 0 && fsync(fd) == 0;
+    munmap(mapping, file_size);
+    close(fd);
+    if (!ok || rename(temp_path.c_str(), path.c_str()) < 0) {
+        perror("[PERSIST] publish snapshot");
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Load a snapshot by mapping it; returns false if missing or invalid.
+// Devices go into 'shard'; the stored system status into 'system_status'
+// when given.
+bool load_snapshot(DeviceShard* shard, const std::string& path, unsigned long long* wal_sequence,
+                   std::string* system_status, const ClockReading& now) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return false;
+    }
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+
+    const SnapshotHeader* header = static_cast<const SnapshotHeader*>(mapping);
+    const PersistedDevice* records = reinterpret_cast<const PersistedDevice*>(header + 1);
+    size_t expected_size = sizeof(SnapshotHeader) + (size_t)header->device_count * sizeof(PersistedDevice);
+    bool valid = memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+                 expected_size == (size_t)st.st_size &&
+                 fnv1a(records, header->device_count * sizeof(PersistedDevice)) == header->checksum;
+    if (!valid) {
+        printf("[PERSIST] Ignoring invalid snapshot %s\n", path.c_str());
+        munmap(mapping, st.st_size);
+        return false;
+    }
+
+    if (system_status) {
+        system_status->assign(header->system_status, strnlen(header->system_status, sizeof(header->system_status)));
+    }
+    shard->device_statuses.reserve(shard->device_statuses.size() + header->device_count);
+    shard->device_histories.reserve(shard->device_histories.size() + header->device_count);
+    shard->device_index.reserve(shard->device_index.size() + header->device_count);
+    for (unsigned int i = 0; i < header->device_count; i++) {
+        std::string name(records[i].name, strnlen(records[i].name, sizeof(records[i].name)));
+        std::string status(records[i].status, strnlen(records[i].status, sizeof(records[i].status)));
+        apply_device_status_locked(shard, name, status, nullptr, now);
+    }
+    *wal_sequence = header->wal_sequence;
+    munmap(mapping, st.st_size);
+    return true;
+}
+
+// Replay WAL records newer than the snapshot, dropping a torn tail.
+// Device records go into 'shard', system status records into the context.
+// Returns the number of records applied.
+size_t replay_wal(ThreadContext* ctx, DeviceShard* shard, PersistentStore* store,
+                  unsigned long long after_sequence, const ClockReading& now) {
+    store->next_sequence = after_sequence + 1;
+    int fd = open(store->wal_path.c_str(), O_RDWR);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+
+    const WalRecord* records = static_cast<const WalRecord*>(mapping);
+    size_t record_count = st.st_size / sizeof(WalRecord);
+    size_t valid_count = 0;
+    size_t applied = 0;
+    for (; valid_count < record_count; valid_count++) {
+        WalRecord record = records[valid_count];
+        unsigned int checksum = record.checksum;
+        record.checksum = 0;
+        if (fnv1a(&record, sizeof(record)) != checksum) {
+            break;
+        }
+        if (record.sequence <= after_sequence) {
+            continue;
+        }
+        std::string key(record.key, strnlen(record.key, sizeof(record.key)));
+        std::string value(record.value, strnlen(record.value, sizeof(record.value)));
+        if (record.type == WAL_SYSTEM_STATUS) {
+            ctx->system_status = value;
+        } else if (record.type == WAL_DEVICE_STATUS) {
+            apply_device_status_locked(shard, key, value, nullptr, now);
+        }
+        store->next_sequence = record.sequence + 1;
+        applied++;
+    }
+    munmap(mapping, st.st_size);
+
+    // Cut off a partial or corrupt tail so new records follow valid ones
+    off_t valid_size = valid_count * sizeof(WalRecord);
+    if (valid_size != st.st_size) {
+        printf("[PERSIST] Truncating WAL tail: %lld -> %lld bytes\n", (long long)st.st_size, (long long)valid_size);
+        if (ftruncate(fd, valid_size) < 0) {
+            perror("[PERSIST] ftruncate WAL");
+        }
+    }
+    close(fd);
+    store->records_since_snapshot = applied;
+    return applied;
+}
+
+// Fold a WAL into a fresh snapshot and keep only the records appended while
+// the snapshot was being written. A null shard compacts the system store.
+bool compact_persistent_store(ThreadContext* ctx, DeviceShard* shard) {
+    PersistentStore* store = shard ? shard->store : ctx->store;
+    pthread_mutex_t* lock = shard ? &shard->mutex : &ctx->mutex;
+
+    pthread_mutex_lock(lock);
+    wal_flush_locked(store);
+    std::string system_status;
+    std::vector<DeviceStatus> devices;
+    if (shard) {
+        devices = shard->device_statuses; // Copy for thread safety
+    } else {
+        system_status = ctx->system_status;
+    }
+    unsigned long long wal_sequence = store->next_sequence - 1;
+    off_t wal_offset = lseek(store->wal_fd, 0, SEEK_END);
+    unsigned long long compacted_records = store->records_since_snapshot;
+    store->records_since_snapshot = 0;
+    pthread_mutex_unlock(lock);
+
+    if (!write_snapshot_file(store->snapshot_path, system_status, devices, wal_sequence)) {
+        pthread_mutex_lock(lock);
+        store->records_since_snapshot += compacted_records;
+        pthread_mutex_unlock(lock);
+        return false;
+    }
+
+    pthread_mutex_lock(lock);
+    wal_flush_locked(store);
+    off_t wal_end = lseek(store->wal_fd, 0, SEEK_END);
+    std::string tail(wal_end - wal_offset, '\0');
+    bool ok = tail.empty() || pread(store->wal_fd, &tail[0], tail.size(), wal_offset) == (ssize_t)tail.size();
+    std::string temp_path = store->wal_path + ".tmp";
+    int new_fd = ok ? open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644) : -1;
+    if (new_fd >= 0 && write(new_fd, tail.data(), tail.size()) == (ssize_t)tail.size() &&
+        fdatasync(new_fd) == 0 && rename(temp_path.c_str(), store->wal_path.c_str()) == 0) {
+        close(store->wal_fd);
+        store->wal_fd = new_fd;
+    } else {
+        // The old WAL stays valid: replay skips records the snapshot covers
+        perror("[PERSIST] rewrite WAL");
+        if (new_fd >= 0) close(new_fd);
+        unlink(temp_path.c_str());
+    }
+    pthread_mutex_unlock(lock);
+
+    printf("[PERSIST] Snapshot written: %s, %d devices, WAL sequence %llu\n",
+           store->snapshot_path.c_str(), (int)devices.size(), wal_sequence);
+    return true;
+}
+
+// Persistence thread: sync the WALs once per second and compact each one
+// periodically or once it grows large
+void* persistence_thread(void* arg) {
+    ThreadContext* ctx = static_cast<ThreadContext*>(arg);
+    pin_current_thread(THREAD_BACKGROUND);
+    const int COMPACT_INTERVAL_SECONDS = 60;
+    const unsigned long long COMPACT_RECORD_THRESHOLD = 200000;
+    int seconds_since_compaction = 0;
+
+    while (true) {
+        sleep(1);
+        seconds_since_compaction++;
+        bool interval_elapsed = seconds_since_compaction >= COMPACT_INTERVAL_SECONDS;
+
+        // Index -1 is the system store, the rest are the shards. Only this
+        // thread replaces a store's WAL descriptor, so it is used unlocked.
+        for (int i = -1; i < MAX_SHARDS; i++) {
+            DeviceShard* shard = i < 0 ? nullptr : &ctx->shards[i];
+            pthread_mutex_t* lock = shard ? &shard->mutex : &ctx->mutex;
+            pthread_mutex_lock(lock);
+            PersistentStore* store = shard ? shard->store : ctx->store;
+            unsigned long long records = store ? store->records_since_snapshot : 0;
+            int wal_fd = store ? store->wal_fd : -1;
+            pthread_mutex_unlock(lock);
+            if (!store) {
+                continue;
+            }
+
+            fdatasync(wal_fd);
+            // An upgrade waits for a compaction under way and stops new
+            // ones: the new process owns the files from then on
+            pthread_mutex_lock(&ctx->compaction_mutex);
+            if (ctx->upgrade_state.load() == UPGRADE_NONE &&
+                (records >= COMPACT_RECORD_THRESHOLD || (records > 0 && interval_elapsed))) {
+                compact_persistent_store(ctx, shard);
+            }
+            pthread_mutex_unlock(&ctx->compaction_mutex);
+        }
+        if (interval_elapsed) {
+            seconds_since_compaction = 0;
+        }
+    }
+    return nullptr;
+}
+
+// Restore one shard from its files if any exist; returns true if it had state
+bool restore_shard(ThreadContext* ctx, DeviceShard* shard, const ClockReading& now) {
+    std::string snapshot_path = shard_file_prefix(ctx, shard) + ".snap";
+    std::string wal_path = shard_file_prefix(ctx, shard) + ".wal";
+    if (access(snapshot_path.c_str(), F_OK) != 0 && access(wal_path.c_str(), F_OK) != 0) {
+        return false;
+    }
+
+    PersistentStore* store = new PersistentStore();
+    store->snapshot_path = snapshot_path;
+    store->wal_path = wal_path;
+    store->wal_fd = -1;
+    unsigned long long snapshot_sequence = 0;
+    bool restored = load_snapshot(shard, snapshot_path, &snapshot_sequence, nullptr, now);
+    size_t replayed = replay_wal(ctx, shard, store, snapshot_sequence, now);
+
+    store->wal_fd = open(wal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (store->wal_fd < 0) {
+        perror("[PERSIST] open shard WAL");
+        delete store;
+    } else {
+        shard->store = store;
+    }
+    return restored || replayed > 0;
+}
+
+// Escape a replication field: whitespace, '%' and '+' become %XX so
+// url_decode restores it and fields can be separated by spaces
+std::string replication_escape(const std::string& value) {
+    static const char hex_digits[] = "0123456789ABCDEF";
+    std::string escaped;
+    escaped.reserve(value.size());
+    for (unsigned char c : value) {
+        if (c <= ' ' || c == '%' || c == '+' || c == 0x7f) {
+            escaped += '%';
+            escaped += hex_digits[c >> 4];
+            escaped += hex_digits[c & 15];
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+// Read one '\n'-terminated line through a per-connection buffer
+bool read_line(int fd, std::string& buffer, std::string& line) {
+    while (true) {
+        size_t newline = buffer.find('\n');
+        if (newline != std::string::npos) {
+            line.assign(buffer, 0, newline);
+            buffer.erase(0, newline + 1);
+            return true;
+        }
+        char chunk[65536];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buffer.append(chunk, n);
+    }
+}
+
+// Encode a full copy of the state, consistent with *version: every change
+// up to that version is included (later ones may be too; replaying them is
+// harmless since each change sets an absolute value)
+std::string build_replication_snapshot(ThreadContext* ctx, unsigned long long* version) {
+    pthread_mutex_lock(&ctx->changes.mutex);
+    *version = ctx->changes.version;
+    unsigned long long history_id = ctx->changes.history_id;
+    pthread_mutex_unlock(&ctx->changes.mutex);
+
+    std::string snapshot = "SNAPSHOT " + std::to_string(history_id) + " " + std::to_string(*version) + "\n";
+    pthread_mutex_lock(&ctx->mutex);
+    snapshot += "S " + replication_escape(ctx->system_status) + "\n";
+    pthread_mutex_unlock(&ctx->mutex);
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        DeviceShard* shard = &ctx->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        for (const auto& device : shard->device_statuses) {
+            snapshot += "D " + std::to_string(i) + " " + replication_escape(device.name) + " " +
+                        replication_escape(device.status) + "\n";
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    snapshot += "END\n";
+    return snapshot;
+}
+
+struct ReplicationStreamArgs {
+    ThreadContext* ctx;
+    int fd;
+};
+
+// Primary side of one replica connection. The replica opens with
+// "SYNC <history> <version>"; if that version is still in the log only the
+// newer changes are sent, otherwise a snapshot first. Changes then follow
+// as "C <version> D <shard> <name> <status>" / "C <version> S <status>",
+// with "H <version>" heartbeats while idle.
+void* replication_stream_thread(void* arg) {
+    ReplicationStreamArgs* args = static_cast<ReplicationStreamArgs*>(arg);
+    ThreadContext* ctx = args->ctx;
+    int fd = args->fd;
+    delete args;
+    pin_current_thread(THREAD_BACKGROUND);
+    ChangeLog* log = &ctx->changes;
+
+    struct timeval tv;
+    tv.tv_sec = 5;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    std::string buffer, line;
+    unsigned long long replica_history = 0, replica_version = 0;
+    if (!read_line(fd, buffer, line) ||
+        sscanf(line.c_str(), "SYNC %llu %llu", &replica_history, &replica_version) != 2) {
+        printf("[REPL] Bad handshake from replica\n");
+        close(fd);
+        return nullptr;
+    }
+
+    pthread_mutex_lock(&log->mutex);
+    bool can_resume = replica_history == log->history_id && replica_version + 1 >= log->oldest &&
+                      replica_version <= log->version;
+    ctx->replicas_connected++;
+    unsigned long long history_id = log->history_id;
+    pthread_mutex_unlock(&log->mutex);
+
+    unsigned long long sent_version = replica_version;
+    bool ok;
+    if (can_resume) {
+        ok = send_all(fd, "DELTAS " + std::to_string(history_id) + " " + std::to_string(sent_version) + "\n");
+        printf("[REPL] Replica resuming from version %llu\n", sent_version);
+    } else {
+        std::string snapshot = build_replication_snapshot(ctx, &sent_version);
+        ok = send_all(fd, snapshot);
+        printf("[REPL] Replica sent snapshot at version %llu (%d bytes)\n", sent_version, (int)snapshot.size());
+    }
+
+    std::string batch;
+    while (ok) {
+        pthread_mutex_lock(&log->mutex);
+        if (log->version == sent_version) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += REPLICATION_HEARTBEAT_SECONDS;
+            pthread_cond_timedwait(&log->changed, &log->mutex, &deadline);
+        }
+        if (sent_version + 1 < log->oldest) {
+            // Fell further behind than the log holds: start over from a snapshot
+            pthread_mutex_unlock(&log->mutex);
+            std::string snapshot = build_replication_snapshot(ctx, &sent_version);
+            printf("[REPL] Replica fell behind, resending snapshot at version %llu\n", sent_version);
+            ok = send_all(fd, snapshot);
+            continue;
+        }
+        batch.clear();
+        if (log->version == sent_version) {
+            batch = "H " + std::to_string(sent_version) + "\n";
+        }
+        // Bounded batches so the log lock is never held for long
+        unsigned long long last = std::min(log->version, sent_version + 4096);
+        for (unsigned long long v = sent_version + 1; v <= last; v++) {
+            const ChangeRecord& record = log->records[v & (CHANGE_LOG_CAPACITY - 1)];
+            batch += "C " + std::to_string(v);
+            if (record.type == CHANGE_DEVICE_STATUS) {
+                batch += " D " + std::to_string(record.shard_id) + " " + replication_escape(record.key) + " " +
+                         replication_escape(record.value) + "\n";
+            } else {
+                batch += " S " + replication_escape(record.value) + "\n";
+            }
+        }
+        sent_version = last;
+        pthread_mutex_unlock(&log->mutex);
+        ok = send_all(fd, batch);
+    }
+
+    pthread_mutex_lock(&log->mutex);
+    ctx->replicas_connected--;
+    pthread_mutex_unlock(&log->mutex);
+    printf("[REPL] Replica disconnected at version %llu\n", sent_version);
+    close(fd);
+    return nullptr;
+}
+
+// Primary: accept replica connections on the replication port
+void* replication_listener_thread(void* arg) {
+    ThreadContext* ctx = static_cast<ThreadContext*>(arg);
+    pin_current_thread(THREAD_BACKGROUND);
+    while (true) {
+        int fd = accept(ctx->replication_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno != EINTR) perror("[REPL] accept");
+            continue;
+        }
+        if (ctx->upgrade_state.load() != UPGRADE_NONE) {
+            close(fd);    // The replica retries and reaches the new process
+            continue;
+        }
+        ReplicationStreamArgs* args = new ReplicationStreamArgs();
+        args->ctx = ctx;
+        args->fd = fd;
+        pthread_t thread;
+        if (pthread_create(&thread, nullptr, replication_stream_thread, args)) {
+            perror("[REPL] pthread_create");
+            close(fd);
+            delete args;
+        } else {
+            pthread_detach(thread);
+        }
+    }
+    return nullptr;
+}
+
+// Drop every device before anything is served (a replica starting, or a
+// new process taking over a snapshot)
+void clear_shards(ThreadContext* ctx) {
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        DeviceShard* shard = &ctx->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        shard->device_statuses.clear();
+        shard->device_histories.clear();
+        shard->device_index.clear();
+        shard->fault_devices = 0;
+        for (int code = 0; code < STATUS_CODE_COUNT; code++) {
+            shard->status_bitmaps[code].clear();
+            shard->status_counts[code] = 0;
+        }
+        shard->name_order.clear();
+        shard->sorted_names = 0;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+// Replica: swap a fully received snapshot in for the live devices. Every
+// shard lock is held for the switch (ascending, like the summary queries),
+// so readers see either the old state or the new one; the old devices are
+// left in `snapshot` for the caller to free outside the locks.
+void install_shard_snapshot(ThreadContext* ctx, DeviceShard* snapshot) {
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        pthread_mutex_lock(&ctx->shards[i].mutex);
+    }
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        DeviceShard* shard = &ctx->shards[i];
+        DeviceShard* incoming = &snapshot[i];
+        shard->device_statuses.swap(incoming->device_statuses);
+        shard->device_histories.swap(incoming->device_histories);
+        shard->device_index.swap(incoming->device_index);
+        std::swap(shard->fault_devices, incoming->fault_devices);
+        for (int code = 0; code < STATUS_CODE_COUNT; code++) {
+            shard->status_bitmaps[code].swap(incoming->status_bitmaps[code]);
+            std::swap(shard->status_counts[code], incoming->status_counts[code]);
+        }
+        shard->name_order.swap(incoming->name_order);
+        std::swap(shard->sorted_names, incoming->sorted_names);
+    }
+    for (int i = MAX_SHARDS - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&ctx->shards[i].mutex);
+    }
+}
+
+// Replica: apply one "D <shard> <name> <status>" field set, to the live
+// shards or, while a snapshot arrives, to the copy being built beside them.
+// The name and status are escaped, so they hold no spaces but may be of
+// any length.
+bool apply_replicated_device(ThreadContext* ctx, DeviceShard* snapshot, const char* fields,
+                             const ClockReading& now, int* shard_id, std::string* name, std::string* status) {
+    if (fields[0] != 'D' || fields[1] != ' ') {
+        return false;
+    }
+    char* shard_end;
+    long shard_number = strtol(fields + 2, &shard_end, 10);
+    if (shard_end == fields + 2 || *shard_end != ' ' || shard_number < 0 || shard_number >= MAX_SHARDS) {
+        return false;
+    }
+    const char* name_start = shard_end + 1;
+    const char* name_end = strchr(name_start, ' ');
+    if (!name_end || strchr(name_end + 1, ' ')) {
+        return false;
+    }
+    *shard_id = (int)shard_number;
+    *name = url_decode(std::string(name_start, name_end - name_start));
+    *status = url_decode(name_end + 1);
+    if (snapshot) {
+        apply_device_status_locked(&snapshot[*shard_id], *name, *status, nullptr, now);    // Not shared yet
+        return true;
+    }
+    DeviceShard* shard = &ctx->shards[*shard_id];
+    pthread_mutex_lock(&shard->mutex);
+    apply_device_status_locked(shard, *name, *status, nullptr, now);
+    pthread_mutex_unlock(&shard->mutex);
+    return true;
+}
+
+// Replica: follow the primary, reconnecting with our last version so a
+// short outage only costs the missed changes
+void* replication_client_thread(void* arg) {
+    ThreadContext* ctx = static_cast<ThreadContext*>(arg);
+    pin_current_thread(THREAD_BACKGROUND);
+    ChangeLog* log = &ctx->changes;
+    std::string host = ctx->primary_address.substr(0, ctx->primary_address.rfind(':'));
+    int port = atoi(ctx->primary_address.c_str() + ctx->primary_address.rfind(':') + 1);
+
+    while (true) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in primary_addr = {};
+        primary_addr.sin_family = AF_INET;
+        primary_addr.sin_port = htons(port);
+        inet_pton(AF_INET, host.c_str(), &primary_addr.sin_addr);
+        if (fd < 0 || connect(fd, (sockaddr*)&primary_addr, sizeof(primary_addr)) < 0) {
+            if (fd >= 0) close(fd);
+            sleep(1);
+            continue;
+        }
+        // Heartbeats arrive every second; silence means the primary is gone
+        struct timeval tv;
+        tv.tv_sec = REPLICATION_HEARTBEAT_SECONDS * 5;
+        tv.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        pthread_mutex_lock(&log->mutex);
+        std::string hello = "SYNC " + std::to_string(log->history_id) + " " + std::to_string(log->version) + "\n";
+        pthread_mutex_unlock(&log->mutex);
+        printf("[REPL] Connected to primary %s, %s", ctx->primary_address.c_str(), hello.c_str());
+
+        std::string buffer, line;
+        bool ok = send_all(fd, hello);
+        bool in_snapshot = false;
+        std::unique_ptr<DeviceShard[]> snapshot;    // Devices of the snapshot being received
+        std::string snapshot_status;
+        unsigned long long history_id = 0, version = 0;
+        while (ok && read_line(fd, buffer, line)) {
+            ClockReading now;
+            read_cached_clock(&ctx->clock, &now);
+            int shard_id;
+            std::string name, status;
+            if (line.compare(0, 2, "C ") == 0) {
+                const char* fields = strchr(line.c_str() + 2, ' ');
+                version = strtoull(line.c_str() + 2, nullptr, 10);
+                if (!fields) break;
+                fields++;
+                if (fields[0] == 'D') {
+                    if (!apply_replicated_device(ctx, nullptr, fields, now, &shard_id, &name, &status)) break;
+                    change_log_append(log, CHANGE_DEVICE_STATUS, shard_id, name, status, version);
+                } else if (fields[0] == 'S' && fields[1] == ' ') {
+                    status = url_decode(fields + 2);
+                    pthread_mutex_lock(&ctx->mutex);
+                    set_system_status_locked(ctx, status);
+                    pthread_mutex_unlock(&ctx->mutex);
+                    change_log_append(log, CHANGE_SYSTEM_STATUS, 0, "", status, version);
+                }
+            } else if (line.compare(0, 2, "H ") == 0) {
+                continue;
+            } else if (in_snapshot && line.compare(0, 2, "D ") == 0) {
+                if (!apply_replicated_device(ctx, snapshot.get(), line.c_str(), now, &shard_id, &name, &status)) {
+                    break;
+                }
+            } else if (in_snapshot && line.compare(0, 2, "S ") == 0) {
+                snapshot_status = url_decode(line.substr(2));
+            } else if (in_snapshot && line == "END") {
+                // Until here the replica kept serving its previous state
+                in_snapshot = false;
+                install_shard_snapshot(ctx, snapshot.get());
+                snapshot.reset();
+                pthread_mutex_lock(&ctx->mutex);
+                set_system_status_locked(ctx, snapshot_status);
+                pthread_mutex_unlock(&ctx->mutex);
+                change_log_reset(log, history_id, version);
+                printf("[REPL] Snapshot applied at version %llu\n", version);
+            } else if (sscanf(line.c_str(), "SNAPSHOT %llu %llu", &history_id, &version) == 2) {
+                in_snapshot = true;
+                snapshot.reset(new DeviceShard[MAX_SHARDS]());
+                for (int i = 0; i < MAX_SHARDS; i++) {
+                    snapshot[i].shard_id = i;
+                }
+            } else if (sscanf(line.c_str(), "DELTAS %llu %llu", &history_id, &version) == 2) {
+                printf("[REPL] Resuming from version %llu\n", version);
+            } else {
+                printf("[REPL] Unexpected line from primary: %.80s\n", line.c_str());
+                break;
+            }
+            pthread_mutex_lock(&log->mutex);
+            ctx->primary_connected = !in_snapshot;
+            pthread_mutex_unlock(&log->mutex);
+        }
+        pthread_mutex_lock(&log->mutex);
+        ctx->primary_connected = false;
+        pthread_mutex_unlock(&log->mutex);
+        printf("[REPL] Lost connection to primary, reconnecting\n");
+        close(fd);
+        sleep(1);
+    }
+    return nullptr;
+}
+
+// One decoded telemetry record, pointing into the receive buffers
+struct TelemetryRecord {
+    const char* name;
+    const char* status;
+    unsigned char name_length;
+    unsigned char status_length;
+};
+
+// Drain telemetry datagrams in batches. Records are grouped by shard so
+// each shard touched by a batch is locked, applied and flushed once.
+void* telemetry_ingest_thread(void* arg) {
+    ThreadContext* ctx = static_cast<ThreadContext*>(arg);
+    pin_current_thread(THREAD_INGEST);
+    std::vector<char> buffers(TELEMETRY_BATCH * TELEMETRY_MAX_DATAGRAM);
+    mmsghdr messages[TELEMETRY_BATCH];
+    iovec vectors[TELEMETRY_BATCH];
+    for (int i = 0; i < TELEMETRY_BATCH; i++) {
+        vectors[i].iov_base = &buffers[i * TELEMETRY_MAX_DATAGRAM];
+        vectors[i].iov_len = TELEMETRY_MAX_DATAGRAM;
+    }
+    std::vector<TelemetryRecord> pending[MAX_SHARDS];
+    int touched[MAX_SHARDS];
+
+    while (true) {
+        // The socket is shared with the new process during an upgrade; leave it the datagrams
+        if (ctx->upgrade_state.load() != UPGRADE_NONE) {
+            usleep(10000);
+            continue;
+        }
+        memset(messages, 0, sizeof(messages));
+        for (int i = 0; i < TELEMETRY_BATCH; i++) {
+            messages[i].msg_hdr.msg_iov = &vectors[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+        // Block for the first datagram, then take whatever else is queued
+        int received = recvmmsg(ctx->telemetry_fd, messages, TELEMETRY_BATCH, MSG_WAITFORONE, nullptr);
+        if (received < 0) {
+            if (errno != EINTR) perror("[UDP] recvmmsg");
+            continue;
+        }
+        if (!begin_write(ctx)) {
+            continue;    // Caught by an upgrade; the batch is lost like any dropped datagram
+        }
+
+        int touched_count = 0;
+        unsigned long long records = 0, malformed = 0, lost = 0;
+        for (int i = 0; i < received; i++) {
+            const unsigned char* data = (const unsigned char*)vectors[i].iov_base;
+            size_t length = messages[i].msg_len;
+            if (length < TELEMETRY_HEADER_SIZE || memcmp(data, TELEMETRY_MAGIC, 4) != 0 ||
+                data[4] >= MAX_SHARDS) {
+                malformed++;
+                continue;
+            }
+            int shard_id = data[4];
+            int record_count = data[5];
+            unsigned int sequence;
+            memcpy(&sequence, data + 8, sizeof(sequence));
+            sequence = ntohl(sequence);
+
+            // Sequence gaps are only counted, never waited for; the shard
+            // lock is not needed since this thread is the only user
+            DeviceShard* shard = &ctx->shards[shard_id];
+            if (shard->telemetry_started && sequence > shard->telemetry_next_sequence) {
+                lost += sequence - shard->telemetry_next_sequence;
+            }
+            shard->telemetry_started = true;
+            shard->telemetry_next_sequence = sequence + 1;
+
+            std::vector<TelemetryRecord>& records_for_shard = pending[shard_id];
+            if (records_for_shard.empty()) {
+                touched[touched_count++] = shard_id;
+            }
+            size_t offset = TELEMETRY_HEADER_SIZE;
+            size_t valid_before = records_for_shard.size();
+            for (int r = 0; r < record_count; r++) {
+                if (offset + 2 > length || offset + 2 + data[offset] + data[offset + 1] > length) {
+                    // Truncated datagram: drop it whole
+                    records_for_shard.resize(valid_before);
+                    malformed++;
+                    break;
+                }
+                TelemetryRecord record;
+                record.name_length = data[offset];
+                record.status_length = data[offset + 1];
+                record.name = (const char*)data + offset + 2;
+                record.status = record.name + record.name_length;
+                records_for_shard.push_back(record);
+                offset += 2 + record.name_length + record.status_length;
+            }
+            records += records_for_shard.size() - valid_before;
+        }
+
+        ClockReading now;
+        read_cached_clock(&ctx->clock, &now);
+        for (int t = 0; t < touched_count; t++) {
+            int shard_id = touched[t];
+            DeviceShard* shard = &ctx->shards[shard_id];
+            std::vector<TelemetryRecord>& records_for_shard = pending[shard_id];
+            bool has_system_status = false;
+            std::string system_status;
+            pthread_mutex_lock(&shard->mutex);
+            open_shard_store_locked(ctx, shard);
+            for (const TelemetryRecord& record : records_for_shard) {
+                std::string status(record.status, record.status_length);
+                if (record.name_length == 0) {
+                    has_system_status = true;
+                    system_status = status;
+                } else {
+                    apply_device_status_locked(shard, std::string(record.name, record.name_length), status,
+                                               nullptr, now);
+                }
+            }
+            wal_flush_locked(shard->store);
+            int device_count = shard->device_statuses.size();
+            int fault_devices = shard->fault_devices;
+            pthread_mutex_unlock(&shard->mutex);
+            records_for_shard.clear();
+
+            if (has_system_status) {
+                update_shard_summary(ctx, shard_id, system_status, device_count, fault_devices, now.local_timestamp);
+            }
+        }
+
+        ctx->telemetry.batches.fetch_add(1, std::memory_order_relaxed);
+        ctx->telemetry.datagrams.fetch_add(received, std::memory_order_relaxed);
+        ctx->telemetry.records.fetch_add(records, std::memory_order_relaxed);
+        ctx->telemetry.malformed.fetch_add(malformed, std::memory_order_relaxed);
+        ctx->telemetry.lost.fetch_add(lost, std::memory_order_relaxed);
+        end_write(ctx);
+    }
+    return nullptr;
+}
+
+// Bind the UDP telemetry socket with a receive buffer deep enough to
+// absorb a full tick from several monitors
+int create_telemetry_socket(int port) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("[UDP] socket");
+        return -1;
+    }
+    int buffer_size = 8 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if (bind(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+        perror("[UDP] bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Create the shm segment of a shard, replacing one left by an earlier run
+ShmAttachment* create_shm_channel(int shard_id) {
+    char name[32];
+    snprintf(name, sizeof(name), "/lws_ring.shard%02d", shard_id);
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror("[SHM] shm_open");
+        return nullptr;
+    }
+    size_t header_size = (sizeof(ShmChannel) + 4095) & ~(size_t)4095;
+    size_t size = header_size + SHM_UP_CAPACITY + SHM_DOWN_CAPACITY;
+    void* mapping = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("[SHM] map channel");
+        shm_unlink(name);
+        return nullptr;
+    }
+
+    // The segment starts zeroed; fill in the layout and publish the magic last
+    ShmChannel* channel = static_cast<ShmChannel*>(mapping);
+    channel->up.capacity = SHM_UP_CAPACITY;
+    channel->up.data_offset = header_size;
+    channel->down.capacity = SHM_DOWN_CAPACITY;
+    channel->down.data_offset = header_size + SHM_UP_CAPACITY;
+    channel->server_pid.store(getpid());
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(channel->magic, SHM_CHANNEL_MAGIC, sizeof(channel->magic));
+
+    ShmAttachment* attachment = new ShmAttachment();
+    attachment->channel = channel;
+    attachment->shard_id = shard_id;
+    pthread_mutex_init(&attachment->producer_mutex, nullptr);
+    return attachment;
+}
+
+struct ShmIngestArgs {
+    ThreadContext* ctx;
+    ShmAttachment* attachment;
+};
+
+// Consume a shard's up ring. Messages are push bodies and go through the
+// same handler as POST /update_system; the ack tells the monitor the push
+// has been applied.
+void* shm_ingest_thread(void* arg) {
+    ShmIngestArgs* args = static_cast<ShmIngestArgs*>(arg);
+    ThreadContext* ctx = args->ctx;
+    ShmChannel* channel = args->attachment->channel;
     delete args;
+    pin_current_thread(THREAD_INGEST);
+    std::string body;
+    while (true) {
+        // During an upgrade pushes go unread and unacked; the monitor sees
+        // no ack and attaches to the new process's channel once we exit
+        if (ctx->upgrade_state.load() != UPGRADE_NONE) {
+            usleep(10000);
+            continue;
+        }
+        if (!shm_ring_read(channel, &channel->up, &body, 1000)) {
+            continue;
+        }
+        if (!begin_write(ctx)) {
+            continue;
+        }
+        handle_update_system_request(ctx, body);
+        end_write(ctx);
+        shm_ring_ack(&channel->up);
+    }
+    return nullptr;
+}
 
-    const char* server_type_str = (server_type == BACKEND_SERVER) ? "BACKEND" : "WEB";
+// Initialize thread context, restoring persisted state when available.
+// An empty state_prefix disables persistence.
+void initialize_context(ThreadContext* context, const char* state_prefix) {
+    context->system_status = "Operational";
+    initialize_app_vars(&context->app_vars);
+    context->active_backend_connections = 0;
+    context->active_web_connections = 0;
+    context->store = nullptr;
+    context->state_prefix = state_prefix;
 
-    // Set receive timeout (5 seconds)
-    struct timeval tv;
-    tv.tv_sec = 5;
-    tv.tv_usec = 0;
-    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    pthread_mutex_init(&context->mutex, nullptr);
+    pthread_mutex_init(&context->conn_mutex, nullptr);
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        DeviceShard* shard = &context->shards[i];
+        pthread_mutex_init(&shard->mutex, nullptr);
+        shard->shard_id = i;
+        shard->store = nullptr;
+        shard->change_log = nullptr;
+        context->shm_channels[i] = nullptr;
+    }
 
-    while (true) {
-        char buffer[4096];
-        ssize_t bytes = recv(client_fd, buffer, sizeof(buffer)-1, 0);
+    // Versions start over on every run; a fresh history id tells replicas
+    // that their versions no longer apply
+    ChangeLog* log = &context->changes;
+    pthread_mutex_init(&log->mutex, nullptr);
+    pthread_cond_init(&log->changed, nullptr);
+    log->records.resize(CHANGE_LOG_CAPACITY);
+    struct timespec seed;
+    clock_gettime(CLOCK_REALTIME, &seed);
+    log->history_id = ((unsigned long long)seed.tv_sec << 20) ^ seed.tv_nsec ^ ((unsigned long long)getpid() << 40);
+    log->version = 0;
+    log->oldest = 1;
+    context->change_log = nullptr;
+    context->read_only = false;
+    context->primary_connected = false;
+    context->replicas_connected = 0;
+    context->replication_fd = -1;
+    context->telemetry_fd = -1;
+    context->io_engine = "threads";
+    context->cpu_pool = nullptr;
+    context->coro_loop = nullptr;
+    context->rate_limiter = nullptr;
+    context->client_timeout_seconds = 5;
+    inet_pton(AF_INET, "127.0.0.1", &context->monitor_address);
+    context->monitor_base_port = NOTIFICATION_BASE_PORT;
+    context->monitor_timeout_ms = 1000;
+    context->upgrade_state = UPGRADE_NONE;
+    context->writes_in_flight = 0;
+    pthread_mutex_init(&context->compaction_mutex, nullptr);
+    context->upgrade_wake_fd = -1;
+    pthread_mutex_init(&context->stream_buffers.mutex, nullptr);
 
-        if (bytes < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                printf("[%s] Connection %d: Receive timeout\n", server_type_str, connection_id);
-            } else {
-                perror("recv failed");
-            }
-            break;
-        } else if (bytes == 0) {
-            printf("[%s] Connection %d: Client disconnected\n", server_type_str, connection_id);
-            break;
+    // Publish the first clock reading before any request can be served
+    refresh_cached_clock(&context->clock);
+    ClockReading now;
+    read_cached_clock(&context->clock, &now);
+
+    if (context->state_prefix.empty()) {
+        // Initialize device statuses
+        DeviceShard* shard = &context->shards[0];
+        apply_device_status_locked(shard, "Device1", "ok", "[INIT]", now);
+        apply_device_status_locked(shard, "Device2", "fault", "[INIT]", now);
+        apply_device_status_locked(shard, "Device3", "ok", "[INIT]", now);
+        apply_device_status_locked(shard, "Network Controller", "operational", "[INIT]", now);
+        apply_device_status_locked(shard, "Storage Unit", "degraded", "[INIT]", now);
+        apply_device_status_locked(shard, "Comm Link", "active", "[INIT]", now);
+        return;
+    }
+
+    // Map the system snapshot, then replay its WAL tail. Device records in
+    // the system files (older single-store layout) migrate into shard 0.
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    PersistentStore* store = new PersistentStore();
+    store->snapshot_path = context->state_prefix + ".snap";
+    store->wal_path = context->state_prefix + ".wal";
+    store->wal_fd = -1;
+    unsigned long long snapshot_sequence = 0;
+    bool restored = load_snapshot(&context->shards[0], store->snapshot_path, &snapshot_sequence,
+                                  &context->system_status, now);
+    size_t replayed = replay_wal(context, &context->shards[0], store, snapshot_sequence, now);
+    bool migrated = !context->shards[0].device_statuses.empty();
+
+    // Then every shard that has files of its own
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        restored |= restore_shard(context, &context->shards[i], now);
+    }
+
+    if (!restored && replayed == 0) {
+        // Initialize device statuses
+        DeviceShard* shard = &context->shards[0];
+        apply_device_status_locked(shard, "Device1", "ok", "[INIT]", now);
+        apply_device_status_locked(shard, "Device2", "fault", "[INIT]", now);
+        apply_device_status_locked(shard, "Device3", "ok", "[INIT]", now);
+        apply_device_status_locked(shard, "Network Controller", "operational", "[INIT]", now);
+        apply_device_status_locked(shard, "Storage Unit", "degraded", "[INIT]", now);
+        apply_device_status_locked(shard, "Comm Link", "active", "[INIT]", now);
+    }
+
+    size_t device_count = 0;
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        device_count += context->shards[i].device_statuses.size();
+    }
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed_ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    printf("[PERSIST] %s %d devices, replayed %d system WAL records in %.1f ms\n",
+           restored ? "Restored" : "Initialized", (int)device_count, (int)replayed, elapsed_ms);
+
+    store->wal_fd = open(store->wal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (store->wal_fd < 0) {
+        perror("[PERSIST] open WAL, running without persistence");
+        delete store;
+        context->state_prefix.clear();
+        return;
+    }
+    context->store = store;
+
+    // Make sure snapshots exist so later restarts never fall back to
+    // defaults, and give devices without shard files (defaults, migrated
+    // records) a store of their own. Migrated records must reach shard 0's
+    // snapshot before the system snapshot is rewritten without them, or
+    // they would be loaded from the system files again on every start.
+    bool migrated_saved = !migrated;
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        DeviceShard* shard = &context->shards[i];
+        if (shard->device_statuses.empty() || (shard->store && !(i == 0 && migrated))) {
+            continue;
+        }
+        if (!shard->store) {
+            open_shard_store_locked(context, shard);
         }
+        if (shard->store && compact_persistent_store(context, shard) && i == 0) {
+            migrated_saved = true;
+        }
+    }
+    if ((!restored || replayed > 0 || migrated) && migrated_saved) {
+        compact_persistent_store(context, nullptr);
+    }
+}
 
-        buffer[bytes] = '\0';
-        printf("[%s] Request recv connection %d: (%d bytes)\n", server_type_str, connection_id, (int)bytes);
+// Hot upgrade. On SIGUSR2 the server execs the binary at its own path
+// (normally just replaced on disk) with --upgrade-fd, one end of a Unix
+// socket pair, and over it:
+//   1. freezes state changes: new writes get a 503, those under way finish,
+//      compaction stops and every WAL is flushed; nothing more is accepted,
+//      so new connections wait in the listen queues
+//   2. sends every listening socket in one SCM_RIGHTS message, with the
+//      line "LISTENERS <kinds>" saying what each one is
+//   3. sends the state the new process cannot restore from its files:
+//      "V <name> <value>" per app variable and "VARS <version>", "TICKETKEYS <hex>"
+//      with TLS so issued session tickets stay valid, then either the replication
+//      snapshot (without persistence) or "VERSION <history> <version>" so
+//      replicas can resume; "END" closes it
+//   4. waits for "READY", which the new process sends just before it
+//      starts accepting
+// Then this process drains: each connection closes after its current
+// response, or at once if idle, and it exits when none are left. If the new
+// process fails before READY it is killed and this one carries on.
+struct UpgradeArgs {
+    ThreadContext* ctx;
+    std::string executable;        // Resolved at startup; the file there may have been replaced since
+    std::vector<std::string> arguments;  // Our command line, without --upgrade-fd
+};
 
-        // Parse HTTP request
-        HttpRequest request = parse_http_request(buffer, bytes, client_fd, server_type);
-        printf("[%s] Connection %d: %s, keep_alive=%s\n", 
-               server_type_str, connection_id, request.version.c_str(), request.keep_alive ? "true" : "false");
+const int UPGRADE_WRITE_WAIT_MS = 5000;     // Give up if writes under way take longer
+const int UPGRADE_READY_TIMEOUT_SECONDS = 30;
 
-        // Route request and generate response
-        std::string response = route_request(request, ctx, connection_id);
-        
-        // Send response
-        send(client_fd, response.c_str(), response.length(), 0);
-        printf("[%s] Sent response for connection %d\n", server_type_str, connection_id);
+// Remember a listening socket so an upgrade can hand it over
+void register_listener(ThreadContext* ctx, char kind, int fd) {
+    if (fd >= 0) {
+        ctx->listeners.emplace_back(kind, fd);
+    }
+}
 
-        // Break loop if not keep-alive
-        if (!request.keep_alive) {
-            printf("[%s] Closing connection %d (keep-alive: false)\n", server_type_str, connection_id);
-            break;
+// Stop accepting and changing state; false if writes under way don't finish
+bool freeze_for_upgrade(ThreadContext* ctx) {
+    ctx->upgrade_state.store(UPGRADE_FROZEN);
+    if (ctx->upgrade_wake_fd >= 0) {
+        eventfd_write(ctx->upgrade_wake_fd, 1);
+    }
+    for (int waited = 0; ctx->writes_in_flight.load() > 0; waited++) {
+        if (waited >= UPGRADE_WRITE_WAIT_MS) {
+            printf("[UPGRADE] %d writes still in flight\n", ctx->writes_in_flight.load());
+            return false;
+        }
+        usleep(1000);
+    }
+    pthread_mutex_lock(&ctx->compaction_mutex);
+    pthread_mutex_unlock(&ctx->compaction_mutex);
+    for (int i = -1; i < MAX_SHARDS; i++) {
+        pthread_mutex_t* lock = i < 0 ? &ctx->mutex : &ctx->shards[i].mutex;
+        pthread_mutex_lock(lock);
+        PersistentStore* store = i < 0 ? ctx->store : ctx->shards[i].store;
+        if (store) {
+            wal_flush_locked(store);
+            fdatasync(store->wal_fd);
         }
+        pthread_mutex_unlock(lock);
+    }
+    return true;
+}
 
-        printf("[%s] Keeping connection %d alive\n", server_type_str, connection_id);
+// Undo a freeze after a failed upgrade. The new process may have compacted
+// before failing, replacing the WAL files, so each store's descriptor is
+// pointed at the current file (keeping its number, which the persistence
+// thread uses unlocked).
+void thaw_after_upgrade(ThreadContext* ctx) {
+    for (int i = -1; i < MAX_SHARDS; i++) {
+        pthread_mutex_t* lock = i < 0 ? &ctx->mutex : &ctx->shards[i].mutex;
+        pthread_mutex_lock(lock);
+        PersistentStore* store = i < 0 ? ctx->store : ctx->shards[i].store;
+        int fd = store ? open(store->wal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644) : -1;
+        if (fd >= 0) {
+            dup3(fd, store->wal_fd, O_CLOEXEC);
+            close(fd);
+        }
+        pthread_mutex_unlock(lock);
+    }
+    ctx->upgrade_state.store(UPGRADE_NONE);
+    if (ctx->upgrade_wake_fd >= 0) {
+        eventfd_write(ctx->upgrade_wake_fd, 1);
     }
+}
 
-    // Update active connection count
-    pthread_mutex_lock(&ctx->conn_mutex);
-    if (server_type == BACKEND_SERVER) {
-        ctx->active_backend_connections--;
-        printf("[BACKEND] close connection %d (remaining backend connections: %d)\n",
-               connection_id, ctx->active_backend_connections);
-    } else {
-        ctx->active_web_connections--;
-        printf("[WEB] close connection %d (remaining web connections: %d)\n",
-               connection_id, ctx->active_web_connections);
+bool send_listeners(int fd, const std::vector<std::pair<char, int>>& listeners) {
+    std::string line = "LISTENERS ";
+    for (const auto& listener : listeners) {
+        line += listener.first;
     }
-    pthread_mutex_unlock(&ctx->conn_mutex);
+    line += "\n";
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * listeners.size()));
+    iovec vector = {(void*)line.data(), line.size()};
+    msghdr message = {};
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * listeners.size());
+    int* fds = (int*)CMSG_DATA(header);
+    for (size_t i = 0; i < listeners.size(); i++) {
+        fds[i] = listeners[i].second;
+    }
+    return sendmsg(fd, &message, MSG_NOSIGNAL) == (ssize_t)line.size();
+}
 
-    close(client_fd);
-    return nullptr;
+// New process: take the listening sockets; bytes that came with them are
+// left in *buffer for read_line
+bool receive_listeners(int fd, std::vector<std::pair<char, int>>* listeners, std::string* buffer) {
+    char data[4096];
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * 253));    // SCM_MAX_FD
+    iovec vector = {data, sizeof(data)};
+    msghdr message = {};
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+    ssize_t received = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+    if (received <= 0) {
+        return false;
+    }
+    std::vector<int> fds;
+    for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            const int* passed = (const int*)CMSG_DATA(header);
+            size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            fds.insert(fds.end(), passed, passed + count);
+        }
+    }
+    buffer->assign(data, received);
+    std::string line;
+    size_t newline = buffer->find('\n');
+    if (newline != std::string::npos) {
+        line = buffer->substr(0, newline);
+        buffer->erase(0, newline + 1);
+    }
+    if (line.compare(0, 10, "LISTENERS ") != 0 || line.size() - 10 != fds.size() ||
+        (message.msg_flags & MSG_CTRUNC)) {
+        for (int passed : fds) {
+            close(passed);
+        }
+        return false;
+    }
+    for (size_t i = 0; i < fds.size(); i++) {
+        listeners->emplace_back(line[10 + i], fds[i]);
+    }
+    return true;
 }
 
-// Initialize server socket
-int create_server_socket(int port) {
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        perror("socket");
-        return -1;
+// First handed-over socket of a kind, removed from the list; -1 if none
+int take_listener(std::vector<std::pair<char, int>>* listeners, char kind) {
+    for (auto it = listeners->begin(); it != listeners->end(); ++it) {
+        if (it->first == kind) {
+            int fd = it->second;
+            listeners->erase(it);
+            return fd;
+        }
     }
+    return -1;
+}
 
-    // Set SO_REUSEADDR
-    int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+// The state a new process takes over beyond its files
+std::string build_upgrade_state(ThreadContext* ctx) {
+    std::string state;
+    unsigned long long values[APP_VAR_COUNT];
+    unsigned long long vars_version;
+    {
+        AppVarStringGuard guard(&ctx->app_vars);
+        vars_version = app_vars_snapshot(&ctx->app_vars, values);
+        for (int i = 0; i < APP_VAR_COUNT; i++) {
+            state += "V " + replication_escape(APP_VAR_SCHEMA[i].name) + " " +
+                     replication_escape(app_var_format(i, values[i])) + "\n";
+        }
+    }
+    state += "VARS " + std::to_string(vars_version) + "\n";
+    std::string ticket_keys = tls_ticket_keys(ctx);
+    if (!ticket_keys.empty()) {
+        state += "TICKETKEYS " + ticket_keys + "\n";
+    }
+    if (ctx->read_only) {
+        return state + "END\n";    // A replica gets its devices from the primary again
+    }
+    if (ctx->state_prefix.empty()) {
+        unsigned long long version;
+        return state + build_replication_snapshot(ctx, &version);
+    }
+    pthread_mutex_lock(&ctx->changes.mutex);
+    state += "VERSION " + std::to_string(ctx->changes.history_id) + " " + std::to_string(ctx->changes.version) + "\n";
+    pthread_mutex_unlock(&ctx->changes.mutex);
+    return state + "END\n";
+}
 
-    sockaddr_in addr = {0};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = INADDR_ANY;
+// New process: apply what build_upgrade_state sent, before any change is
+// versioned; *devices counts the devices received
+bool receive_upgrade_state(ThreadContext* ctx, int fd, std::string& buffer, int* devices) {
+    ClockReading now;
+    read_cached_clock(&ctx->clock, &now);
+    std::string line;
+    *devices = 0;
+    while (read_line(fd, buffer, line)) {
+        unsigned long long history_id, version;
+        if (line == "END") {
+            return true;
+        } else if (line.compare(0, 2, "V ") == 0 && line.find(' ', 2) != std::string::npos) {
+            // Variables the new schema dropped or no longer accepts keep their defaults
+            size_t space = line.find(' ', 2);
+            std::vector<AppVarChange> changes(1);
+            std::string error;
+            int var = app_var_index(url_decode(line.substr(2, space - 2)));
+            if (var >= 0 && app_var_parse(var, url_decode(line.substr(space + 1)), &changes[0], &error)) {
+                app_vars_apply(&ctx->app_vars, changes);
+            }
+        } else if (sscanf(line.c_str(), "VARS %llu", &version) == 1) {
+            ctx->app_vars.sequence.store(version * 2);
+        } else if (line.compare(0, 11, "TICKETKEYS ") == 0) {
+            tls_set_ticket_keys(ctx, line.substr(11));
+        } else if (sscanf(line.c_str(), "SNAPSHOT %llu %llu", &history_id, &version) == 2) {
+            clear_shards(ctx);
+            change_log_reset(&ctx->changes, history_id, version);
+        } else if (sscanf(line.c_str(), "VERSION %llu %llu", &history_id, &version) == 2) {
+            change_log_reset(&ctx->changes, history_id, version);
+        } else if (line.compare(0, 2, "S ") == 0) {
+            pthread_mutex_lock(&ctx->mutex);
+            set_system_status_locked(ctx, url_decode(line.substr(2)));
+            pthread_mutex_unlock(&ctx->mutex);
+        } else if (line.compare(0, 2, "D ") == 0) {
+            int shard_id;
+            std::string name, status;
+            if (apply_replicated_device(ctx, nullptr, line.c_str(), now, &shard_id, &name, &status)) {
+                (*devices)++;
+            }
+        }
+    }
+    return false;
+}
 
-    if (bind(server_fd, (sockaddr*)&addr, sizeof(addr))) {
-        perror("bind");
-        close(server_fd);
-        return -1;
+// Start the new binary and hand everything over; false (with this process
+// serving again) if it did not get as far as READY
+bool upgrade_to_new_binary(UpgradeArgs* args) {
+    ThreadContext* ctx = args->ctx;
+    int channel[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel) < 0) {
+        perror("[UPGRADE] socketpair");
+        return false;
+    }
+    std::vector<std::string> arguments = args->arguments;
+    arguments.push_back("--upgrade-fd");
+    arguments.push_back(std::to_string(channel[1]));
+    std::vector<char*> argv;
+    for (std::string& argument : arguments) {
+        argv.push_back(&argument[0]);
     }
+    argv.push_back(nullptr);
 
-    if (listen(server_fd, 10)) {
-        perror("listen");
-        close(server_fd);
-        return -1;
+    pid_t child = fork();
+    if (child == 0) {
+        // Only async-signal-safe calls until exec. The new process starts
+        // with this process's original mask, not this thread's.
+        fcntl(channel[1], F_SETFD, 0);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, nullptr);
+        if (thread_pinning.unpinned.pinned) {
+            sched_setaffinity(0, sizeof(thread_pinning.unpinned.cpus), &thread_pinning.unpinned.cpus);
+        }
+        execv(args->executable.c_str(), argv.data());
+        _exit(127);
+    }
+    close(channel[1]);
+    if (child < 0) {
+        perror("[UPGRADE] fork");
+        close(channel[0]);
+        return false;
     }
 
-    return server_fd;
+    bool handed_over = freeze_for_upgrade(ctx) && send_listeners(channel[0], ctx->listeners) &&
+                       send_all(channel[0], build_upgrade_state(ctx));
+    std::string buffer, line;
+    struct timeval tv;
+    tv.tv_sec = UPGRADE_READY_TIMEOUT_SECONDS;
+    tv.tv_usec = 0;
+    setsockopt(channel[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    bool ready = handed_over && read_line(channel[0], buffer, line) && line == "READY";
+    close(channel[0]);
+    if (!ready) {
+        kill(child, SIGKILL);
+        waitpid(child, nullptr, 0);
+        thaw_after_upgrade(ctx);
+        return false;
+    }
+    printf("[UPGRADE] pid %d took over %d listening sockets\n", (int)child, (int)ctx->listeners.size());
+    return true;
 }
 
-// Initialize thread context with default values
-void initialize_context(ThreadContext* context) {
-    context->system_status = "Operational";
-    context->app_vars["mode"] = "normal";
-    context->app_vars["speed"] = "50";
-    context->active_backend_connections = 0;
-    context->active_web_connections = 0;
-
-    // Initialize device statuses
-    context->device_statuses.push_back({"Device1", "ok"});
-    context->device_statuses.push_back({"Device2", "fault"});
-    context->device_statuses.push_back({"Device3", "ok"});
-    context->device_statuses.push_back({"Network Controller", "operational"});
-    context->device_statuses.push_back({"Storage Unit", "degraded"});
-    context->device_statuses.push_back({"Comm Link", "active"});
+// Let connections finish their current response, then exit; ones that
+// stay busy are cut off after the idle limit plus a grace period
+void drain_for_upgrade(ThreadContext* ctx) {
+    ctx->upgrade_state.store(UPGRADE_DRAINING);
+    if (ctx->upgrade_wake_fd >= 0) {
+        eventfd_write(ctx->upgrade_wake_fd, 1);
+    }
+    time_t deadline = time(nullptr) + ctx->client_timeout_seconds + 5;
+    int remaining;
+    while (true) {
+        pthread_mutex_lock(&ctx->conn_mutex);
+        remaining = ctx->active_backend_connections + ctx->active_web_connections;
+        pthread_mutex_unlock(&ctx->conn_mutex);
+        if (remaining == 0 || time(nullptr) >= deadline) {
+            break;
+        }
+        usleep(20000);
+    }
+    printf("[UPGRADE] Drained, exiting with %d connections open\n", remaining);
+    fflush(stdout);
+    _exit(0);
+}
 
-    pthread_mutex_init(&context->mutex, nullptr);
-    pthread_mutex_init(&context->conn_mutex, nullptr);
+// Waits for SIGUSR2, which every other thread has blocked
+void* upgrade_thread(void* arg) {
+    UpgradeArgs* args = static_cast<UpgradeArgs*>(arg);
+    pin_current_thread(THREAD_BACKGROUND);
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR2);
+    while (true) {
+        int signal_number;
+        if (sigwait(&signals, &signal_number) != 0) {
+            continue;
+        }
+        printf("[UPGRADE] SIGUSR2: starting %s\n", args->executable.c_str());
+        if (upgrade_to_new_binary(args)) {
+            drain_for_upgrade(args->ctx);
+        }
+        printf("[UPGRADE] Upgrade failed, still serving\n");
+    }
+    return nullptr;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
     printf("Dual-port web server starting...\n");
+
+    // SIGUSR2 (hot upgrade) is only taken by upgrade_thread's sigwait;
+    // every thread started from here inherits the block
+    sigset_t upgrade_signals;
+    sigemptyset(&upgrade_signals);
+    sigaddset(&upgrade_signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &upgrade_signals, nullptr);
     
-    const int BACKEND_PORT = 12345;  // Backend API port
-    const int WEB_PORT = 8080;       // Web interface port
+    int BACKEND_PORT = 12345;  // Backend API port
+    int WEB_PORT = 8080;       // Web interface port
+    int REPLICATION_PORT = 0;  // Replica streams, 0 = not serving replicas
+    int UDP_PORT = 0;          // UDP telemetry, 0 = disabled
+    int SHM_SHARDS = 0;        // Shards 0..N-1 get a shared-memory channel
+    const char* STATE_FILE_PREFIX = "web_server_state";  // .snap and .wal files
+    const char* PRIMARY_ADDRESS = nullptr;  // Run as a read replica of host:port
+    const char* IO_ENGINE = "threads";      // "threads" or "uring"
+    ListenerOptions LISTENER = {4096, 1, 0, 0, 0, 0};  // Backlog, acceptors, defer-accept, fastopen, buffers
+    int CPU_WORKERS = (int)sysconf(_SC_NPROCESSORS_ONLN);  // Render/query pool, 0 = run inline
+    int BACKEND_WORKERS = 1;   // Pool workers reserved for backend pushes
+    int WEB_QUEUE_BUDGET_MS = 1000;  // Shed web work queued longer, 0 = never shed
+    double RATE_LIMIT = 0;     // Web requests per second per client address, 0 = unlimited
+    int RATE_BURST = 0;        // Bucket size, 0 = twice the rate
+    const char* WEB_ADDRESS = "0.0.0.0";      // Listen addresses
+    const char* BACKEND_ADDRESS = "0.0.0.0";
+    const char* MONITOR_HOST = "127.0.0.1";   // Where notifications go
+    int MONITOR_PORT = NOTIFICATION_BASE_PORT;  // Shard K's monitor is on MONITOR_PORT + K
+    int MONITOR_TIMEOUT_MS = 1000;   // Notification connect and send limit
+    int CLIENT_TIMEOUT_SECONDS = 5;  // Idle client connections are closed
+    int CONNECTION_STACK_KB = 256;   // Connection thread stacks
+    int PARK_IDLE_MS = 1000;         // Idle time before a connection gives up its thread, -1 = never
+    const char* TLS_CERT = nullptr;  // PEM certificate chain; TLS is off without one
+    const char* TLS_KEY = nullptr;   // PEM private key, the certificate file by default
+    const char* TLS_PORTS = "both";  // both, web or backend
+    int RING_ENTRIES = URING_ENTRIES;
+    int RING_BUFFERS = URING_BUFFER_COUNT;
+    int RING_BUFFER_SIZE = URING_BUFFER_SIZE;
+    int UPGRADE_FD = -1;       // Set by a running server that execs us to take over
 
-    // Initialize context
-    ThreadContext context{};
-    initialize_context(&context);
+    // What a hot upgrade runs: this binary's path and command line
+    UpgradeArgs* upgrade_args = new UpgradeArgs();
+    char executable[PATH_MAX];
+    ssize_t executable_length = readlink("/proc/self/exe", executable, sizeof(executable) - 1);
+    upgrade_args->executable = executable_length > 0 ? std::string(executable, executable_length) : argv[0];
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--upgrade-fd") == 0 && i + 1 < argc) {
+            i++;
+        } else {
+            upgrade_args->arguments.push_back(argv[i]);
+        }
+    }
+
+    // Config files first, so the command line overrides them
+    std::vector<std::string> options;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--config") == 0 && i + 1 < argc && !read_config_file(argv[++i], &options)) {
+            return 1;
+        }
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+            i++;
+        } else {
+            options.push_back(argv[i]);
+        }
+    }
+    std::vector<const char*> args;
+    for (const std::string& option : options) {
+        args.push_back(option.c_str());
+    }
+    int arg_count = (int)args.size();
+
+    for (int i = 0; i < arg_count; i++) {
+        if (strcmp(args[i], "--web-port") == 0 && i + 1 < arg_count) {
+            WEB_PORT = atoi(args[++i]);
+        } else if (strcmp(args[i], "--backend-port") == 0 && i + 1 < arg_count) {
+            BACKEND_PORT = atoi(args[++i]);
+        } else if (strcmp(args[i], "--shm-shards") == 0 && i + 1 < arg_count) {
+            SHM_SHARDS = std::min(MAX_SHARDS, atoi(args[++i]));
+        } else if (strcmp(args[i], "--udp-port") == 0 && i + 1 < arg_count) {
+            UDP_PORT = atoi(args[++i]);
+        } else if (strcmp(args[i], "--replication-port") == 0 && i + 1 < arg_count) {
+            REPLICATION_PORT = atoi(args[++i]);
+        } else if (strcmp(args[i], "--replica-of") == 0 && i + 1 < arg_count) {
+            PRIMARY_ADDRESS = args[++i];
+        } else if (strcmp(args[i], "--state-prefix") == 0 && i + 1 < arg_count) {
+            STATE_FILE_PREFIX = args[++i];
+        } else if (strcmp(args[i], "--io-engine") == 0 && i + 1 < arg_count &&
+                   (strcmp(args[i + 1], "threads") == 0 || strcmp(args[i + 1], "uring") == 0)) {
+            IO_ENGINE = args[++i];
+        } else if (strcmp(args[i], "--listen-backlog") == 0 && i + 1 < arg_count) {
+            LISTENER.backlog = std::max(1, atoi(args[++i]));
+        } else if (strcmp(args[i], "--acceptors") == 0 && i + 1 < arg_count) {
+            LISTENER.acceptors = std::max(1, std::min(64, atoi(args[++i])));
+        } else if (strcmp(args[i], "--defer-accept") == 0 && i + 1 < arg_count) {
+            LISTENER.defer_accept = std::max(0, atoi(args[++i]));
+        } else if (strcmp(args[i], "--fastopen") == 0 && i + 1 < arg_count) {
+            LISTENER.fastopen = std::max(0, atoi(args[++i]));
+        } else if (strcmp(args[i], "--cpu-workers") == 0 && i + 1 < arg_count) {
+            CPU_WORKERS = std::max(0, std::min(256, atoi(args[++i])));
+        } else if (strcmp(args[i], "--backend-workers") == 0 && i + 1 < arg_count) {
+            BACKEND_WORKERS = std::max(0, std::min(64, atoi(args[++i])));
+        } else if (strcmp(args[i], "--web-queue-budget") == 0 && i + 1 < arg_count) {
+            WEB_QUEUE_BUDGET_MS = std::max(0, atoi(args[++i]));
+        } else if (strcmp(args[i], "--rate-limit") == 0 && i + 1 < arg_count) {
+            RATE_LIMIT = std::max(0.0, atof(args[++i]));
+        } else if (strcmp(args[i], "--rate-burst") == 0 && i + 1 < arg_count) {
+            RATE_BURST = std::max(0, std::min(16000, atoi(args[++i])));
+        } else if (strcmp(args[i], "--web-address") == 0 && i + 1 < arg_count) {
+            WEB_ADDRESS = args[++i];
+        } else if (strcmp(args[i], "--backend-address") == 0 && i + 1 < arg_count) {
+            BACKEND_ADDRESS = args[++i];
+        } else if (strcmp(args[i], "--monitor-host") == 0 && i + 1 < arg_count) {
+            MONITOR_HOST = args[++i];
+        } else if (strcmp(args[i], "--monitor-port") == 0 && i + 1 < arg_count) {
+            MONITOR_PORT = atoi(args[++i]);
+        } else if (strcmp(args[i], "--monitor-timeout") == 0 && i + 1 < arg_count) {
+            MONITOR_TIMEOUT_MS = std::max(1, atoi(args[++i]));
+        } else if (strcmp(args[i], "--client-timeout") == 0 && i + 1 < arg_count) {
+            CLIENT_TIMEOUT_SECONDS = std::max(1, atoi(args[++i]));
+        } else if (strcmp(args[i], "--connection-stack") == 0 && i + 1 < arg_count) {
+            CONNECTION_STACK_KB = std::max(64, std::min(65536, atoi(args[++i])));
+        } else if (strcmp(args[i], "--park-idle") == 0 && i + 1 < arg_count) {
+            PARK_IDLE_MS = std::max(-1, atoi(args[++i]));
+        } else if (strcmp(args[i], "--socket-rcvbuf") == 0 && i + 1 < arg_count) {
+            LISTENER.receive_buffer = std::max(0, atoi(args[++i]));
+        } else if (strcmp(args[i], "--socket-sndbuf") == 0 && i + 1 < arg_count) {
+            LISTENER.send_buffer = std::max(0, atoi(args[++i]));
+        } else if (strcmp(args[i], "--tls-cert") == 0 && i + 1 < arg_count) {
+            TLS_CERT = args[++i];
+        } else if (strcmp(args[i], "--tls-key") == 0 && i + 1 < arg_count) {
+            TLS_KEY = args[++i];
+        } else if (strcmp(args[i], "--tls-ports") == 0 && i + 1 < arg_count &&
+                   (strcmp(args[i + 1], "both") == 0 || strcmp(args[i + 1], "web") == 0 ||
+                    strcmp(args[i + 1], "backend") == 0)) {
+            TLS_PORTS = args[++i];
+        } else if (strcmp(args[i], "--uring-entries") == 0 && i + 1 < arg_count) {
+            RING_ENTRIES = std::max(64, std::min(16384, atoi(args[++i])));
+        } else if (strcmp(args[i], "--uring-buffers") == 0 && i + 1 < arg_count) {
+            RING_BUFFERS = std::max(64, std::min(32768, atoi(args[++i])));
+        } else if (strcmp(args[i], "--uring-buffer-size") == 0 && i + 1 < arg_count) {
+            RING_BUFFER_SIZE = std::max(1024, std::min(1 << 20, atoi(args[++i])));
+        } else if (strcmp(args[i], "--cpu-affinity") == 0 && i + 1 < arg_count) {
+            // CLASS=CPUS, once per thread class
+            const char* setting = args[++i];
+            if (!set_thread_affinity(setting)) {
+                printf("Bad --cpu-affinity %s: expected CLASS=CPUS, e.g. worker=2-7, with CLASS one of acceptor,\n"
+                       "connection, worker, loop, uring, ingest, background\n", setting);
+                return 1;
+            }
+        } else if (strcmp(args[i], "--upgrade-fd") == 0 && i + 1 < arg_count) {
+            UPGRADE_FD = atoi(args[++i]);
+        } else {
+            printf("Unknown option %s\n", args[i]);
+            printf("Usage: %s [--config FILE] [--web-port N] [--backend-port N] [--udp-port N] [--shm-shards N]\n"
+                   "       [--state-prefix P] [--replication-port N | --replica-of HOST:PORT]\n"
+                   "       [--web-address ADDR] [--backend-address ADDR] [--io-engine threads|uring]\n"
+                   "       [--listen-backlog N] [--acceptors N] [--defer-accept SECONDS] [--fastopen QUEUE]\n"
+                   "       [--cpu-workers N] [--backend-workers N] [--web-queue-budget MS]\n"
+                   "       [--rate-limit PER_SECOND] [--rate-burst N] [--client-timeout SECONDS]\n"
+                   "       [--connection-stack KB] [--park-idle MS] [--socket-rcvbuf BYTES] [--socket-sndbuf BYTES]\n"
+                   "       [--tls-cert FILE] [--tls-key FILE] [--tls-ports both|web|backend]\n"
+                   "       [--monitor-host ADDR] [--monitor-port N] [--monitor-timeout MS]\n"
+                   "       [--uring-entries N] [--uring-buffers N] [--uring-buffer-size BYTES]\n"
+                   "       [--cpu-affinity CLASS=CPUS]...\n"
+                   "Config files take the same options, one per line without the dashes; the command line\n"
+                   "overrides them. SIGUSR2 execs the binary at this path again, which takes over the\n"
+                   "listening sockets while this process finishes its connections and exits.\n"
+                   "On the thread engine a keep-alive connection idle for --park-idle MS (default 1000,\n"
+                   "-1 never) gives up its thread until its next request; the io_uring engine never holds one.\n"
+                   "With --tls-cert the ports speak TLS (1.2 or later) with session resumption; the\n"
+                   "kernel takes over encryption where it supports kTLS. The io_uring engine serves\n"
+                   "TLS connections on threads.\n",
+                   argv[0]);
+            return 1;
+        }
+    }
 
-    // Create server sockets
-    int backend_server_fd = create_server_socket(BACKEND_PORT);
-    if (backend_server_fd < 0) {
-        printf("Failed to create backend server socket\n");
+    in_addr web_address, backend_address, monitor_address;
+    if (inet_pton(AF_INET, WEB_ADDRESS, &web_address) != 1 ||
+        inet_pton(AF_INET, BACKEND_ADDRESS, &backend_address) != 1 ||
+        inet_pton(AF_INET, MONITOR_HOST, &monitor_address) != 1) {
+        printf("Listen and monitor addresses must be IPv4 addresses\n");
+        return 1;
+    }
+    if (RING_BUFFERS & (RING_BUFFERS - 1)) {
+        printf("--uring-buffers must be a power of two\n");
         return 1;
     }
-    printf("Backend API listening on port %d\n", BACKEND_PORT);
+    finish_thread_pinning();
 
-    int web_server_fd = create_server_socket(WEB_PORT);
-    if (web_server_fd < 0) {
-        printf("Failed to create web server socket\n");
-        close(backend_server_fd);
+    // Taking over from a running server: its listeners arrive only once it
+    // has frozen and flushed its state, so the files are safe to restore
+    std::vector<std::pair<char, int>> inherited;
+    std::string upgrade_buffer;
+    if (UPGRADE_FD >= 0 && !receive_listeners(UPGRADE_FD, &inherited, &upgrade_buffer)) {
+        printf("[UPGRADE] No listening sockets from the running server\n");
         return 1;
     }
-    printf("Web interface listening on port %d\n", WEB_PORT);
 
-    int connection_counter = 0;
-    int accept_counter = 0;
-    
-    // Main server loop using select()
-    while (true) {
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        FD_SET(backend_server_fd, &read_fds);
-        FD_SET(web_server_fd, &read_fds);
-        
-        int max_fd = std::max(backend_server_fd, web_server_fd);
-        
-        // Wait for activity on either server socket
-        int activity = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
-        
-        if (activity < 0) {
-            perror("select");
-            break;
+    // Initialize context. Replicas keep no state of their own: everything
+    // comes from the primary's snapshot and change stream.
+    ThreadContext context{};
+    if (PRIMARY_ADDRESS) {
+        initialize_context(&context, "");
+        clear_shards(&context);
+        context.system_status = "Waiting for primary";
+        context.read_only = true;
+        context.primary_address = PRIMARY_ADDRESS;
+    } else {
+        initialize_context(&context, STATE_FILE_PREFIX);
+    }
+    // TLS comes before the upgrade state, which carries the session ticket keys
+    if (TLS_CERT) {
+        context.tls = create_tls_context(TLS_CERT, TLS_KEY ? TLS_KEY : TLS_CERT);
+        if (!context.tls) {
+            printf("Failed to set up TLS with %s\n", TLS_CERT);
+            return 1;
         }
-        
-        // Check for new backend connections
-        if (FD_ISSET(backend_server_fd, &read_fds)) {
-            sockaddr_in client_addr;
-            socklen_t client_len = sizeof(client_addr);
-            int client_fd = accept(backend_server_fd, (sockaddr*)&client_addr, &client_len);
-            accept_counter++;
-            
-            if (client_fd < 0) {
-                perror("backend accept");
-                continue;
-            }
-            connection_counter++;
+        context.tls_ports[WEB_SERVER] = strcmp(TLS_PORTS, "backend") != 0;
+        context.tls_ports[BACKEND_SERVER] = strcmp(TLS_PORTS, "web") != 0;
+        signal(SIGPIPE, SIG_IGN);    // OpenSSL writes with write(), a gone peer must not kill us
+    }
+    if (UPGRADE_FD >= 0) {
+        int devices;
+        if (!receive_upgrade_state(&context, UPGRADE_FD, upgrade_buffer, &devices)) {
+            printf("[UPGRADE] State handover from the running server failed\n");
+            return 1;
+        }
+        printf("[UPGRADE] Taking over from pid %d: %d listening sockets, %s\n", (int)getppid(),
+               (int)inherited.size(),
+               context.state_prefix.empty() ? (std::to_string(devices) + " devices handed over").c_str()
+                                            : "devices restored from the state files");
+    }
+    if (!PRIMARY_ADDRESS) {
+        // Version every change from here on
+        context.change_log = &context.changes;
+        for (int i = 0; i < MAX_SHARDS; i++) {
+            context.shards[i].change_log = &context.changes;
+        }
+    }
 
-            // Update backend connection count
-            pthread_mutex_lock(&context.conn_mutex);
-            context.active_backend_connections++;
-            int current_backend_connections = context.active_backend_connections;
-            pthread_mutex_unlock(&context.conn_mutex);
+    context.client_timeout_seconds = CLIENT_TIMEOUT_SECONDS;
+    context.park_idle_ms = PARK_IDLE_MS;
+    pthread_attr_init(&context.connection_thread_attr);
+    pthread_attr_setdetachstate(&context.connection_thread_attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&context.connection_thread_attr, (size_t)CONNECTION_STACK_KB * 1024);
 
-            printf("BACKEND accepted connection: accept %d, connection %d (active backend connections: %d)\n",
-                   accept_counter, connection_counter, current_backend_connections);
+    // Every connection is a descriptor: allow as many as the hard limit does
+    rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+    context.monitor_address = monitor_address;
+    context.monitor_base_port = MONITOR_PORT;
+    context.monitor_timeout_ms = MONITOR_TIMEOUT_MS;
+
+    // Create server sockets, or take over the running server's; replicas
+    // take no backend pushes
+    int backend_server_fd = -1;
+    if (!context.read_only) {
+        backend_server_fd = take_listener(&inherited, 'B');
+        if (backend_server_fd < 0) {
+            backend_server_fd = create_server_socket(BACKEND_PORT, &LISTENER, backend_address.s_addr);
+        }
+        register_listener(&context, 'B', backend_server_fd);
+        if (backend_server_fd < 0) {
+            printf("Failed to create backend server socket\n");
+            return 1;
+        }
+        printf("Backend API listening on %s:%d%s\n", BACKEND_ADDRESS, BACKEND_PORT,
+               context.tls_ports[BACKEND_SERVER] ? " (TLS)" : "");
+    }
 
-            // Create thread arguments for backend client
-            ClientThreadArgs* args = new ClientThreadArgs();
-            args->ctx = &context;
-            args->client_fd = client_fd;
-            args->connection_id = connection_counter;
-            args->server_type = BACKEND_SERVER;
+    if (UDP_PORT > 0 && !context.read_only) {
+        context.telemetry_fd = take_listener(&inherited, 'U');
+        if (context.telemetry_fd < 0) {
+            context.telemetry_fd = create_telemetry_socket(UDP_PORT);
+        }
+        register_listener(&context, 'U', context.telemetry_fd);
+        pthread_t telemetry_tid;
+        if (context.telemetry_fd < 0 ||
+            pthread_create(&telemetry_tid, nullptr, telemetry_ingest_thread, &context)) {
+            printf("Failed to start UDP telemetry listener\n");
+            return 1;
+        }
+        pthread_detach(telemetry_tid);
+        printf("UDP telemetry listening on port %d\n", UDP_PORT);
+    }
 
-            // Create thread to handle backend client
-            pthread_t thread;
-            if (pthread_create(&thread, nullptr, handle_client, args)) {
-                perror("pthread_create for backend");
+    for (int i = 0; i < SHM_SHARDS && !context.read_only; i++) {
+        ShmAttachment* attachment = create_shm_channel(i);
+        if (!attachment) {
+            break;
+        }
+        context.shm_channels[i] = attachment;
+        ShmIngestArgs* args = new ShmIngestArgs{&context, attachment};
+        pthread_t shm_tid;
+        if (pthread_create(&shm_tid, nullptr, shm_ingest_thread, args)) {
+            perror("pthread_create for shm channel");
+            return 1;
+        }
+        pthread_detach(shm_tid);
+    }
+    if (SHM_SHARDS > 0 && !context.read_only) {
+        printf("Shared-memory channels ready for shards 0-%d\n", SHM_SHARDS - 1);
+    }
 
-                // Roll back connection count on error
-                pthread_mutex_lock(&context.conn_mutex);
-                context.active_backend_connections--;
-                pthread_mutex_unlock(&context.conn_mutex);
+    int web_server_fd = take_listener(&inherited, 'W');
+    if (web_server_fd < 0) {
+        web_server_fd = create_server_socket(WEB_PORT, &LISTENER, web_address.s_addr);
+    }
+    register_listener(&context, 'W', web_server_fd);
+    if (web_server_fd < 0) {
+        printf("Failed to create web server socket\n");
+        close(backend_server_fd);
+        return 1;
+    }
+    printf("Web interface listening on %s:%d (backlog %d%s%s%s)\n", WEB_ADDRESS, WEB_PORT, LISTENER.backlog,
+           LISTENER.defer_accept > 0 ? ", defer-accept" : "", LISTENER.fastopen > 0 ? ", fastopen" : "",
+           context.tls_ports[WEB_SERVER] ? ", TLS" : "");
 
-                close(client_fd);
-                delete args;
-            } else {
-                pthread_detach(thread);
-            }
+    if (REPLICATION_PORT > 0 && !context.read_only) {
+        context.replication_fd = take_listener(&inherited, 'R');
+        if (context.replication_fd < 0) {
+            context.replication_fd = create_server_socket(REPLICATION_PORT);
         }
-        
-        // Check for new web connections
-        if (FD_ISSET(web_server_fd, &read_fds)) {
-            sockaddr_in client_addr;
-            socklen_t client_len = sizeof(client_addr);
-            int client_fd = accept(web_server_fd, (sockaddr*)&client_addr, &client_len);
-            accept_counter++;
-            
-            if (client_fd < 0) {
-                perror("web accept");
-                continue;
-            }
-            connection_counter++;
+        register_listener(&context, 'R', context.replication_fd);
+        pthread_t replication_tid;
+        if (context.replication_fd < 0 ||
+            pthread_create(&replication_tid, nullptr, replication_listener_thread, &context)) {
+            printf("Failed to start replication listener\n");
+            return 1;
+        }
+        pthread_detach(replication_tid);
+        printf("Replication listening on port %d\n", REPLICATION_PORT);
+    } else if (context.read_only) {
+        pthread_t replication_tid;
+        if (pthread_create(&replication_tid, nullptr, replication_client_thread, &context)) {
+            perror("pthread_create for replication");
+            return 1;
+        }
+        pthread_detach(replication_tid);
+        printf("Replicating from %s\n", PRIMARY_ADDRESS);
+    }
 
-            // Update web connection count
-            pthread_mutex_lock(&context.conn_mutex);
-            context.active_web_connections++;
-            int current_web_connections = context.active_web_connections;
-            pthread_mutex_unlock(&context.conn_mutex);
+    // Start the coarse clock thread shared by all handlers
+    pthread_t clock_tid;
+    if (pthread_create(&clock_tid, nullptr, clock_thread, &context.clock)) {
+        perror("pthread_create for clock");
+        close(backend_server_fd);
+        close(web_server_fd);
+        return 1;
+    }
+    pthread_detach(clock_tid);
 
-            printf("WEB accepted connection: accept %d, connection %d (active web connections: %d)\n",
-                   accept_counter, connection_counter, current_web_connections);
+    // Start WAL sync and snapshot compaction
+    if (context.store) {
+        pthread_t persistence_tid;
+        if (pthread_create(&persistence_tid, nullptr, persistence_thread, &context) == 0) {
+            pthread_detach(persistence_tid);
+        } else {
+            perror("pthread_create for persistence");
+        }
+    }
 
-            // Create thread arguments for web client
-            ClientThreadArgs* args = new ClientThreadArgs();
-            args->ctx = &context;
-            args->client_fd = client_fd;
-            args->connection_id = connection_counter;
-            args->server_type = WEB_SERVER;
+    // Render and query handlers get their own workers, one per core, and
+    // backend pushes a few more that web work cannot take
+    if (CPU_WORKERS > 0) {
+        context.cpu_pool = create_task_pool(CPU_WORKERS, BACKEND_WORKERS, WEB_QUEUE_BUDGET_MS);
+        if (!context.cpu_pool) {
+            printf("Failed to start the CPU worker pool\n");
+            return 1;
+        }
+        printf("CPU worker pool: %d workers + %d reserved for backend, web queue budget %d ms\n", CPU_WORKERS,
+               BACKEND_WORKERS, WEB_QUEUE_BUDGET_MS);
+    }
 
-            // Create thread to handle web client
-            pthread_t thread;
-            if (pthread_create(&thread, nullptr, handle_client, args)) {
-                perror("pthread_create for web");
+    // Per-client token buckets on the web port
+    if (RATE_LIMIT > 0) {
+        int burst = RATE_BURST > 0 ? RATE_BURST : std::max(1, std::min(16000, (int)(RATE_LIMIT * 2)));
+        context.rate_limiter = create_rate_limiter(RATE_LIMIT, burst);
+        printf("Rate limit: %.1f requests/s per client, burst %d\n", RATE_LIMIT, burst);
+    }
 
-                // Roll back connection count on error
-                pthread_mutex_lock(&context.conn_mutex);
-                context.active_web_connections--;
-                pthread_mutex_unlock(&context.conn_mutex);
+    // Handlers waiting on sockets and timers are resumed by the coroutine loop
+    context.coro_loop = create_coroutine_loop();
+    if (!context.coro_loop) {
+        printf("Failed to start the coroutine loop\n");
+        return 1;
+    }
 
-                close(client_fd);
-                delete args;
-            } else {
-                pthread_detach(thread);
-            }
+    // io_uring engine if asked for and supported, else the thread path
+    context.io_engine = "threads";
+    UringEngine* engine = nullptr;
+    if (strcmp(IO_ENGINE, "uring") == 0) {
+        engine = new UringEngine();
+        engine->ctx = &context;
+        engine->entries = RING_ENTRIES;
+        engine->buffer_count = RING_BUFFERS;
+        engine->buffer_size = RING_BUFFER_SIZE;
+        engine->listen_fds[BACKEND_SERVER] = backend_server_fd;
+        engine->listen_fds[WEB_SERVER] = web_server_fd;
+        engine->connection_counter = 0;
+        engine->accept_counter = 0;
+        if (uring_setup(engine)) {
+            context.io_engine = "uring";
+            printf("I/O engine: io_uring\n");
+        } else {
+            delete engine;
+            engine = nullptr;
+            printf("I/O engine: io_uring unavailable, falling back to threads\n");
+        }
+    }
+
+    // Thread path: the main thread is the first acceptor; any others get
+    // their own SO_REUSEPORT listeners, created only now so that no socket
+    // in the group is left without an acceptor. Every such socket taken
+    // over from the running server needs an acceptor too, or what is queued
+    // on it is lost, so with the ring those still get acceptor threads.
+    int inherited_acceptors = (int)std::count_if(inherited.begin(), inherited.end(),
+                                                 [](const std::pair<char, int>& listener) {
+                                                     return listener.first == 'W';
+                                                 });
+    int acceptors = engine ? 1 + inherited_acceptors : std::max(LISTENER.acceptors, 1 + inherited_acceptors);
+    for (int i = 1; i < acceptors; i++) {
+        AcceptorArgs* args = new AcceptorArgs{&context, {-1, -1}};
+        args->listen_fds[BACKEND_SERVER] = backend_server_fd >= 0 ? take_listener(&inherited, 'B') : -1;
+        if (backend_server_fd >= 0 && args->listen_fds[BACKEND_SERVER] < 0) {
+            args->listen_fds[BACKEND_SERVER] = create_server_socket(BACKEND_PORT, &LISTENER, backend_address.s_addr);
+        }
+        args->listen_fds[WEB_SERVER] = take_listener(&inherited, 'W');
+        if (args->listen_fds[WEB_SERVER] < 0) {
+            args->listen_fds[WEB_SERVER] = create_server_socket(WEB_PORT, &LISTENER, web_address.s_addr);
+        }
+        register_listener(&context, 'B', args->listen_fds[BACKEND_SERVER]);
+        register_listener(&context, 'W', args->listen_fds[WEB_SERVER]);
+        pthread_t acceptor_tid;
+        if (args->listen_fds[WEB_SERVER] < 0 || (backend_server_fd >= 0 && args->listen_fds[BACKEND_SERVER] < 0) ||
+            pthread_create(&acceptor_tid, nullptr, acceptor_thread, args)) {
+            printf("Failed to start acceptor %d\n", i);
+            return 1;
         }
+        pthread_detach(acceptor_tid);
+    }
+    if (!engine) {
+        printf("Accepting on %d thread%s\n", acceptors, acceptors > 1 ? "s (SO_REUSEPORT)" : "");
+    } else if (acceptors > 1) {
+        printf("Accepting on the ring and %d thread%s for taken-over sockets\n", acceptors - 1,
+               acceptors > 2 ? "s" : "");
+    }
+
+    // Sockets this configuration has no use for (a replica no longer takes
+    // pushes, telemetry switched off) close with the old process
+    for (const auto& listener : inherited) {
+        printf("[UPGRADE] Closing unused listening socket (%c)\n", listener.first);
+        close(listener.second);
+    }
+
+    // SIGUSR2 starts a hot upgrade. The binary's path was resolved at
+    // startup, before anything could replace it.
+    upgrade_args->ctx = &context;
+    pthread_t upgrade_tid;
+    if (pthread_create(&upgrade_tid, nullptr, upgrade_thread, upgrade_args) == 0) {
+        pthread_detach(upgrade_tid);
+    } else {
+        perror("pthread_create for upgrade");
+    }
+    if (UPGRADE_FD >= 0) {
+        send_all(UPGRADE_FD, "READY\n");
+        close(UPGRADE_FD);
+    }
+
+    if (engine) {
+        run_uring_engine(engine);
+        return 1;
     }
+    AcceptorArgs main_acceptor = {&context, {-1, -1}};
+    main_acceptor.listen_fds[BACKEND_SERVER] = backend_server_fd;
+    main_acceptor.listen_fds[WEB_SERVER] = web_server_fd;
+    acceptor_thread(&main_acceptor);
 
     // Cleanup
     pthread_mutex_destroy(&context.mutex);
     pthread_mutex_destroy(&context.conn_mutex);
-    close(backend_server_fd);
+    if (backend_server_fd >= 0) {
+        close(backend_server_fd);
+    }
     close(web_server_fd);
     return 0;
 }